@@ -318,7 +318,7 @@ new(class, path, ...)
 
   } else {
 
-    cdb_generate_header(cdb, name, desc, max_records, type, units, min_value, max_value);
+    cdb_generate_header(cdb, name, desc, max_records, type, units, min_value, max_value, CDB_ENCODING_FLOAT64);
 
     ret = cdb_write_header(cdb);
 
@@ -394,6 +394,44 @@ read_header(self)
 
   _cdb_update_header_hash(self, cdb);
 
+SV*
+stats(self)
+  SV *self;
+
+  PREINIT:
+  cdb_stats_t counters;
+  HV *stats;
+
+  CODE:
+  /* undef unless the library was configured with --enable-stats */
+  if (cdb_get_stats(extract_cdb_ptr(self), &counters) != CDB_SUCCESS) {
+    XSRETURN_UNDEF;
+  }
+
+  stats = newHV();
+
+  my_hv_store(stats, "syscalls", newSVuv((UV)counters.syscalls));
+  my_hv_store(stats, "bytes_read", newSVuv((UV)counters.bytes_read));
+  my_hv_store(stats, "bytes_written", newSVuv((UV)counters.bytes_written));
+  my_hv_store(stats, "lookups", newSVuv((UV)counters.lookups));
+  my_hv_store(stats, "probes", newSVuv((UV)counters.probes));
+  my_hv_store(stats, "records_decoded", newSVuv((UV)counters.records_decoded));
+  my_hv_store(stats, "allocations", newSVuv((UV)counters.allocations));
+  my_hv_store(stats, "cook_ns", newSVuv((UV)counters.cook_ns));
+  my_hv_store(stats, "step_ns", newSVuv((UV)counters.step_ns));
+  my_hv_store(stats, "stats_ns", newSVuv((UV)counters.stats_ns));
+
+  RETVAL = newRV_noinc((SV *)stats);
+  OUTPUT:
+  RETVAL
+
+void
+reset_stats(self)
+  SV *self;
+
+  CODE:
+  cdb_reset_stats(extract_cdb_ptr(self));
+
 SV*
 read_records(self, ...)
   SV *self;
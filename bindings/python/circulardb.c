@@ -14,7 +14,7 @@
 
 static PyTypeObject StorageType;
 static PyTypeObject StatisticsType;
-static PyTypeObject AggregateType;
+static PyTypeObject RecordsType;
 
 typedef struct {
     PyObject_HEAD
@@ -28,6 +28,19 @@ typedef struct {
     cdb_range_t *range;
 } StatisticsObject;
 
+// Records read by read_buffer(), as a buffer of (int64 time, double value)
+// structs. The times and values columns are strided views of the same
+// memory, which keep the records they came from alive.
+typedef struct {
+    PyObject_HEAD
+    PyObject     *parent;
+    cdb_record_t *records;
+    Py_ssize_t   len;
+    int          field;     // -1 for the records, 0 for the times, 1 for the values
+    Py_ssize_t   shape;
+    Py_ssize_t   stride;
+} RecordsObject;
+
 // Forward.
 static void Statistics_init(PyObject*);
 
@@ -69,10 +82,8 @@ cdb_range_t* _new_statistics(PyObject* self) {
    * value. Statistics are good only for the last read. */
   PyObject* statistics = ((StorageObject*)self)->statistics;
 
-  // Release the old object. There should be a better way of doing this
-  if (statistics != Py_None) {
-    PyObject_Del(statistics);
-  }
+  // Release the old object - whoever still holds it keeps it
+  Py_XDECREF(statistics);
 
   statistics = PyObject_New(PyObject, &StatisticsType);
   Statistics_init(statistics); // Calls calloc() on range member.
@@ -122,6 +133,7 @@ static PyObject* Storage_new(PyTypeObject *type, PyObject *args, PyObject *kwdic
       return NULL;
     }
 
+    Py_INCREF(Py_None);
     self->statistics = Py_None;
   }
 
@@ -173,7 +185,7 @@ static int Storage_init(PyObject *self, PyObject *args, PyObject *kwdict) {
 
   } else {
 
-    cdb_generate_header(cdb, name, desc, max_records, _cdb_type_from_string(type), units, min_value, max_value);
+    cdb_generate_header(cdb, name, desc, max_records, _cdb_type_from_string(type), units, min_value, max_value, CDB_ENCODING_FLOAT64);
 
     if (cdb_write_header(cdb) != CDB_SUCCESS) {
       PyErr_SetFromErrno(PyExc_IOError);
@@ -265,12 +277,20 @@ static PyObject* cdb_py_read_records(PyObject *self, PyObject *args, PyObject *k
   }
 
   cdb_t *cdb            = ((StorageObject*)self)->cdb;
-  cdb_range_t *range    = _new_statistics(self);
   cdb_record_t *records = NULL;
+  cdb_range_t range;
 
   cdb_request_t request = _parse_cdb_request(start, end, count, cooked, step);
 
-  ret = cdb_read_records(cdb, &request, &cnt, &records, range);
+  memset(&range, 0, sizeof(range));
+
+  // Another thread may replace the statistics object while the GIL is
+  // released, so the read fills a local range that is copied in afterwards
+  Py_BEGIN_ALLOW_THREADS
+  ret = cdb_read_records(cdb, &request, &cnt, &records, &range);
+  Py_END_ALLOW_THREADS
+
+  memcpy(_new_statistics(self), &range, sizeof(cdb_range_t));
 
   _check_return(ret);
 
@@ -310,11 +330,14 @@ static PyObject* _cdb_write_or_update_records(PyObject* self, PyObject* list, in
     records[i].value = (value == Py_None ? CDB_NAN : PyFloat_AsDouble(value));
   }
 
+  // The records are our own copy, so the list may change meanwhile
+  Py_BEGIN_ALLOW_THREADS
   if (type == PY_CDB_WRITE) {
     ret = cdb_write_records(cdb, records, len, &cnt);
   } else {
     ret = cdb_update_records(cdb, records, len, &cnt);
   }
+  Py_END_ALLOW_THREADS
 
   if (ret != CDB_SUCCESS) {
     return PyErr_SetFromErrno(PyExc_IOError);
@@ -330,16 +353,21 @@ static PyObject* _cdb_write_or_update_record(PyObject* self, PyObject* time, PyO
 
   cdb_t *cdb = ((StorageObject*)self)->cdb;
 
+  cdb_time_t t = _parse_time(time);
+  double v     = CDB_NAN;
+
   // Convert None to NAN, which is what the circulardb code expects
-  if (value == Py_None) {
-      value = PyFloat_FromDouble(CDB_NAN);
+  if (value != Py_None) {
+    v = PyFloat_AsDouble(value);
   }
 
+  Py_BEGIN_ALLOW_THREADS
   if (type == PY_CDB_WRITE) {
-    ret = cdb_write_record(cdb, _parse_time(time), PyFloat_AsDouble(value));
+    ret = cdb_write_record(cdb, t, v);
   } else {
-    ret = cdb_update_record(cdb, _parse_time(time), PyFloat_AsDouble(value));
+    ret = cdb_update_record(cdb, t, v);
   }
+  Py_END_ALLOW_THREADS
 
   if (ret == false) {
     return PyErr_SetFromErrno(PyExc_IOError);
@@ -360,6 +388,128 @@ static PyObject* cdb_py_write_records(PyObject* self, PyObject* args) {
   return _cdb_write_or_update_records(self, list, PY_CDB_WRITE);
 }
 
+// Records aren't copied into Python objects - the buffer is the records
+// cdb_read_records() returned. The read runs without the GIL.
+static PyObject* cdb_py_read_buffer(PyObject *self, PyObject *args, PyObject *kwdict) {
+  static char *kwlist[] = {
+    "start", "end", "count", "cooked", "step",  NULL,
+  };
+
+  cdb_time_t start = 0;
+  cdb_time_t end   = 0;
+  int ret          = 0;
+  int cooked       = 1;
+  long step        = 0;
+  int64_t count    = 0;
+  uint64_t cnt     = 0;
+
+  cdb_t *cdb            = ((StorageObject*)self)->cdb;
+  cdb_record_t *records = NULL;
+  cdb_request_t request;
+  cdb_range_t range;
+  RecordsObject *buffer;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwdict, "|LLLil:read_buffer", kwlist, &start, &end, &count, &cooked, &step)) {
+    return NULL;
+  }
+
+  request = _parse_cdb_request(start, end, count, cooked, step);
+
+  memset(&range, 0, sizeof(range));
+
+  // The statistics object may be replaced by another thread meanwhile, so
+  // they are only copied in once the GIL is back
+  Py_BEGIN_ALLOW_THREADS
+  ret = cdb_read_records(cdb, &request, &cnt, &records, &range);
+  Py_END_ALLOW_THREADS
+
+  if (ret != CDB_SUCCESS) {
+    free(records);
+    _check_return(ret);
+    return NULL;
+  }
+
+  if ((buffer = PyObject_New(RecordsObject, &RecordsType)) == NULL) {
+    free(records);
+    return NULL;
+  }
+
+  buffer->parent  = NULL;
+  buffer->records = records;
+  buffer->len     = cnt;
+  buffer->field   = -1;
+  buffer->shape   = cnt;
+  buffer->stride  = sizeof(cdb_record_t);
+
+  memcpy(_new_statistics(self), &range, sizeof(cdb_range_t));
+
+  _cdb_py_update_header(self, cdb);
+
+  return (PyObject*)buffer;
+}
+
+// Writes from anything with a buffer of (int64 time, double value) structs,
+// such as a numpy array or what read_buffer() returned, without copying it.
+// The write runs without the GIL.
+static PyObject* cdb_py_write_buffer(PyObject* self, PyObject* args) {
+  PyObject *obj;
+  Py_buffer view;
+  cdb_record_t *records;
+  cdb_t *cdb   = ((StorageObject*)self)->cdb;
+  uint64_t cnt = 0;
+  uint64_t len = 0;
+  bool copied  = false;
+  int ret;
+
+  if (!PyArg_ParseTuple(args, "O:write_buffer", &obj)) {
+    return NULL;
+  }
+
+  if (PyObject_GetBuffer(obj, &view, PyBUF_SIMPLE) != 0) {
+    return NULL;
+  }
+
+  if (view.len % sizeof(cdb_record_t) != 0) {
+    PyBuffer_Release(&view);
+    PyErr_SetString(PyExc_ValueError, "Buffer length isn't a whole number of (time, value) records.");
+    return NULL;
+  }
+
+  len     = view.len / sizeof(cdb_record_t);
+  records = (cdb_record_t*)view.buf;
+
+  // A string's bytes, say, needn't be lined up for doubles
+  if (((uintptr_t)view.buf % sizeof(double)) != 0) {
+
+    if ((records = malloc(view.len > 0 ? view.len : 1)) == NULL) {
+      PyBuffer_Release(&view);
+      return PyErr_NoMemory();
+    }
+
+    memcpy(records, view.buf, view.len);
+    copied = true;
+  }
+
+  // The exporter can't resize the buffer while it is held
+  Py_BEGIN_ALLOW_THREADS
+  ret = cdb_write_records(cdb, records, len, &cnt);
+  Py_END_ALLOW_THREADS
+
+  if (copied) {
+    free(records);
+  }
+
+  PyBuffer_Release(&view);
+
+  if (ret != CDB_SUCCESS) {
+    return PyErr_SetFromErrno(PyExc_IOError);
+  }
+
+  _cdb_py_update_header(self, cdb);
+
+  return PyInt_FromLong(cnt);
+}
+
 static PyObject* cdb_py_write_record(PyObject* self, PyObject* args) {
   PyObject *time, *value;
 
@@ -406,7 +556,11 @@ static PyObject* cdb_py_discard_records_in_time_range(PyObject *self, PyObject *
 
   cdb_request_t request = _parse_cdb_request(start, end, 0, 0, 0);
 
-  int ret = cdb_discard_records_in_time_range(cdb, &request, &cnt);
+  int ret;
+
+  Py_BEGIN_ALLOW_THREADS
+  ret = cdb_discard_records_in_time_range(cdb, &request, &cnt);
+  Py_END_ALLOW_THREADS
 
   _check_return(ret);
 
@@ -421,6 +575,7 @@ static PyObject* cdb_py_open_cdb(PyObject* self) {
     PyErr_SetFromErrno(PyExc_IOError);
   }
 
+  Py_INCREF(self);
   return self;
 }
 
@@ -432,6 +587,7 @@ static PyObject* cdb_py_close_cdb(PyObject* self) {
     PyErr_SetFromErrno(PyExc_IOError);
   }
 
+  Py_INCREF(self);
   return self;
 }
 
@@ -445,6 +601,7 @@ static PyObject* cdb_py_read_header(PyObject* self) {
 
   _cdb_py_update_header(self, cdb);
 
+  Py_INCREF(self);
   return self;
 }
 
@@ -456,6 +613,7 @@ static PyObject* cdb_py_write_header(PyObject* self) {
     PyErr_SetFromErrno(PyExc_IOError);
   }
 
+  Py_INCREF(self);
   return self;
 }
 
@@ -463,6 +621,7 @@ static PyObject* cdb_py_print(PyObject* self) {
 
   cdb_t *cdb = ((StorageObject*)self)->cdb;
   cdb_print(cdb);
+  Py_INCREF(self);
   return self;
 }
 
@@ -470,6 +629,7 @@ static PyObject* cdb_py_print_header(PyObject* self) {
 
   cdb_t *cdb = ((StorageObject*)self)->cdb;
   cdb_print_header(cdb);
+  Py_INCREF(self);
   return self;
 }
 
@@ -504,18 +664,126 @@ static PyObject* cdb_py_print_records(PyObject *self, PyObject *args, PyObject *
 
   cdb_print_records(cdb, &request, PyFile_AsFile(file_obj), PyString_AsString(date_format));
 
+  Py_INCREF(self);
   return self;
 }
 
+// PyDict_SetItemString() doesn't steal the reference
+static void _dict_set_u64(PyObject *dict, const char *key, uint64_t value) {
+  PyObject *item = PyLong_FromUnsignedLongLong(value);
+
+  PyDict_SetItemString(dict, key, item);
+  Py_DECREF(item);
+}
+
+// None unless the library was configured with --enable-stats
+static PyObject* cdb_py_stats(PyObject* self) {
+
+  cdb_t *cdb = ((StorageObject*)self)->cdb;
+  cdb_stats_t stats;
+  PyObject *dict;
+
+  if (cdb_get_stats(cdb, &stats) != CDB_SUCCESS) {
+    Py_RETURN_NONE;
+  }
+
+  dict = PyDict_New();
+
+  _dict_set_u64(dict, "syscalls", stats.syscalls);
+  _dict_set_u64(dict, "bytes_read", stats.bytes_read);
+  _dict_set_u64(dict, "bytes_written", stats.bytes_written);
+  _dict_set_u64(dict, "lookups", stats.lookups);
+  _dict_set_u64(dict, "probes", stats.probes);
+  _dict_set_u64(dict, "records_decoded", stats.records_decoded);
+  _dict_set_u64(dict, "allocations", stats.allocations);
+  _dict_set_u64(dict, "cook_ns", stats.cook_ns);
+  _dict_set_u64(dict, "step_ns", stats.step_ns);
+  _dict_set_u64(dict, "stats_ns", stats.stats_ns);
+
+  return dict;
+}
+
+static PyObject* cdb_py_reset_stats(PyObject* self) {
+
+  cdb_reset_stats(((StorageObject*)self)->cdb);
+
+  Py_RETURN_NONE;
+}
+
+// { op: { count, sum_ns, max_ns, p50 ... p999, buckets: [(low, high, count)] } }
+// for the latencies of every operation, over all handles and threads. None
+// unless the library was configured with --enable-stats.
+static PyObject* cdb_py_histograms(PyObject *self) {
+
+  cdb_histogram_t histograms[CDB_OP_MAX];
+  PyObject *dict;
+  int op, i;
+
+  if (cdb_get_histograms(histograms) != CDB_SUCCESS) {
+    Py_RETURN_NONE;
+  }
+
+  dict = PyDict_New();
+
+  for (op = 0; op < CDB_OP_MAX; op++) {
+    cdb_histogram_t *histogram = &histograms[op];
+    PyObject *entry   = PyDict_New();
+    PyObject *buckets = PyList_New(0);
+
+    _dict_set_u64(entry, "count", histogram->count);
+    _dict_set_u64(entry, "sum_ns", histogram->sum_ns);
+    _dict_set_u64(entry, "max_ns", histogram->max_ns);
+    _dict_set_u64(entry, "p50", cdb_histogram_percentile(histogram, 0.50));
+    _dict_set_u64(entry, "p90", cdb_histogram_percentile(histogram, 0.90));
+    _dict_set_u64(entry, "p99", cdb_histogram_percentile(histogram, 0.99));
+    _dict_set_u64(entry, "p999", cdb_histogram_percentile(histogram, 0.999));
+
+    // Only the buckets with something in them
+    for (i = 0; i < CDB_HISTOGRAM_BUCKETS; i++) {
+
+      if (histogram->buckets[i] > 0) {
+        PyObject *bucket = Py_BuildValue("(KKK)",
+          (unsigned PY_LONG_LONG)cdb_histogram_bucket_low(i),
+          (unsigned PY_LONG_LONG)cdb_histogram_bucket_high(i),
+          (unsigned PY_LONG_LONG)histogram->buckets[i]);
+
+        PyList_Append(buckets, bucket);
+        Py_DECREF(bucket);
+      }
+    }
+
+    PyDict_SetItemString(entry, "buckets", buckets);
+    PyDict_SetItemString(dict, cdb_op_name(op), entry);
+    Py_DECREF(buckets);
+    Py_DECREF(entry);
+  }
+
+  return dict;
+}
+
+static PyObject* cdb_py_reset_histograms(PyObject *self) {
+
+  cdb_reset_histograms();
+
+  Py_RETURN_NONE;
+}
+
+static PyMethodDef module_methods[] = {
+  { "histograms",       (PyCFunction)cdb_py_histograms, METH_NOARGS, PyDoc_STR("Latency histograms of the library's operations, or None if they aren't kept.") },
+  { "reset_histograms", (PyCFunction)cdb_py_reset_histograms, METH_NOARGS, "" },
+  { NULL }
+};
+
 static PyObject* cdb_py_statistics(PyObject *self, PyObject *args, PyObject *kwdict) {
   PyObject* statistics = ((StorageObject*)self)->statistics;
 
   // Do a read of the full range to populate
   if (statistics == Py_None) {
-    cdb_py_read_records(self, args, kwdict);
+    Py_XDECREF(cdb_py_read_records(self, args, kwdict));
     statistics = ((StorageObject*)self)->statistics;
   }
 
+  Py_INCREF(statistics);
   return statistics;
 }
 
@@ -632,6 +900,143 @@ static PyObject* Statistics_get(PyObject *self, void *closure) {
   return PyFloat_FromDouble(cdb_get_statistic(((StatisticsObject*)self)->range, (cdb_statistics_enum_t)closure));
 }
 
+// Records functions
+static void Records_dealloc(PyObject *self) {
+  RecordsObject *buffer = (RecordsObject*)self;
+
+  if (buffer->parent != NULL) {
+    Py_DECREF(buffer->parent);
+  } else {
+    free(buffer->records);
+  }
+
+  PyObject_Del(self);
+}
+
+static void* _records_start(RecordsObject *buffer) {
+  static cdb_record_t empty;
+
+  cdb_record_t *records = buffer->records != NULL ? buffer->records : &empty;
+
+  switch (buffer->field) {
+    case 0 : return &records[0].time;
+    case 1 : return &records[0].value;
+    default: return records;
+  }
+}
+
+static Py_ssize_t Records_length(PyObject *self) {
+  return ((RecordsObject*)self)->len;
+}
+
+// (time, value) for the records, or an int or float for a column
+static PyObject* Records_item(PyObject *self, Py_ssize_t i) {
+  RecordsObject *buffer = (RecordsObject*)self;
+
+  if (i < 0 || i >= buffer->len) {
+    PyErr_SetString(PyExc_IndexError, "Record index out of range.");
+    return NULL;
+  }
+
+  switch (buffer->field) {
+    case 0 : return PyInt_FromLong(buffer->records[i].time);
+    case 1 : return PyFloat_FromDouble(buffer->records[i].value);
+    default: return Py_BuildValue("(Ld)", (PY_LONG_LONG)buffer->records[i].time, buffer->records[i].value);
+  }
+}
+
+static int Records_getbuffer(PyObject *self, Py_buffer *view, int flags) {
+  RecordsObject *buffer = (RecordsObject*)self;
+
+  if ((flags & PyBUF_WRITABLE) == PyBUF_WRITABLE) {
+    PyErr_SetString(PyExc_BufferError, "Records are read only.");
+    return -1;
+  }
+
+  if (buffer->field >= 0 && (flags & PyBUF_STRIDES) != PyBUF_STRIDES) {
+    PyErr_SetString(PyExc_BufferError, "A column is strided.");
+    return -1;
+  }
+
+  view->buf        = _records_start(buffer);
+  view->obj        = self;
+  view->readonly   = 1;
+  view->itemsize   = buffer->field >= 0 ? sizeof(double) : sizeof(cdb_record_t);
+  view->len        = buffer->len * view->itemsize;
+  view->ndim       = 1;
+  view->format     = NULL;
+  view->shape      = NULL;
+  view->strides    = NULL;
+  view->suboffsets = NULL;
+  view->internal   = NULL;
+
+  if ((flags & PyBUF_FORMAT) == PyBUF_FORMAT) {
+    view->format = (char*)(buffer->field == 0 ? "q" : buffer->field == 1 ? "d" : "T{q:time:d:value:}");
+  }
+
+  if ((flags & PyBUF_ND) == PyBUF_ND) {
+    view->shape = &buffer->shape;
+  }
+
+  if ((flags & PyBUF_STRIDES) == PyBUF_STRIDES) {
+    view->strides = &buffer->stride;
+  }
+
+  Py_INCREF(self);
+
+  return 0;
+}
+
+// The old buffer interface, for buffer() and numpy.frombuffer() - the
+// records only, since it can't describe a strided column
+static Py_ssize_t Records_getsegcount(PyObject *self, Py_ssize_t *lenp) {
+  RecordsObject *buffer = (RecordsObject*)self;
+
+  if (lenp != NULL) {
+    *lenp = buffer->len * sizeof(cdb_record_t);
+  }
+
+  return 1;
+}
+
+static Py_ssize_t Records_getreadbuffer(PyObject *self, Py_ssize_t segment, void **ptr) {
+  RecordsObject *buffer = (RecordsObject*)self;
+
+  if (segment != 0 || buffer->field >= 0) {
+    PyErr_SetString(PyExc_TypeError, "A column is strided - use memoryview() or numpy.asarray().");
+    return -1;
+  }
+
+  *ptr = _records_start(buffer);
+
+  return buffer->len * sizeof(cdb_record_t);
+}
+
+static PyObject* Records_column(PyObject *self, void *closure) {
+  RecordsObject *buffer = (RecordsObject*)self;
+  RecordsObject *column;
+
+  if (buffer->field >= 0) {
+    PyErr_SetString(PyExc_AttributeError, "A column has no columns.");
+    return NULL;
+  }
+
+  if ((column = PyObject_New(RecordsObject, &RecordsType)) == NULL) {
+    return NULL;
+  }
+
+  Py_INCREF(self);
+
+  column->parent  = self;
+  column->records = buffer->records;
+  column->len     = buffer->len;
+  column->field   = (int)(long)closure;
+  column->shape   = buffer->len;
+  column->stride  = sizeof(cdb_record_t);
+
+  return (PyObject*)column;
+}
+
 /*
 // Ruby Class / Method glue
 
@@ -657,6 +1062,8 @@ static PyMethodDef Storage_methods[] = {
   { "write_header",   (PyCFunction)cdb_py_write_header, 0, "" },
   { "read_records",   (PyCFunction)cdb_py_read_records, METH_VARARGS|METH_KEYWORDS, PyDoc_STR("Read records from a CircularDB file.") },
   { "write_records",  (PyCFunction)cdb_py_write_records, METH_VARARGS, "" },
+  { "read_buffer",    (PyCFunction)cdb_py_read_buffer, METH_VARARGS|METH_KEYWORDS, PyDoc_STR("Read records into a Records buffer, without a Python object per record.") },
+  { "write_buffer",   (PyCFunction)cdb_py_write_buffer, METH_VARARGS, PyDoc_STR("Write records from a buffer of (int64 time, double value) structs.") },
   { "write_record",   (PyCFunction)cdb_py_write_record, METH_VARARGS, "" },
   { "update_records", (PyCFunction)cdb_py_update_records, METH_VARARGS, "" },
   { "update_record",  (PyCFunction)cdb_py_update_record, METH_VARARGS, "" },
@@ -665,6 +1072,8 @@ static PyMethodDef Storage_methods[] = {
   { "print_records",  (PyCFunction)cdb_py_print_records, METH_VARARGS|METH_KEYWORDS, "" },
   { "discard",        (PyCFunction)cdb_py_discard_records_in_time_range, METH_VARARGS, "" },
   { "statistics",     (PyCFunction)cdb_py_statistics, 0, "" },
+  { "stats",          (PyCFunction)cdb_py_stats, METH_NOARGS, PyDoc_STR("Performance counters of this handle, or None if they aren't kept.") },
+  { "reset_stats",    (PyCFunction)cdb_py_reset_stats, METH_NOARGS, "" },
   { NULL }
 };
 
@@ -724,6 +1133,63 @@ static PyTypeObject StorageType = {
     Storage_new,        /* tp_new */
 };
 
+static PySequenceMethods Records_as_sequence = {
+  Records_length,     /* sq_length */
+  0,                  /* sq_concat */
+  0,                  /* sq_repeat */
+  Records_item,       /* sq_item */
+};
+
+static PyBufferProcs Records_as_buffer = {
+  Records_getreadbuffer,  /* bf_getreadbuffer */
+  0,                      /* bf_getwritebuffer */
+  Records_getsegcount,    /* bf_getsegcount */
+  0,                      /* bf_getcharbuffer */
+  Records_getbuffer,      /* bf_getbuffer */
+  0,                      /* bf_releasebuffer */
+};
+
+static PyGetSetDef Records_getseters[] = {
+  { "times",  (getter)Records_column, 0, "The times, as a strided int64 buffer", (void*)0 },
+  { "values", (getter)Records_column, 0, "The values, as a strided double buffer", (void*)1 },
+  { NULL }  /* Sentinel */
+};
+
+static PyTypeObject RecordsType = {
+    PyObject_HEAD_INIT(NULL)
+    0,                  /*ob_size*/
+    "circulardb.Records",    /*tp_name*/
+    sizeof(RecordsObject),  /*tp_basicsize*/
+    0,                  /*tp_itemsize*/
+    /* methods */
+    Records_dealloc,    /*tp_dealloc*/
+    0,                  /*tp_print*/
+    0,                  /*tp_getattr*/
+    0,                  /*tp_setattr*/
+    0,                  /*tp_compare*/
+    0,                  /*tp_repr*/
+    0,                  /*tp_as_number*/
+    &Records_as_sequence, /*tp_as_sequence*/
+    0,                  /*tp_as_mapping*/
+    0,                  /*tp_hash*/
+    0,                  /*tp_call*/
+    0,                  /*tp_str*/
+    0,                  /*tp_getattro*/
+    0,                  /*tp_setattro*/
+    &Records_as_buffer, /*tp_as_buffer*/
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_NEWBUFFER, /*tp_flags*/
+    "Records read by Storage.read_buffer()", /*tp_doc*/
+    0,                  /*tp_traverse*/
+    0,                  /*tp_clear*/
+    0,                  /*tp_richcompare*/
+    0,                  /*tp_weaklistoffset*/
+    0,                  /*tp_iter*/
+    0,                  /*tp_iternext*/
+    0,                  /* tp_methods */
+    0,                  /* tp_members */
+    Records_getseters,  /* tp_getset */
+};
+
 static PyGetSetDef Statistics_getseters[] = {
   { "median",  (getter)Statistics_get, 0,  "median",  (void*)CDB_MEDIAN },
   { "mad",     (getter)Statistics_get, 0,  "mad",     (void*)CDB_MAD },
@@ -797,12 +1263,11 @@ initcirculardb(void)
   if (PyType_Ready(&StatisticsType) < 0)
     return;
 
-  AggregateType.tp_new = PyType_GenericNew;
-  if (PyType_Ready(&AggregateType) < 0)
+  if (PyType_Ready(&RecordsType) < 0)
     return;
 
   // Create the module.
-  mod = Py_InitModule3("circulardb", NULL, "CircularDB Library Extension");
+  mod = Py_InitModule3("circulardb", module_methods, "CircularDB Library Extension");
 
   if (mod == NULL)
     return;
@@ -810,8 +1275,8 @@ initcirculardb(void)
   // Add the type to the module.
   Py_INCREF(&StorageType);
   Py_INCREF(&StatisticsType);
-  Py_INCREF(&AggregateType);
+  Py_INCREF(&RecordsType);
   PyModule_AddObject(mod, "Storage", (PyObject *)&StorageType);
   PyModule_AddObject(mod, "Statistics", (PyObject *)&StatisticsType);
-  PyModule_AddObject(mod, "Aggregate", (PyObject *)&AggregateType);
+  PyModule_AddObject(mod, "Records", (PyObject *)&RecordsType);
 }
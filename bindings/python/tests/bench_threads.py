@@ -0,0 +1,83 @@
+#!/usr/bin/python
+
+# Reads from several threads at once. The binding releases the GIL around
+# the library calls, so the reads - the disk I/O and the sorting for the
+# statistics - run side by side, and the time for the same total work should
+# drop as threads are added, up to the number of cores.
+#
+#   python tests/bench_threads.py [records] [reads] [max threads]
+
+import sys
+import os
+import time
+import shutil
+import struct
+import tempfile
+import threading
+
+sys.path.append('.')
+
+import circulardb
+
+def create(path, records):
+  cdb    = circulardb.Storage(path, os.O_CREAT|os.O_RDWR|os.O_EXCL, -1, "Threads", None, records, "gauge")
+  start  = int(time.time()) - records
+  packed = ''.join([ struct.pack('=qd', start+i, float(i % 1000)) for i in range(0, records) ])
+
+  cdb.write_buffer(packed)
+  cdb.close()
+
+def reader(path, reads):
+  # A handle each, as a threaded server would have
+  cdb = circulardb.Storage(path, os.O_RDONLY)
+
+  for i in range(0, reads):
+    cdb.read_buffer()
+    cdb.statistics().median
+
+  cdb.close()
+
+def run(path, threads, reads):
+  workers = [ threading.Thread(target = reader, args = (path, reads / threads)) for i in range(0, threads) ]
+  start   = time.time()
+
+  for worker in workers:
+    worker.start()
+
+  for worker in workers:
+    worker.join()
+
+  return time.time() - start
+
+def main():
+  records = len(sys.argv) > 1 and int(sys.argv[1]) or 200000
+  reads   = len(sys.argv) > 2 and int(sys.argv[2]) or 64
+  maximum = len(sys.argv) > 3 and int(sys.argv[3]) or 8
+
+  tempdir = tempfile.mkdtemp()
+  path    = os.path.join(tempdir, "threads.cdb")
+
+  try:
+    create(path, records)
+
+    # Warm the page cache, so the first run isn't the slow one
+    reader(path, 1)
+
+    base    = None
+    threads = 1
+
+    print "%d reads of %d records" % (reads, records)
+
+    while threads <= maximum:
+      elapsed = run(path, threads, reads)
+      base    = base or elapsed
+
+      print "%2d thread(s): %8.3fs  %5.2fx" % (threads, elapsed, base / elapsed)
+
+      threads *= 2
+
+  finally:
+    shutil.rmtree(tempdir)
+
+if __name__ == '__main__':
+  main()
@@ -5,6 +5,7 @@ import os
 import time
 import shutil
 import math
+import struct
 import tempfile
 
 sys.path.append('.')
@@ -154,5 +155,90 @@ class TestCircularDB(unittest.TestCase):
 
     cdb.close()
 
+  def test_stats(self):
+    cdb = circulardb.Storage(self.file, os.O_CREAT|os.O_RDWR|os.O_EXCL, -1, self.name, None, 0, "gauge")
+    self.assert_(cdb)
+
+    records = []
+    start   = 1190860358
+
+    for i in range(0, 20):
+      records.append([ start+i, float(i) ])
+
+    self.assertEqual(20, cdb.write_records(records))
+
+    cdb.reset_stats()
+    cdb.read_records(cooked = 1, step = 5)
+
+    stats = cdb.stats()
+
+    # None without --enable-stats
+    if stats is not None:
+      self.assertEqual(20, stats['records_decoded'])
+      self.assert_(stats['bytes_read'] > 0)
+
+      cdb.reset_stats()
+      self.assertEqual(0, cdb.stats()['syscalls'])
+
+    cdb.close()
+
+  def test_histograms(self):
+    cdb = circulardb.Storage(self.file, os.O_CREAT|os.O_RDWR|os.O_EXCL, -1, self.name, None, 0, "gauge")
+    self.assert_(cdb)
+
+    self.assertEqual(1, cdb.write_record(1190860358, 1.0))
+
+    circulardb.reset_histograms()
+    cdb.read_records()
+
+    histograms = circulardb.histograms()
+
+    # None without --enable-stats
+    if histograms is not None:
+      self.assertEqual(1, histograms['read']['count'])
+      self.assertEqual(0, histograms['write']['count'])
+      self.assert_(histograms['read']['p99'] >= histograms['read']['p50'])
+      self.assertEqual(1, len(histograms['read']['buckets']))
+
+    cdb.close()
+
+  def test_buffer(self):
+    cdb = circulardb.Storage(self.file, os.O_CREAT|os.O_RDWR|os.O_EXCL, -1, self.name, None, 0, "gauge")
+    self.assert_(cdb)
+
+    start  = 1190860358
+    packed = ''.join([ struct.pack('=qd', start+i, float(i)) for i in range(0, 20) ])
+
+    # Any buffer of (int64, double) structs
+    self.assertEqual(20, cdb.write_buffer(packed))
+    self.assertEqual(20, cdb.num_records)
+    self.assertRaises(ValueError, cdb.write_buffer, packed[:-1])
+
+    read = cdb.read_buffer(cooked = 0)
+
+    self.assertEqual(20, len(read))
+    self.assertEqual((start+3, 3.0), read[3])
+    self.assertEqual(packed, str(buffer(read)))
+    self.assertEqual(9.5, cdb.statistics().mean)
+
+    # The columns are strided views of the same records
+    times  = read.times
+    values = read.values
+    del read
+
+    self.assertEqual(start+19, times[19])
+    self.assertEqual(19.0, values[19])
+    self.assertEqual(20, memoryview(values).shape[0])
+    self.assertEqual((16,), memoryview(values).strides)
+    self.assertEqual(map(float, range(0, 20)), list(values))
+
+    # What was read can be written back
+    copy = circulardb.Storage(os.path.join(self.tempdir, "copy.cdb"), os.O_CREAT|os.O_RDWR|os.O_EXCL, -1, self.name, None, 0, "gauge")
+    self.assertEqual(20, copy.write_buffer(cdb.read_buffer(cooked = 0)))
+    self.assertEqual(cdb.read_records(), copy.read_records())
+
+    copy.close()
+    cdb.close()
+
 if __name__ == '__main__':
   unittest.main()
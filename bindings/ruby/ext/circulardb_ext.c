@@ -7,6 +7,10 @@
 #include <ruby.h>
 #include <rubyio.h>
 
+#ifdef HAVE_RUBY_THREAD_H
+#include <ruby/thread.h>
+#endif
+
 #include <circulardb.h>
 #include <fcntl.h>
 
@@ -17,6 +21,10 @@
 #define O_BINARY 0
 #endif
 
+#ifndef RB_GC_GUARD
+#define RB_GC_GUARD(v) (*(volatile VALUE*)&(v))
+#endif
+
 /* TODO handle clone/dup */
 
 static VALUE mCircularDB;
@@ -71,6 +79,86 @@ void _check_return(int ret) {
     }
 }
 
+/* A library call made without the GVL. Everything it needs is copied in
+ * here first, since it must not touch a Ruby object, and it leaves its
+ * results here until the GVL is back. */
+typedef struct {
+    cdb_t         *cdb;
+    cdb_t         **cdbs;
+    int           num_cdbs;
+    int           type;
+    cdb_request_t request;
+    cdb_record_t  *records;
+    uint64_t      len;
+    uint64_t      cnt;
+    cdb_range_t   range;
+    cdb_time_t    time;
+    double        value;
+    int           ret;
+} cdb_rb_call_t;
+
+/* Runs func without the GVL, so that other threads run while the records
+ * are read or written and the statistics sorted. Rubies without a GVL just
+ * call it. There is no unblocking function - a thread in the library is
+ * interrupted once the call returns. */
+static void _cdb_rb_without_gvl(void *(*func)(void*), cdb_rb_call_t *call) {
+#if defined(HAVE_RB_THREAD_CALL_WITHOUT_GVL)
+    rb_thread_call_without_gvl(func, call, NULL, NULL);
+#elif defined(HAVE_RB_THREAD_BLOCKING_REGION)
+    rb_thread_blocking_region((rb_blocking_function_t*)func, call, NULL, NULL);
+#else
+    func(call);
+#endif
+}
+
+static void* _cdb_rb_read_records_func(void *data) {
+    cdb_rb_call_t *call = data;
+
+    call->ret = cdb_read_records(call->cdb, &call->request, &call->cnt, &call->records, &call->range);
+
+    return NULL;
+}
+
+static void* _cdb_rb_write_records_func(void *data) {
+    cdb_rb_call_t *call = data;
+
+    if (call->type == RCDB_WRITE) {
+        call->ret = cdb_write_records(call->cdb, call->records, call->len, &call->cnt);
+    } else {
+        call->ret = cdb_update_records(call->cdb, call->records, call->len, &call->cnt);
+    }
+
+    return NULL;
+}
+
+static void* _cdb_rb_write_record_func(void *data) {
+    cdb_rb_call_t *call = data;
+
+    if (call->type == RCDB_WRITE) {
+        call->ret = cdb_write_record(call->cdb, call->time, call->value);
+    } else {
+        call->ret = cdb_update_record(call->cdb, call->time, call->value);
+    }
+
+    return NULL;
+}
+
+static void* _cdb_rb_discard_records_func(void *data) {
+    cdb_rb_call_t *call = data;
+
+    call->ret = cdb_discard_records_in_time_range(call->cdb, &call->request, &call->cnt);
+
+    return NULL;
+}
+
+static void* _cdb_rb_read_aggregate_records_func(void *data) {
+    cdb_rb_call_t *call = data;
+
+    call->ret = cdb_read_aggregate_records(call->cdbs, call->num_cdbs, &call->request, &call->cnt, &call->records, &call->range);
+
+    return NULL;
+}
+
 /* Cleanup after an object has been GCed */
 static void cdb_rb_free(void *p) {
     cdb_free(p);
@@ -206,6 +294,7 @@ static VALUE cdb_rb_initialize(int argc, VALUE *argv, VALUE self) {
             StringValuePtr(units),
             NUM2ULL(min_value),
             NUM2ULL(max_value),
+            CDB_ENCODING_FLOAT64
         );
 
         num_records = INT2FIX(0);
@@ -285,33 +374,38 @@ static VALUE cdb_rb_read_records(int argc, VALUE *argv, VALUE self) {
 
     VALUE start, end, count, cooked, step, array;
 
-    uint64_t i   = 0;
-    uint64_t cnt = 0;
-    int      ret = 0;
+    uint64_t i = 0;
 
-    cdb_t *cdb;
-    cdb_range_t *range    = _new_statistics(self);
-    cdb_record_t *records = NULL;
+    cdb_rb_call_t call;
+
+    MEMZERO(&call, cdb_rb_call_t, 1);
 
     rb_scan_args(argc, argv, "05", &start, &end, &count, &cooked, &step);
 
-    cdb_request_t request = _parse_cdb_request(start, end, count, cooked, step);
+    call.request = _parse_cdb_request(start, end, count, cooked, step);
 
-    Data_Get_Struct(self, cdb_t, cdb);
+    Data_Get_Struct(self, cdb_t, call.cdb);
+
+    /* The statistics object is only filled in with the GVL held, since
+     * another thread may be reading into it too */
+    _cdb_rb_without_gvl(_cdb_rb_read_records_func, &call);
 
-    ret = cdb_read_records(cdb, &request, &cnt, &records, range);
+    MEMCPY(_new_statistics(self), &call.range, cdb_range_t, 1);
 
-    _check_return(ret);
+    if (call.ret != CDB_SUCCESS) {
+        free(call.records);
+        _check_return(call.ret);
+    }
 
-    array = rb_ary_new2(cnt);
+    array = rb_ary_new2(call.cnt);
 
-    for (i = 0; i < cnt; i++) {
-        rb_ary_store(array, i, rb_ary_new3(2, ULONG2NUM(records[i].time), rb_float_new(records[i].value)));
+    for (i = 0; i < call.cnt; i++) {
+        rb_ary_store(array, i, rb_ary_new3(2, ULONG2NUM(call.records[i].time), rb_float_new(call.records[i].value)));
     }
 
-    free(records);
+    free(call.records);
 
-    _cdb_rb_update_header_hash(self, cdb);
+    _cdb_rb_update_header_hash(self, call.cdb);
 
     return array;
 }
@@ -321,11 +415,10 @@ static VALUE _cdb_write_or_update_records(VALUE self, VALUE array, int type) {
 
     uint64_t len = RARRAY(array)->len;
     uint64_t i   = 0;
-    uint64_t cnt = 0;
-    bool     ret = false;
 
     cdb_t *cdb;
     cdb_record_t *records = ALLOCA_N(cdb_record_t, len);
+    cdb_rb_call_t call;
 
     Data_Get_Struct(self, cdb_t, cdb);
 
@@ -338,47 +431,50 @@ static VALUE _cdb_write_or_update_records(VALUE self, VALUE array, int type) {
         records[i].value = value == Qnil ? CDB_NAN : NUM2DBL(value);
     }
 
-    if (type == RCDB_WRITE) {
-        ret = cdb_write_records(cdb, records, len, &cnt);
-    } else {
-        ret = cdb_update_records(cdb, records, len, &cnt);
-    }
+    MEMZERO(&call, cdb_rb_call_t, 1);
+
+    /* The records are our own copy, so the array may change meanwhile */
+    call.cdb     = cdb;
+    call.type    = type;
+    call.records = records;
+    call.len     = len;
+
+    _cdb_rb_without_gvl(_cdb_rb_write_records_func, &call);
 
-    if (ret != CDB_SUCCESS) {
+    if (call.ret != CDB_SUCCESS) {
         rb_sys_fail(0);
     }
 
     _cdb_rb_update_header_hash(self, cdb);
 
-    return ULL2NUM(cnt);
+    return ULL2NUM(call.cnt);
 }
 
 static VALUE _cdb_write_or_update_record(VALUE self, VALUE time, VALUE value, int type) {
 
-    bool ret = false;
-
     cdb_t *cdb;
+    cdb_rb_call_t call;
 
     Data_Get_Struct(self, cdb_t, cdb);
 
+    MEMZERO(&call, cdb_rb_call_t, 1);
+
+    call.cdb   = cdb;
+    call.type  = type;
+    call.time  = _parse_time(time);
+
     /* Convert nil to NAN, which is what the circulardb code expects */
-    if (value == Qnil) {
-        value = rb_float_new(CDB_NAN);
-    }
+    call.value = value == Qnil ? CDB_NAN : NUM2DBL(value);
 
-    if (type == RCDB_WRITE) {
-        ret = cdb_write_record(cdb, _parse_time(time), NUM2DBL(value));
-    } else {
-        ret = cdb_update_record(cdb, _parse_time(time), NUM2DBL(value));
-    }
+    _cdb_rb_without_gvl(_cdb_rb_write_record_func, &call);
 
-    if (ret == false) {
+    if (call.ret == false) {
         rb_sys_fail(0);
     }
 
     _cdb_rb_update_header_hash(self, cdb);
 
-    return ULL2NUM((int)ret);
+    return ULL2NUM(call.ret);
 }
 
 static VALUE cdb_rb_write_records(VALUE self, VALUE array) {
@@ -403,17 +499,19 @@ static VALUE cdb_rb_update_record(VALUE self, VALUE time, VALUE value) {
 
 static VALUE cdb_rb_discard_records_in_time_range(VALUE self, VALUE start_time, VALUE end_time) {
 
-    cdb_t *cdb;
-    Data_Get_Struct(self, cdb_t, cdb);
-    uint64_t cnt = 0;
+    cdb_rb_call_t call;
+
+    MEMZERO(&call, cdb_rb_call_t, 1);
+
+    Data_Get_Struct(self, cdb_t, call.cdb);
 
-    cdb_request_t request = _parse_cdb_request(start_time, end_time, Qnil, Qnil, Qnil);
+    call.request = _parse_cdb_request(start_time, end_time, Qnil, Qnil, Qnil);
 
-    int ret = cdb_discard_records_in_time_range(cdb, &request, &cnt);
+    _cdb_rb_without_gvl(_cdb_rb_discard_records_func, &call);
 
-    _check_return(ret);
+    _check_return(call.ret);
 
-    return ULL2NUM(cnt);
+    return ULL2NUM(call.cnt);
 }
 
 static VALUE cdb_rb_open_cdb(VALUE self) {
@@ -510,6 +608,45 @@ static VALUE cdb_rb_print_records(int argc, VALUE *argv, VALUE self) {
     return self;
 }
 
+/* nil unless the library was configured with --enable-stats */
+static VALUE cdb_rb_stats(VALUE self) {
+
+    cdb_t *cdb;
+    cdb_stats_t stats;
+    VALUE hash;
+
+    Data_Get_Struct(self, cdb_t, cdb);
+
+    if (cdb_get_stats(cdb, &stats) != CDB_SUCCESS) {
+        return Qnil;
+    }
+
+    hash = rb_hash_new();
+
+    rb_hash_aset(hash, ID2SYM(rb_intern("syscalls")), ULL2NUM(stats.syscalls));
+    rb_hash_aset(hash, ID2SYM(rb_intern("bytes_read")), ULL2NUM(stats.bytes_read));
+    rb_hash_aset(hash, ID2SYM(rb_intern("bytes_written")), ULL2NUM(stats.bytes_written));
+    rb_hash_aset(hash, ID2SYM(rb_intern("lookups")), ULL2NUM(stats.lookups));
+    rb_hash_aset(hash, ID2SYM(rb_intern("probes")), ULL2NUM(stats.probes));
+    rb_hash_aset(hash, ID2SYM(rb_intern("records_decoded")), ULL2NUM(stats.records_decoded));
+    rb_hash_aset(hash, ID2SYM(rb_intern("allocations")), ULL2NUM(stats.allocations));
+    rb_hash_aset(hash, ID2SYM(rb_intern("cook_ns")), ULL2NUM(stats.cook_ns));
+    rb_hash_aset(hash, ID2SYM(rb_intern("step_ns")), ULL2NUM(stats.step_ns));
+    rb_hash_aset(hash, ID2SYM(rb_intern("stats_ns")), ULL2NUM(stats.stats_ns));
+
+    return hash;
+}
+
+static VALUE cdb_rb_reset_stats(VALUE self) {
+
+    cdb_t *cdb;
+    Data_Get_Struct(self, cdb_t, cdb);
+
+    cdb_reset_stats(cdb);
+
+    return self;
+}
+
 static VALUE cdb_rb_statistics(int argc, VALUE *argv, VALUE self) {
     VALUE statistics = rb_iv_get(self, "@statistics");
 
@@ -537,21 +674,23 @@ static VALUE cdb_agg_rb_initialize(VALUE self, VALUE name) {
 static VALUE cdb_agg_rb_read_records(int argc, VALUE *argv, VALUE self) {
 
     VALUE start, end, count, cooked, step, array;
-    VALUE cdb_objects = rb_iv_get(self, "@cdbs");
+
+    /* Our own copy, so that the Storage objects can't be collected while
+     * the GVL is released, even if another thread changes @cdbs */
+    VALUE cdb_objects = rb_ary_dup(rb_iv_get(self, "@cdbs"));
 
     uint64_t i   = 0;
-    uint64_t cnt = 0;
-    int ret      = 0;
     int num_cdbs = RARRAY(cdb_objects)->len;
 
     /* initialize the cdbs array to the size of the cdb_objects array */
     cdb_t *cdbs[num_cdbs];
-    cdb_record_t *records = NULL;
-    cdb_range_t *range    = _new_statistics(self);
+    cdb_rb_call_t call;
+
+    MEMZERO(&call, cdb_rb_call_t, 1);
 
     rb_scan_args(argc, argv, "05", &start, &end, &count, &cooked, &step);
 
-    cdb_request_t request = _parse_cdb_request(start, end, count, cooked, step);
+    call.request = _parse_cdb_request(start, end, count, cooked, step);
 
     /* First, loop over the incoming array of CircularDB::Storage objects and
      * extract the pointers to the cdb_t structs. */
@@ -559,17 +698,27 @@ static VALUE cdb_agg_rb_read_records(int argc, VALUE *argv, VALUE self) {
         Data_Get_Struct(RARRAY(cdb_objects)->ptr[i], cdb_t, cdbs[i]);
     }
 
-    ret = cdb_read_aggregate_records(cdbs, num_cdbs, &request, &cnt, &records, range);
+    call.cdbs     = cdbs;
+    call.num_cdbs = num_cdbs;
+
+    _cdb_rb_without_gvl(_cdb_rb_read_aggregate_records_func, &call);
+
+    RB_GC_GUARD(cdb_objects);
 
-    _check_return(ret);
+    MEMCPY(_new_statistics(self), &call.range, cdb_range_t, 1);
+
+    if (call.ret != CDB_SUCCESS) {
+        free(call.records);
+        _check_return(call.ret);
+    }
 
-    array = rb_ary_new2(cnt);
+    array = rb_ary_new2(call.cnt);
 
-    for (i = 0; i < cnt; i++) {
-        rb_ary_store(array, i, rb_ary_new3(2, ULONG2NUM(records[i].time), rb_float_new(records[i].value)));
+    for (i = 0; i < call.cnt; i++) {
+        rb_ary_store(array, i, rb_ary_new3(2, ULONG2NUM(call.records[i].time), rb_float_new(call.records[i].value)));
     }
 
-    free(records);
+    free(call.records);
 
     return array;
 }
@@ -716,6 +865,8 @@ void Init_circulardb_ext() {
     rb_define_method(cStorage, "print_records", cdb_rb_print_records, -1);
     rb_define_method(cStorage, "_set_header", _set_header, 2);
     rb_define_method(cStorage, "statistics", cdb_rb_statistics, -1);
+    rb_define_method(cStorage, "stats", cdb_rb_stats, 0);
+    rb_define_method(cStorage, "reset_stats", cdb_rb_reset_stats, 0);
 
     /* CircularDB::Aggregate class */
     rb_define_method(cAggregate, "initialize", cdb_agg_rb_initialize, 1);
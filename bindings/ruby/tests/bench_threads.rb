@@ -0,0 +1,87 @@
+# Reads from several threads at once. The extension releases the GVL around
+# the library calls, so the reads - the disk I/O and the sorting for the
+# statistics - run side by side, and the time for the same total work should
+# drop as threads are added, up to the number of cores.
+#
+#   ruby tests/bench_threads.rb [records] [reads] [max threads]
+
+require File.dirname(__FILE__) + '/test_helper'
+
+require 'circulardb/aggregate'
+require 'circulardb/storage'
+require 'fileutils'
+require 'tmpdir'
+
+records = (ARGV[0] || 200000).to_i
+reads   = (ARGV[1] || 64).to_i
+maximum = (ARGV[2] || 8).to_i
+
+def create(file, records)
+  start = Time.now.to_i - records
+  cdb   = CircularDB::Storage.new(file, File::CREAT|File::RDWR|File::EXCL, nil, "Threads", records)
+
+  cdb.write_records((0...records).collect { |i| [ start + i, (i % 1000).to_f ] })
+  cdb.close
+end
+
+# A handle each, as a threaded server would have
+def storage_reader(files, reads)
+  cdb = CircularDB::Storage.new(files[0], File::RDONLY)
+
+  reads.times do
+    cdb.read_records(nil, nil, nil, true, 100)
+    cdb.statistics.median
+  end
+
+  cdb.close
+end
+
+def aggregate_reader(files, reads)
+  agg = CircularDB::Aggregate.new("Threads")
+  agg.cdbs = files.collect { |file| CircularDB::Storage.new(file, File::RDONLY) }
+
+  reads.times do
+    agg.read_records(nil, nil, nil, true, 100)
+    agg.statistics.median
+  end
+
+  agg.close
+end
+
+def run(kind, files, threads, reads)
+  start = Time.now
+
+  (1..threads).collect { Thread.new { send(kind, files, reads / threads) } }.each { |thread| thread.join }
+
+  Time.now - start
+end
+
+tempdir = Dir.mktmpdir('circulardb')
+
+begin
+  files = (1..3).collect { |i| File.join(tempdir, "#{i}.cdb") }
+  files.each { |file| create(file, records) }
+
+  [ :storage_reader, :aggregate_reader ].each do |kind|
+
+    # Warm the page cache, so the first run isn't the slow one
+    send(kind, files, 1)
+
+    puts "#{kind}: #{reads} reads of #{records} records"
+
+    base    = nil
+    threads = 1
+
+    while threads <= maximum
+      elapsed = run(kind, files, threads, reads)
+      base  ||= elapsed
+
+      printf("%2d thread(s): %8.3fs  %5.2fx\n", threads, elapsed, base / elapsed)
+
+      threads *= 2
+    end
+  end
+
+ensure
+  FileUtils.rm_rf(tempdir)
+end
@@ -19,6 +19,7 @@ extern "C" {
 #include <float.h>
 #include <inttypes.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -32,11 +33,18 @@ extern "C" {
  * >138    string          >\0             '%s',
  * >204    byte            0x02            gauge
  * >204    byte            0x04            counter
+ * >4      string          2.
+ * >>12    lelong          0x02            gauge
+ * >>12    lelong          0x04            counter
  *
  */
 
 #define CDB_TOKEN   "CDB"
-#define CDB_VERSION "1.1.1"
+#define CDB_VERSION "2.0.0"
+
+/* The earlier header, which is still read, and written back as it was, for
+ * the row layout. */
+#define CDB_VERSION_1_1 "1.1.1"
 
 #define CDB_EXTENSION "cdb"
 #define CDB_DEFAULT_DATA_UNIT "absolute"
@@ -49,29 +57,125 @@ extern "C" {
 
 #define CDB_DEFAULT_DATA_TYPE CDB_TYPE_GAUGE
 
+/* Use a 64bit value for the time, to be compatible across platforms and not
+ * rely on the definition of time_t */
+typedef int64_t cdb_time_t;
+
+/* How records are laid out after the header */
+#define CDB_LAYOUT_ROWS    0    /* time, value pairs */
+#define CDB_LAYOUT_COLUMNS 1    /* max_records times, then max_records values */
+#define CDB_LAYOUT_COMPRESSED 2 /* a ring of Gorilla compressed blocks */
+#define CDB_LAYOUT_IMPLICIT 3   /* max_records values, one every step seconds */
+
+/* How the column and implicit layouts store values. The scaled integers hold
+ * (value - value_offset) / value_scale, rounded to the nearest and clamped to
+ * the type's range. */
+#define CDB_ENCODING_FLOAT64 0
+#define CDB_ENCODING_FLOAT32 1
+#define CDB_ENCODING_INT16   2
+#define CDB_ENCODING_INT32   3
+
+/* header->flags */
+#define CDB_FLAG_CHECKSUMS 0x1  /* CRC32C checksums over the records */
+
+/* The header as it is in memory, and as 1.x files had it on disk. 2.0.0
+ * files keep it packed and little endian instead: the fields every open
+ * needs in a fixed 64 bytes, then tagged extensions for the strings and
+ * anything layout specific. */
 typedef struct cdb_header_s {
     char        token[4];           // CDB
     char        version[6];         //
     char        name[128];          // "short name" for this database
     char        desc[512];          // a longer description of this database.
     char        units[64];          // bytes, percent, seconds, etc
+    uint16_t    sequence;           // Seqlock count, odd while a writer is active
     int32_t     type;               // Defined above
     double      min_value;          // Values outside this range will be ignored/dropped
     double      max_value;          // Set both to 0 to disable.
     uint64_t    max_records;        // Maximum records this CDB can hold before cycling.
     uint64_t    start_record;       // Pointer to the logical start record
-    uint64_t    num_records;
+    uint64_t    num_records;        // Only stored for layouts other than rows
+    /* 1.1.1 headers end here */
+    uint32_t    layout;             // Defined above
+    uint32_t    flags;
+    uint64_t    data_offset;        // Where the records start
+    uint32_t    block_size;         // Compressed layout: bytes per block
+    uint32_t    num_blocks;         // Compressed layout: blocks in the ring
+    uint64_t    start_block;        // Compressed layout: the oldest block
+    uint64_t    used_blocks;        // Compressed layout: blocks holding records
+    cdb_time_t  base_time;          // Implicit layout: time of the oldest slot
+    uint64_t    step;               // Implicit layout: seconds between slots
+    uint32_t    encoding;           // Defined above
+    uint32_t    pad;
+    double      value_offset;       // Scaled integer encodings
+    double      value_scale;
+    char        reserved[184];
 } cdb_header_t;
 
-/* Use a 64bit value for the time, to be compatible across platforms and not
- * rely on the definition of time_t */
-typedef int64_t cdb_time_t;
-
 typedef struct cdb_record_s {
     cdb_time_t time;
     double value;
 } cdb_record_t;
 
+/* What a handle has done, for working out why a call was slow. Only counted
+ * when the library is configured with --enable-stats - otherwise the counting
+ * isn't compiled in, and cdb_get_stats() says so. */
+typedef struct cdb_stats_s {
+    uint64_t syscalls;          /* pread(), pwrite() and fcntl() */
+    uint64_t bytes_read;
+    uint64_t bytes_written;
+    uint64_t lookups;           /* Searches for the record at a time */
+    uint64_t probes;            /* Times read by them */
+    uint64_t records_decoded;   /* Read back from the file */
+    uint64_t allocations;
+    uint64_t cook_ns;           /* Turning counters into rates */
+    uint64_t step_ns;           /* Averaging request->step records */
+    uint64_t stats_ns;          /* cdb_range_t statistics */
+} cdb_stats_t;
+
+/* A cdb_t may be shared by multiple threads once it has been set up: all
+ * record I/O uses pread()/pwrite() at explicit offsets, and the lock below
+ * lets any number of readers run concurrently while writes, header refreshes
+ * and cdb_close() run exclusively. Setting filename/flags/mode and
+ * cdb_generate_header() must still happen before the handle is shared.
+ *
+ * To create a file in a layout other than rows, set header->layout after
+ * cdb_generate_header() and before the header is first written. A compressed
+ * file gets a fixed number of blocks, budgeted at two bytes a record: it
+ * keeps max_records records if they compress that well, and fewer if not.
+ * Updates that make a compressed block too big fail with CDB_ENOSPACE.
+ *
+ * The implicit layout is for series written every header->step seconds
+ * (which must be set along with the layout): only values are stored, and
+ * times are worked out from header->base_time. Times are rounded down to the
+ * step, a record for a slot that is already written replaces it, slots
+ * skipped over read back as no record at all, and records older than the
+ * oldest slot are dropped.
+ *
+ * Encodings other than CDB_ENCODING_FLOAT64 are only for the column and
+ * implicit layouts.
+ *
+ * Setting CDB_FLAG_CHECKSUMS in header->flags, at the same time as the
+ * layout, has writes keep CRC32C checksums of the records: one per block in
+ * the compressed layout, one per 512 slots in the column and implicit ones
+ * (the row layout has none). Reads check the ones they touch and fail with
+ * CDB_ECHECKSUM on a mismatch, unless the request has skip_checksums set.
+ *
+ * Readers in other processes don't need to lock the file either: writers bump
+ * header->sequence (through a shared mapping of the header) around every
+ * update, and readers that see it move re-read the header and retry. Each
+ * update holds an fcntl() lock over the count, so writers that don't set
+ * locking still take turns, and a writer that dies part way through doesn't
+ * leave readers waiting on it.
+ *
+ * Several writer processes may share a file if each sets locking to true on
+ * its own handle: every update then takes an exclusive fcntl() lock on the
+ * file and re-reads the header under it. To amortize that over many writes,
+ * bracket them with cdb_lock()/cdb_unlock() - updates inside the group reuse
+ * the lock that is already held. A handle that finds, once it has the lock,
+ * that a new file was renamed over its path reopens the path and locks that,
+ * so writers can wait out a cdb_convert or cdb_repair. Handles that don't set
+ * locking keep the old file until they are reopened. */
 typedef struct cdb_s {
     int fd;
     int flags;
@@ -79,6 +183,15 @@ typedef struct cdb_s {
     bool synced;
     char *filename;
     cdb_header_t *header;
+    void *mapped_header;            /* Shared mapping of the on disk header */
+    uint16_t *mapped_sequence;      /* The sequence count in it */
+    pthread_rwlock_t lock;
+    bool locking;                   /* fcntl() lock the file around every update */
+    int lock_depth;                 /* cdb_lock() nesting */
+    bool seq_locked;                /* fcntl() locking the sequence count */
+    uint64_t base;                  /* Where the header is - 0 but in containers */
+    struct cdb_container_s *container;  /* Which owns fd, for series in one */
+    cdb_stats_t stats;
 } cdb_t;
 
 /* roll up all the previous positional arguments */
@@ -88,8 +201,43 @@ typedef struct cdb_request_s {
     int64_t count; /* number of records requested */
     bool cooked;   /* For counter types, do the math */
     uint32_t step;     /* Request averaged data */
+    bool skip_checksums; /* Don't verify checksums on the way */
 } cdb_request_t;
 
+/* A run of records that failed their checksum: count physical slots from
+ * first, or for the compressed layout count blocks from the oldest. */
+typedef struct cdb_damage_s {
+    uint64_t first;
+    uint64_t count;
+} cdb_damage_t;
+
+/* Where a cdb_scan_records() has got to. */
+typedef struct cdb_scan_s {
+    uint64_t position;   /* Next record - or block, for the compressed layout */
+    uint64_t offset;     /* Records of that block already returned */
+    uint16_t sequence;   /* The file as it was when the scan started */
+    bool started;
+    bool skip_checksums; /* Don't verify checksums on the way */
+} cdb_scan_t;
+
+/* What cdb_cook_records() carries from one buffer to the next. */
+typedef struct cdb_cook_s {
+    double prev_value;
+    cdb_time_t prev_date;
+    int32_t factor;      /* From the units - "per sec" and so on */
+    bool started;
+} cdb_cook_t;
+
+/* What cdb_repair_records() found and did. */
+typedef struct cdb_repair_s {
+    uint64_t old_start;   /* start_record the header had */
+    uint64_t new_start;   /* Slot the oldest record turned out to be in */
+    uint64_t num_read;
+    uint64_t num_written;
+    uint64_t num_merged;  /* Had the time of the record before, and replaced it */
+    uint64_t num_dropped; /* Out of order */
+} cdb_repair_t;
+
 /* Hold all the stats for a particular time range, so this computation can be
  * done only once. */
 typedef struct cdb_range_s {
@@ -132,6 +280,12 @@ enum {
     CDB_EINTERPF = 11,  /* Aggregate follower failure */
     CDB_EBADTOK  = 12,  /* The CDB had an invalid header token */
     CDB_EBADVER  = 13,  /* The CDB had an incompatible version string */
+    CDB_EBUSY    = 14,  /* Writers kept changing the CDB while it was being read */
+    CDB_EFULL    = 15,  /* The ingest queue is full */
+    CDB_ENOSPACE = 16,  /* An updated compressed block, or a new series, doesn't fit */
+    CDB_ENOSERIES = 17, /* No series by that name in the container */
+    CDB_ECHECKSUM = 18, /* Records didn't match their checksum */
+    CDB_ETOOSMALL = 19, /* A caller's buffer can't hold the records */
 };
 
 #define RECORD_SIZE sizeof(cdb_record_t)
@@ -141,6 +295,8 @@ enum {
 /* Basic CDB handling functions */
 cdb_t* cdb_new(void);
 cdb_request_t cdb_new_request(void);
+cdb_scan_t cdb_new_scan(void);
+cdb_cook_t cdb_new_cook(void);
 
 /* Return CDB_SUCCESS or errno */
 int cdb_free(cdb_t *cdb);
@@ -151,8 +307,25 @@ int cdb_read_header(cdb_t *cdb);
 /* Return CDB_SUCCESS, CDB_ERDONLY or errno */
 int cdb_write_header(cdb_t *cdb);
 
+/* encoding is one of CDB_ENCODING_* - 0 for doubles. The scaled integer
+ * encodings start out with a value_offset of 0 and a value_scale of 1, to be
+ * set in the header before it is first written. */
 void cdb_generate_header(cdb_t *cdb, char* name, char* desc, uint64_t max_records, int32_t type,
-    char* units, uint64_t min_value, uint64_t max_value);
+    char* units, uint64_t min_value, uint64_t max_value, uint32_t encoding);
+
+/* Set cdb's header to source's settings, with nothing written yet - for a
+ * new file to take source's records, as cdb_convert and cdb_repair do. */
+void cdb_copy_header(cdb_t *cdb, cdb_t *source);
+
+/* What a CDB_E* code means. Anything past the last code is taken to be an
+ * errno. The codes share their numbers with errno values, so an error known
+ * to come from the system (a failed fopen(), say) wants strerror() instead. */
+const char* cdb_strerror(int ret);
+
+/* Hold the file write lock across a group of updates. These nest. */
+/* Return CDB_SUCCESS or errno */
+int cdb_lock(cdb_t *cdb);
+int cdb_unlock(cdb_t *cdb);
 
 /* Return CDB_SUCCESS, CDB_ERDONLY, CDB_EINVMAX or errno */
 int cdb_write_records(cdb_t *cdb, cdb_record_t *records, uint64_t len, uint64_t *num_recs);
@@ -168,10 +341,100 @@ int cdb_discard_records_in_time_range(cdb_t *cdb, cdb_request_t *request, uint64
 
 double cdb_get_statistic(cdb_range_t *range, cdb_statistics_enum_t type);
 
-/* Return CDB_SUCCESS, CDB_ENOMEM, CDB_ETMRANGE, CDB_ENORECS or errno */
+/* Return CDB_SUCCESS, CDB_ENOMEM, CDB_ETMRANGE, CDB_ENORECS, CDB_ECHECKSUM or errno */
 int cdb_read_records(cdb_t *cdb, cdb_request_t *request,
     uint64_t *num_recs, cdb_record_t **records, cdb_range_t *range);
 
+/* cdb_read_records() into records, which has room for capacity, without
+ * allocating. The buffer also holds the records as read, before they are
+ * cooked, averaged and sliced, so it may need room for more than are
+ * returned. With a range, scratch needs room for capacity doubles, which is
+ * checked before anything is read; with a NULL range it isn't used. Unlike
+ * cdb_read_records(), request is left as it was. */
+/* Return CDB_SUCCESS, CDB_EINVAL, CDB_ETOOSMALL (with *num_recs set to the
+ * room needed), CDB_ETMRANGE, CDB_ENORECS, CDB_ECHECKSUM or errno */
+int cdb_read_records_into(cdb_t *cdb, const cdb_request_t *request, cdb_record_t *records, uint64_t capacity,
+    uint64_t *num_recs, cdb_range_t *range, double *scratch, uint64_t scratch_capacity);
+
+/* Read the next records, oldest first, into records, which has room for len.
+ * Counters are raw and there are no statistics, so a file of any size can be
+ * read a buffer at a time. *num_recs is 0 once there are no more. The
+ * compressed layout returns at most a block's records each time. */
+/* Return CDB_SUCCESS, CDB_EINVAL, CDB_ENOMEM, CDB_EBUSY (the file changed
+ * since the scan started), CDB_ECHECKSUM or errno */
+int cdb_scan_records(cdb_t *cdb, cdb_scan_t *scan, cdb_record_t *records, uint64_t len, uint64_t *num_recs);
+
+/* Cook len scanned records in place, as a cooked read would. *num_recs may be
+ * one less than len for the first buffer of a counter with a rate. */
+/* Return CDB_SUCCESS, CDB_ESANITY or errno */
+int cdb_cook_records(cdb_t *cdb, cdb_cook_t *cook, cdb_record_t *records, uint64_t len, uint64_t *num_recs);
+
+/* Copy src's records to dst - a new file, its header written - oldest first
+ * and in order, whatever src's start_record says. The rows and columns
+ * layouts start from the slot where the times jump back. A record with the
+ * time of the one before replaces it, and one out of order is dropped. Reads
+ * src a buffer at a time, so it works on files of any size. With a NULL dst
+ * only the report is filled in. */
+/* Return CDB_SUCCESS, CDB_ESANITY, CDB_ENOMEM, CDB_EBUSY or errno */
+int cdb_repair_records(cdb_t *src, cdb_t *dst, cdb_repair_t *report);
+
+/* Check every checksum in the file. *damage is malloc()ed and lists the
+ * damaged runs, oldest block or lowest slot first; NULL if there are none. */
+/* Return CDB_SUCCESS, CDB_EINVAL (no checksums), CDB_ENOMEM, CDB_EBUSY or errno */
+int cdb_verify_checksums(cdb_t *cdb, cdb_damage_t **damage, uint64_t *num_damaged);
+
+/* Copy out, or zero, the handle's counters. They are updated atomically, so
+ * a copy taken while other threads use the handle is only roughly in step. */
+/* Return CDB_SUCCESS, or CDB_EINVAL if they aren't counted */
+int cdb_get_stats(cdb_t *cdb, cdb_stats_t *stats);
+void cdb_reset_stats(cdb_t *cdb);
+
+/* Latency histograms
+ *
+ * With --enable-stats the library also times each of these operations, over
+ * all handles, into log-linear histograms of nanoseconds: eight buckets for
+ * every power of two, so a bucket is within 12.5% of the latencies in it.
+ * Each thread records into its own histograms without locking; snapshots
+ * add up every thread's, including threads that have exited. */
+typedef enum cdb_op_enum_s {
+    CDB_OP_OPEN,        /* cdb_open() */
+    CDB_OP_READ,        /* Reading records, before statistics */
+    CDB_OP_SEARCH,      /* Finding the record at a time */
+    CDB_OP_WRITE,       /* cdb_write_records() */
+    CDB_OP_STATS,       /* Statistics of a range */
+    CDB_OP_AGGREGATE,   /* cdb_read_aggregate_records() */
+    CDB_OP_MAX
+} cdb_op_t;
+
+#define CDB_HISTOGRAM_SUB_BITS 3
+#define CDB_HISTOGRAM_BUCKETS  ((64 - CDB_HISTOGRAM_SUB_BITS + 1) << CDB_HISTOGRAM_SUB_BITS)
+
+typedef struct cdb_histogram_s {
+    uint64_t count;
+    uint64_t sum_ns;
+    uint64_t max_ns;
+    uint64_t buckets[CDB_HISTOGRAM_BUCKETS];
+} cdb_histogram_t;
+
+/* "open", "read" and so on */
+const char* cdb_op_name(cdb_op_t op);
+
+/* Snapshot of all the histograms, indexed by cdb_op_t. */
+/* Return CDB_SUCCESS, or CDB_EINVAL if they aren't kept */
+int cdb_get_histograms(cdb_histogram_t histograms[CDB_OP_MAX]);
+void cdb_reset_histograms(void);
+
+/* Add from's counts to into, for instance to combine snapshots from several
+ * processes. */
+void cdb_merge_histogram(cdb_histogram_t *into, const cdb_histogram_t *from);
+
+/* The latencies bucket holds, lowest and highest */
+uint64_t cdb_histogram_bucket_low(int bucket);
+uint64_t cdb_histogram_bucket_high(int bucket);
+
+/* An upper bound on the p (0 to 1) quantile latency - 0 if it is empty. */
+uint64_t cdb_histogram_percentile(const cdb_histogram_t *histogram, double p);
+
 void cdb_print_header(cdb_t * cdb);
 
 void cdb_print_records(cdb_t *cdb, cdb_request_t *request, FILE *fh, const char *date_format);
@@ -185,6 +448,142 @@ int cdb_read_aggregate_records(cdb_t **cdbs, int num_cdbs, cdb_request_t *reques
 
 void cdb_print_aggregate_records(cdb_t **cdbs, int num_cdbs, cdb_request_t *request, FILE *fh, const char *date_format);
 
+/* Query arenas
+ *
+ * Scratch memory for a query, bumped out of one region and given back all at
+ * once by cdb_arena_reset(). A thread keeps one and resets it after each
+ * query, so a busy server makes no malloc() calls to contend on. Not for
+ * sharing between threads. */
+typedef struct cdb_arena_s cdb_arena_t;
+
+/* With a region of size bytes the arena is carved from it, and it is never
+ * grown - what doesn't fit is allocated until the next reset. With a NULL
+ * region the arena allocates its own, of size (0 to start empty), and grows
+ * it at each reset to what the query before needed. Returns NULL on failure. */
+cdb_arena_t* cdb_arena_new(void *region, size_t size);
+
+/* size bytes, 16 byte aligned, until the next reset. NULL on failure. */
+void* cdb_arena_alloc(cdb_arena_t *arena, size_t size);
+
+void cdb_arena_reset(cdb_arena_t *arena);
+void cdb_arena_free(cdb_arena_t *arena);
+
+/* cdb_read_aggregate_records() with its records, and all its scratch memory,
+ * from arena. The records are good until the arena is reset. */
+/* Return CDB_SUCCESS, CDB_ENOMEM, CDB_ETMRANGE, CDB_ENORECS, CDB_EINTERPD, CDB_EINTERPF or errno */
+int cdb_read_aggregate_records_arena(cdb_t **cdbs, int num_cdbs, cdb_request_t *request, cdb_arena_t *arena,
+    uint64_t *num_recs, cdb_record_t **records, cdb_range_t *range);
+
+/* Ingest interface
+ *
+ * Any number of threads push records for any number of cdb_t handles; one or
+ * more flusher threads take them off lock free queues and write each handle's
+ * records with one cdb_write_records() call per batch. A handle always goes
+ * to the same flusher, so its records are written in push order. */
+typedef struct cdb_ingest_s cdb_ingest_t;
+
+typedef struct cdb_ingest_stats_s {
+    uint64_t capacity;      /* slots, over all queues */
+    uint64_t depth;         /* pushed and not yet written */
+    uint64_t high_water;    /* deepest any one queue has been */
+    uint64_t pushed;
+    uint64_t written;
+    uint64_t failed;        /* cdb_write_records() returned an error */
+    uint64_t rejected;      /* CDB_EFULL returned to a producer */
+    uint64_t stolen;        /* series written by another shard (writer pool) */
+} cdb_ingest_stats_t;
+
+/* capacity is per flusher, rounded up to a power of two. When the queue is
+ * full, cdb_ingest_push() waits for room if block is set and returns
+ * CDB_EFULL otherwise. Returns NULL on failure. */
+cdb_ingest_t* cdb_ingest_new(uint64_t capacity, int num_flushers, bool block);
+
+/* Return CDB_SUCCESS, CDB_EFULL, CDB_EFAULT, or CDB_EINVAL after shutdown */
+int cdb_ingest_push(cdb_ingest_t *ingest, cdb_t *cdb, cdb_time_t time, double value);
+
+/* Wait until everything pushed so far has been written. */
+/* Return CDB_SUCCESS or the last write error since the previous flush */
+int cdb_ingest_flush(cdb_ingest_t *ingest);
+
+/* Write out everything still queued, stop the flushers and free the queue.
+ * A push racing with this is either written or gets CDB_EINVAL, and is
+ * waited for - but none may start once it has returned. */
+/* Return CDB_SUCCESS or the last write error */
+int cdb_ingest_free(cdb_ingest_t *ingest);
+
+void cdb_ingest_get_stats(cdb_ingest_t *ingest, cdb_ingest_stats_t *stats);
+
+/* Writer pool interface
+ *
+ * Series are named by path and hashed to one of num_shards writer threads,
+ * which alone open and write them, so writes need no locking at all. Shards
+ * that run out of work help write the series of busy ones. The files must
+ * already exist. */
+typedef struct cdb_pool_s cdb_pool_t;
+
+/* max_pending bounds the records queued per shard (0 for no bound); past it
+ * writers wait for room if block is set and get CDB_EFULL otherwise.
+ * max_open bounds the files each shard keeps open between writes (0 for the
+ * default) - the least recently written are closed and opened again when
+ * next written. Returns NULL on failure. */
+cdb_pool_t* cdb_pool_new(int num_shards, uint64_t max_pending, uint64_t max_open, bool block);
+
+/* records are copied. */
+/* Return CDB_SUCCESS, CDB_EFULL, CDB_ENOMEM, CDB_EFAULT, or CDB_EINVAL after shutdown */
+int cdb_pool_write_records(cdb_pool_t *pool, const char *path, cdb_record_t *records, uint64_t len);
+int cdb_pool_write_record(cdb_pool_t *pool, const char *path, cdb_time_t time, double value);
+
+/* Return CDB_SUCCESS or the last write error since the previous flush */
+int cdb_pool_flush(cdb_pool_t *pool);
+
+/* Return CDB_SUCCESS or the last write error */
+int cdb_pool_free(cdb_pool_t *pool);
+
+void cdb_pool_get_stats(cdb_pool_t *pool, cdb_ingest_stats_t *stats);
+
+/* Container interface
+ *
+ * A container packs many named series into one file: a directory of up to
+ * max_series names at the front, then each series' header and records at a
+ * page aligned offset of their own. Series have a fixed size, so they use the
+ * column, implicit or compressed layouts - rows are turned into columns.
+ *
+ * Series handles work like any other cdb_t, but share the container's file
+ * and belong to it: don't cdb_close() or cdb_free() them. With locking set,
+ * a series' updates lock only that series. */
+typedef struct cdb_container_s cdb_container_t;
+
+#define CDB_CONTAINER_DEFAULT_SERIES 4096
+
+/* flags as for open(). max_series is only used when creating the container,
+ * and 0 means CDB_CONTAINER_DEFAULT_SERIES. */
+/* Return CDB_SUCCESS, CDB_ENOMEM, CDB_EBADTOK, CDB_EBADVER, CDB_ESANITY,
+ * CDB_EINVAL for too many series, or errno */
+int cdb_container_open(const char *filename, int flags, uint32_t max_series, cdb_container_t **container);
+
+/* Add a series named proto->header->name, with proto's header as set up by
+ * cdb_generate_header(), and return its handle. */
+/* Return CDB_SUCCESS, CDB_EINVAL if the name is taken, CDB_ENOSPACE, CDB_ERDONLY or errno */
+int cdb_container_add_series(cdb_container_t *container, cdb_t *proto, cdb_t **cdb);
+
+/* Return CDB_SUCCESS, CDB_ENOSERIES or errno */
+int cdb_container_open_series(cdb_container_t *container, const char *name, cdb_t **cdb);
+
+/* cdb_read_records() of the same request for num series. records[i] and
+ * num_recs[i] are for names[i], NULL and 0 if it has no records in range,
+ * and are to be freed by the caller. The series are read in the order they
+ * lie in the file, after asking for neighbouring ones to be read ahead
+ * together. */
+/* Return CDB_SUCCESS, CDB_ENOSERIES or the first error from cdb_read_records() */
+int cdb_container_read_records(cdb_container_t *container, const char **names, uint64_t num,
+    cdb_request_t *request, cdb_record_t **records, uint64_t *num_recs);
+
+uint32_t cdb_container_num_series(cdb_container_t *container);
+
+/* Close the file and free the container and all its series handles. */
+/* Return CDB_SUCCESS or errno */
+int cdb_container_close(cdb_container_t *container);
+
 #endif
 
 #ifdef __cplusplus
@@ -0,0 +1,422 @@
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <limits.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "circulardb_interface.h"
+
+/* Records handed to each cdb_write_records() call */
+#define CONVERT_BATCH 4096
+
+typedef struct convert_options_s {
+  uint64_t max_records;     /* 0 keeps the source's */
+  int layout;               /* -1 keeps the source's */
+  int encoding;             /* -1 keeps the source's */
+  bool scaled;              /* value_offset/value_scale were given */
+  double value_offset;
+  double value_scale;
+  uint64_t step;            /* Implicit layout, 0 keeps the source's */
+  uint32_t rollup;          /* Average every rollup records */
+  int checksums;            /* -1 keeps the source's */
+} convert_options_t;
+
+static convert_options_t options = { 0, -1, -1, false, 0, 1, 0, 0, -1 };
+
+static char **paths      = NULL;
+static uint64_t num_paths = 0;
+static uint64_t max_paths = 0;
+static uint64_t next_path = 0;
+static int failures       = 0;
+
+/* What the library's errors mean here, where they differ */
+static const char* convert_error(int ret) {
+
+  switch (ret) {
+    case CDB_EINVAL:
+      return "Invalid settings for the new file";
+    case CDB_ECHECKSUM:
+      return "Records failed their checksum - see cdb_validate";
+    default:
+      return cdb_strerror(ret);
+  }
+}
+
+static int parse_layout(const char *name) {
+  if (strcmp(name, "rows") == 0) return CDB_LAYOUT_ROWS;
+  if (strcmp(name, "columns") == 0) return CDB_LAYOUT_COLUMNS;
+  if (strcmp(name, "compressed") == 0) return CDB_LAYOUT_COMPRESSED;
+  if (strcmp(name, "implicit") == 0) return CDB_LAYOUT_IMPLICIT;
+  return -1;
+}
+
+static int parse_encoding(const char *name) {
+  if (strcmp(name, "float64") == 0) return CDB_ENCODING_FLOAT64;
+  if (strcmp(name, "float32") == 0) return CDB_ENCODING_FLOAT32;
+  if (strcmp(name, "int16") == 0) return CDB_ENCODING_INT16;
+  if (strcmp(name, "int32") == 0) return CDB_ENCODING_INT32;
+  return -1;
+}
+
+/* The source's header, with the options applied and nothing written yet. */
+static void convert_header(cdb_t *dst, cdb_t *src) {
+  cdb_header_t *header = dst->header;
+
+  cdb_copy_header(dst, src);
+
+  memset(header->version, 0, sizeof(header->version));
+  strncpy(header->version, CDB_VERSION, sizeof(header->version));
+
+  if (options.max_records > 0) {
+    header->max_records = options.max_records;
+  }
+
+  if (options.layout >= 0) {
+    header->layout = options.layout;
+  }
+
+  if (options.encoding >= 0) {
+    header->encoding = options.encoding;
+  }
+
+  if (options.scaled) {
+    header->value_offset = options.value_offset;
+    header->value_scale  = options.value_scale;
+  }
+
+  if (options.step > 0) {
+    header->step = options.step;
+  }
+
+  if (options.checksums == 1) {
+    header->flags |= CDB_FLAG_CHECKSUMS;
+  } else if (options.checksums == 0) {
+    header->flags &= ~CDB_FLAG_CHECKSUMS;
+  }
+}
+
+/* Write out what has been converted so far. */
+static int convert_flush(cdb_t *dst, cdb_record_t *records, uint64_t *len, uint64_t *total) {
+
+  uint64_t written = 0;
+  int ret = CDB_SUCCESS;
+
+  if (*len > 0) {
+    ret = cdb_write_records(dst, records, *len, &written);
+
+    *total += *len;
+    *len    = 0;
+  }
+
+  return ret;
+}
+
+/* Stream src to dst oldest first, a buffer at a time in large sequential
+ * reads, so a file of any size takes the same memory. Counters are copied as
+ * they are, not cooked, and nothing is sorted for statistics. A roll up
+ * averages as it goes, NaNs as 0, like a read with a step. The new ring drops
+ * whatever doesn't fit in it. */
+static int convert_records(cdb_t *src, cdb_t *dst, uint64_t *converted) {
+
+  cdb_scan_t scan = cdb_new_scan();
+  cdb_record_t *records;
+  cdb_record_t *out;
+  uint64_t num_recs = 0;
+  uint64_t len = 0;
+  uint64_t total = 0;
+  uint32_t rolled = 0;
+  long double time_mean = 0;
+  long double value_mean = 0;
+  int ret = CDB_SUCCESS;
+
+  if ((records = (cdb_record_t*)malloc(2 * CONVERT_BATCH * sizeof(cdb_record_t))) == NULL) {
+    return CDB_ENOMEM;
+  }
+
+  out = &records[CONVERT_BATCH];
+
+  do {
+    uint64_t i;
+
+    ret = cdb_scan_records(src, &scan, records, CONVERT_BATCH, &num_recs);
+
+    for (i = 0; ret == CDB_SUCCESS && i < num_recs; i++) {
+
+      if (options.rollup <= 1) {
+        out[len++] = records[i];
+
+      } else {
+        rolled += 1;
+        time_mean  += (records[i].time - time_mean) / rolled;
+        value_mean += ((isnan(records[i].value) ? 0 : records[i].value) - value_mean) / rolled;
+
+        if (rolled == options.rollup) {
+          out[len].time  = (cdb_time_t)time_mean;
+          out[len].value = (double)value_mean;
+          len += 1;
+
+          rolled     = 0;
+          time_mean  = 0;
+          value_mean = 0;
+        }
+      }
+
+      if (len == CONVERT_BATCH) {
+        ret = convert_flush(dst, out, &len, &total);
+      }
+    }
+
+  } while (ret == CDB_SUCCESS && num_recs > 0);
+
+  /* What is left over averages on its own */
+  if (ret == CDB_SUCCESS && rolled > 0) {
+    out[len].time  = (cdb_time_t)time_mean;
+    out[len].value = (double)value_mean;
+    len += 1;
+  }
+
+  if (ret == CDB_SUCCESS) {
+    ret = convert_flush(dst, out, &len, &total);
+  }
+
+  *converted = total < dst->header->max_records ? total : dst->header->max_records;
+
+  free(records);
+
+  return ret;
+}
+
+static int convert_file(const char *path) {
+
+  char tmp[PATH_MAX];
+  struct stat st;
+  uint64_t converted = 0;
+  int ret;
+
+  cdb_t *src = cdb_new();
+  cdb_t *dst = cdb_new();
+
+  src->filename = (char*)path;
+  src->flags    = O_RDWR;
+  src->locking  = true;
+
+  snprintf(tmp, sizeof(tmp), "%s.convert.%d", path, (int)getpid());
+
+  /* Writers that lock the file wait for us until the new one is in place */
+  if ((ret = cdb_lock(src)) == CDB_SUCCESS && (ret = cdb_read_header(src)) == CDB_SUCCESS) {
+
+    ret = fstat(src->fd, &st) == 0 ? CDB_SUCCESS : errno;
+
+    dst->filename = tmp;
+    dst->flags    = O_CREAT|O_EXCL|O_RDWR;
+    dst->mode     = st.st_mode & 07777;
+
+    convert_header(dst, src);
+
+    if (ret == CDB_SUCCESS && (ret = cdb_write_header(dst)) == CDB_SUCCESS &&
+        (ret = convert_records(src, dst, &converted)) == CDB_SUCCESS) {
+
+      if (fsync(dst->fd) != 0 || rename(tmp, path) != 0) {
+        ret = errno;
+      }
+    }
+
+    if (ret != CDB_SUCCESS) {
+      unlink(tmp);
+    }
+  }
+
+  if (ret == CDB_SUCCESS) {
+    printf("Converted: %s (%"PRIu64" records)\n", path, converted);
+  } else {
+    fprintf(stderr, "Couldn't convert %s: %s\n", path, convert_error(ret));
+  }
+
+  cdb_free(dst);
+  cdb_free(src);
+
+  return ret;
+}
+
+static int add_path(const char *path) {
+
+  if (num_paths == max_paths) {
+    uint64_t grown = max_paths ? max_paths * 2 : 64;
+    char **resized = (char**)realloc(paths, grown * sizeof(char*));
+
+    if (resized == NULL) {
+      return -1;
+    }
+
+    paths     = resized;
+    max_paths = grown;
+  }
+
+  if ((paths[num_paths] = strdup(path)) == NULL) {
+    return -1;
+  }
+
+  num_paths += 1;
+
+  return 0;
+}
+
+static int add_tree_path(const char *path, const struct stat *st, int type, struct FTW *ftw) {
+  size_t len = strlen(path);
+
+  (void)st;
+  (void)ftw;
+
+  if (type != FTW_F || len < sizeof(CDB_EXTENSION) + 1 ||
+      strcmp(path + len - sizeof(CDB_EXTENSION) + 1, CDB_EXTENSION) != 0 || path[len - sizeof(CDB_EXTENSION)] != '.') {
+    return 0;
+  }
+
+  return add_path(path);
+}
+
+static void* convert_worker(void *arg) {
+  uint64_t i;
+
+  (void)arg;
+
+  while ((i = __sync_fetch_and_add(&next_path, 1)) < num_paths) {
+
+    if (convert_file(paths[i]) != CDB_SUCCESS) {
+      __sync_add_and_fetch(&failures, 1);
+    }
+  }
+
+  return NULL;
+}
+
+static void usage(void) {
+  fprintf(stderr,
+    "Usage: cdb_convert [options] file|directory ...\n"
+    "\n"
+    "Rewrites each CircularDB file, and every .cdb file under each directory,\n"
+    "with the settings below, then renames the new file over the old one.\n"
+    "Anything not given is kept as it was.\n"
+    "\n"
+    "  -m max_records  capacity\n"
+    "  -l layout       rows, columns, compressed or implicit\n"
+    "  -t step         seconds between records, for the implicit layout\n"
+    "  -e encoding     float64, float32, int16 or int32\n"
+    "  -o offset       value offset, for int16 and int32\n"
+    "  -s scale        value scale, for int16 and int32\n"
+    "  -r count        roll up: average every count records\n"
+    "  -c on|off       CRC32C checksums\n"
+    "  -j jobs         files to convert at once (default 1)\n");
+}
+
+int main(int argc, char** argv) {
+  pthread_t *workers;
+  int jobs = 1;
+  int opt;
+  int i;
+
+  while ((opt = getopt(argc, argv, "m:l:t:e:o:s:r:c:j:h")) != -1) {
+    switch (opt) {
+      case 'm':
+        options.max_records = strtoull(optarg, NULL, 10);
+        break;
+      case 'l':
+        if ((options.layout = parse_layout(optarg)) < 0) {
+          fprintf(stderr, "cdb_convert: Unknown layout: %s\n", optarg);
+          return 1;
+        }
+        break;
+      case 't':
+        options.step = strtoull(optarg, NULL, 10);
+        break;
+      case 'e':
+        if ((options.encoding = parse_encoding(optarg)) < 0) {
+          fprintf(stderr, "cdb_convert: Unknown encoding: %s\n", optarg);
+          return 1;
+        }
+        break;
+      case 'o':
+        options.value_offset = strtod(optarg, NULL);
+        options.scaled = true;
+        break;
+      case 's':
+        options.value_scale = strtod(optarg, NULL);
+        options.scaled = true;
+        break;
+      case 'r':
+        options.rollup = (uint32_t)strtoul(optarg, NULL, 10);
+        break;
+      case 'c':
+        options.checksums = strcmp(optarg, "on") == 0;
+        break;
+      case 'j':
+        jobs = atoi(optarg);
+        break;
+      default:
+        usage();
+        return 1;
+    }
+  }
+
+  if (optind >= argc) {
+    usage();
+    return 1;
+  }
+
+  for (i = optind; i < argc; i++) {
+    struct stat st;
+
+    if (stat(argv[i], &st) != 0) {
+      perror(argv[i]);
+      failures += 1;
+
+    } else if (S_ISDIR(st.st_mode)) {
+
+      if (nftw(argv[i], add_tree_path, 16, FTW_PHYS) != 0) {
+        perror(argv[i]);
+        failures += 1;
+      }
+
+    } else if (add_path(argv[i]) != 0) {
+      perror(argv[i]);
+      failures += 1;
+    }
+  }
+
+  if (jobs < 1) {
+    jobs = 1;
+  }
+
+  if ((uint64_t)jobs > num_paths) {
+    jobs = num_paths > 0 ? (int)num_paths : 1;
+  }
+
+  workers = (pthread_t*)calloc(jobs, sizeof(pthread_t));
+
+  for (i = 1; i < jobs; i++) {
+    pthread_create(&workers[i], NULL, convert_worker, NULL);
+  }
+
+  /* This thread is the first worker */
+  convert_worker(NULL);
+
+  for (i = 1; i < jobs; i++) {
+    pthread_join(workers[i], NULL);
+  }
+
+  for (i = 0; (uint64_t)i < num_paths; i++) {
+    free(paths[i]);
+  }
+
+  free(paths);
+  free(workers);
+
+  return failures > 0 ? 1 : 0;
+}
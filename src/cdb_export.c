@@ -0,0 +1,323 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "circulardb_private.h"
+
+/* Output is built up here and written out in one go when it fills */
+#define EXPORT_BUFFER (1024 * 1024)
+
+/* The most one record can take, date included */
+#define EXPORT_RECORD_MAX 512
+
+/* Records read from the file at a time */
+#define EXPORT_CHUNK 65536
+
+/* Times a scan is started again because a writer moved the file under it */
+#define EXPORT_RETRIES 10
+
+enum { FORMAT_CSV, FORMAT_JSONL, FORMAT_BINARY };
+
+static void put_le64(char *p, uint64_t v) {
+  int i;
+
+  for (i = 0; i < 8; i++) {
+    p[i] = (char)(v >> (i * 8));
+  }
+}
+
+/* Append one record to out, returning the bytes used. */
+static size_t format_record(char *out, int format, cdb_record_t *record,
+  cdb_date_cache_t *cache, const char *date_format) {
+
+  const char *date = NULL;
+  size_t date_len = 0;
+  size_t len = 0;
+
+  if (format == FORMAT_BINARY) {
+    uint64_t bits;
+
+    memcpy(&bits, &record->value, sizeof(bits));
+    put_le64(out, (uint64_t)record->time);
+    put_le64(out + 8, bits);
+
+    return 16;
+  }
+
+  if (date_format != NULL) {
+    date_len = _cdb_format_date(cache, record->time, date_format, &date);
+  }
+
+  if (format == FORMAT_CSV) {
+    len += _cdb_format_int(out + len, record->time);
+    out[len++] = ',';
+
+    if (date != NULL) {
+      memcpy(out + len, date, date_len);
+      len += date_len;
+      out[len++] = ',';
+    }
+
+    if (!isnan(record->value)) {
+      len += _cdb_format_double(out + len, record->value);
+    }
+
+  } else {
+    memcpy(out + len, "{\"time\":", 8);
+    len += 8;
+    len += _cdb_format_int(out + len, record->time);
+
+    if (date != NULL) {
+      memcpy(out + len, ",\"date\":\"", 9);
+      len += 9;
+      memcpy(out + len, date, date_len);
+      len += date_len;
+      out[len++] = '"';
+    }
+
+    memcpy(out + len, ",\"value\":", 9);
+    len += 9;
+
+    /* JSON has no NaN or infinity */
+    if (isfinite(record->value)) {
+      len += _cdb_format_double(out + len, record->value);
+    } else {
+      memcpy(out + len, "null", 4);
+      len += 4;
+    }
+
+    out[len++] = '}';
+  }
+
+  out[len++] = '\n';
+
+  return len;
+}
+
+static void usage(void) {
+  fprintf(stderr,
+    "Usage: cdb_export [options] file\n"
+    "\n"
+    "Writes the records of a CircularDB file to standard output.\n"
+    "\n"
+    "  -f format       csv (time,value), jsonl or binary - little endian\n"
+    "                  64 bit time and double value pairs (default csv)\n"
+    "  -d date_format  add a strftime() formatted date to each text record\n"
+    "  -s start        first time to export\n"
+    "  -e end          last time to export\n"
+    "  -c              cook counters\n"
+    "  -o file         write to file instead\n");
+}
+
+/* Write out what's in buffer, saying why if it doesn't all go */
+static bool export_write(FILE *fh, const char *buffer, size_t used) {
+
+  if (used > 0 && fwrite(buffer, 1, used, fh) != used) {
+    perror("cdb_export");
+    return false;
+  }
+
+  return true;
+}
+
+/* Scan the file a chunk at a time, formatting each into buffer and writing
+ * it out as it fills. A writer that moves the records under the scan starts it
+ * again, skipping what has already gone out. Returns CDB_FAILURE, having said
+ * why, if the output couldn't be written. */
+static int export_records(cdb_t *cdb, FILE *fh, int format, const char *date_format,
+  cdb_request_t *request, char *buffer, size_t used) {
+
+  cdb_date_cache_t cache;
+  cdb_cook_t cook = cdb_new_cook();
+  cdb_record_t *records;
+  cdb_time_t last = 0;
+  bool seen = false;
+  bool done = false;
+  int retries = 0;
+  int ret = CDB_SUCCESS;
+
+  memset(&cache, 0, sizeof(cache));
+
+  records = (cdb_record_t*)malloc(sizeof(cdb_record_t) * EXPORT_CHUNK);
+
+  if (records == NULL) {
+    return CDB_ENOMEM;
+  }
+
+  while (!done) {
+    cdb_scan_t scan = cdb_new_scan();
+    uint64_t len = 0;
+
+    while (!done && (ret = cdb_scan_records(cdb, &scan, records, EXPORT_CHUNK, &len)) == CDB_SUCCESS && len > 0) {
+      uint64_t kept = 0;
+      uint64_t i = 0;
+
+      for (i = 0; i < len; i++) {
+
+        if (request->end != 0 && records[i].time > request->end) {
+          done = true;
+          break;
+        }
+
+        if (records[i].time < request->start || (seen && records[i].time <= last)) {
+          continue;
+        }
+
+        records[kept++] = records[i];
+      }
+
+      if (kept == 0) {
+        continue;
+      }
+
+      seen = true;
+      last = records[kept - 1].time;
+
+      if (request->cooked && (ret = cdb_cook_records(cdb, &cook, records, kept, &kept)) != CDB_SUCCESS) {
+        break;
+      }
+
+      for (i = 0; i < kept; i++) {
+
+        if (used + EXPORT_RECORD_MAX > EXPORT_BUFFER) {
+
+          if (!export_write(fh, buffer, used)) {
+            free(records);
+            return CDB_FAILURE;
+          }
+
+          used = 0;
+        }
+
+        used += format_record(buffer + used, format, &records[i], &cache, date_format);
+      }
+    }
+
+    if (ret != CDB_EBUSY || ++retries > EXPORT_RETRIES) {
+      break;
+    }
+  }
+
+  if (!export_write(fh, buffer, used)) {
+    ret = CDB_FAILURE;
+  }
+
+  free(records);
+
+  return ret;
+}
+
+int main(int argc, char** argv) {
+  cdb_request_t request = cdb_new_request();
+  const char *date_format = NULL;
+  const char *output = NULL;
+  char *buffer;
+  size_t used = 0;
+  int format = FORMAT_CSV;
+  int opt;
+  int ret;
+  FILE *fh = stdout;
+  cdb_t *cdb;
+
+  request.cooked = false;
+
+  while ((opt = getopt(argc, argv, "f:d:s:e:co:h")) != -1) {
+    switch (opt) {
+      case 'f':
+        if (strcmp(optarg, "csv") == 0) {
+          format = FORMAT_CSV;
+        } else if (strcmp(optarg, "jsonl") == 0) {
+          format = FORMAT_JSONL;
+        } else if (strcmp(optarg, "binary") == 0) {
+          format = FORMAT_BINARY;
+        } else {
+          fprintf(stderr, "cdb_export: Unknown format: %s\n", optarg);
+          return 1;
+        }
+        break;
+      case 'd':
+        date_format = optarg;
+        break;
+      case 's':
+        request.start = strtoll(optarg, NULL, 10);
+        break;
+      case 'e':
+        request.end = strtoll(optarg, NULL, 10);
+        break;
+      case 'c':
+        request.cooked = true;
+        break;
+      case 'o':
+        output = optarg;
+        break;
+      default:
+        usage();
+        return 1;
+    }
+  }
+
+  if (optind != argc - 1) {
+    usage();
+    return 1;
+  }
+
+  if (request.end != 0 && request.end < request.start) {
+    fprintf(stderr, "cdb_export: The end is before the start\n");
+    return 1;
+  }
+
+  cdb = cdb_new();
+  cdb->filename = argv[optind];
+  cdb->flags    = O_RDONLY;
+
+  if ((ret = cdb_read_header(cdb)) != CDB_SUCCESS) {
+    fprintf(stderr, "cdb_export: Couldn't read %s: %s\n", cdb->filename, cdb_strerror(ret));
+    cdb_free(cdb);
+    return 1;
+  }
+
+  if (output != NULL && (fh = fopen(output, "wb")) == NULL) {
+    perror(output);
+    cdb_free(cdb);
+    return 1;
+  }
+
+  if ((buffer = (char*)malloc(EXPORT_BUFFER)) == NULL) {
+    fprintf(stderr, "cdb_export: %s\n", cdb_strerror(CDB_ENOMEM));
+
+    if (fh != stdout) {
+      fclose(fh);
+    }
+
+    cdb_free(cdb);
+    return 1;
+  }
+
+  if (format == FORMAT_CSV) {
+    const char *columns = date_format != NULL ? "time,date,value\n" : "time,value\n";
+
+    used = strlen(columns);
+    memcpy(buffer, columns, used);
+  }
+
+  ret = export_records(cdb, fh, format, date_format, &request, buffer, used);
+
+  if (ret != CDB_SUCCESS && ret != CDB_FAILURE) {
+    fprintf(stderr, "cdb_export: Couldn't read %s: %s\n", cdb->filename, cdb_strerror(ret));
+  }
+
+  ret = ret != CDB_SUCCESS;
+
+  if (fh != stdout ? fclose(fh) != 0 : fflush(fh) != 0) {
+    perror("cdb_export");
+    ret = 1;
+  }
+
+  free(buffer);
+  cdb_free(cdb);
+
+  return ret;
+}
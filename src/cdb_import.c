@@ -0,0 +1,354 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "circulardb_private.h"
+
+/* Input is read this much at a time */
+#define IMPORT_BUFFER (1024 * 1024)
+
+/* Records handed to each cdb_write_records() call */
+#define IMPORT_BATCH 4096
+
+enum { FORMAT_CSV, FORMAT_JSONL, FORMAT_BINARY };
+
+typedef struct import_s {
+  cdb_t *cdb;
+  cdb_record_t *records;
+  uint64_t batch;
+  uint64_t pending;
+  uint64_t imported;
+  uint64_t skipped;
+  int ret;
+} import_t;
+
+static void import_flush(import_t *import) {
+  uint64_t written = 0;
+
+  if (import->pending == 0 || import->ret != CDB_SUCCESS) {
+    return;
+  }
+
+  import->ret = cdb_write_records(import->cdb, import->records, import->pending, &written);
+  import->imported += import->pending;
+  import->pending = 0;
+}
+
+static void import_record(import_t *import, cdb_time_t time, double value) {
+
+  import->records[import->pending].time  = time;
+  import->records[import->pending].value = value;
+
+  if (++import->pending == import->batch) {
+    import_flush(import);
+  }
+}
+
+static const char* skip_spaces(const char *p, const char *end) {
+
+  while (p < end && (*p == ' ' || *p == '\t')) {
+    p++;
+  }
+
+  return p;
+}
+
+/* time,value or time,date,value - the header line, or anything else that
+ * doesn't start with a time, is skipped. An empty value is a NaN. */
+static void import_csv(import_t *import, const char *line, const char *end) {
+  const char *p = skip_spaces(line, end);
+  const char *comma = end;
+  int64_t time = 0;
+  double value = CDB_NAN;
+
+  while (comma > line && comma[-1] != ',') {
+    comma--;
+  }
+
+  if (comma == line || !_cdb_parse_int(&p, end, &time)) {
+    import->skipped += 1;
+    return;
+  }
+
+  p = skip_spaces(comma, end);
+
+  if (p < end && !_cdb_parse_double(&p, end, &value)) {
+    import->skipped += 1;
+    return;
+  }
+
+  import_record(import, time, value);
+}
+
+/* Where the value of "key" starts in a JSON object, or NULL */
+static const char* json_value(const char *line, const char *end, const char *key) {
+  size_t len = strlen(key);
+  const char *p = line;
+
+  while ((p = (const char*)memchr(p, '"', end - p)) != NULL) {
+
+    if ((size_t)(end - p) > len + 1 && memcmp(p + 1, key, len) == 0 && p[len + 1] == '"') {
+      p = skip_spaces(p + len + 2, end);
+
+      if (p < end && *p == ':') {
+        return skip_spaces(p + 1, end);
+      }
+    }
+
+    p++;
+  }
+
+  return NULL;
+}
+
+/* {"time":..., "value":...} - a null value is a NaN */
+static void import_jsonl(import_t *import, const char *line, const char *end) {
+  const char *time_at  = json_value(line, end, "time");
+  const char *value_at = json_value(line, end, "value");
+  int64_t time = 0;
+  double value = CDB_NAN;
+
+  if (time_at == NULL || value_at == NULL || !_cdb_parse_int(&time_at, end, &time)) {
+    import->skipped += 1;
+    return;
+  }
+
+  if ((end - value_at < 4 || memcmp(value_at, "null", 4) != 0) && !_cdb_parse_double(&value_at, end, &value)) {
+    import->skipped += 1;
+    return;
+  }
+
+  import_record(import, time, value);
+}
+
+static uint64_t get_le64(const unsigned char *p) {
+  uint64_t v = 0;
+  int i;
+
+  for (i = 7; i >= 0; i--) {
+    v = (v << 8) | p[i];
+  }
+
+  return v;
+}
+
+/* Returns how much of buffer was used - whole lines, or whole records */
+static size_t import_chunk(import_t *import, int format, const char *buffer, size_t len, bool last) {
+  const char *p = buffer;
+  const char *end = buffer + len;
+
+  if (format == FORMAT_BINARY) {
+
+    while (end - p >= 16) {
+      uint64_t bits = get_le64((const unsigned char*)p + 8);
+      double value;
+
+      memcpy(&value, &bits, sizeof(value));
+      import_record(import, (cdb_time_t)get_le64((const unsigned char*)p), value);
+      p += 16;
+    }
+
+    return p - buffer;
+  }
+
+  while (p < end) {
+    const char *eol = (const char*)memchr(p, '\n', end - p);
+    const char *stop;
+
+    /* Leave a partial line for the next chunk, unless there isn't one */
+    if (eol == NULL) {
+
+      if (!last) {
+        break;
+      }
+
+      eol = end;
+    }
+
+    stop = eol;
+
+    if (stop > p && stop[-1] == '\r') {
+      stop--;
+    }
+
+    if (stop > p) {
+
+      if (format == FORMAT_CSV) {
+        import_csv(import, p, stop);
+      } else {
+        import_jsonl(import, p, stop);
+      }
+    }
+
+    p = eol < end ? eol + 1 : end;
+  }
+
+  return p - buffer;
+}
+
+static void usage(void) {
+  fprintf(stderr,
+    "Usage: cdb_import [options] file\n"
+    "\n"
+    "Writes records from standard input to a CircularDB file, creating it if\n"
+    "it doesn't exist. Takes what cdb_export writes.\n"
+    "\n"
+    "  -f format       csv, jsonl or binary (default csv)\n"
+    "  -m max_records  capacity of a new file\n"
+    "  -i file         read from file instead\n");
+}
+
+int main(int argc, char** argv) {
+  import_t import;
+  struct stat st;
+  const char *input = NULL;
+  uint64_t max_records = 0;
+  char *buffer;
+  size_t have = 0;
+  bool discard = false;
+  int format = FORMAT_CSV;
+  int opt;
+  FILE *fh = stdin;
+
+  while ((opt = getopt(argc, argv, "f:m:i:h")) != -1) {
+    switch (opt) {
+      case 'f':
+        if (strcmp(optarg, "csv") == 0) {
+          format = FORMAT_CSV;
+        } else if (strcmp(optarg, "jsonl") == 0) {
+          format = FORMAT_JSONL;
+        } else if (strcmp(optarg, "binary") == 0) {
+          format = FORMAT_BINARY;
+        } else {
+          fprintf(stderr, "cdb_import: Unknown format: %s\n", optarg);
+          return 1;
+        }
+        break;
+      case 'm':
+        max_records = strtoull(optarg, NULL, 10);
+        break;
+      case 'i':
+        input = optarg;
+        break;
+      default:
+        usage();
+        return 1;
+    }
+  }
+
+  if (optind != argc - 1) {
+    usage();
+    return 1;
+  }
+
+  if (input != NULL && (fh = fopen(input, "rb")) == NULL) {
+    perror(input);
+    return 1;
+  }
+
+  memset(&import, 0, sizeof(import));
+
+  import.cdb = cdb_new();
+  import.cdb->filename = argv[optind];
+  import.cdb->flags    = O_RDWR;
+
+  if (stat(import.cdb->filename, &st) != 0 && errno == ENOENT) {
+    char *name = strdup(import.cdb->filename);
+    char *base = basename(name);
+    char *dot  = strrchr(base, '.');
+
+    if (dot != NULL && dot != base) {
+      *dot = '\0';
+    }
+
+    import.cdb->flags = O_CREAT|O_RDWR;
+
+    cdb_generate_header(import.cdb, base, (char*)"", max_records, 0, (char*)"", 0, 0, CDB_ENCODING_FLOAT64);
+    import.ret = cdb_write_header(import.cdb);
+
+    free(name);
+
+  } else {
+    import.ret = cdb_read_header(import.cdb);
+  }
+
+  if (import.ret != CDB_SUCCESS) {
+    fprintf(stderr, "cdb_import: Couldn't open %s: %s\n", import.cdb->filename, cdb_strerror(import.ret));
+    cdb_free(import.cdb);
+    return 1;
+  }
+
+  /* A batch bigger than the ring would only be thrown away in part */
+  import.batch = import.cdb->header->max_records < IMPORT_BATCH ? import.cdb->header->max_records : IMPORT_BATCH;
+
+  import.records = (cdb_record_t*)malloc(import.batch * RECORD_SIZE);
+  buffer = (char*)malloc(IMPORT_BUFFER);
+
+  if (import.records == NULL || buffer == NULL) {
+    import.ret = CDB_ENOMEM;
+  }
+
+  while (import.ret == CDB_SUCCESS) {
+    size_t got = fread(buffer + have, 1, IMPORT_BUFFER - have, fh);
+    size_t used;
+    bool last = got == 0;
+
+    have += got;
+
+    /* Throw away the rest of a line longer than the whole buffer */
+    if (discard) {
+      const char *eol = (const char*)memchr(buffer, '\n', have);
+
+      if (eol == NULL) {
+        have = 0;
+      } else {
+        have -= eol + 1 - buffer;
+        memmove(buffer, eol + 1, have);
+        discard = false;
+      }
+    }
+
+    used = import_chunk(&import, format, buffer, have, last);
+
+    memmove(buffer, buffer + used, have - used);
+    have -= used;
+
+    if (last) {
+      break;
+    }
+
+    if (have == IMPORT_BUFFER) {
+      import.skipped += 1;
+      have = 0;
+      discard = true;
+    }
+  }
+
+  import_flush(&import);
+
+  if (ferror(fh)) {
+    perror("cdb_import");
+    import.ret = CDB_FAILURE;
+  }
+
+  if (import.ret != CDB_SUCCESS && import.ret != CDB_FAILURE) {
+    fprintf(stderr, "cdb_import: Couldn't write %s: %s\n", import.cdb->filename, cdb_strerror(import.ret));
+  }
+
+  fprintf(stderr, "Imported %"PRIu64" records, skipped %"PRIu64"\n", import.imported, import.skipped);
+
+  if (fh != stdin) {
+    fclose(fh);
+  }
+
+  free(buffer);
+  free(import.records);
+  cdb_free(import.cdb);
+
+  return import.ret == CDB_SUCCESS ? 0 : 1;
+}
@@ -0,0 +1,135 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "circulardb_interface.h"
+
+static bool dry_run = false;
+
+static bool is_clean(cdb_repair_t *report) {
+  return report->old_start == report->new_start && report->num_merged == 0 && report->num_dropped == 0;
+}
+
+static void print_report(const char *path, cdb_repair_t *report, bool repaired) {
+
+  printf("%s: %s", repaired ? "Repaired" : dry_run ? "Would repair" : "Clean", path);
+
+  if (report->old_start != report->new_start) {
+    printf(" (start_record %"PRIu64" -> %"PRIu64")", report->old_start, report->new_start);
+  }
+
+  printf(": %"PRIu64" of %"PRIu64" records kept, %"PRIu64" duplicate(s) merged, %"PRIu64" out of order dropped\n",
+    report->num_written, report->num_read, report->num_merged, report->num_dropped);
+}
+
+static int repair_file(const char *path) {
+
+  char tmp[PATH_MAX];
+  struct stat st;
+  cdb_repair_t report;
+  bool clean = false;
+  int ret;
+
+  cdb_t *src = cdb_new();
+  cdb_t *dst = cdb_new();
+
+  src->filename = (char*)path;
+  src->flags    = dry_run ? O_RDONLY : O_RDWR;
+  src->locking  = true;
+
+  snprintf(tmp, sizeof(tmp), "%s.repair.%d", path, (int)getpid());
+
+  memset(&report, 0, sizeof(report));
+
+  /* Writers that lock the file wait for us until the new one is in place */
+  if ((dry_run || (ret = cdb_lock(src)) == CDB_SUCCESS) && (ret = cdb_read_header(src)) == CDB_SUCCESS) {
+
+    if (dry_run) {
+      ret   = cdb_repair_records(src, NULL, &report);
+      clean = is_clean(&report);
+
+    } else {
+      ret = fstat(src->fd, &st) == 0 ? CDB_SUCCESS : errno;
+
+      dst->filename = tmp;
+      dst->flags    = O_CREAT|O_EXCL|O_RDWR;
+      dst->mode     = st.st_mode & 07777;
+
+      cdb_copy_header(dst, src);
+
+      if (ret == CDB_SUCCESS && (ret = cdb_write_header(dst)) == CDB_SUCCESS &&
+          (ret = cdb_repair_records(src, dst, &report)) == CDB_SUCCESS) {
+
+        clean = is_clean(&report);
+
+        /* Nothing to fix - leave the file as it was */
+        if (!clean && (fsync(dst->fd) != 0 || rename(tmp, path) != 0)) {
+          ret = errno;
+        }
+      }
+
+      if (ret != CDB_SUCCESS || clean) {
+        unlink(tmp);
+      }
+    }
+  }
+
+  if (ret == CDB_SUCCESS) {
+    print_report(path, &report, !clean && !dry_run);
+  } else {
+    fprintf(stderr, "Couldn't repair %s: %s\n", path, cdb_strerror(ret));
+  }
+
+  cdb_free(dst);
+  cdb_free(src);
+
+  return ret;
+}
+
+static void usage(void) {
+  fprintf(stderr,
+    "Usage: cdb_repair [-n] file ...\n"
+    "\n"
+    "Rebuilds each CircularDB file with its records oldest first and in order.\n"
+    "The oldest record is found from where the times jump back, not from the\n"
+    "header. A record with the same time as the one before it replaces it and\n"
+    "records out of order are dropped. Files with nothing to fix are left as\n"
+    "they are.\n"
+    "\n"
+    "  -n  only say what would be done\n");
+}
+
+int main(int argc, char** argv) {
+  int failures = 0;
+  int opt;
+  int i;
+
+  while ((opt = getopt(argc, argv, "nh")) != -1) {
+    switch (opt) {
+      case 'n':
+        dry_run = true;
+        break;
+      default:
+        usage();
+        return 1;
+    }
+  }
+
+  if (optind >= argc) {
+    usage();
+    return 1;
+  }
+
+  for (i = optind; i < argc; i++) {
+
+    if (repair_file(argv[i]) != CDB_SUCCESS) {
+      failures += 1;
+    }
+  }
+
+  return failures > 0 ? 1 : 0;
+}
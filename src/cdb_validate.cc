@@ -1,149 +1,468 @@
 #include <stdlib.h>
+#include <string.h>
 #include <iostream>
-#include <map>
-#include <set>
 #include <sstream>
+#include <string>
 #include <vector>
 
+#include <errno.h>
 #include <fcntl.h>
-
-/* For calloc on Linux */
-#ifdef _GNU_SOURCE
-#include <malloc.h>
-#endif
+#include <ftw.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "circulardb_interface.h"
 
 using namespace std;
 
-char formatted[256];
+/* Records read at a time - memory use doesn't grow with the file */
+#define VALIDATE_CHUNK 65536
+
+/* Times a file is read again when a writer changes it part way through */
+#define VALIDATE_RETRIES 3
+
+enum { FORMAT_TEXT, FORMAT_JSON };
+
+struct problem {
+  cdb_time_t time;
+  double value;
+  double previous;
+};
+
+/* What one file came to. Only the first max_examples of each kind of problem
+ * are kept, the rest are only counted. */
+struct validation {
+  std::string filename;
+  std::string error;
+  int type;
+  uint64_t num_recs;
+  uint64_t num_out_of_order;
+  uint64_t num_duplicates;
+  uint64_t num_wraps;
+  uint64_t num_damaged;
+  const char *damage_unit;
+  std::vector<problem> out_of_order;
+  std::vector<problem> duplicates;
+  std::vector<problem> wraps;
+  std::vector<cdb_damage_t> damage;
+
+  bool has_problems() const {
+    return !error.empty() || num_out_of_order > 0 || num_duplicates > 0 || num_wraps > 0 || num_damaged > 0;
+  }
+};
+
+static std::vector<std::string> paths;
+static uint64_t next_path   = 0;
+static uint64_t max_examples = 10;
+static int format = FORMAT_TEXT;
+
+static pthread_mutex_t output_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t num_clean      = 0;
+static uint64_t num_problems   = 0;
+static uint64_t num_unreadable = 0;
 
-char* format_time(time_t time) {
+static const char* format_time(cdb_time_t time, char *formatted, size_t size) {
   const char *date_format = "%Y-%m-%d %H:%M:%S";
+  struct tm tm;
+  time_t stime = (time_t)time;
+
+  localtime_r(&stime, &tm);
+  strftime(formatted, size, date_format, &tm);
+
+  return formatted;
+}
+
+static void add_problem(std::vector<problem> &problems, uint64_t *count, cdb_time_t time, double value, double previous) {
 
-  strftime(formatted, sizeof(formatted), date_format, localtime(&time));
+  if (problems.size() < max_examples) {
+    problem p = { time, value, previous };
+    problems.push_back(p);
+  }
 
-  return (char*)&formatted;
+  *count += 1;
 }
 
-void validate(cdb_t *cdb) {
-  cout << "Working on: " << cdb->filename << endl;
+/* One linear pass: a sorted ring only needs each record compared with the
+ * one before it. */
+static int check_records(cdb_t *cdb, validation &result, cdb_record_t *records) {
+  cdb_scan_t scan = cdb_new_scan();
+  cdb_time_t prev_time = 0;
+  double prev_value = 0;
+  bool have_prev = false;
+  uint64_t len = 0;
+  int ret;
+
+  /* Raw data for counters, and checksums are checked all at once after */
+  scan.skip_checksums = true;
+
+  while ((ret = cdb_scan_records(cdb, &scan, records, VALIDATE_CHUNK, &len)) == CDB_SUCCESS && len > 0) {
+
+    for (uint64_t i = 0; i < len; i++) {
+      cdb_time_t time = records[i].time;
+      double value = records[i].value;
+
+      if (have_prev) {
+
+        if (time == prev_time) {
+          add_problem(result.duplicates, &result.num_duplicates, time, value, prev_value);
+        } else if (time < prev_time) {
+          add_problem(result.out_of_order, &result.num_out_of_order, time, value, prev_value);
+        }
+
+        if (result.type == CDB_TYPE_COUNTER && value < prev_value) {
+          add_problem(result.wraps, &result.num_wraps, time, value, prev_value);
+        }
+      }
 
-  /* Check for exceptional conditions */
-  if (cdb_read_header(cdb) != CDB_SUCCESS) {
-    cout << "Couldn't read header for: " << cdb->filename << endl;
+      prev_time  = time;
+      prev_value = value;
+      have_prev  = true;
+    }
+
+    result.num_recs += len;
+  }
+
+  return ret;
+}
+
+static void check_checksums(cdb_t *cdb, validation &result) {
+  cdb_damage_t *damage = NULL;
+  uint64_t num_damaged = 0;
+  int ret;
+
+  result.damage_unit = cdb->header->layout == CDB_LAYOUT_COMPRESSED ? "block" : "slot";
+
+  if ((ret = cdb_verify_checksums(cdb, &damage, &num_damaged)) != CDB_SUCCESS) {
+    result.error = std::string("Couldn't verify checksums: ") + cdb_strerror(ret);
     return;
   }
 
-  if (cdb->header->num_records == 0) {
-    cout << "No records for: " << cdb->filename << endl;
+  result.num_damaged = num_damaged;
+
+  for (uint64_t i = 0; i < num_damaged && i < max_examples; i++) {
+    result.damage.push_back(damage[i]);
+  }
+
+  free(damage);
+}
+
+static void validate(const std::string &filename, validation &result, cdb_record_t *records) {
+  cdb_t *cdb = cdb_new();
+  int ret;
+
+  cdb->filename = (char*)filename.c_str();
+  cdb->flags    = O_RDONLY;
+
+  result.filename = filename;
+
+  if ((ret = cdb_read_header(cdb)) != CDB_SUCCESS) {
+    result.error = std::string("Couldn't read header: ") + cdb_strerror(ret);
+    cdb_free(cdb);
     return;
   }
 
-  std::set<cdb_time_t> all_dates;
-  std::map<cdb_time_t, std::string> wraps;
-  std::vector<cdb_time_t> duplicates;
-  std::vector<cdb_time_t> bad_dates;
+  for (int attempt = 0; ; attempt++) {
+    result.type = cdb->header->type;
+
+    ret = check_records(cdb, result, records);
+
+    if (ret != CDB_EBUSY || attempt == VALIDATE_RETRIES) {
+      break;
+    }
 
-  cdb_time_t prev_date  = -1;
-  double prev_value = -1;
-  uint64_t num_recs = 0;
-  uint64_t i = 0;
+    /* Start again on the file as it is now */
+    std::string name = result.filename;
+    result = validation();
+    result.filename = name;
+  }
 
-  cdb_range_t *range    = (cdb_range_t*)calloc(1, sizeof(cdb_range_t));
-  cdb_request_t request = cdb_new_request();
-  cdb_record_t *records = NULL;
+  if (ret != CDB_SUCCESS) {
+    result.error = std::string("Couldn't read records: ") + cdb_strerror(ret);
 
-  /* We want to check against raw data for counters */
-  request.cooked = false;
+  } else if (cdb->header->flags & CDB_FLAG_CHECKSUMS) {
+    check_checksums(cdb, result);
+  }
 
-  cdb_read_records(cdb, &request, &num_recs, &records, range);
+  cdb_close(cdb);
+  cdb_free(cdb);
+}
 
-  for (i = 0; i < num_recs; i++) {
-    cdb_time_t date  = records[i].time;
-    double value = records[i].value;
+static void print_problems(std::ostringstream &out, const char *what, uint64_t count,
+  const std::vector<problem> &problems, bool values) {
 
-    if (all_dates.find(date) != all_dates.end()) {
-      duplicates.push_back(date);
-    } else {
-      all_dates.insert(date);
+  char formatted[256];
+
+  if (count == 0) {
+    return;
+  }
+
+  out << "Error: DB has " << count << " record(s) with " << what << "." << endl;
+
+  for (size_t i = 0; i < problems.size(); i++) {
+    out << "  [" << problems[i].time << "] " << format_time(problems[i].time, formatted, sizeof(formatted));
+
+    if (values) {
+      out << " :" << problems[i].value << " < " << problems[i].previous;
     }
 
-    if (cdb->header->type == CDB_TYPE_COUNTER && prev_value != -1 && (value < prev_value)) {
-      std::ostringstream wrap_string;
-      wrap_string << value << " < " << prev_value;
-      cout << wrap_string.str() << endl;
+    out << endl;
+  }
 
-      wraps[date] = wrap_string.str();
+  if (count > problems.size()) {
+    out << "  ... and " << count - problems.size() << " more" << endl;
+  }
+}
+
+static void print_text(std::ostringstream &out, const validation &result) {
+
+  out << "Working on: " << result.filename << endl;
+
+  if (result.num_recs == 0 && result.error.empty()) {
+    out << "No records for: " << result.filename << endl;
+  }
+
+  print_problems(out, "out of order timestamps", result.num_out_of_order, result.out_of_order, false);
+  print_problems(out, "duplicate timestamps", result.num_duplicates, result.duplicates, false);
+  print_problems(out, "counter wraps", result.num_wraps, result.wraps, true);
+
+  if (result.num_damaged > 0) {
+    out << "Error: DB has " << result.num_damaged << " damaged region(s)." << endl;
+
+    for (size_t i = 0; i < result.damage.size(); i++) {
+      out << "  " << result.damage_unit << "s [" << result.damage[i].first << " - "
+          << result.damage[i].first + result.damage[i].count - 1 << "]" << endl;
     }
 
-    if (prev_date != -1 && date < prev_date) {
-      bad_dates.push_back(date);
+    if (result.num_damaged > result.damage.size()) {
+      out << "  ... and " << result.num_damaged - result.damage.size() << " more" << endl;
     }
+  }
 
-    prev_date  = date;
-    prev_value = value;
+  if (!result.error.empty()) {
+    out << "Error: " << result.error << endl;
   }
 
-  if (!bad_dates.empty()) {
-    cout << "Error: DB has " << bad_dates.size() << " record(s) with out of order timestamps." << endl;
+  out << endl;
+}
+
+static void print_json_string(std::ostringstream &out, const std::string &s) {
+
+  out << '"';
 
-    for (unsigned int i = 0; i < bad_dates.size(); i++) {
-      cout << "  [" << bad_dates[i] << "] " << format_time((time_t)bad_dates[i]) << endl;
+  for (size_t i = 0; i < s.size(); i++) {
+    unsigned char c = (unsigned char)s[i];
+
+    if (c == '"' || c == '\\') {
+      out << '\\' << c;
+    } else if (c < 0x20) {
+      char escaped[8];
+      snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+      out << escaped;
+    } else {
+      out << c;
     }
   }
 
-  if (!duplicates.empty()) {
-    cout << "Error: DB has " << duplicates.size() << " record(s) with duplicate timestamps." << endl;
+  out << '"';
+}
+
+static void print_json_times(std::ostringstream &out, const char *name, const std::vector<problem> &problems) {
+
+  out << ",\"" << name << "\":[";
+
+  for (size_t i = 0; i < problems.size(); i++) {
+    out << (i ? "," : "") << problems[i].time;
+  }
+
+  out << "]";
+}
+
+/* One object per line */
+static void print_json(std::ostringstream &out, const validation &result) {
 
-    for (unsigned int i = 0; i < duplicates.size(); i++) {
-      cout << "  [" << duplicates[i] << "] " << format_time((time_t)duplicates[i]) << endl;
-    }
+  out << "{\"file\":";
+  print_json_string(out, result.filename);
+
+  out << ",\"ok\":" << (result.has_problems() ? "false" : "true");
+
+  if (!result.error.empty()) {
+    out << ",\"error\":";
+    print_json_string(out, result.error);
   }
 
-  if (!wraps.empty()) {
-    cout << "Error: DB has " << wraps.size() << " record(s) with counter wraps." << endl;
+  out << ",\"records\":" << result.num_recs
+      << ",\"out_of_order\":" << result.num_out_of_order
+      << ",\"duplicates\":" << result.num_duplicates
+      << ",\"counter_wraps\":" << result.num_wraps
+      << ",\"damaged\":" << result.num_damaged;
 
-    for (std::map<cdb_time_t, std::string>::const_iterator it = wraps.begin(); it != wraps.end(); ++it) {
-      cout << "  [" << it->first << "] " << format_time((time_t)it->first) << " :" << it->second << endl;
-    }
+  print_json_times(out, "out_of_order_times", result.out_of_order);
+  print_json_times(out, "duplicate_times", result.duplicates);
+  print_json_times(out, "counter_wrap_times", result.wraps);
+
+  out << "}" << endl;
+}
+
+static void report(const validation &result) {
+  std::ostringstream out;
+
+  out.precision(8);
+
+  if (format == FORMAT_JSON) {
+    print_json(out, result);
+  } else {
+    print_text(out, result);
+  }
+
+  pthread_mutex_lock(&output_lock);
+
+  cout << out.str();
+
+  if (result.error.find("Couldn't read header") == 0) {
+    num_unreadable += 1;
+  } else if (result.has_problems()) {
+    num_problems += 1;
+  } else {
+    num_clean += 1;
   }
 
-  cout << endl;
+  pthread_mutex_unlock(&output_lock);
+}
+
+static void* validate_worker(void *arg) {
+  cdb_record_t *records = (cdb_record_t*)malloc(VALIDATE_CHUNK * RECORD_SIZE);
+  uint64_t i;
+
+  (void)arg;
+
+  if (records == NULL) {
+    perror("cdb_validate");
+    exit(1);
+  }
+
+  while ((i = __sync_fetch_and_add(&next_path, 1)) < paths.size()) {
+    validation result = validation();
+
+    validate(paths[i], result, records);
+    report(result);
+  }
 
   free(records);
-  free(range);
+
+  return NULL;
+}
+
+static int add_tree_path(const char *path, const struct stat *st, int type, struct FTW *ftw) {
+  size_t len = strlen(path);
+
+  (void)st;
+  (void)ftw;
+
+  if (type == FTW_F && len > sizeof(CDB_EXTENSION) && path[len - sizeof(CDB_EXTENSION)] == '.' &&
+      strcmp(path + len - sizeof(CDB_EXTENSION) + 1, CDB_EXTENSION) == 0) {
+    paths.push_back(path);
+  }
+
+  return 0;
+}
+
+static void usage(void) {
+  fprintf(stderr,
+    "Usage: cdb_validate [options] file|directory ...\n"
+    "\n"
+    "Checks each CircularDB file, and every .cdb file under each directory, for\n"
+    "out of order or duplicate timestamps, counter wraps and bad checksums.\n"
+    "\n"
+    "  -j jobs      files to check at once (default 1)\n"
+    "  -f format    text or json - one object per file, then a summary\n"
+    "  -n count     problems of each kind to list per file (default 10)\n"
+    "\n"
+    "Exits with 1 if any file had a problem.\n");
 }
 
 int main(int argc, char** argv) {
-  int i;
-
-  if (argc > 1) {
-    for (i = 1; i < argc; i++) {
-      int ret;
-
-      cdb_t *cdb = cdb_new();
-      cdb->filename = argv[i];
-      cdb->flags = O_RDONLY;
-
-      ret = cdb_read_header(cdb);
-
-      if (ret == CDB_SUCCESS) {
-        validate(cdb);
-      } else if (ret == CDB_EBADTOK) {
-        fprintf(stderr, "Couldn't open CircularDB file: Bad/bogus token.\n");
-      } else if (ret == CDB_EBADVER) {
-        fprintf(stderr, "Couldn't open CircularDB file: Incompatible version.\n");
-      } else {
-        perror("Couldn't open CircularDB file: Unknown error.\n");
+  std::vector<pthread_t> workers;
+  int jobs = 1;
+  int failures = 0;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "j:f:n:h")) != -1) {
+    switch (opt) {
+      case 'j':
+        jobs = atoi(optarg);
+        break;
+      case 'f':
+        if (strcmp(optarg, "json") == 0) {
+          format = FORMAT_JSON;
+        } else if (strcmp(optarg, "text") == 0) {
+          format = FORMAT_TEXT;
+        } else {
+          fprintf(stderr, "cdb_validate: Unknown format: %s\n", optarg);
+          return 1;
+        }
+        break;
+      case 'n':
+        max_examples = strtoull(optarg, NULL, 10);
+        break;
+      default:
+        usage();
+        return 1;
+    }
+  }
+
+  if (optind >= argc) {
+    printf("cdb_validate: Need at least 1 CircularDB file to validate.\n");
+    return 1;
+  }
+
+  for (int i = optind; i < argc; i++) {
+    struct stat st;
+
+    if (stat(argv[i], &st) != 0) {
+      perror(argv[i]);
+      failures += 1;
+
+    } else if (S_ISDIR(st.st_mode)) {
+
+      if (nftw(argv[i], add_tree_path, 16, FTW_PHYS) != 0) {
+        perror(argv[i]);
+        failures += 1;
       }
 
-      cdb_close(cdb);
-      cdb_free(cdb);
+    } else {
+      paths.push_back(argv[i]);
     }
+  }
+
+  if (jobs < 1) {
+    jobs = 1;
+  }
+
+  if ((uint64_t)jobs > paths.size()) {
+    jobs = paths.size() > 0 ? (int)paths.size() : 1;
+  }
+
+  workers.resize(jobs);
+
+  for (int i = 1; i < jobs; i++) {
+    pthread_create(&workers[i], NULL, validate_worker, NULL);
+  }
+
+  /* This thread is the first worker */
+  validate_worker(NULL);
+
+  for (int i = 1; i < jobs; i++) {
+    pthread_join(workers[i], NULL);
+  }
+
+  if (format == FORMAT_JSON) {
+    cout << "{\"summary\":true,\"files\":" << paths.size() << ",\"clean\":" << num_clean
+         << ",\"problems\":" << num_problems << ",\"unreadable\":" << num_unreadable << "}" << endl;
   } else {
-    printf("cdb_validate: Need at least 1 CircularDB file to validate.\n");
+    cout << "Validated " << paths.size() << " file(s): " << num_clean << " clean, "
+         << num_problems << " with problems, " << num_unreadable << " unreadable." << endl;
   }
 
-  return(0);
+  return failures > 0 || num_problems > 0 || num_unreadable > 0 ? 1 : 0;
 }
@@ -15,24 +15,77 @@
 #include <float.h>
 #include <inttypes.h>
 #include <math.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <time.h>
 #include <unistd.h>
 
 /* For the aggregation interface */
-#include <gsl/gsl_errno.h>
-#include <gsl/gsl_interp.h>
 #include <gsl/gsl_sort.h>
 #include <gsl/gsl_statistics.h>
 
 #include <circulardb_interface.h>
 
+#include "circulardb_private.h"
+
+/* How long readers wait on, and how often they retry around, a writer */
+#define CDB_SEQLOCK_SPINS   100000
+#define CDB_SEQLOCK_RETRIES 1000
+
+/* Spins between readers checking there is a writer at all */
+#define CDB_SEQLOCK_PROBE   1000
+
+/* A 1.1.1 header ends at num_records. Row layout files still use it. */
+#define CDB_HEADER_V1_SIZE 760
+
+/* 2.0.0 headers: the fixed part, and where the sequence count is in it */
+#define CDB_HEADER_V2_FIXED 64
+#define CDB_V2_SEQUENCE     10
+
+/* 2.0.0 header extension tags. Readers skip the ones they don't know, unless
+ * CDB_TAG_REQUIRED is set in them. */
+#define CDB_TAG_NAME        0x0001  /* string */
+#define CDB_TAG_DESC        0x0002  /* string */
+#define CDB_TAG_UNITS       0x0003  /* string */
+#define CDB_TAG_RANGE       0x0004  /* min_value, max_value */
+#define CDB_TAG_BLOCKS      0x0005  /* block_size, num_blocks, start_block, used_blocks */
+#define CDB_TAG_IMPLICIT    0x0006  /* base_time, step */
+#define CDB_TAG_ENCODING    0x0007  /* encoding, value_offset, value_scale */
+#define CDB_TAG_REQUIRED    0x8000
+
+/* Columns are moved through a stack buffer this many records at a time */
+#define CDB_COLUMN_CHUNK 512
+
+/* Slots per checksum in the column and implicit layouts */
+#define CDB_CHECKSUM_RECORDS 512
+
+/* Compressed layout blocks, and how many bytes each record is budgeted when
+ * working out how many blocks a file gets */
+#define CDB_BLOCK_SIZE             4096
+#define CDB_BLOCK_BYTES_PER_RECORD 2
+
+/* header->sequence lives in what used to be padding after units[], so the
+ * on disk layout must not move. */
+typedef char _cdb_header_layout_check[
+    (offsetof(cdb_header_t, sequence) == 714 &&
+     offsetof(cdb_header_t, layout) == CDB_HEADER_V1_SIZE && HEADER_SIZE == 1024) ? 1 : -1];
+
+/* Prefer open file description locks where we have them */
+#ifdef F_OFD_SETLKW
+#define CDB_SETLKW F_OFD_SETLKW
+#else
+#define CDB_SETLKW F_SETLKW
+#endif
+
 /* Future win32 support */
 #ifndef O_BINARY
 #define O_BINARY 0
@@ -44,20 +97,70 @@ int cdb_error(void) {
     return cdb_error;
 }
 
-static void _print_record(FILE *fh, cdb_time_t time, double value, const char *date_format) {
+#ifdef CDB_STATS
+uint64_t _cdb_stat_clock(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000000) + ts.tv_nsec;
+}
+#endif
+
+/* Records are formatted into a buffer this big and written out in one go */
+#define CDB_PRINT_BUFFER (64 * 1024)
 
-    if (date_format == NULL || strcmp(date_format, "") == 0) {
+/* The most one printed record takes, date included */
+#define CDB_PRINT_RECORD_MAX 320
 
-        fprintf(fh, "%d %.8g\n", (int)(time), value);
+static void _print_records(FILE *fh, cdb_record_t *records, uint64_t num_recs, const char *date_format) {
 
-    } else {
+    uint64_t i = 0;
+    size_t used = 0;
+    size_t size = CDB_PRINT_BUFFER;
+    char fallback[CDB_PRINT_RECORD_MAX];
+    char *buffer = malloc(size);
+    cdb_date_cache_t cache;
+
+    if (buffer == NULL) {
+        buffer = fallback;
+        size   = sizeof(fallback);
+    }
+
+    if (date_format != NULL && strcmp(date_format, "") == 0) {
+        date_format = NULL;
+    }
+
+    cache.valid   = false;
+    cache.day_end = 0;
+
+    for (i = 0; i < num_recs; i++) {
+
+        if (used + CDB_PRINT_RECORD_MAX > size) {
+            fwrite(buffer, 1, used, fh);
+            used = 0;
+        }
+
+        used += _cdb_format_int(buffer + used, (int)records[i].time);
+        buffer[used++] = ' ';
 
-        char formatted[256];
-        time_t stime = (time_t)time;
+        if (date_format != NULL) {
+            const char *formatted = NULL;
+            size_t len = _cdb_format_date(&cache, records[i].time, date_format, &formatted);
 
-        strftime(formatted, sizeof(formatted), date_format, localtime(&stime));
+            buffer[used++] = '[';
+            memcpy(buffer + used, formatted, len);
+            used += len;
+            buffer[used++] = ']';
+            buffer[used++] = ' ';
+        }
+
+        used += _cdb_format_double_g(buffer + used, records[i].value, 8);
+        buffer[used++] = '\n';
+    }
+
+    fwrite(buffer, 1, used, fh);
 
-        fprintf(fh, "%d [%s] %.8g\n", (int)(time), formatted, value);
+    if (buffer != fallback) {
+        free(buffer);
     }
 }
 
@@ -115,921 +218,4028 @@ static uint64_t _physical_record_for_logical_record(cdb_header_t *header, int64_
     return physical_record;
 }
 
-static int64_t _seek_to_logical_record(cdb_t *cdb, int64_t logical_record) {
+/* Slots of the implicit layout that were skipped over hold a NaN with a
+ * payload of its own, so gaps aren't mixed up with CDB_NAN */
+#define CDB_GAP_BITS 0x7ff8cdb0cdb0cdb0ULL
 
-    uint64_t physical_record = _physical_record_for_logical_record(cdb->header, logical_record);
-    uint64_t offset = HEADER_SIZE + (physical_record * RECORD_SIZE);
+static double _cdb_gap(void) {
 
-    if (lseek(cdb->fd, offset, SEEK_SET) != offset) {
-        return -1;
+    uint64_t bits = CDB_GAP_BITS;
+    double value;
+
+    memcpy(&value, &bits, sizeof(value));
+
+    return value;
+}
+
+static bool _cdb_is_gap(double value) {
+
+    uint64_t bits;
+
+    memcpy(&bits, &value, sizeof(bits));
+
+    return bits == CDB_GAP_BITS;
+}
+
+/* Value encodings.
+ *
+ * Values are converted a chunk at a time, in plain loops over the stored type
+ * that the compiler can widen to doubles with vector instructions; NaNs and
+ * gaps are patched up in a second pass. The scaled integers keep the type's
+ * two lowest values for those, and float32 has its own gap NaN. */
+#define CDB_INT16_NAN        INT16_MIN
+#define CDB_INT16_GAP        (INT16_MIN + 1)
+#define CDB_INT32_NAN        INT32_MIN
+#define CDB_INT32_GAP        (INT32_MIN + 1)
+#define CDB_FLOAT32_GAP_BITS 0x7fccdb00U
+
+static size_t _cdb_value_size(cdb_header_t *header) {
+
+    switch (header->encoding) {
+        case CDB_ENCODING_FLOAT32:
+            return sizeof(float);
+        case CDB_ENCODING_INT16:
+            return sizeof(int16_t);
+        case CDB_ENCODING_INT32:
+            return sizeof(int32_t);
+        default:
+            return sizeof(double);
     }
+}
 
-    return physical_record;
+static double _cdb_scale_value(cdb_header_t *header, double value, double min, double max) {
+
+    double scaled = round((value - header->value_offset) / header->value_scale);
+
+    if (scaled < min) {
+        return min;
+    }
+
+    if (scaled > max) {
+        return max;
+    }
+
+    return scaled;
 }
 
-static cdb_time_t _time_for_logical_record(cdb_t *cdb, int64_t logical_record) {
+static void _cdb_encode_values(cdb_header_t *header, const double *values, uint64_t len, void *raw) {
 
-    cdb_record_t record[RECORD_SIZE];
-    cdb_time_t time = 0;
+    uint64_t i = 0;
 
-    /* skip over any record that has NULL time or bad time values
-       Such datapoints in cdb indicate a corrupted cdb. */
-    while (!time || time <= 0) {
+    switch (header->encoding) {
+
+        case CDB_ENCODING_FLOAT32: {
+            float *out   = (float*)raw;
+            uint32_t gap = CDB_FLOAT32_GAP_BITS;
+
+            for (i = 0; i < len; i++) {
+
+                if (_cdb_is_gap(values[i])) {
+                    memcpy(&out[i], &gap, sizeof(gap));
+                } else {
+                    out[i] = (float)values[i];
+                }
+            }
 
-        if (_seek_to_logical_record(cdb, logical_record) < 0) {
-            time = 0;
             break;
         }
 
-        logical_record += 1;
+        case CDB_ENCODING_INT16: {
+            int16_t *out = (int16_t*)raw;
+
+            for (i = 0; i < len; i++) {
+
+                if (_cdb_is_gap(values[i])) {
+                    out[i] = CDB_INT16_GAP;
+                } else if (isnan(values[i])) {
+                    out[i] = CDB_INT16_NAN;
+                } else {
+                    out[i] = (int16_t)_cdb_scale_value(header, values[i], INT16_MIN + 2, INT16_MAX);
+                }
+            }
 
-        if (read(cdb->fd, &record, RECORD_SIZE) < 0) {
-            time = 0;
             break;
         }
 
-        time = record->time;
-    }
+        case CDB_ENCODING_INT32: {
+            int32_t *out = (int32_t*)raw;
 
-    return time;
-}
+            for (i = 0; i < len; i++) {
 
-/* note - if no exact match, will return a record with a time greater than the requested value */
-static int64_t _logical_record_for_time(cdb_t *cdb, cdb_time_t req_time, int64_t start_logical_record, int64_t end_logical_record) {
+                if (_cdb_is_gap(values[i])) {
+                    out[i] = CDB_INT32_GAP;
+                } else if (isnan(values[i])) {
+                    out[i] = CDB_INT32_NAN;
+                } else {
+                    out[i] = (int32_t)_cdb_scale_value(header, values[i], INT32_MIN + 2.0, INT32_MAX);
+                }
+            }
 
-    bool first_time = false;
-    cdb_time_t start_time, next_time, center_time;
-    int64_t delta, center_logical_record, next_logical_record;
+            break;
+        }
 
-    uint64_t num_recs = cdb->header->num_records;
+        default:
+            memcpy(raw, values, len * sizeof(double));
+    }
+}
 
-    /* for the very first time find start and end */
-    if (start_logical_record == 0 && end_logical_record == 0) {
+static void _cdb_decode_values(cdb_header_t *header, const void *raw, uint64_t len, double *values) {
 
-        start_logical_record = 0;
-        end_logical_record   = num_recs - 1;
+    double offset = header->value_offset;
+    double scale  = header->value_scale;
+    uint64_t i = 0;
 
-        first_time = true;
-    }
+    switch (header->encoding) {
 
-    /* if no particular time was requested, just return the first one. */
-    if (req_time == 0) {
-        return start_logical_record;
-    }
+        case CDB_ENCODING_FLOAT32: {
+            const float *in = (const float*)raw;
 
-    /* if there are only 2 or 1 records in the search space, return the last record */
-    if (end_logical_record - start_logical_record <= 1) {
-        return end_logical_record;
-    }
+            for (i = 0; i < len; i++) {
+                values[i] = in[i];
+            }
 
-    start_time = _time_for_logical_record(cdb, start_logical_record);
+            for (i = 0; i < len; i++) {
+                uint32_t bits;
 
-    /* if requested time is less than start_time, start_time is the best we can do. */
-    if (req_time <= start_time) {
-        return start_logical_record;
-    }
+                memcpy(&bits, &in[i], sizeof(bits));
 
-    /* don't go out of bounds */
-    if (start_logical_record + 1 >= num_recs) {
-        return start_logical_record;
-    }
+                if (bits == CDB_FLOAT32_GAP_BITS) {
+                    values[i] = _cdb_gap();
+                }
+            }
 
-    next_logical_record = start_logical_record;
-    next_time = start_time;
+            break;
+        }
 
-    /* if _seek_to_logical_record encounters bad data it fabricates and
-       returns next good value. Try to get the *real* next rec. */
-    while ((next_time - start_time) == 0) {
+        case CDB_ENCODING_INT16: {
+            const int16_t *in = (const int16_t*)raw;
 
-        next_logical_record += 1;
+            for (i = 0; i < len; i++) {
+                values[i] = offset + (in[i] * scale);
+            }
 
-        next_time = _time_for_logical_record(cdb, next_logical_record);
+            for (i = 0; i < len; i++) {
+
+                if (in[i] == CDB_INT16_NAN) {
+                    values[i] = CDB_NAN;
+                } else if (in[i] == CDB_INT16_GAP) {
+                    values[i] = _cdb_gap();
+                }
+            }
 
-        if (next_logical_record >= num_recs) {
             break;
         }
-    }
 
-    delta = next_time - start_time;
+        case CDB_ENCODING_INT32: {
+            const int32_t *in = (const int32_t*)raw;
 
-    /* delta = 0 means that _seek_to_logical_record fabricated data on the fly */
-    if (delta == 0) {
-        return start_logical_record;
-    /* if we have wrapped over, or if the requested time is in the range of start and next, return start */
-    } else if (delta < 0) {
-        return start_logical_record;
-    } else if (req_time <= next_time) {
-        return next_logical_record;
-    }
+            for (i = 0; i < len; i++) {
+                values[i] = offset + (in[i] * scale);
+            }
 
-    /* for the very first binary search pivot point, take an aggressive guess to make search converge faster */
-    if (first_time) {
-        center_logical_record = (req_time - start_time) / (next_time - start_time) - 1;
-    } else {
-        center_logical_record = start_logical_record + (end_logical_record - start_logical_record) / 2;
-    }
+            for (i = 0; i < len; i++) {
 
-    if (num_recs > 0) {
-        center_logical_record = (center_logical_record % num_recs);
-    }
+                if (in[i] == CDB_INT32_NAN) {
+                    values[i] = CDB_NAN;
+                } else if (in[i] == CDB_INT32_GAP) {
+                    values[i] = _cdb_gap();
+                }
+            }
 
-    center_time = _time_for_logical_record(cdb, center_logical_record);
+            break;
+        }
 
-    if (req_time >= center_time) {
-        start_logical_record = center_logical_record;
-    } else {
-        end_logical_record = center_logical_record;
+        default:
+            memcpy(values, raw, len * sizeof(double));
     }
-
-    return _logical_record_for_time(cdb, req_time, start_logical_record, end_logical_record);
 }
 
-bool _cdb_is_writable(cdb_t *cdb) {
+/* pread() and pwrite() of the handle's file, counted in its stats */
+static ssize_t _cdb_pread(cdb_t *cdb, void *buffer, size_t len, off_t offset) {
 
-    /* We can't check for the O_RDONLY bit being because its defined value is zero.
-     * i.e. there are no bits set to look for. We therefore assume
-     * O_RDONLY if neither O_WRONLY nor O_RDWR are set. */
-    if (cdb->flags & O_RDWR) {
-        return true;
+    ssize_t got = pread(cdb->fd, buffer, len, offset);
+
+    CDB_STAT_ADD(cdb, syscalls, 1);
+
+    if (got > 0) {
+        CDB_STAT_ADD(cdb, bytes_read, got);
     }
 
-    return false;
+    return got;
 }
 
-int cdb_read_header(cdb_t *cdb) {
-    struct stat st;
+static ssize_t _cdb_pwrite(cdb_t *cdb, const void *buffer, size_t len, off_t offset) {
 
-    /* If the header has already been read from backing store do not read again */
-    if (cdb->synced == true) {
-        return CDB_SUCCESS;
-    }
+    ssize_t put = pwrite(cdb->fd, buffer, len, offset);
 
-    if (cdb_open(cdb) != 0) {
-        return cdb_error();
+    CDB_STAT_ADD(cdb, syscalls, 1);
+
+    if (put > 0) {
+        CDB_STAT_ADD(cdb, bytes_written, put);
     }
 
-    if (pread(cdb->fd, cdb->header, HEADER_SIZE, 0) != HEADER_SIZE) {
-        return cdb_error();
+    return put;
+}
+
+/* All record I/O goes through pread()/pwrite() at an explicit offset, so the
+ * file offset is never shared state and a cdb_t can be used from several
+ * threads at once.
+ *
+ * These are also the only functions that know how each layout places records
+ * in the file: the row layout stores time, value pairs, and the column layout
+ * stores every time and then every value, so a time search only reads times
+ * and a scan of values only reads values. The implicit layout has only the
+ * values. */
+static off_t _cdb_time_offset(cdb_header_t *header, uint64_t physical_record) {
+
+    if (header->layout == CDB_LAYOUT_COLUMNS) {
+        return header->data_offset + (physical_record * sizeof(cdb_time_t));
     }
 
-    if (strncmp(cdb->header->token, CDB_TOKEN, sizeof(CDB_TOKEN)) != 0) {
-        return CDB_EBADTOK;
+    return header->data_offset + (physical_record * RECORD_SIZE);
+}
+
+static off_t _cdb_value_offset(cdb_header_t *header, uint64_t physical_record) {
+
+    if (header->layout == CDB_LAYOUT_COLUMNS) {
+        return header->data_offset + (header->max_records * sizeof(cdb_time_t)) +
+            (physical_record * _cdb_value_size(header));
     }
 
-    if (strncmp(cdb->header->version, CDB_VERSION, sizeof(CDB_VERSION)) != 0) {
-        return CDB_EBADVER;
+    if (header->layout == CDB_LAYOUT_IMPLICIT) {
+        return header->data_offset + (physical_record * _cdb_value_size(header));
     }
 
-    cdb->synced = true;
+    return header->data_offset + (physical_record * RECORD_SIZE) + offsetof(cdb_record_t, value);
+}
 
-    /* Calculate the number of records */
-    if (fstat(cdb->fd, &st) == 0) {
-        cdb->header->num_records = (st.st_size - HEADER_SIZE) / RECORD_SIZE;
-    } else {
-        cdb->header->num_records = 0;
+static int _cdb_pread_time(cdb_t *cdb, uint64_t physical_record, cdb_time_t *time) {
+
+    off_t offset = _cdb_time_offset(cdb->header, physical_record);
+
+    if (_cdb_pread(cdb, time, sizeof(cdb_time_t), offset) != sizeof(cdb_time_t)) {
+        return cdb_error();
     }
 
     return CDB_SUCCESS;
 }
 
-int cdb_write_header(cdb_t *cdb) {
+/* Checksums of the column and implicit layouts.
+ *
+ * A table of CRC32Cs follows the values, one for every CDB_CHECKSUM_RECORDS
+ * slots: over their times, then their values, as they are on disk. CRCs start
+ * from zero, so slots that were never written, or are past the end of the
+ * file, match a table entry that wasn't either. Writes fold the XOR of the
+ * old and new bytes into the entry rather than reading the whole chunk again,
+ * which also keeps damage elsewhere in the chunk from being checksummed over. */
+static uint64_t _cdb_checksum_chunks(cdb_header_t *header) {
+
+    return (header->max_records + CDB_CHECKSUM_RECORDS - 1) / CDB_CHECKSUM_RECORDS;
+}
 
-    if (cdb->synced) {
-        return CDB_SUCCESS;
-    }
+static off_t _cdb_checksum_offset(cdb_header_t *header, uint64_t chunk) {
 
-    if (_cdb_is_writable(cdb) == false) {
-        return CDB_ERDONLY;
-    }
+    return _cdb_value_offset(header, header->max_records) + (chunk * sizeof(uint32_t));
+}
 
-    cdb->synced = false;
+/* pread() that counts anything past the end of the file as zeros */
+static int _cdb_pread_zeros(cdb_t *cdb, void *buffer, size_t len, off_t offset) {
 
-    if (cdb_open(cdb) > 0) {
-        return cdb_error();
-    }
+    ssize_t got = _cdb_pread(cdb, buffer, len, offset);
 
-    if (pwrite(cdb->fd, cdb->header, HEADER_SIZE, 0) != HEADER_SIZE) {
+    if (got < 0) {
         return cdb_error();
     }
 
-    cdb->synced = true;
+    memset((unsigned char*)buffer + got, 0, len - got);
 
     return CDB_SUCCESS;
 }
 
-void cdb_print_header(cdb_t * cdb) {
+/* Slots in a chunk, and bytes of times ahead of its values */
+static uint64_t _cdb_checksum_slots(cdb_header_t *header, uint64_t chunk) {
 
-    printf("version: [%s]\n", cdb->header->version);
-    printf("name: [%s]\n", cdb->header->name);
-    printf("desc: [%s]\n", cdb->header->desc);
-    printf("units: [%s]\n", cdb->header->units);
+    uint64_t first = chunk * CDB_CHECKSUM_RECORDS;
 
-    if (cdb->header->type == CDB_TYPE_COUNTER) {
-        printf("type: [COUNTER]\n");
-    }
+    return header->max_records - first < CDB_CHECKSUM_RECORDS ? header->max_records - first : CDB_CHECKSUM_RECORDS;
+}
 
-    if (cdb->header->type == CDB_TYPE_GAUGE) {
-        printf("type: [GAUGE]\n");
-    }
+static size_t _cdb_checksum_time_size(cdb_header_t *header) {
 
-    printf("min_value: [%g]\n", cdb->header->min_value);
-    printf("max_value: [%g]\n", cdb->header->max_value);
-    printf("max_records: [%"PRIu64"]\n", cdb->header->max_records);
-    printf("num_records: [%"PRIu64"]\n", cdb->header->num_records);
-    printf("start_record: [%"PRIu64"]\n", cdb->header->start_record);
+    return header->layout == CDB_LAYOUT_COLUMNS ? sizeof(cdb_time_t) : 0;
 }
 
-int cdb_write_records(cdb_t *cdb, cdb_record_t *records, uint64_t len, uint64_t *num_recs) {
+/* Work out the CRC of a chunk from what is on disk, and read the stored one. */
+static int _cdb_checksum_chunk(cdb_t *cdb, uint64_t chunk, uint32_t *crc, uint32_t *stored) {
 
-    /* read old header if it exists.
-       write a header out, since the db may not have existed.
-    */
-    uint64_t i   = 0;
-    uint64_t j   = 0;
-    off_t offset = 0;
-    *num_recs    = 0;
+    cdb_header_t *header = cdb->header;
+    unsigned char buffer[CDB_CHECKSUM_RECORDS * sizeof(double)];
+    uint64_t first = chunk * CDB_CHECKSUM_RECORDS;
+    uint64_t slots = _cdb_checksum_slots(header, chunk);
+    size_t time_size = _cdb_checksum_time_size(header);
+    size_t value_size = _cdb_value_size(header);
+    int ret = CDB_SUCCESS;
 
-    if (cdb_read_header(cdb) != CDB_SUCCESS) {
-        return cdb_error();
-    }
+    *crc = 0;
 
-    if (_cdb_is_writable(cdb) == false) {
-        return CDB_ERDONLY;
+    if (time_size > 0) {
+
+        if ((ret = _cdb_pread_zeros(cdb, buffer, slots * time_size, _cdb_time_offset(header, first))) != CDB_SUCCESS) {
+            return ret;
+        }
+
+        *crc = _cdb_crc32c(*crc, buffer, slots * time_size);
     }
 
-    if (cdb->header->max_records <= 0) {
-        return CDB_EINVMAX;
+    if ((ret = _cdb_pread_zeros(cdb, buffer, slots * value_size, _cdb_value_offset(header, first))) != CDB_SUCCESS) {
+        return ret;
     }
 
-    /* Logic for writes:
-    cdb is 5 records.
-        try to write 7 records
-        len = 7
-        len + 0 > 5
-        j = (7 + 0) - 5
-        j = 2
-        i = 7 - 2
-        i = 5
+    *crc = _cdb_crc32c(*crc, buffer, slots * value_size);
 
-        need to write j records at offset: HEADER_SIZE + (cdb->header->start_record * RECORD_SIZE)
-        index into records is i
+    return _cdb_pread_zeros(cdb, stored, sizeof(uint32_t), _cdb_checksum_offset(header, chunk));
+}
 
-        need to write i records at offset: HEADER_SIZE + (cdb->header->num_records * RECORD_SIZE)
-        index into records is 0;
-    */
+/* Check the chunks len slots from physical_record touch, wrapping around the
+ * end of the ring. */
+static int _cdb_checksum_verify(cdb_t *cdb, uint64_t physical_record, uint64_t len) {
 
-    /* Calculate our indicies into the records array. */
-    if (len + cdb->header->num_records >= cdb->header->max_records) {
-        j = (len + cdb->header->num_records) - cdb->header->max_records;
-        i = (len - j);
-    } else {
-        i = len;
-    }
+    cdb_header_t *header = cdb->header;
 
-    /* If we need to wrap around */
-    if (j > 0) {
+    if (!(header->flags & CDB_FLAG_CHECKSUMS)) {
+        return CDB_SUCCESS;
+    }
 
-        offset = HEADER_SIZE + (cdb->header->start_record * RECORD_SIZE);
+    while (len > 0) {
+        uint64_t chunk = physical_record / CDB_CHECKSUM_RECORDS;
+        uint64_t end   = (chunk * CDB_CHECKSUM_RECORDS) + _cdb_checksum_slots(header, chunk);
+        uint64_t take  = end - physical_record < len ? end - physical_record : len;
+        uint32_t crc   = 0;
+        uint32_t stored = 0;
+        int ret = CDB_SUCCESS;
 
-        cdb->header->start_record += j;
-        cdb->header->start_record %= cdb->header->max_records;
+        if ((ret = _cdb_checksum_chunk(cdb, chunk, &crc, &stored)) != CDB_SUCCESS) {
+            return ret;
+        }
 
-        if (pwrite(cdb->fd, &records[i], (RECORD_SIZE * j), offset) != (RECORD_SIZE * j)) {
-            return cdb_error();
+        if (crc != stored) {
+            return CDB_ECHECKSUM;
         }
 
-        cdb->synced = false;
+        len -= take;
+        physical_record = (physical_record + take) % header->max_records;
+    }
 
-        /* start_record is no longer 0, so update the header */
-        if (cdb_write_header(cdb) != CDB_SUCCESS) {
+    return CDB_SUCCESS;
+}
+
+/* Write len physically contiguous times (or values, in their encoding) and
+ * fold the change into the checksums. len is at most CDB_COLUMN_CHUNK. */
+static int _cdb_pwrite_column(cdb_t *cdb, const void *data, uint64_t physical_record, uint64_t len, bool times) {
+
+    cdb_header_t *header = cdb->header;
+    unsigned char diff[CDB_COLUMN_CHUNK * sizeof(double)];
+    size_t time_size = _cdb_checksum_time_size(header);
+    size_t value_size = _cdb_value_size(header);
+    size_t size = (times ? time_size : value_size);
+    off_t offset = times ? _cdb_time_offset(header, physical_record) : _cdb_value_offset(header, physical_record);
+    uint64_t done = 0;
+    uint64_t i = 0;
+    int ret = CDB_SUCCESS;
+
+    if (!(header->flags & CDB_FLAG_CHECKSUMS)) {
+
+        if (_cdb_pwrite(cdb, data, size * len, offset) != (size * len)) {
             return cdb_error();
         }
+
+        return CDB_SUCCESS;
+    }
+
+    if ((ret = _cdb_pread_zeros(cdb, diff, size * len, offset)) != CDB_SUCCESS) {
+        return ret;
     }
 
-    /* Normal case */
-    offset = HEADER_SIZE + (cdb->header->num_records * RECORD_SIZE);
-    cdb->header->num_records += i;
+    for (i = 0; i < size * len; i++) {
+        diff[i] ^= ((const unsigned char*)data)[i];
+    }
 
-    if (pwrite(cdb->fd, &records[0], (RECORD_SIZE * i), offset) != (RECORD_SIZE * i)) {
+    if (_cdb_pwrite(cdb, data, size * len, offset) != (size * len)) {
         return cdb_error();
     }
 
-    *num_recs += len;
+    /* CRCs are linear: the new one is the old one XOR the CRC of the change,
+     * carried on over the rest of the chunk */
+    while (done < len) {
+        uint64_t slot  = physical_record + done;
+        uint64_t chunk = slot / CDB_CHECKSUM_RECORDS;
+        uint64_t at    = slot - (chunk * CDB_CHECKSUM_RECORDS);
+        uint64_t slots = _cdb_checksum_slots(header, chunk);
+        uint64_t take  = slots - at < len - done ? slots - at : len - done;
+        uint64_t pos   = (times ? 0 : slots * time_size) + (at * size);
+        uint64_t total = slots * (time_size + value_size);
+        uint32_t crc   = _cdb_crc32c(0, diff + (done * size), take * size);
+        uint32_t stored = 0;
+
+        crc = _cdb_crc32c_zeros(crc, total - pos - (take * size));
+
+        if ((ret = _cdb_pread_zeros(cdb, &stored, sizeof(stored), _cdb_checksum_offset(header, chunk))) != CDB_SUCCESS) {
+            return ret;
+        }
 
-#ifdef DEBUG
-    printf("write_records: wrote [%"PRIu64"] records\n", *num_recs);
-#endif
+        stored ^= crc;
+
+        if (_cdb_pwrite(cdb, &stored, sizeof(stored), _cdb_checksum_offset(header, chunk)) != sizeof(stored)) {
+            return cdb_error();
+        }
+
+        done += take;
+    }
 
     return CDB_SUCCESS;
 }
 
-bool cdb_write_record(cdb_t *cdb, cdb_time_t time, double value) {
+/* Read, or write, len physically contiguous values of the column or implicit
+ * layouts, in their encoding. len is at most CDB_COLUMN_CHUNK. */
+static int _cdb_pread_values(cdb_t *cdb, uint64_t physical_record, uint64_t len, double *values) {
 
-    cdb_record_t record[RECORD_SIZE];
-    uint64_t num_recs = 0;
+    unsigned char raw[CDB_COLUMN_CHUNK * sizeof(double)];
+    size_t size = _cdb_value_size(cdb->header) * len;
+    void *buffer = cdb->header->encoding == CDB_ENCODING_FLOAT64 ? (void*)values : (void*)raw;
 
-    record->time  = time;
-    record->value = value;
+    if (_cdb_pread(cdb, buffer, size, _cdb_value_offset(cdb->header, physical_record)) != size) {
+        return cdb_error();
+    }
 
-    if (cdb_write_records(cdb, record, 1, &num_recs) != CDB_SUCCESS) {
-        return false;
+    if (buffer == raw) {
+        _cdb_decode_values(cdb->header, raw, len, values);
     }
 
-    return true;
+    return CDB_SUCCESS;
 }
 
-int cdb_update_records(cdb_t *cdb, cdb_record_t *records, uint64_t len, uint64_t *num_recs) {
-
-    int ret    = CDB_SUCCESS;
-    *num_recs  = 0;
-    uint64_t i = 0;
+static int _cdb_pwrite_values(cdb_t *cdb, uint64_t physical_record, uint64_t len, const double *values) {
 
-    if (cdb_read_header(cdb) != CDB_SUCCESS) {
-        return cdb_error();
-    }
+    unsigned char raw[CDB_COLUMN_CHUNK * sizeof(double)];
 
-    if (_cdb_is_writable(cdb) == false) {
-        return CDB_ERDONLY;
-    }
+    _cdb_encode_values(cdb->header, values, len, raw);
 
-#ifdef DEBUG
-    printf("in update_records with [%"PRIu64"] num_recs\n", cdb->header->num_records);
-#endif
+    return _cdb_pwrite_column(cdb, raw, physical_record, len, false);
+}
 
-    for (i = 0; i < len; i++) {
+/* Read len records that are physically contiguous, starting at physical_record. */
+static int _cdb_pread_records(cdb_t *cdb, uint64_t physical_record, uint64_t len, cdb_record_t *records) {
 
-        cdb_time_t time = records[i].time;
-        cdb_time_t rtime;
-        uint64_t lrec;
+    cdb_time_t times[CDB_COLUMN_CHUNK];
+    double values[CDB_COLUMN_CHUNK];
+    uint64_t done = 0;
 
-        lrec = _logical_record_for_time(cdb, time, 0, 0);
+    if (cdb->header->layout != CDB_LAYOUT_COLUMNS) {
+        off_t offset = _cdb_time_offset(cdb->header, physical_record);
 
-        if (lrec >= 1) {
-            lrec -= 1;
-            /* DRK things like this are extremely confusing. some logical
-               functions are zero based? some are one? or you're trying to back up? */
+        if (_cdb_pread(cdb, records, RECORD_SIZE * len, offset) != (RECORD_SIZE * len)) {
+            return cdb_error();
         }
 
-        rtime = _time_for_logical_record(cdb, lrec);
+        CDB_STAT_ADD(cdb, records_decoded, len);
 
-        while (rtime < time && lrec < cdb->header->num_records - 1) {
+        return CDB_SUCCESS;
+    }
 
-            /* DRK is this true? or is the condition (lrec - start_lrec) <
-               num_recs -- seems you can't wrap here (i.e. what if the initial
-               lrec was num_recs - 1) */
+    while (done < len) {
+        uint64_t chunk = len - done > CDB_COLUMN_CHUNK ? CDB_COLUMN_CHUNK : len - done;
+        uint64_t i = 0;
 
-            lrec += 1;
-            rtime = _time_for_logical_record(cdb, lrec);
+        if (_cdb_pread(cdb, times, sizeof(cdb_time_t) * chunk,
+                _cdb_time_offset(cdb->header, physical_record + done)) != (sizeof(cdb_time_t) * chunk)) {
+            return cdb_error();
         }
 
-#ifdef DEBUG
-        printf("update_records: value: lrec [%"PRIu64"] time [%d] rtime [%d]\n", lrec, (int)time, (int)rtime);
-#endif
+        if (_cdb_pread_values(cdb, physical_record + done, chunk, values) != CDB_SUCCESS) {
+            return cdb_error();
+        }
 
-        while (time == rtime && lrec < cdb->header->num_records - 1) {
+        for (i = 0; i < chunk; i++) {
+            records[done + i].time  = times[i];
+            records[done + i].value = values[i];
+        }
 
-            _seek_to_logical_record(cdb, lrec);
+        done += chunk;
+    }
 
-            if (write(cdb->fd, &records[0], RECORD_SIZE) != RECORD_SIZE) {
-                ret = cdb_error();
-                break;
-            }
+    CDB_STAT_ADD(cdb, records_decoded, len);
 
-            lrec += 1;
+    return CDB_SUCCESS;
+}
 
-            rtime = _time_for_logical_record(cdb, lrec);
+/* Write len records to physically contiguous slots, starting at physical_record. */
+static int _cdb_pwrite_records(cdb_t *cdb, uint64_t physical_record, uint64_t len, cdb_record_t *records) {
+
+    cdb_time_t times[CDB_COLUMN_CHUNK];
+    double values[CDB_COLUMN_CHUNK];
+    uint64_t done = 0;
+
+    if (cdb->header->layout != CDB_LAYOUT_COLUMNS) {
+        off_t offset = _cdb_time_offset(cdb->header, physical_record);
+
+        if (_cdb_pwrite(cdb, records, RECORD_SIZE * len, offset) != (RECORD_SIZE * len)) {
+            return cdb_error();
         }
+
+        return CDB_SUCCESS;
     }
 
-    if (ret == CDB_SUCCESS) {
+    while (done < len) {
+        uint64_t chunk = len - done > CDB_COLUMN_CHUNK ? CDB_COLUMN_CHUNK : len - done;
+        uint64_t i = 0;
 
-        if (i > 0) {
-            cdb->synced = false;
-            *num_recs = i;
+        for (i = 0; i < chunk; i++) {
+            times[i]  = records[done + i].time;
+            values[i] = records[done + i].value;
         }
 
-        if (cdb_write_header(cdb) != CDB_SUCCESS) {
-            ret = cdb_error();
+        if (_cdb_pwrite_column(cdb, times, physical_record + done, chunk, true) != CDB_SUCCESS) {
+            return cdb_error();
+        }
+
+        if (_cdb_pwrite_values(cdb, physical_record + done, chunk, values) != CDB_SUCCESS) {
+            return cdb_error();
         }
+
+        done += chunk;
     }
 
-    return ret;
+    return CDB_SUCCESS;
 }
 
-bool cdb_update_record(cdb_t *cdb, cdb_time_t time, double value) {
+static cdb_time_t _time_for_logical_record(cdb_t *cdb, int64_t logical_record) {
 
-    cdb_record_t record[RECORD_SIZE];
-    uint64_t num_recs = 0;
+    cdb_time_t time = 0;
 
-    record->time  = time;
-    record->value = value;
+    /* skip over any record that has NULL time or bad time values
+       Such datapoints in cdb indicate a corrupted cdb. */
+    while (!time || time <= 0) {
 
-    if (cdb_update_records(cdb, record, 1, &num_recs) != 0) {
-        return false;
+        uint64_t physical_record = _physical_record_for_logical_record(cdb->header, logical_record);
+
+        logical_record += 1;
+
+        CDB_STAT_ADD(cdb, probes, 1);
+
+        if (_cdb_pread_time(cdb, physical_record, &time) != CDB_SUCCESS) {
+            time = 0;
+            break;
+        }
     }
 
-    return true;
+    return time;
 }
 
-int cdb_discard_records_in_time_range(cdb_t *cdb, cdb_request_t *request, uint64_t *num_recs) {
+/* note - if no exact match, will return a record with a time greater than the requested value */
+static int64_t _logical_record_search(cdb_t *cdb, cdb_time_t req_time, int64_t start_logical_record, int64_t end_logical_record) {
 
-    uint64_t i = 0;
-    int64_t lrec;
-    off_t offset = RECORD_SIZE;
-    *num_recs = 0;
+    bool first_time = false;
+    cdb_time_t start_time, next_time, center_time;
+    int64_t delta, center_logical_record, next_logical_record;
 
-    if (cdb_read_header(cdb) != CDB_SUCCESS) {
-        return cdb_error();
-    }
+    uint64_t num_recs = cdb->header->num_records;
 
-    if (_cdb_is_writable(cdb) == false) {
-        return CDB_ERDONLY;
+    /* for the very first time find start and end */
+    if (start_logical_record == 0 && end_logical_record == 0) {
+
+        start_logical_record = 0;
+        end_logical_record   = num_recs - 1;
+
+        first_time = true;
+
+        CDB_STAT_ADD(cdb, lookups, 1);
     }
 
-    lrec = _logical_record_for_time(cdb, request->start, 0, 0);
+    /* if no particular time was requested, just return the first one. */
+    if (req_time == 0) {
+        return start_logical_record;
+    }
 
-    if (lrec >= 1) {
-        lrec -= 1;
+    /* if there are only 2 or 1 records in the search space, return the last record */
+    if (end_logical_record - start_logical_record <= 1) {
+        return end_logical_record;
     }
 
-    for (i = lrec; i < cdb->header->num_records; i++) {
+    start_time = _time_for_logical_record(cdb, start_logical_record);
 
-        cdb_time_t rtime = _time_for_logical_record(cdb, i);
+    /* if requested time is less than start_time, start_time is the best we can do. */
+    if (req_time <= start_time) {
+        return start_logical_record;
+    }
 
-        if (rtime >= request->start && rtime <= request->end) {
+    /* don't go out of bounds */
+    if (start_logical_record + 1 >= num_recs) {
+        return start_logical_record;
+    }
 
-            cdb_record_t record[RECORD_SIZE];
+    next_logical_record = start_logical_record;
+    next_time = start_time;
 
-            record->time  = rtime;
-            record->value = CDB_NAN;
+    /* if _time_for_logical_record encounters bad data it fabricates and
+       returns next good value. Try to get the *real* next rec. */
+    while ((next_time - start_time) == 0) {
 
-            if (pwrite(cdb->fd, &record, RECORD_SIZE, offset) != RECORD_SIZE) {
-                return cdb_error();
-            }
+        next_logical_record += 1;
 
-            *num_recs += 1;
+        next_time = _time_for_logical_record(cdb, next_logical_record);
+
+        if (next_logical_record >= num_recs) {
+            break;
         }
     }
 
-    if (*num_recs > 0) {
-        cdb->synced = false;
-    }
+    delta = next_time - start_time;
 
-    if (cdb_write_header(cdb) != CDB_SUCCESS) {
-        return cdb_error();
+    /* delta = 0 means that _time_for_logical_record fabricated data on the fly */
+    if (delta == 0) {
+        return start_logical_record;
+    /* if we have wrapped over, or if the requested time is in the range of start and next, return start */
+    } else if (delta < 0) {
+        return start_logical_record;
+    } else if (req_time <= next_time) {
+        return next_logical_record;
     }
 
-    return CDB_SUCCESS;
-}
+    /* for the very first binary search pivot point, take an aggressive guess to make search converge faster */
+    if (first_time) {
+        center_logical_record = (req_time - start_time) / (next_time - start_time) - 1;
+    } else {
+        center_logical_record = start_logical_record + (end_logical_record - start_logical_record) / 2;
+    }
 
-static int _compute_scale_factor_and_num_records(cdb_t *cdb, int64_t *num_records, int32_t *factor) {
+    if (num_recs > 0) {
+        center_logical_record = (center_logical_record % num_recs);
+    }
 
-    if (cdb->header->type == CDB_TYPE_COUNTER) {
-        if (*num_records != 0) {
+    center_time = _time_for_logical_record(cdb, center_logical_record);
 
-            if (*num_records > 0) {
-                *num_records += 1;
-            } else {
-                *num_records -= 1;
-            }
-        }
+    if (req_time >= center_time) {
+        start_logical_record = center_logical_record;
+    } else {
+        end_logical_record = center_logical_record;
     }
 
-    if (strlen(cdb->header->units) > 0) {
-
-        int32_t multiplier = 1;
-        char *frequency;
+    return _logical_record_search(cdb, req_time, start_logical_record, end_logical_record);
+}
 
-        if ((frequency = calloc(strlen(cdb->header->units), sizeof(char))) == NULL) {
-            return CDB_ENOMEM;
-        }
+static int64_t _logical_record_for_time(cdb_t *cdb, cdb_time_t req_time, int64_t start_logical_record, int64_t end_logical_record) {
 
-        if ((sscanf(cdb->header->units, "per %d %s", &multiplier, frequency) == 2) ||
-            (sscanf(cdb->header->units, "per %s", frequency) == 1) ||
-            (sscanf(cdb->header->units, "%*s per %s", frequency) == 1)) {
+    int64_t logical_record;
 
-            if (strcmp(frequency, "min") == 0) {
-                *factor = 60;
-            } else if (strcmp(frequency, "hour") == 0) {
-                *factor = 60 * 60;
-            } else if (strcmp(frequency, "sec") == 0 || strcmp(frequency, "second") == 0) {
-                *factor = 1;
-            } else if (strcmp(frequency, "day") == 0) {
-                *factor = 60 * 60 * 24;
-            } else if (strcmp(frequency, "week") == 0) {
-                *factor = 60 * 60 * 24 * 7;
-            } else if (strcmp(frequency, "month") == 0) {
-                *factor = 60 * 60 * 24 * 30;
-            } else if (strcmp(frequency, "quarter") == 0) {
-                *factor = 60 * 60 * 24 * 90;
-            } else if (strcmp(frequency, "year") == 0) {
-                *factor = 60 * 60 * 24 * 365;
-            }
+    CDB_STAT_START(started);
+    CDB_PROBE3(search_entry, cdb->filename, req_time, cdb->header->num_records);
 
-            if (*factor != 0) {
-                *factor *= multiplier;
-            }
-        }
+    logical_record = _logical_record_search(cdb, req_time, start_logical_record, end_logical_record);
 
-        free(frequency);
-    }
+    CDB_PROBE3(search_return, cdb->filename, req_time, logical_record);
+    CDB_HISTOGRAM_SINCE(CDB_OP_SEARCH, started);
 
-    return CDB_SUCCESS;
+    return logical_record;
 }
 
-/* Statistics code
- * Make only one call to reading for a particular time range and compute all our stats
- */
-void _compute_statistics(cdb_range_t *range, uint64_t *num_recs, cdb_record_t *records) {
+bool _cdb_is_writable(cdb_t *cdb) {
+
+    /* We can't check for the O_RDONLY bit being because its defined value is zero.
+     * i.e. there are no bits set to look for. We therefore assume
+     * O_RDONLY if neither O_WRONLY nor O_RDWR are set. */
+    if (cdb->flags & O_RDWR) {
+        return true;
+    }
+
+    return false;
+}
+
+/* Header seqlock.
+ *
+ * The header page is mapped shared, so every process that has the file open
+ * sees the same header->sequence counter. Writers make the counter odd while
+ * they change records or the header, and even again once they are done.
+ * Readers note the (even) counter before reading and retry if it has moved
+ * by the time they are done, so they never act on a torn start_record /
+ * num_records pair and never need to flock() the file.
+ *
+ * Writers hold an fcntl() lock over the counter for the whole update - the
+ * file lock if locking is on, or one on just the counter's bytes if not - so
+ * no two are ever in the middle of one at once. That lock goes when a writer
+ * dies, which is how readers tell an odd counter left behind by a crash from
+ * a writer that is still busy. */
+static void _cdb_map_header(cdb_t *cdb) {
+
+    struct stat st;
+    int prot = PROT_READ;
+    void *map;
+
+    if (cdb->mapped_header != NULL) {
+        return;
+    }
+
+    /* Touching a mapping past EOF raises SIGBUS. Only the sequence is used,
+     * which every version of the header has, and every version is at least
+     * this long on disk. */
+    if (fstat(cdb->fd, &st) != 0 || st.st_size < cdb->base + CDB_HEADER_V1_SIZE) {
+        return;
+    }
+
+    if (_cdb_is_writable(cdb)) {
+        prot |= PROT_WRITE;
+    }
+
+    map = mmap(NULL, CDB_HEADER_V1_SIZE, prot, MAP_SHARED, cdb->fd, cdb->base);
+
+    /* Without the mapping we simply fall back to trusting our own header */
+    if (map == MAP_FAILED) {
+        return;
+    }
+
+    cdb->mapped_header = map;
+
+    if (strncmp((char*)map + offsetof(cdb_header_t, version), "1.", 2) == 0) {
+        cdb->mapped_sequence = (uint16_t*)((char*)map + offsetof(cdb_header_t, sequence));
+    } else {
+        cdb->mapped_sequence = (uint16_t*)((char*)map + CDB_V2_SEQUENCE);
+    }
+}
+
+static uint16_t _cdb_seq_load(cdb_t *cdb) {
+
+    uint16_t sequence = *(volatile uint16_t*)cdb->mapped_sequence;
+
+    __sync_synchronize();
+
+    return sequence;
+}
+
+/* Wait for a file lock, through any signals */
+static int _cdb_setlkw(cdb_t *cdb, struct flock *fl) {
+
+    while (fcntl(cdb->fd, CDB_SETLKW, fl) != 0) {
+
+        CDB_STAT_ADD(cdb, syscalls, 1);
+
+        if (errno != EINTR) {
+            return cdb_error();
+        }
+    }
+
+    CDB_STAT_ADD(cdb, syscalls, 1);
+
+    return CDB_SUCCESS;
+}
+
+/* The counter's bytes in the file, for fcntl() */
+static void _cdb_seq_range(cdb_t *cdb, struct flock *fl, short type) {
+
+    memset(fl, 0, sizeof(*fl));
+
+    fl->l_type   = type;
+    fl->l_whence = SEEK_SET;
+    fl->l_start  = cdb->base + ((char*)cdb->mapped_sequence - (char*)cdb->mapped_header);
+    fl->l_len    = sizeof(uint16_t);
+}
+
+/* Whether a writer in another process, or on another handle, holds the lock
+ * over the counter. Plain POSIX locks don't show the ones our own process
+ * holds, so without OFD locks there is no telling, and we assume there is. */
+static bool _cdb_seq_writer_active(cdb_t *cdb) {
+
+#ifdef F_OFD_GETLK
+    struct flock fl;
+
+    _cdb_seq_range(cdb, &fl, F_WRLCK);
+
+    CDB_STAT_ADD(cdb, syscalls, 1);
+
+    if (fcntl(cdb->fd, F_OFD_GETLK, &fl) != 0) {
+        return true;
+    }
+
+    return fl.l_type != F_UNLCK;
+#else
+    (void)cdb;
+    return true;
+#endif
+}
+
+/* Wait for any writer to finish and return the sequence to validate against. */
+static int _cdb_seq_read_begin(cdb_t *cdb, uint16_t *sequence) {
+
+    int spins = 0;
+
+    if (cdb->mapped_header == NULL) {
+        *sequence = cdb->header->sequence;
+        return CDB_SUCCESS;
+    }
+
+    while ((*sequence = _cdb_seq_load(cdb)) & 1) {
+
+        /* With nobody holding the lock the writer died mid update. The odd
+         * count will do as well as an even one: the next writer moves it on,
+         * which anything read now is checked against. */
+        if (++spins % CDB_SEQLOCK_PROBE == 0 && !_cdb_seq_writer_active(cdb)) {
+            break;
+        }
+
+        if (spins > CDB_SEQLOCK_SPINS) {
+            return CDB_EBUSY;
+        }
+
+        sched_yield();
+    }
+
+    return CDB_SUCCESS;
+}
+
+/* True if a writer has been at the file since sequence was taken. */
+static bool _cdb_seq_read_retry(cdb_t *cdb, uint16_t sequence) {
+
+    if (cdb->mapped_header == NULL) {
+        return false;
+    }
+
+    __sync_synchronize();
+
+    return _cdb_seq_load(cdb) != sequence;
+}
+
+/* Take the lock over the counter, unless the file lock already covers it.
+ * Called before the header is refreshed, so that what the last writer did
+ * is seen. */
+static int _cdb_seq_write_lock(cdb_t *cdb) {
+
+    struct flock fl;
+    int ret = CDB_SUCCESS;
+
+    if (cdb->locking || _cdb_is_writable(cdb) == false) {
+        return CDB_SUCCESS;
+    }
+
+    if (cdb_open(cdb) != CDB_SUCCESS) {
+        return cdb_error();
+    }
+
+    /* Nothing to share until there is a header */
+    _cdb_map_header(cdb);
+
+    if (cdb->mapped_header == NULL) {
+        return CDB_SUCCESS;
+    }
+
+    _cdb_seq_range(cdb, &fl, F_WRLCK);
+
+    if ((ret = _cdb_setlkw(cdb, &fl)) == CDB_SUCCESS) {
+        cdb->seq_locked = true;
+    }
+
+    return ret;
+}
+
+static void _cdb_seq_write_unlock(cdb_t *cdb) {
+
+    struct flock fl;
+
+    if (cdb->seq_locked) {
+        _cdb_seq_range(cdb, &fl, F_UNLCK);
+        _cdb_setlkw(cdb, &fl);
+        cdb->seq_locked = false;
+    }
+}
+
+static void _cdb_seq_write_begin(cdb_t *cdb) {
+
+    if (cdb->mapped_header == NULL || _cdb_is_writable(cdb) == false) {
+        return;
+    }
+
+    /* We have the counter to ourselves, so an odd one was left by a writer
+     * that died mid update. Moving that on by two keeps it odd while we
+     * work and still shows readers that caught it that it has changed. Our
+     * header follows along so it still counts as current for the update. */
+    cdb->header->sequence = __sync_add_and_fetch(cdb->mapped_sequence, (_cdb_seq_load(cdb) & 1) ? 2 : 1);
+
+    __sync_synchronize();
+}
+
+static void _cdb_seq_write_end(cdb_t *cdb) {
+
+    if (cdb->mapped_header == NULL || _cdb_is_writable(cdb) == false) {
+        return;
+    }
+
+    __sync_synchronize();
+
+    /* The header may only have been mapped during this update (when it was
+     * first written), in which case there is no write section to close. */
+    if ((_cdb_seq_load(cdb) & 1) == 0) {
+        cdb->header->sequence = _cdb_seq_load(cdb);
+        return;
+    }
+
+    /* Our own header is current, so remember the count we leave behind */
+    cdb->header->sequence = __sync_add_and_fetch(cdb->mapped_sequence, 1);
+}
+
+/* True if the in memory header still matches the file. */
+static bool _cdb_header_is_current(cdb_t *cdb) {
+
+    if (cdb->synced == false) {
+        return false;
+    }
+
+    if (cdb->mapped_header == NULL) {
+        return true;
+    }
+
+    return _cdb_seq_load(cdb) == cdb->header->sequence;
+}
+
+/* 2.0.0 header.
+ *
+ * Little endian, laid out by hand so no compiler padding gets in:
+ *
+ *    0  token[4]      "CDB"
+ *    4  version[6]    "2.0.0"
+ *   10  sequence      u16 in host order - it is only shared live, mapped
+ *   12  type          i32
+ *   16  max_records   u64
+ *   24  start_record  u64
+ *   32  num_records   u64
+ *   40  layout        u32
+ *   44  flags         u32
+ *   48  data_offset   u64
+ *   56  ext_size      u32, bytes of extensions after the fixed part
+ *   60  reserved      u32
+ *
+ * Each extension is a u16 tag, a u16 length and that many bytes of value, and
+ * only those that aren't the default are written. Everything fits in
+ * HEADER_SIZE bytes, so an open reads it with a single pread(). */
+static void _cdb_le16_put(unsigned char *p, uint16_t v) {
+    p[0] = (unsigned char)v;
+    p[1] = (unsigned char)(v >> 8);
+}
+
+void _cdb_le32_put(unsigned char *p, uint32_t v) {
+    _cdb_le16_put(p, (uint16_t)v);
+    _cdb_le16_put(p + 2, (uint16_t)(v >> 16));
+}
+
+void _cdb_le64_put(unsigned char *p, uint64_t v) {
+    _cdb_le32_put(p, (uint32_t)v);
+    _cdb_le32_put(p + 4, (uint32_t)(v >> 32));
+}
+
+static void _cdb_le_double_put(unsigned char *p, double v) {
+    uint64_t bits;
+
+    memcpy(&bits, &v, sizeof(bits));
+    _cdb_le64_put(p, bits);
+}
+
+static uint16_t _cdb_le16_get(const unsigned char *p) {
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+uint32_t _cdb_le32_get(const unsigned char *p) {
+    return _cdb_le16_get(p) | ((uint32_t)_cdb_le16_get(p + 2) << 16);
+}
+
+uint64_t _cdb_le64_get(const unsigned char *p) {
+    return _cdb_le32_get(p) | ((uint64_t)_cdb_le32_get(p + 4) << 32);
+}
+
+static double _cdb_le_double_get(const unsigned char *p) {
+    uint64_t bits = _cdb_le64_get(p);
+    double v;
+
+    memcpy(&v, &bits, sizeof(v));
+
+    return v;
+}
+
+static bool _cdb_tag_put(unsigned char *buffer, size_t size, size_t *pos, uint16_t tag, const void *value, size_t len) {
+
+    if (*pos + 4 + len > size) {
+        return false;
+    }
+
+    _cdb_le16_put(buffer + *pos, tag);
+    _cdb_le16_put(buffer + *pos + 2, (uint16_t)len);
+    memcpy(buffer + *pos + 4, value, len);
+
+    *pos += 4 + len;
+
+    return true;
+}
+
+/* Strings go without their NUL, and not at all if they are empty */
+static bool _cdb_tag_put_string(unsigned char *buffer, size_t size, size_t *pos, uint16_t tag,
+    const char *value, size_t field) {
+
+    size_t len = strnlen(value, field - 1);
+
+    return len == 0 || _cdb_tag_put(buffer, size, pos, tag, value, len);
+}
+
+static void _cdb_tag_get_string(char *field, size_t size, const unsigned char *value, size_t len) {
+
+    memset(field, 0, size);
+    memcpy(field, value, len < size - 1 ? len : size - 1);
+}
+
+/* Lay the header out in the size bytes of buffer. Returns false if the
+ * extensions don't fit. */
+static bool _cdb_header_encode(cdb_header_t *header, unsigned char *buffer, size_t size) {
+
+    unsigned char value[24];
+    size_t pos = CDB_HEADER_V2_FIXED;
+
+    memset(buffer, 0, size);
+
+    memcpy(buffer, header->token, sizeof(header->token));
+    memcpy(buffer + 4, header->version, sizeof(header->version));
+    memcpy(buffer + CDB_V2_SEQUENCE, &header->sequence, sizeof(header->sequence));
+    _cdb_le32_put(buffer + 12, (uint32_t)header->type);
+    _cdb_le64_put(buffer + 16, header->max_records);
+    _cdb_le64_put(buffer + 24, header->start_record);
+    _cdb_le64_put(buffer + 32, header->num_records);
+    _cdb_le32_put(buffer + 40, header->layout);
+    _cdb_le32_put(buffer + 44, header->flags);
+    _cdb_le64_put(buffer + 48, header->data_offset);
+
+    if (!_cdb_tag_put_string(buffer, size, &pos, CDB_TAG_NAME, header->name, sizeof(header->name)) ||
+        !_cdb_tag_put_string(buffer, size, &pos, CDB_TAG_DESC, header->desc, sizeof(header->desc)) ||
+        !_cdb_tag_put_string(buffer, size, &pos, CDB_TAG_UNITS, header->units, sizeof(header->units))) {
+        return false;
+    }
+
+    if (header->min_value != 0 || header->max_value != 0) {
+        _cdb_le_double_put(value, header->min_value);
+        _cdb_le_double_put(value + 8, header->max_value);
+
+        if (!_cdb_tag_put(buffer, size, &pos, CDB_TAG_RANGE, value, 16)) {
+            return false;
+        }
+    }
+
+    if (header->layout == CDB_LAYOUT_COMPRESSED) {
+        _cdb_le32_put(value, header->block_size);
+        _cdb_le32_put(value + 4, header->num_blocks);
+        _cdb_le64_put(value + 8, header->start_block);
+        _cdb_le64_put(value + 16, header->used_blocks);
+
+        if (!_cdb_tag_put(buffer, size, &pos, CDB_TAG_BLOCKS, value, 24)) {
+            return false;
+        }
+    }
+
+    if (header->layout == CDB_LAYOUT_IMPLICIT) {
+        _cdb_le64_put(value, (uint64_t)header->base_time);
+        _cdb_le64_put(value + 8, header->step);
+
+        if (!_cdb_tag_put(buffer, size, &pos, CDB_TAG_IMPLICIT, value, 16)) {
+            return false;
+        }
+    }
+
+    if (header->encoding != CDB_ENCODING_FLOAT64) {
+        _cdb_le32_put(value, header->encoding);
+        _cdb_le_double_put(value + 4, header->value_offset);
+        _cdb_le_double_put(value + 12, header->value_scale);
+
+        if (!_cdb_tag_put(buffer, size, &pos, CDB_TAG_ENCODING, value, 20)) {
+            return false;
+        }
+    }
+
+    _cdb_le32_put(buffer + 56, (uint32_t)(pos - CDB_HEADER_V2_FIXED));
+
+    return true;
+}
+
+/* The reverse, from the len bytes of buffer, which hold at least the fixed
+ * part and the extensions. */
+static int _cdb_header_decode(cdb_header_t *header, const unsigned char *buffer, size_t len) {
+
+    size_t pos = CDB_HEADER_V2_FIXED;
+    size_t end = CDB_HEADER_V2_FIXED + _cdb_le32_get(buffer + 56);
+
+    if (end > len) {
+        return CDB_ESANITY;
+    }
+
+    memset(header, 0, HEADER_SIZE);
+
+    memcpy(header->token, buffer, sizeof(header->token));
+    memcpy(header->version, buffer + 4, sizeof(header->version));
+    memcpy(&header->sequence, buffer + CDB_V2_SEQUENCE, sizeof(header->sequence));
+    header->type         = (int32_t)_cdb_le32_get(buffer + 12);
+    header->max_records  = _cdb_le64_get(buffer + 16);
+    header->start_record = _cdb_le64_get(buffer + 24);
+    header->num_records  = _cdb_le64_get(buffer + 32);
+    header->layout       = _cdb_le32_get(buffer + 40);
+    header->flags        = _cdb_le32_get(buffer + 44);
+    header->data_offset  = _cdb_le64_get(buffer + 48);
+    header->value_scale  = 1;
+
+    while (pos + 4 <= end) {
+        uint16_t tag = _cdb_le16_get(buffer + pos);
+        size_t size  = _cdb_le16_get(buffer + pos + 2);
+        const unsigned char *value = buffer + pos + 4;
+
+        if (pos + 4 + size > end) {
+            return CDB_ESANITY;
+        }
+
+        /* Fixed size values may grow at the end later on */
+        switch (tag) {
+            case CDB_TAG_NAME:
+                _cdb_tag_get_string(header->name, sizeof(header->name), value, size);
+                break;
+            case CDB_TAG_DESC:
+                _cdb_tag_get_string(header->desc, sizeof(header->desc), value, size);
+                break;
+            case CDB_TAG_UNITS:
+                _cdb_tag_get_string(header->units, sizeof(header->units), value, size);
+                break;
+            case CDB_TAG_RANGE:
+                if (size < 16) {
+                    return CDB_ESANITY;
+                }
+                header->min_value = _cdb_le_double_get(value);
+                header->max_value = _cdb_le_double_get(value + 8);
+                break;
+            case CDB_TAG_BLOCKS:
+                if (size < 24) {
+                    return CDB_ESANITY;
+                }
+                header->block_size  = _cdb_le32_get(value);
+                header->num_blocks  = _cdb_le32_get(value + 4);
+                header->start_block = _cdb_le64_get(value + 8);
+                header->used_blocks = _cdb_le64_get(value + 16);
+                break;
+            case CDB_TAG_IMPLICIT:
+                if (size < 16) {
+                    return CDB_ESANITY;
+                }
+                header->base_time = (cdb_time_t)_cdb_le64_get(value);
+                header->step      = _cdb_le64_get(value + 8);
+                break;
+            case CDB_TAG_ENCODING:
+                if (size < 20) {
+                    return CDB_ESANITY;
+                }
+                header->encoding     = _cdb_le32_get(value);
+                header->value_offset = _cdb_le_double_get(value + 4);
+                header->value_scale  = _cdb_le_double_get(value + 12);
+                break;
+            default:
+                if (tag & CDB_TAG_REQUIRED) {
+                    return CDB_EBADVER;
+                }
+                break;
+        }
+
+        pos += 4 + size;
+    }
+
+    return CDB_SUCCESS;
+}
+
+static int _cdb_read_header(cdb_t *cdb) {
+    struct stat st;
+    unsigned char buffer[HEADER_SIZE];
+    const char *version;
+    ssize_t got = 0;
+    uint16_t sequence = 0;
+    int retries = 0;
+    int ret = CDB_SUCCESS;
+
+    /* If the header has already been read from backing store and nobody has
+     * written to the file since, do not read again */
+    if (_cdb_header_is_current(cdb)) {
+        return CDB_SUCCESS;
+    }
+
+    if (cdb_open(cdb) != 0) {
+        return cdb_error();
+    }
+
+    _cdb_map_header(cdb);
+
+    do {
+
+        if (retries++ > CDB_SEQLOCK_RETRIES) {
+            return CDB_EBUSY;
+        }
+
+        if ((ret = _cdb_seq_read_begin(cdb, &sequence)) != CDB_SUCCESS) {
+            return ret;
+        }
+
+        /* Enough for any version of the header, in one go. A file too short
+         * for any header is no more a CDB than one with a bad token. */
+        if ((got = _cdb_pread(cdb, buffer, HEADER_SIZE, cdb->base)) < CDB_HEADER_V2_FIXED) {
+            return got < 0 ? cdb_error() : CDB_EBADTOK;
+        }
+
+        if (strncmp((char*)buffer, CDB_TOKEN, sizeof(CDB_TOKEN)) != 0) {
+            return CDB_EBADTOK;
+        }
+
+        version = (char*)buffer + offsetof(cdb_header_t, version);
+
+        if (strncmp(version, CDB_VERSION_1_1, sizeof(CDB_VERSION_1_1)) == 0) {
+
+            if (got < CDB_HEADER_V1_SIZE) {
+                return CDB_ESANITY;
+            }
+
+            memcpy(cdb->header, buffer, CDB_HEADER_V1_SIZE);
+            memset((char*)cdb->header + CDB_HEADER_V1_SIZE, 0, HEADER_SIZE - CDB_HEADER_V1_SIZE);
+
+            cdb->header->layout      = CDB_LAYOUT_ROWS;
+            cdb->header->data_offset = CDB_HEADER_V1_SIZE;
+
+        } else if (version[0] == CDB_VERSION[0] && version[1] == '.') {
+
+            /* Later minor versions only add extensions */
+            if ((ret = _cdb_header_decode(cdb->header, buffer, got)) != CDB_SUCCESS) {
+                return ret;
+            }
+
+        } else {
+            return CDB_EBADVER;
+        }
+
+        if (cdb->header->layout != CDB_LAYOUT_ROWS && cdb->header->layout != CDB_LAYOUT_COLUMNS &&
+            cdb->header->layout != CDB_LAYOUT_COMPRESSED && cdb->header->layout != CDB_LAYOUT_IMPLICIT) {
+            return CDB_EBADVER;
+        }
+
+        if (cdb->header->encoding > CDB_ENCODING_INT32) {
+            return CDB_EBADVER;
+        }
+
+        /* Calculate the number of records. Only rows grow the file as they
+         * go - other layouts keep the count in the header. */
+        if (cdb->header->layout == CDB_LAYOUT_COMPRESSED) {
+
+            if (cdb->header->block_size <= CDB_BLOCK_HEADER_SIZE || cdb->header->num_blocks == 0 ||
+                cdb->header->start_block >= cdb->header->num_blocks ||
+                cdb->header->used_blocks > cdb->header->num_blocks) {
+                return CDB_ESANITY;
+            }
+
+        } else if (cdb->header->layout != CDB_LAYOUT_ROWS) {
+
+            if (cdb->header->num_records > cdb->header->max_records ||
+                cdb->header->start_record >= cdb->header->max_records ||
+                (cdb->header->layout == CDB_LAYOUT_IMPLICIT && cdb->header->step == 0)) {
+                return CDB_ESANITY;
+            }
+
+        } else if (fstat(cdb->fd, &st) == 0 && st.st_size > cdb->header->data_offset) {
+            cdb->header->num_records = (st.st_size - cdb->header->data_offset) / RECORD_SIZE;
+        } else {
+            cdb->header->num_records = 0;
+        }
+
+    } while (_cdb_seq_read_retry(cdb, sequence));
+
+    cdb->header->sequence = sequence;
+    cdb->synced = true;
+
+    return CDB_SUCCESS;
+}
+
+/* Enough blocks for max_records at the budgeted size, and never fewer than
+ * two so there is always one to drop */
+static void _cdb_block_defaults(cdb_header_t *header) {
+
+    uint64_t per_block = (CDB_BLOCK_SIZE - CDB_BLOCK_HEADER_SIZE) / CDB_BLOCK_BYTES_PER_RECORD;
+
+    if (header->layout != CDB_LAYOUT_COMPRESSED || header->num_blocks != 0) {
+        return;
+    }
+
+    header->block_size = CDB_BLOCK_SIZE;
+    header->num_blocks = (uint32_t)((header->max_records + per_block - 1) / per_block) + 1;
+
+    if (header->num_blocks < 2) {
+        header->num_blocks = 2;
+    }
+}
+
+uint64_t _cdb_series_size(cdb_header_t *header) {
+
+    uint64_t checksums = 0;
+
+    _cdb_block_defaults(header);
+
+    if (header->flags & CDB_FLAG_CHECKSUMS) {
+        checksums = _cdb_checksum_chunks(header) * sizeof(uint32_t);
+    }
+
+    switch (header->layout) {
+        case CDB_LAYOUT_COLUMNS:
+            return HEADER_SIZE + (header->max_records * (sizeof(cdb_time_t) + _cdb_value_size(header))) + checksums;
+        case CDB_LAYOUT_COMPRESSED:
+            return HEADER_SIZE + ((uint64_t)header->num_blocks * header->block_size);
+        case CDB_LAYOUT_IMPLICIT:
+            return HEADER_SIZE + (header->max_records * _cdb_value_size(header)) + checksums;
+        default:
+            return 0;
+    }
+}
+
+static int _cdb_write_header(cdb_t *cdb) {
+
+    unsigned char buffer[HEADER_SIZE];
+    const void *data = buffer;
+    size_t size = HEADER_SIZE;
+
+    if (cdb->synced) {
+        return CDB_SUCCESS;
+    }
+
+    if (_cdb_is_writable(cdb) == false) {
+        return CDB_ERDONLY;
+    }
+
+    cdb->synced = false;
+
+    if (cdb_open(cdb) > 0) {
+        return cdb_error();
+    }
+
+    /* Don't clobber the live sequence count with our copy of it */
+    if (cdb->mapped_header != NULL) {
+        cdb->header->sequence = _cdb_seq_load(cdb);
+    }
+
+    /* Only layouts that keep values apart from times can narrow them */
+    if (cdb->header->encoding > CDB_ENCODING_INT32 ||
+        (cdb->header->encoding != CDB_ENCODING_FLOAT64 && cdb->header->layout != CDB_LAYOUT_COLUMNS &&
+         cdb->header->layout != CDB_LAYOUT_IMPLICIT) ||
+        (cdb->header->encoding >= CDB_ENCODING_INT16 && cdb->header->value_scale == 0)) {
+        return CDB_EINVAL;
+    }
+
+    /* The row layout has no checksums */
+    if ((cdb->header->flags & CDB_FLAG_CHECKSUMS) && cdb->header->layout == CDB_LAYOUT_ROWS) {
+        return CDB_EINVAL;
+    }
+
+    /* Without a step there is no telling where records go */
+    if (cdb->header->layout == CDB_LAYOUT_IMPLICIT && cdb->header->step == 0) {
+        return CDB_EINVAL;
+    }
+
+    /* Files already out there keep the header they were made with */
+    if (strncmp(cdb->header->version, CDB_VERSION_1_1, sizeof(CDB_VERSION_1_1)) == 0 &&
+        cdb->header->layout == CDB_LAYOUT_ROWS) {
+
+        cdb->header->data_offset = CDB_HEADER_V1_SIZE;
+        data = cdb->header;
+        size = CDB_HEADER_V1_SIZE;
+
+    } else {
+
+        if (cdb->header->data_offset < cdb->base + HEADER_SIZE) {
+            cdb->header->data_offset = cdb->base + HEADER_SIZE;
+        }
+
+        _cdb_block_defaults(cdb->header);
+
+        memset(cdb->header->version, 0, sizeof(cdb->header->version));
+        strncpy(cdb->header->version, CDB_VERSION, sizeof(cdb->header->version));
+
+        if (!_cdb_header_encode(cdb->header, buffer, sizeof(buffer))) {
+            return CDB_ESANITY;
+        }
+    }
+
+    if (_cdb_pwrite(cdb, data, size, cdb->base) != size) {
+        return cdb_error();
+    }
+
+    _cdb_map_header(cdb);
+
+    cdb->synced = true;
+
+    return CDB_SUCCESS;
+}
+
+/* Take the handle lock for reading, refreshing the in memory header first if
+ * it is out of date. The refresh itself needs the lock exclusively. The
+ * sequence the header was read at is returned, for _cdb_seq_read_retry(). */
+static int _cdb_rdlock(cdb_t *cdb, uint16_t *sequence) {
+
+    int ret = CDB_SUCCESS;
+
+    pthread_rwlock_rdlock(&cdb->lock);
+
+    if (_cdb_header_is_current(cdb)) {
+        *sequence = cdb->header->sequence;
+        return CDB_SUCCESS;
+    }
+
+    pthread_rwlock_unlock(&cdb->lock);
+    pthread_rwlock_wrlock(&cdb->lock);
+
+    ret = _cdb_read_header(cdb);
+
+    pthread_rwlock_unlock(&cdb->lock);
+
+    if (ret != CDB_SUCCESS) {
+        return ret;
+    }
+
+    pthread_rwlock_rdlock(&cdb->lock);
+
+    *sequence = cdb->header->sequence;
+
+    return CDB_SUCCESS;
+}
+
+int cdb_read_header(cdb_t *cdb) {
+
+    int ret = CDB_SUCCESS;
+
+    pthread_rwlock_wrlock(&cdb->lock);
+    ret = _cdb_read_header(cdb);
+    pthread_rwlock_unlock(&cdb->lock);
+
+    return ret;
+}
+
+int64_t _cdb_logical_record_for_time(cdb_t *cdb, cdb_time_t time) {
+
+    uint16_t sequence = 0;
+    int64_t logical_record = -1;
+
+    if (_cdb_rdlock(cdb, &sequence) != CDB_SUCCESS) {
+        return -1;
+    }
+
+    if (cdb->header->num_records > 0 &&
+        (cdb->header->layout == CDB_LAYOUT_ROWS || cdb->header->layout == CDB_LAYOUT_COLUMNS)) {
+        logical_record = _logical_record_for_time(cdb, time, 0, 0);
+    }
+
+    pthread_rwlock_unlock(&cdb->lock);
+
+    return logical_record;
+}
+
+/* Whether the file we have open is no longer the one at our path - a new
+ * one was renamed over it, as cdb_convert and cdb_repair do. */
+static bool _cdb_file_replaced(cdb_t *cdb) {
+
+    struct stat ours;
+    struct stat path;
+
+    CDB_STAT_ADD(cdb, syscalls, 2);
+
+    if (fstat(cdb->fd, &ours) != 0) {
+        return false;
+    }
+
+    /* With nothing at the path at all there is nothing better to write to */
+    if (stat(cdb->filename, &path) != 0) {
+        return false;
+    }
+
+    return ours.st_nlink == 0 || ours.st_dev != path.st_dev || ours.st_ino != path.st_ino;
+}
+
+/* Advisory write lock on the whole file, or on the series' header in a
+ * container. OFD locks belong to the open file description, so separate
+ * handles exclude each other even within a process; plain POSIX locks are per
+ * process and only keep other processes out. */
+static int _cdb_file_lock(cdb_t *cdb, short type) {
+
+    struct flock fl;
+    int retries = 0;
+    int ret = CDB_SUCCESS;
+
+    if (cdb_open(cdb) != CDB_SUCCESS) {
+        return cdb_error();
+    }
+
+    memset(&fl, 0, sizeof(fl));
+
+    fl.l_type   = type;
+    fl.l_whence = SEEK_SET;
+    fl.l_start  = cdb->base;
+    fl.l_len    = cdb->container != NULL ? HEADER_SIZE : 0;
+
+    if ((ret = _cdb_setlkw(cdb, &fl)) != CDB_SUCCESS) {
+        return ret;
+    }
+
+    /* Whoever held the lock may have swapped a new file in while we waited.
+     * The lock we got is on the old one, and anything written to it now is
+     * lost, so open the new one and lock that instead. A container's file
+     * is never swapped under its series. */
+    while (type != F_UNLCK && cdb->container == NULL && _cdb_file_replaced(cdb)) {
+
+        if (retries++ > CDB_SEQLOCK_RETRIES) {
+            return CDB_EBUSY;
+        }
+
+        if (cdb->mapped_header != NULL) {
+            munmap(cdb->mapped_header, CDB_HEADER_V1_SIZE);
+            cdb->mapped_header   = NULL;
+            cdb->mapped_sequence = NULL;
+        }
+
+        /* Closing it lets go of the lock on the old file. The new one is
+         * there already, and mustn't be truncated. */
+        close(cdb->fd);
+        cdb->fd     = -1;
+        cdb->flags &= ~(O_CREAT|O_EXCL|O_TRUNC);
+        cdb->synced = false;
+
+        if (cdb_open(cdb) != CDB_SUCCESS) {
+            return cdb_error();
+        }
+
+        if ((ret = _cdb_setlkw(cdb, &fl)) != CDB_SUCCESS) {
+            return ret;
+        }
+    }
+
+    return CDB_SUCCESS;
+}
+
+/* Start an update: take the handle lock, the file lock as well if locking is
+ * on and no cdb_lock() group already holds it, optionally bring the header up
+ * to date with what other writers did, and open the seqlock write section. */
+static int _cdb_update_begin(cdb_t *cdb, bool refresh) {
+
+    int ret = CDB_SUCCESS;
+    bool file_lock;
+
+    pthread_rwlock_wrlock(&cdb->lock);
+
+    file_lock = cdb->locking && cdb->lock_depth == 0;
+
+    if (file_lock && (ret = _cdb_file_lock(cdb, F_WRLCK)) != CDB_SUCCESS) {
+        pthread_rwlock_unlock(&cdb->lock);
+        return ret;
+    }
+
+    if ((ret = _cdb_seq_write_lock(cdb)) != CDB_SUCCESS) {
+
+        if (file_lock) {
+            _cdb_file_lock(cdb, F_UNLCK);
+        }
+
+        pthread_rwlock_unlock(&cdb->lock);
+        return ret;
+    }
+
+    if (refresh) {
+
+        /* Under the file lock the header has to be re-read if anyone else
+         * may have written - without the mapped sequence we can't tell. */
+        if (file_lock && cdb->mapped_header == NULL) {
+            cdb->synced = false;
+        }
+
+        if ((ret = _cdb_read_header(cdb)) != CDB_SUCCESS) {
+
+            _cdb_seq_write_unlock(cdb);
+
+            if (file_lock) {
+                _cdb_file_lock(cdb, F_UNLCK);
+            }
+
+            pthread_rwlock_unlock(&cdb->lock);
+            return ret;
+        }
+    }
+
+    _cdb_seq_write_begin(cdb);
+
+    return CDB_SUCCESS;
+}
+
+static void _cdb_update_end(cdb_t *cdb) {
+
+    _cdb_seq_write_end(cdb);
+    _cdb_seq_write_unlock(cdb);
+
+    if (cdb->locking && cdb->lock_depth == 0) {
+        _cdb_file_lock(cdb, F_UNLCK);
+    }
+
+    pthread_rwlock_unlock(&cdb->lock);
+}
+
+int cdb_write_header(cdb_t *cdb) {
+
+    int ret = CDB_SUCCESS;
+
+    if ((ret = _cdb_update_begin(cdb, false)) != CDB_SUCCESS) {
+        return ret;
+    }
+
+    ret = _cdb_write_header(cdb);
+
+    _cdb_update_end(cdb);
+
+    return ret;
+}
+
+int cdb_lock(cdb_t *cdb) {
+
+    int ret = CDB_SUCCESS;
+
+    pthread_rwlock_wrlock(&cdb->lock);
+
+    if (cdb->lock_depth == 0) {
+        ret = _cdb_file_lock(cdb, F_WRLCK);
+
+        /* Whatever happened before we held the lock, we need to see it */
+        if (ret == CDB_SUCCESS && cdb->mapped_header == NULL) {
+            cdb->synced = false;
+        }
+    }
+
+    if (ret == CDB_SUCCESS) {
+        cdb->lock_depth += 1;
+    }
+
+    pthread_rwlock_unlock(&cdb->lock);
+
+    return ret;
+}
+
+int cdb_unlock(cdb_t *cdb) {
+
+    int ret = CDB_SUCCESS;
+
+    pthread_rwlock_wrlock(&cdb->lock);
+
+    if (cdb->lock_depth > 0 && --cdb->lock_depth == 0) {
+        ret = _cdb_file_lock(cdb, F_UNLCK);
+    }
+
+    pthread_rwlock_unlock(&cdb->lock);
+
+    return ret;
+}
+
+void cdb_print_header(cdb_t * cdb) {
+
+    printf("version: [%s]\n", cdb->header->version);
+    printf("name: [%s]\n", cdb->header->name);
+    printf("desc: [%s]\n", cdb->header->desc);
+    printf("units: [%s]\n", cdb->header->units);
+
+    if (cdb->header->type == CDB_TYPE_COUNTER) {
+        printf("type: [COUNTER]\n");
+    }
+
+    if (cdb->header->type == CDB_TYPE_GAUGE) {
+        printf("type: [GAUGE]\n");
+    }
+
+    printf("min_value: [%g]\n", cdb->header->min_value);
+    printf("max_value: [%g]\n", cdb->header->max_value);
+    printf("max_records: [%"PRIu64"]\n", cdb->header->max_records);
+    printf("num_records: [%"PRIu64"]\n", cdb->header->num_records);
+    printf("start_record: [%"PRIu64"]\n", cdb->header->start_record);
+
+    if (cdb->header->layout == CDB_LAYOUT_COLUMNS) {
+        printf("layout: [COLUMNS]\n");
+    } else if (cdb->header->layout == CDB_LAYOUT_COMPRESSED) {
+        printf("layout: [COMPRESSED]\n");
+        printf("block_size: [%"PRIu32"]\n", cdb->header->block_size);
+        printf("num_blocks: [%"PRIu32"]\n", cdb->header->num_blocks);
+        printf("used_blocks: [%"PRIu64"]\n", cdb->header->used_blocks);
+    } else if (cdb->header->layout == CDB_LAYOUT_IMPLICIT) {
+        printf("layout: [IMPLICIT]\n");
+        printf("base_time: [%"PRId64"]\n", cdb->header->base_time);
+        printf("step: [%"PRIu64"]\n", cdb->header->step);
+    } else {
+        printf("layout: [ROWS]\n");
+    }
+
+    if (cdb->header->encoding == CDB_ENCODING_FLOAT32) {
+        printf("encoding: [FLOAT32]\n");
+    } else if (cdb->header->encoding == CDB_ENCODING_INT16 || cdb->header->encoding == CDB_ENCODING_INT32) {
+        printf("encoding: [%s]\n", cdb->header->encoding == CDB_ENCODING_INT16 ? "INT16" : "INT32");
+        printf("value_offset: [%g]\n", cdb->header->value_offset);
+        printf("value_scale: [%g]\n", cdb->header->value_scale);
+    } else {
+        printf("encoding: [FLOAT64]\n");
+    }
+
+    if (cdb->header->flags & CDB_FLAG_CHECKSUMS) {
+        printf("checksums: [CRC32C]\n");
+    }
+}
+
+/* Compressed layout.
+ *
+ * Records live in a ring of num_blocks blocks of block_size bytes, each a
+ * cdb_block_header_t followed by a Gorilla stream (see circulardb_compress.c).
+ * Writes append to the tail block and start a new one when it is full. The
+ * oldest block is dropped when the ring has gone all the way round, or as
+ * soon as the blocks after it hold max_records on their own - so a file
+ * keeps the last max_records records (give or take a block) as long as they
+ * compress to the budget, and fewer if they don't.
+ *
+ * The block headers hold each block's first and last time, so reads only
+ * decode the blocks that overlap the request. */
+static off_t _cdb_block_offset(cdb_header_t *header, uint64_t nth) {
+
+    uint64_t block = (header->start_block + nth) % header->num_blocks;
+
+    return header->data_offset + (block * header->block_size);
+}
+
+/* nth counts from the oldest block. */
+static int _cdb_block_read_header(cdb_t *cdb, uint64_t nth, cdb_block_header_t *block) {
+
+    if (_cdb_pread(cdb, block, CDB_BLOCK_HEADER_SIZE, _cdb_block_offset(cdb->header, nth)) != CDB_BLOCK_HEADER_SIZE) {
+        return cdb_error();
+    }
+
+    return CDB_SUCCESS;
+}
+
+/* CRC32C of a whole block, with its crc field counted as zero. */
+static uint32_t _cdb_block_crc(cdb_t *cdb, unsigned char *buffer) {
+
+    cdb_block_header_t *block = (cdb_block_header_t*)buffer;
+    uint32_t stored = block->crc;
+    uint32_t crc;
+
+    block->crc = 0;
+    crc = _cdb_crc32c(0, buffer, cdb->header->block_size);
+    block->crc = stored;
+
+    return crc;
+}
+
+/* With verify, a block that doesn't match its checksum is CDB_ECHECKSUM. */
+static int _cdb_block_read(cdb_t *cdb, uint64_t nth, unsigned char *buffer, bool verify) {
+
+    if (_cdb_pread(cdb, buffer, cdb->header->block_size, _cdb_block_offset(cdb->header, nth)) != cdb->header->block_size) {
+        return cdb_error();
+    }
+
+    if (verify && (cdb->header->flags & CDB_FLAG_CHECKSUMS) &&
+        _cdb_block_crc(cdb, buffer) != ((cdb_block_header_t*)buffer)->crc) {
+        return CDB_ECHECKSUM;
+    }
+
+    return CDB_SUCCESS;
+}
+
+static int _cdb_block_write(cdb_t *cdb, uint64_t nth, unsigned char *buffer) {
+
+    if (cdb->header->flags & CDB_FLAG_CHECKSUMS) {
+        ((cdb_block_header_t*)buffer)->crc = _cdb_block_crc(cdb, buffer);
+    }
+
+    if (_cdb_pwrite(cdb, buffer, cdb->header->block_size, _cdb_block_offset(cdb->header, nth)) != cdb->header->block_size) {
+        return cdb_error();
+    }
+
+    return CDB_SUCCESS;
+}
+
+static int _cdb_block_drop_oldest(cdb_t *cdb) {
+
+    cdb_block_header_t block;
+
+    if (_cdb_block_read_header(cdb, 0, &block) != CDB_SUCCESS) {
+        return cdb_error();
+    }
+
+    cdb->header->num_records -= block.count;
+    cdb->header->start_block  = (cdb->header->start_block + 1) % cdb->header->num_blocks;
+    cdb->header->used_blocks -= 1;
+
+    return CDB_SUCCESS;
+}
+
+/* Make the block after the tail the new, empty, tail. */
+static int _cdb_block_next(cdb_t *cdb) {
+
+    if (cdb->header->used_blocks == cdb->header->num_blocks && _cdb_block_drop_oldest(cdb) != CDB_SUCCESS) {
+        return cdb_error();
+    }
+
+    cdb->header->used_blocks += 1;
+
+    /* Keep no more whole blocks than max_records needs */
+    while (cdb->header->used_blocks > 2) {
+        cdb_block_header_t block;
+
+        if (_cdb_block_read_header(cdb, 0, &block) != CDB_SUCCESS) {
+            return cdb_error();
+        }
+
+        if (cdb->header->num_records - block.count < cdb->header->max_records) {
+            break;
+        }
+
+        if (_cdb_block_drop_oldest(cdb) != CDB_SUCCESS) {
+            return cdb_error();
+        }
+    }
+
+    return CDB_SUCCESS;
+}
+
+static int _cdb_compressed_write_records(cdb_t *cdb, cdb_record_t *records, uint64_t len) {
+
+    uint64_t capacity = cdb->header->block_size - CDB_BLOCK_HEADER_SIZE;
+    unsigned char *buffer;
+    cdb_block_header_t *block;
+    uint64_t i = 0;
+    int ret = CDB_SUCCESS;
+
+    CDB_STAT_ADD(cdb, allocations, 1);
+
+    if ((buffer = calloc(1, cdb->header->block_size)) == NULL) {
+        return CDB_ENOMEM;
+    }
+
+    block = (cdb_block_header_t*)buffer;
+
+    if (cdb->header->used_blocks == 0) {
+        cdb->header->used_blocks = 1;
+        _cdb_block_init(block);
+
+    } else if ((ret = _cdb_block_read(cdb, cdb->header->used_blocks - 1, buffer, true)) != CDB_SUCCESS) {
+
+        /* Leave a damaged tail as it is, rather than checksum the damage
+         * over again, and carry on in a new block */
+        if (ret != CDB_ECHECKSUM || (ret = _cdb_block_next(cdb)) != CDB_SUCCESS) {
+            free(buffer);
+            return ret;
+        }
+
+        memset(buffer, 0, cdb->header->block_size);
+        _cdb_block_init(block);
+    }
+
+    for (i = 0; i < len; i++) {
+
+        if (_cdb_block_append(block, buffer + CDB_BLOCK_HEADER_SIZE, capacity, records[i].time, records[i].value)) {
+            cdb->header->num_records += 1;
+            continue;
+        }
+
+        /* The tail is full */
+        if ((ret = _cdb_block_write(cdb, cdb->header->used_blocks - 1, buffer)) != CDB_SUCCESS ||
+            (ret = _cdb_block_next(cdb)) != CDB_SUCCESS) {
+            break;
+        }
+
+        memset(buffer, 0, cdb->header->block_size);
+        _cdb_block_init(block);
+
+        if (!_cdb_block_append(block, buffer + CDB_BLOCK_HEADER_SIZE, capacity, records[i].time, records[i].value)) {
+            ret = CDB_ESANITY;
+            break;
+        }
+
+        cdb->header->num_records += 1;
+    }
+
+    if (ret == CDB_SUCCESS) {
+        ret = _cdb_block_write(cdb, cdb->header->used_blocks - 1, buffer);
+    }
+
+    free(buffer);
+
+    return ret;
+}
+
+/* Decode the nth block into records, leaving the raw block in buffer. */
+static int _cdb_block_load(cdb_t *cdb, uint64_t nth, unsigned char *buffer, cdb_record_t *records) {
+
+    int ret = _cdb_block_read(cdb, nth, buffer, true);
+
+    if (ret != CDB_SUCCESS) {
+        return ret;
+    }
+
+    if (((cdb_block_header_t*)buffer)->count > CDB_BLOCK_MAX_RECORDS(cdb->header->block_size)) {
+        return CDB_ESANITY;
+    }
+
+    _cdb_block_decode((cdb_block_header_t*)buffer, buffer + CDB_BLOCK_HEADER_SIZE, records);
+
+    CDB_STAT_ADD(cdb, records_decoded, ((cdb_block_header_t*)buffer)->count);
+
+    return CDB_SUCCESS;
+}
+
+/* Encode records back into the nth block after an update. */
+static int _cdb_block_store(cdb_t *cdb, uint64_t nth, unsigned char *buffer, cdb_record_t *records, uint32_t count) {
+
+    cdb_block_header_t *block = (cdb_block_header_t*)buffer;
+    uint32_t i = 0;
+
+    memset(buffer, 0, cdb->header->block_size);
+    _cdb_block_init(block);
+
+    for (i = 0; i < count; i++) {
+
+        if (!_cdb_block_append(block, buffer + CDB_BLOCK_HEADER_SIZE,
+                cdb->header->block_size - CDB_BLOCK_HEADER_SIZE, records[i].time, records[i].value)) {
+            return CDB_ENOSPACE;
+        }
+    }
+
+    return _cdb_block_write(cdb, nth, buffer);
+}
+
+/* Update values in place, or discard them (set them to NaN) if records is
+ * NULL, for records with times from start to end. */
+static int _cdb_compressed_update(cdb_t *cdb, cdb_record_t *records, uint64_t len,
+    cdb_time_t start, cdb_time_t end, uint64_t *num_recs) {
+
+    unsigned char *buffer = malloc(cdb->header->block_size);
+    cdb_record_t *decoded = malloc(CDB_BLOCK_MAX_RECORDS(cdb->header->block_size) * RECORD_SIZE);
+    uint64_t nth = 0;
+    int ret = CDB_SUCCESS;
+
+    CDB_STAT_ADD(cdb, allocations, 2);
+
+    if (buffer == NULL || decoded == NULL) {
+        free(buffer);
+        free(decoded);
+        return CDB_ENOMEM;
+    }
+
+    for (nth = 0; nth < cdb->header->used_blocks && ret == CDB_SUCCESS; nth++) {
+        cdb_block_header_t block;
+        uint64_t changed = 0;
+        uint64_t i = 0;
+        uint32_t j = 0;
+
+        if ((ret = _cdb_block_read_header(cdb, nth, &block)) != CDB_SUCCESS) {
+            break;
+        }
+
+        if (block.count == 0 || block.last_time < start || block.first_time > end) {
+            continue;
+        }
+
+        if ((ret = _cdb_block_load(cdb, nth, buffer, decoded)) != CDB_SUCCESS) {
+            break;
+        }
+
+        for (j = 0; j < block.count; j++) {
+
+            if (records == NULL) {
+
+                if (decoded[j].time >= start && decoded[j].time <= end) {
+                    decoded[j].value = CDB_NAN;
+                    changed += 1;
+                }
+
+                continue;
+            }
+
+            for (i = 0; i < len; i++) {
+
+                if (decoded[j].time == records[i].time) {
+                    decoded[j].value = records[i].value;
+                    changed += 1;
+                }
+            }
+        }
+
+        if (changed > 0) {
+            ret = _cdb_block_store(cdb, nth, buffer, decoded, block.count);
+            *num_recs += changed;
+        }
+    }
+
+    free(buffer);
+    free(decoded);
+
+    return ret;
+}
+
+/* Implicit layout.
+ *
+ * The file holds max_records values in a ring, like the column layout without
+ * its times: logical slot n, counted from start_record, is the record for
+ * base_time + n * step. Slots that were skipped over hold a gap marker, so
+ * finding the record for a time is arithmetic and no time is ever read. */
+
+static uint64_t _cdb_slot_physical(cdb_header_t *header, uint64_t slot) {
+
+    return (header->start_record + slot) % header->max_records;
+}
+
+/* Read the values of len slots, starting at logical slot. */
+static int _cdb_slot_pread(cdb_t *cdb, uint64_t slot, uint64_t len, double *values) {
+
+    uint64_t physical = _cdb_slot_physical(cdb->header, slot);
+    uint64_t first    = cdb->header->max_records - physical;
+
+    if (first > len) {
+        first = len;
+    }
+
+    if (_cdb_pread_values(cdb, physical, first, values) != CDB_SUCCESS) {
+        return cdb_error();
+    }
+
+    /* The rest wrapped around to the start of the ring */
+    if (len > first && _cdb_pread_values(cdb, 0, len - first, &values[first]) != CDB_SUCCESS) {
+        return cdb_error();
+    }
+
+    CDB_STAT_ADD(cdb, records_decoded, len);
+
+    return CDB_SUCCESS;
+}
+
+/* Values on their way to physically contiguous slots, so a run of writes is
+ * a single pwrite() */
+typedef struct {
+    uint64_t physical;
+    uint64_t len;
+    double values[CDB_COLUMN_CHUNK];
+} cdb_slot_run_t;
+
+static int _cdb_slot_flush(cdb_t *cdb, cdb_slot_run_t *run) {
+
+    if (run->len > 0 && _cdb_pwrite_values(cdb, run->physical, run->len, run->values) != CDB_SUCCESS) {
+        return cdb_error();
+    }
+
+    run->len = 0;
+
+    return CDB_SUCCESS;
+}
+
+/* Queue a value for logical slot, writing out the run first if the slot
+ * doesn't follow on from it. */
+static int _cdb_slot_put(cdb_t *cdb, cdb_slot_run_t *run, uint64_t slot, double value) {
+
+    uint64_t physical = _cdb_slot_physical(cdb->header, slot);
+
+    if (run->len > 0 && (physical != run->physical + run->len || run->len == CDB_COLUMN_CHUNK) &&
+        _cdb_slot_flush(cdb, run) != CDB_SUCCESS) {
+        return cdb_error();
+    }
+
+    if (run->len == 0) {
+        run->physical = physical;
+    }
+
+    run->values[run->len++] = value;
+
+    return CDB_SUCCESS;
+}
+
+/* The slots from the first at or after start to the last at or before end,
+ * where 0 is no limit. Returns false if there are none. */
+static bool _cdb_slots_for_times(cdb_header_t *header, cdb_time_t start, cdb_time_t end,
+    uint64_t *first, uint64_t *last) {
+
+    cdb_time_t newest;
+
+    if (header->num_records == 0) {
+        return false;
+    }
+
+    newest = header->base_time + (cdb_time_t)((header->num_records - 1) * header->step);
+
+    if ((start != 0 && start > newest) || (end != 0 && end < header->base_time)) {
+        return false;
+    }
+
+    *first = 0;
+    *last  = header->num_records - 1;
+
+    if (start > header->base_time) {
+        *first = ((uint64_t)(start - header->base_time) + header->step - 1) / header->step;
+    }
+
+    if (end != 0 && end < newest) {
+        *last = (uint64_t)(end - header->base_time) / header->step;
+    }
+
+    return *first <= *last;
+}
+
+static int _cdb_implicit_write_records(cdb_t *cdb, cdb_record_t *records, uint64_t len, uint64_t *num_recs) {
+
+    cdb_header_t *header = cdb->header;
+    cdb_slot_run_t run;
+    uint64_t i = 0;
+    int ret = CDB_SUCCESS;
+
+    run.len = 0;
+
+    for (i = 0; i < len && ret == CDB_SUCCESS; i++) {
+
+        cdb_time_t time = records[i].time;
+        uint64_t slot;
+
+        if (header->num_records == 0) {
+            header->base_time = time;
+        }
+
+        /* Older than anything the ring holds */
+        if (time < header->base_time) {
+            continue;
+        }
+
+        slot = (uint64_t)(time - header->base_time) / header->step;
+
+        /* So far ahead that none of what is held would be kept */
+        if (slot >= header->num_records + header->max_records) {
+            header->base_time  += (cdb_time_t)(slot * header->step);
+            header->num_records = 0;
+            slot = 0;
+        }
+
+        /* Drop the oldest slots to make room */
+        if (slot >= header->max_records) {
+            uint64_t drop = slot - header->max_records + 1;
+
+            header->start_record = (header->start_record + drop) % header->max_records;
+            header->base_time   += (cdb_time_t)(drop * header->step);
+            header->num_records -= drop;
+            slot -= drop;
+        }
+
+        /* Mark whatever was skipped over */
+        while (header->num_records < slot && ret == CDB_SUCCESS) {
+            ret = _cdb_slot_put(cdb, &run, header->num_records, _cdb_gap());
+            header->num_records += 1;
+        }
+
+        if (ret == CDB_SUCCESS && (ret = _cdb_slot_put(cdb, &run, slot, records[i].value)) == CDB_SUCCESS) {
+
+            if (slot == header->num_records) {
+                header->num_records += 1;
+            }
+
+            *num_recs += 1;
+        }
+    }
+
+    if (ret == CDB_SUCCESS) {
+        ret = _cdb_slot_flush(cdb, &run);
+    }
+
+    return ret;
+}
+
+/* Update values in place, or discard them (set them to NaN) if records is
+ * NULL, for records with times from start to end. Gaps stay gaps. */
+static int _cdb_implicit_update(cdb_t *cdb, cdb_record_t *records, uint64_t len,
+    cdb_time_t start, cdb_time_t end, uint64_t *num_recs) {
+
+    cdb_header_t *header = cdb->header;
+    cdb_slot_run_t run;
+    double values[CDB_COLUMN_CHUNK];
+    uint64_t first = 0;
+    uint64_t last  = 0;
+    uint64_t i = 0;
+    int ret = CDB_SUCCESS;
+
+    run.len = 0;
+
+    for (i = 0; i < len && ret == CDB_SUCCESS; i++) {
+        uint64_t slot;
+
+        if (records[i].time < header->base_time) {
+            continue;
+        }
+
+        slot = (uint64_t)(records[i].time - header->base_time) / header->step;
+
+        if (slot >= header->num_records) {
+            continue;
+        }
+
+        /* Earlier updates may still be queued */
+        if ((ret = _cdb_slot_flush(cdb, &run)) != CDB_SUCCESS ||
+            (ret = _cdb_slot_pread(cdb, slot, 1, values)) != CDB_SUCCESS) {
+            break;
+        }
+
+        if (!_cdb_is_gap(values[0]) && (ret = _cdb_slot_put(cdb, &run, slot, records[i].value)) == CDB_SUCCESS) {
+            *num_recs += 1;
+        }
+    }
+
+    if (records == NULL && _cdb_slots_for_times(header, start, end, &first, &last)) {
+
+        while (first <= last && ret == CDB_SUCCESS) {
+            uint64_t chunk = last - first + 1 > CDB_COLUMN_CHUNK ? CDB_COLUMN_CHUNK : last - first + 1;
+
+            if ((ret = _cdb_slot_pread(cdb, first, chunk, values)) != CDB_SUCCESS) {
+                break;
+            }
+
+            for (i = 0; i < chunk && ret == CDB_SUCCESS; i++) {
+
+                if (!_cdb_is_gap(values[i]) && (ret = _cdb_slot_put(cdb, &run, first + i, CDB_NAN)) == CDB_SUCCESS) {
+                    *num_recs += 1;
+                }
+            }
+
+            first += chunk;
+        }
+    }
+
+    if (ret == CDB_SUCCESS) {
+        ret = _cdb_slot_flush(cdb, &run);
+    }
+
+    return ret;
+}
+
+static int _cdb_write_records(cdb_t *cdb, cdb_record_t *records, uint64_t len, uint64_t *num_recs) {
+
+    /* read old header if it exists.
+       write a header out, since the db may not have existed.
+    */
+    uint64_t i   = 0;
+    uint64_t j   = 0;
+    *num_recs    = 0;
+
+    if (_cdb_read_header(cdb) != CDB_SUCCESS) {
+        return cdb_error();
+    }
+
+    if (_cdb_is_writable(cdb) == false) {
+        return CDB_ERDONLY;
+    }
+
+    if (cdb->header->max_records <= 0) {
+        return CDB_EINVMAX;
+    }
+
+    if (cdb->header->layout == CDB_LAYOUT_COMPRESSED) {
+        int ret = _cdb_compressed_write_records(cdb, records, len);
+
+        /* Whatever made it into blocks is counted, even on failure */
+        cdb->synced = false;
+
+        if (_cdb_write_header(cdb) != CDB_SUCCESS && ret == CDB_SUCCESS) {
+            ret = cdb_error();
+        }
+
+        if (ret == CDB_SUCCESS) {
+            *num_recs = len;
+        }
+
+        return ret;
+    }
+
+    if (cdb->header->layout == CDB_LAYOUT_IMPLICIT) {
+        int ret = _cdb_implicit_write_records(cdb, records, len, num_recs);
+
+        cdb->synced = false;
+
+        if (_cdb_write_header(cdb) != CDB_SUCCESS && ret == CDB_SUCCESS) {
+            ret = cdb_error();
+        }
+
+        return ret;
+    }
+
+    /* Logic for writes:
+    cdb is 5 records.
+        try to write 7 records
+        len = 7
+        len + 0 > 5
+        j = (7 + 0) - 5
+        j = 2
+        i = 7 - 2
+        i = 5
+
+        need to write j records at physical record: cdb->header->start_record
+        index into records is i
+
+        need to write i records at physical record: cdb->header->num_records
+        index into records is 0;
+    */
+
+    /* Calculate our indicies into the records array. */
+    if (len + cdb->header->num_records >= cdb->header->max_records) {
+        j = (len + cdb->header->num_records) - cdb->header->max_records;
+        i = (len - j);
+    } else {
+        i = len;
+    }
+
+    /* Normal case. These are older than the wrapped records, so they go
+       first and lose wherever a write longer than the ring laps it. */
+    if (i > 0) {
+        uint64_t physical_record = cdb->header->num_records;
+
+        cdb->header->num_records += i;
+
+        if (_cdb_pwrite_records(cdb, physical_record, i, &records[0]) != CDB_SUCCESS) {
+            return cdb_error();
+        }
+
+        /* Only rows can count their records from the size of the file */
+        if (cdb->header->layout != CDB_LAYOUT_ROWS) {
+            cdb->synced = false;
+
+            if (_cdb_write_header(cdb) != CDB_SUCCESS) {
+                return cdb_error();
+            }
+        }
+    }
+
+    /* If we need to wrap around */
+    if (j > 0) {
+
+        uint64_t physical_record = cdb->header->start_record;
+        uint64_t max_records     = cdb->header->max_records;
+        cdb_record_t *wrapped    = &records[i];
+        uint64_t first           = 0;
+
+        cdb->header->start_record += j;
+        cdb->header->start_record %= max_records;
+
+        /* Only the newest max_records of a longer write survive. The ones
+           skipped would have been overwritten in the same slots. */
+        if (j > max_records) {
+            physical_record = (physical_record + j - max_records) % max_records;
+            wrapped += j - max_records;
+            j = max_records;
+        }
+
+        /* Nothing may be written past the end of the ring - the columns
+           layout keeps the values and checksums there. */
+        first = j < max_records - physical_record ? j : max_records - physical_record;
+
+        if (_cdb_pwrite_records(cdb, physical_record, first, wrapped) != CDB_SUCCESS) {
+            return cdb_error();
+        }
+
+        if (first < j && _cdb_pwrite_records(cdb, 0, j - first, &wrapped[first]) != CDB_SUCCESS) {
+            return cdb_error();
+        }
+
+        cdb->synced = false;
+
+        /* start_record is no longer 0, so update the header */
+        if (_cdb_write_header(cdb) != CDB_SUCCESS) {
+            return cdb_error();
+        }
+    }
+
+    *num_recs += len;
+
+#ifdef DEBUG
+    printf("write_records: wrote [%"PRIu64"] records\n", *num_recs);
+#endif
+
+    return CDB_SUCCESS;
+}
+
+int cdb_write_records(cdb_t *cdb, cdb_record_t *records, uint64_t len, uint64_t *num_recs) {
+
+    int ret = CDB_SUCCESS;
+
+    CDB_STAT_START(started);
+    CDB_PROBE4(write_records_entry, cdb->filename, len,
+        len > 0 ? records[0].time : 0, len > 0 ? records[len - 1].time : 0);
+
+    if ((ret = _cdb_update_begin(cdb, true)) == CDB_SUCCESS) {
+
+        ret = _cdb_write_records(cdb, records, len, num_recs);
+
+        _cdb_update_end(cdb);
+    }
+
+    CDB_PROBE3(write_records_return, cdb->filename, ret, ret == CDB_SUCCESS ? *num_recs : 0);
+    CDB_HISTOGRAM_SINCE(CDB_OP_WRITE, started);
+
+    return ret;
+}
+
+bool cdb_write_record(cdb_t *cdb, cdb_time_t time, double value) {
+
+    cdb_record_t record[RECORD_SIZE];
+    uint64_t num_recs = 0;
+
+    record->time  = time;
+    record->value = value;
+
+    if (cdb_write_records(cdb, record, 1, &num_recs) != CDB_SUCCESS) {
+        return false;
+    }
+
+    return true;
+}
+
+static int _cdb_update_records(cdb_t *cdb, cdb_record_t *records, uint64_t len, uint64_t *num_recs) {
+
+    int ret    = CDB_SUCCESS;
+    *num_recs  = 0;
+    uint64_t i = 0;
+
+    if (_cdb_read_header(cdb) != CDB_SUCCESS) {
+        return cdb_error();
+    }
+
+    if (_cdb_is_writable(cdb) == false) {
+        return CDB_ERDONLY;
+    }
+
+#ifdef DEBUG
+    printf("in update_records with [%"PRIu64"] num_recs\n", cdb->header->num_records);
+#endif
+
+    if (cdb->header->layout == CDB_LAYOUT_COMPRESSED) {
+        cdb_time_t start = 0;
+        cdb_time_t end   = 0;
+        uint64_t changed = 0;
+
+        for (i = 0; i < len; i++) {
+
+            if (i == 0 || records[i].time < start) {
+                start = records[i].time;
+            }
+
+            if (i == 0 || records[i].time > end) {
+                end = records[i].time;
+            }
+        }
+
+        if (len > 0 && (ret = _cdb_compressed_update(cdb, records, len, start, end, &changed)) == CDB_SUCCESS) {
+            *num_recs = len;
+        }
+
+        return ret;
+    }
+
+    if (cdb->header->layout == CDB_LAYOUT_IMPLICIT) {
+        return _cdb_implicit_update(cdb, records, len, 0, 0, num_recs);
+    }
+
+    for (i = 0; i < len; i++) {
+
+        cdb_time_t time = records[i].time;
+        cdb_time_t rtime;
+        uint64_t lrec;
+
+        lrec = _logical_record_for_time(cdb, time, 0, 0);
+
+        if (lrec >= 1) {
+            lrec -= 1;
+            /* DRK things like this are extremely confusing. some logical
+               functions are zero based? some are one? or you're trying to back up? */
+        }
+
+        rtime = _time_for_logical_record(cdb, lrec);
+
+        while (rtime < time && lrec < cdb->header->num_records - 1) {
+
+            /* DRK is this true? or is the condition (lrec - start_lrec) <
+               num_recs -- seems you can't wrap here (i.e. what if the initial
+               lrec was num_recs - 1) */
+
+            lrec += 1;
+            rtime = _time_for_logical_record(cdb, lrec);
+        }
+
+#ifdef DEBUG
+        printf("update_records: value: lrec [%"PRIu64"] time [%d] rtime [%d]\n", lrec, (int)time, (int)rtime);
+#endif
+
+        while (time == rtime && lrec < cdb->header->num_records - 1) {
+
+            uint64_t physical_record = _physical_record_for_logical_record(cdb->header, lrec);
+
+            if (_cdb_pwrite_records(cdb, physical_record, 1, &records[i]) != CDB_SUCCESS) {
+                ret = cdb_error();
+                break;
+            }
+
+            lrec += 1;
+
+            rtime = _time_for_logical_record(cdb, lrec);
+        }
+    }
+
+    if (ret == CDB_SUCCESS) {
+
+        if (i > 0) {
+            cdb->synced = false;
+            *num_recs = i;
+        }
+
+        if (_cdb_write_header(cdb) != CDB_SUCCESS) {
+            ret = cdb_error();
+        }
+    }
+
+    return ret;
+}
+
+int cdb_update_records(cdb_t *cdb, cdb_record_t *records, uint64_t len, uint64_t *num_recs) {
+
+    int ret = CDB_SUCCESS;
+
+    if ((ret = _cdb_update_begin(cdb, true)) != CDB_SUCCESS) {
+        return ret;
+    }
+
+    ret = _cdb_update_records(cdb, records, len, num_recs);
+
+    _cdb_update_end(cdb);
+
+    return ret;
+}
+
+bool cdb_update_record(cdb_t *cdb, cdb_time_t time, double value) {
+
+    cdb_record_t record[RECORD_SIZE];
+    uint64_t num_recs = 0;
+
+    record->time  = time;
+    record->value = value;
+
+    if (cdb_update_records(cdb, record, 1, &num_recs) != 0) {
+        return false;
+    }
+
+    return true;
+}
+
+static int _cdb_discard_records_in_time_range(cdb_t *cdb, cdb_request_t *request, uint64_t *num_recs) {
+
+    uint64_t i = 0;
+    int64_t lrec;
+    *num_recs = 0;
+
+    if (_cdb_read_header(cdb) != CDB_SUCCESS) {
+        return cdb_error();
+    }
+
+    if (_cdb_is_writable(cdb) == false) {
+        return CDB_ERDONLY;
+    }
+
+    if (cdb->header->layout == CDB_LAYOUT_COMPRESSED) {
+        return _cdb_compressed_update(cdb, NULL, 0, request->start, request->end, num_recs);
+    }
+
+    if (cdb->header->layout == CDB_LAYOUT_IMPLICIT) {
+        return _cdb_implicit_update(cdb, NULL, 0, request->start, request->end, num_recs);
+    }
+
+    lrec = _logical_record_for_time(cdb, request->start, 0, 0);
+
+    if (lrec >= 1) {
+        lrec -= 1;
+    }
+
+    for (i = lrec; i < cdb->header->num_records; i++) {
+
+        cdb_time_t rtime = _time_for_logical_record(cdb, i);
+
+        if (rtime >= request->start && rtime <= request->end) {
+
+            cdb_record_t record[RECORD_SIZE];
+            uint64_t physical_record = _physical_record_for_logical_record(cdb->header, i);
+
+            record->time  = rtime;
+            record->value = CDB_NAN;
+
+            if (_cdb_pwrite_records(cdb, physical_record, 1, record) != CDB_SUCCESS) {
+                return cdb_error();
+            }
+
+            *num_recs += 1;
+        }
+    }
+
+    if (*num_recs > 0) {
+        cdb->synced = false;
+    }
+
+    if (_cdb_write_header(cdb) != CDB_SUCCESS) {
+        return cdb_error();
+    }
+
+    return CDB_SUCCESS;
+}
+
+int cdb_discard_records_in_time_range(cdb_t *cdb, cdb_request_t *request, uint64_t *num_recs) {
+
+    int ret = CDB_SUCCESS;
+
+    if ((ret = _cdb_update_begin(cdb, true)) != CDB_SUCCESS) {
+        return ret;
+    }
+
+    ret = _cdb_discard_records_in_time_range(cdb, request, num_recs);
+
+    _cdb_update_end(cdb);
+
+    return ret;
+}
+
+static int _compute_scale_factor_and_num_records(cdb_t *cdb, int64_t *num_records, int32_t *factor) {
+
+    if (cdb->header->type == CDB_TYPE_COUNTER) {
+        if (*num_records != 0) {
+
+            if (*num_records > 0) {
+                *num_records += 1;
+            } else {
+                *num_records -= 1;
+            }
+        }
+    }
+
+    if (strlen(cdb->header->units) > 0) {
+
+        int32_t multiplier = 1;
+        char frequency[sizeof(cdb->header->units)];
+
+        if ((sscanf(cdb->header->units, "per %d %s", &multiplier, frequency) == 2) ||
+            (sscanf(cdb->header->units, "per %s", frequency) == 1) ||
+            (sscanf(cdb->header->units, "%*s per %s", frequency) == 1)) {
+
+            if (strcmp(frequency, "min") == 0) {
+                *factor = 60;
+            } else if (strcmp(frequency, "hour") == 0) {
+                *factor = 60 * 60;
+            } else if (strcmp(frequency, "sec") == 0 || strcmp(frequency, "second") == 0) {
+                *factor = 1;
+            } else if (strcmp(frequency, "day") == 0) {
+                *factor = 60 * 60 * 24;
+            } else if (strcmp(frequency, "week") == 0) {
+                *factor = 60 * 60 * 24 * 7;
+            } else if (strcmp(frequency, "month") == 0) {
+                *factor = 60 * 60 * 24 * 30;
+            } else if (strcmp(frequency, "quarter") == 0) {
+                *factor = 60 * 60 * 24 * 90;
+            } else if (strcmp(frequency, "year") == 0) {
+                *factor = 60 * 60 * 24 * 365;
+            }
+
+            if (*factor != 0) {
+                *factor *= multiplier;
+            }
+        }
+    }
+
+    return CDB_SUCCESS;
+}
+
+/* Cook len records in place - counters into deltas, or rates if the units
+ * say per what, and anything outside min/max into NaN - carrying what the
+ * next records need in cook. Returns how many are left, since with a rate the
+ * very first record only starts it off. */
+static uint64_t _cdb_cook(cdb_header_t *header, cdb_cook_t *cook, cdb_record_t *buffer, uint64_t len) {
+
+    bool check_min_max = true;
+    uint64_t i = 0;
+    uint64_t cooked_recs = 0;
+
+    if (header->min_value == 0 && header->max_value == 0) {
+        check_min_max = false;
+    }
+
+    for (i = 0; i < len; i++) {
+
+        cdb_time_t date = buffer[i].time;
+        double value    = buffer[i].value;
+
+        if (header->type == CDB_TYPE_COUNTER) {
+            double new_value = value;
+            value = CDB_NAN;
+
+            if (!isnan(cook->prev_value) && !isnan(new_value)) {
+
+                double val_delta = new_value - cook->prev_value;
+
+                if (val_delta >= 0) {
+                    value = val_delta;
+                }
+            }
+
+            cook->prev_value = new_value;
+        }
+
+        if (cook->factor != 0 && header->type == CDB_TYPE_COUNTER) {
+
+            /* Skip the first entry, since it's absolute and is needed
+             * to calculate the second */
+            if (cook->prev_date == 0) {
+                cook->prev_date = date;
+                continue;
+            }
+
+            cdb_time_t time_delta = date - cook->prev_date;
+
+            if (time_delta > 0 && !isnan(value)) {
+                value = cook->factor * (value / time_delta);
+            }
+
+            cook->prev_date = date;
+        }
+
+        /* Check for min/max boundaries */
+        /* Should this be done on write instead of read? */
+        if (check_min_max && !isnan(value)) {
+            if (value > header->max_value || value < header->min_value) {
+                value = CDB_NAN;
+            }
+        }
+
+        /* Write the munged data back over the buffer - we might skip
+         * elements, so cooked_recs never gets ahead of i. */
+        buffer[cooked_recs].time  = date;
+        buffer[cooked_recs].value = value;
+        cooked_recs += 1;
+    }
+
+    return cooked_recs;
+}
+
+/* Statistics code
+ * Make only one call to reading for a particular time range and compute all our stats.
+ * values is scratch space for num_recs doubles.
+ */
+static void _compute_statistics_into(cdb_range_t *range, uint64_t *num_recs, cdb_record_t *records, double *values) {
 
     uint64_t i     = 0;
     uint64_t valid = 0;
     double sum     = 0.0;
+
+    CDB_STAT_START(started);
+    CDB_PROBE3(statistics_entry, *num_recs, range->start_time, range->end_time);
+
+    for (i = 0; i < *num_recs; i++) {
+
+        if (!isnan(records[i].value)) {
+
+            sum += values[valid] = records[i].value;
+            valid++;
+        }
+    }
+
+    range->num_recs = valid;
+    range->mean     = gsl_stats_mean(values, 1, valid);
+    range->max      = gsl_stats_max(values, 1, valid);
+    range->min      = gsl_stats_min(values, 1, valid);
+    range->sum      = sum;
+    range->stddev   = gsl_stats_sd(values, 1, valid);
+    range->absdev   = gsl_stats_absdev(values, 1, valid);
+
+    /* The rest need sorted data */
+    gsl_sort(values, 1, valid);
+
+    range->median   = gsl_stats_median_from_sorted_data(values, 1, valid);
+    range->pct95th  = gsl_stats_quantile_from_sorted_data(values, 1, valid, 0.95);
+    range->pct75th  = gsl_stats_quantile_from_sorted_data(values, 1, valid, 0.75);
+    range->pct50th  = gsl_stats_quantile_from_sorted_data(values, 1, valid, 0.50);
+    range->pct25th  = gsl_stats_quantile_from_sorted_data(values, 1, valid, 0.25);
+
+    /* MAD must come last because it alters the values array
+     * http://en.wikipedia.org/wiki/Median_absolute_deviation */
+    for (i = 0; i < valid; i++) {
+        values[i] = fabs(values[i] - range->median);
+
+        if (values[i] < 0.0) {
+            values[i] *= -1.0;
+        }
+    }
+
+    /* Final sort is required MAD */
+    gsl_sort(values, 1, valid);
+    range->mad = gsl_stats_median_from_sorted_data(values, 1, valid);
+
+    CDB_PROBE3(statistics_return, valid, range->start_time, range->end_time);
+    CDB_HISTOGRAM_SINCE(CDB_OP_STATS, started);
+}
+
+void _compute_statistics(cdb_range_t *range, uint64_t *num_recs, cdb_record_t *records) {
+
     double *values = calloc(*num_recs, sizeof(double));
 
-    for (i = 0; i < *num_recs; i++) {
+    _compute_statistics_into(range, num_recs, records, values);
+
+    free(values);
+}
+
+double cdb_get_statistic(cdb_range_t *range, cdb_statistics_enum_t type) {
+
+    switch (type) {
+        case CDB_MEDIAN:
+            return range->median;
+        case CDB_MAD:
+            return range->mad;
+        case CDB_95TH:
+            return range->pct95th;
+        case CDB_75TH:
+            return range->pct75th;
+        case CDB_50TH:
+            return range->pct50th;
+        case CDB_25TH:
+            return range->pct25th;
+        case CDB_MEAN:
+            return range->mean;
+        case CDB_SUM:
+            return range->sum;
+        case CDB_MAX:
+            return range->max;
+        case CDB_MIN:
+            return range->min;
+        case CDB_STDDEV:
+            return range->stddev;
+        case CDB_ABSDEV:
+            return range->absdev;
+        default:
+            fprintf(stderr, "aggregate_using_function_for_records() function: [%d] not supported\n", type);
+            return CDB_FAILURE;
+    }
+}
+
+/* Room for len records to be read into. The readers below fill in *buffer
+ * if it is set, which has room for capacity records - CDB_ETOOSMALL, with
+ * *num_recs set to len, if that isn't enough. Otherwise they allocate it. */
+static int _cdb_read_buffer(cdb_t *cdb, cdb_record_t **buffer, uint64_t capacity, uint64_t len, uint64_t *num_recs) {
+
+    if (*buffer != NULL) {
+
+        if (len > capacity) {
+            *num_recs = len;
+            return CDB_ETOOSMALL;
+        }
+
+        return CDB_SUCCESS;
+    }
+
+    CDB_STAT_ADD(cdb, allocations, 1);
+
+    if ((*buffer = calloc(len ? len : 1, RECORD_SIZE)) == NULL) {
+        return CDB_ENOMEM;
+    }
+
+    return CDB_SUCCESS;
+}
+
+/* Read the raw records a request covers, from the row and column layouts.
+ * request->count has already been flipped to count from the end. */
+static int _cdb_read_raw_records(cdb_t *cdb, cdb_request_t *request, uint64_t *num_recs,
+    cdb_record_t **buffer, uint64_t capacity) {
+
+    int64_t first_requested_logical_record;
+    int64_t last_requested_logical_record;
+    uint64_t last_requested_physical_record;
+    uint64_t seek_physical_record;
+    bool owned = *buffer == NULL;
+    int ret = CDB_SUCCESS;
+
+    if (request->count != 0 && request->count < 0 && request->start == 0) {
+        /* if reading only few records from the end, just set -ve offset to seek to */
+        first_requested_logical_record = request->count;
+
+    } else {
+        /* compute which record to start reading from the beginning, based on start time specified. */
+        first_requested_logical_record = _logical_record_for_time(cdb, request->start, 0, 0);
+    }
+
+    /* if end is not defined, read all the records or only read uptill the specified record. */
+    if (request->end == 0) {
+
+        last_requested_logical_record = cdb->header->num_records - 1;
+
+    } else {
+
+        last_requested_logical_record = _logical_record_for_time(cdb, request->end, 0, 0);
+
+        /* this can return something > end, check for that */
+        if (_time_for_logical_record(cdb, last_requested_logical_record) > request->end) {
+            last_requested_logical_record -= 1;
+        }
+    }
+
+    last_requested_physical_record = (last_requested_logical_record + cdb->header->start_record) % cdb->header->num_records;
+
+    seek_physical_record = _physical_record_for_logical_record(cdb->header, first_requested_logical_record);
+
+    if (last_requested_physical_record >= seek_physical_record) {
+
+        uint64_t nrec = (last_requested_physical_record - seek_physical_record + 1);
+
+        if (!request->skip_checksums && (ret = _cdb_checksum_verify(cdb, seek_physical_record, nrec)) != CDB_SUCCESS) {
+            return ret;
+        }
+
+        if ((ret = _cdb_read_buffer(cdb, buffer, capacity, nrec, num_recs)) != CDB_SUCCESS) {
+            return ret;
+        }
+
+        if (_cdb_pread_records(cdb, seek_physical_record, nrec, *buffer) != CDB_SUCCESS) {
+            ret = cdb_error();
+
+            if (owned) {
+                free(*buffer);
+                *buffer = NULL;
+            }
+
+            return ret;
+        }
+
+        *num_recs = nrec;
+
+    } else {
+
+        /* We've wrapped around the end of the file */
+        uint64_t nrec1 = (cdb->header->num_records - seek_physical_record);
+        uint64_t nrec2 = (last_requested_physical_record + 1);
+
+        if (!request->skip_checksums &&
+            ((ret = _cdb_checksum_verify(cdb, seek_physical_record, nrec1)) != CDB_SUCCESS ||
+             (ret = _cdb_checksum_verify(cdb, 0, nrec2)) != CDB_SUCCESS)) {
+            return ret;
+        }
+
+        if ((ret = _cdb_read_buffer(cdb, buffer, capacity, nrec1 + nrec2, num_recs)) != CDB_SUCCESS) {
+            return ret;
+        }
+
+        /* Read from the first requested record to the end of the file, and
+         * then the wrap around portion from the first record. */
+        if (_cdb_pread_records(cdb, seek_physical_record, nrec1, *buffer) != CDB_SUCCESS ||
+            _cdb_pread_records(cdb, 0, nrec2, &(*buffer)[nrec1]) != CDB_SUCCESS) {
+            ret = cdb_error();
+
+            if (owned) {
+                free(*buffer);
+                *buffer = NULL;
+            }
+
+            return ret;
+        }
+
+        *num_recs = nrec1 + nrec2;
+    }
+
+    return CDB_SUCCESS;
+}
+
+/* Block headers a compressed read keeps on the stack before it allocates */
+#define CDB_STACK_BLOCKS 128
+
+/* The same for the compressed layout, decoding only the blocks that hold
+ * records in the requested range. A caller's buffer needs room for all the
+ * records of those blocks, not only the ones kept. */
+static int _cdb_compressed_read_records(cdb_t *cdb, cdb_request_t *request, uint64_t *num_recs,
+    cdb_record_t **buffer, uint64_t capacity) {
+
+    cdb_block_header_t stack_blocks[CDB_STACK_BLOCKS];
+    uint64_t stack_raw[CDB_BLOCK_SIZE / sizeof(uint64_t)];
+    cdb_block_header_t *blocks = stack_blocks;
+    unsigned char *raw = (unsigned char*)stack_raw;
+    uint64_t first = 0;
+    uint64_t skip  = 0;
+    uint64_t total = 0;
+    uint64_t nth   = 0;
+    uint64_t used  = cdb->header->used_blocks;
+    bool owned = *buffer == NULL;
+    int ret = CDB_SUCCESS;
+
+    *num_recs = 0;
+
+    if (used > CDB_STACK_BLOCKS) {
+        CDB_STAT_ADD(cdb, allocations, 1);
+
+        if ((blocks = calloc(used, CDB_BLOCK_HEADER_SIZE)) == NULL) {
+            return CDB_ENOMEM;
+        }
+    }
+
+    for (nth = 0; nth < used && ret == CDB_SUCCESS; nth++) {
+        ret = _cdb_block_read_header(cdb, nth, &blocks[nth]);
+    }
+
+    if (ret == CDB_SUCCESS && request->count < 0 && request->start == 0) {
+        /* Just enough blocks from the end for the last count records */
+        uint64_t want = -request->count;
+        uint64_t have = 0;
+
+        first = used;
+
+        while (first > 0 && have < want) {
+            first -= 1;
+            have  += blocks[first].count;
+        }
+
+        skip = have > want ? have - want : 0;
+    }
+
+    for (nth = first; nth < used && ret == CDB_SUCCESS; nth++) {
+
+        if (request->start != 0 && blocks[nth].last_time < request->start) {
+            continue;
+        }
+
+        if (request->end != 0 && blocks[nth].first_time > request->end) {
+            continue;
+        }
+
+        total += blocks[nth].count;
+    }
+
+    if (ret == CDB_SUCCESS) {
+        ret = _cdb_read_buffer(cdb, buffer, capacity, total, num_recs);
+    }
+
+    if (ret == CDB_SUCCESS && cdb->header->block_size > sizeof(stack_raw)) {
+        CDB_STAT_ADD(cdb, allocations, 1);
+
+        if ((raw = malloc(cdb->header->block_size)) == NULL) {
+            raw = (unsigned char*)stack_raw;
+            ret = CDB_ENOMEM;
+        }
+    }
+
+    for (nth = first; nth < used && ret == CDB_SUCCESS; nth++) {
+        cdb_record_t *decoded = &(*buffer)[*num_recs];
+        uint32_t i = 0;
+
+        if (request->start != 0 && blocks[nth].last_time < request->start) {
+            continue;
+        }
+
+        if (request->end != 0 && blocks[nth].first_time > request->end) {
+            continue;
+        }
+
+        ret = _cdb_block_read(cdb, nth, raw, !request->skip_checksums);
+
+        /* A writer in another process got to the block since its header was
+         * read, so have the caller try again */
+        if ((ret == CDB_SUCCESS || ret == CDB_ECHECKSUM) && ((cdb_block_header_t*)raw)->count != blocks[nth].count) {
+            ret = CDB_EBUSY;
+        }
+
+        if (ret != CDB_SUCCESS) {
+            break;
+        }
+
+        _cdb_block_decode((cdb_block_header_t*)raw, raw + CDB_BLOCK_HEADER_SIZE, decoded);
+
+        CDB_STAT_ADD(cdb, records_decoded, blocks[nth].count);
+
+        /* Keep the ones in range */
+        for (i = 0; i < blocks[nth].count; i++) {
+
+            if (skip > 0) {
+                skip -= 1;
+                continue;
+            }
+
+            if (request->start != 0 && decoded[i].time < request->start) {
+                continue;
+            }
+
+            if (request->end != 0 && decoded[i].time > request->end) {
+                continue;
+            }
+
+            (*buffer)[(*num_recs)++] = decoded[i];
+        }
+    }
+
+    if (raw != (unsigned char*)stack_raw) {
+        free(raw);
+    }
+
+    if (blocks != stack_blocks) {
+        free(blocks);
+    }
+
+    if (ret != CDB_SUCCESS && ret != CDB_ETOOSMALL && owned) {
+        free(*buffer);
+        *buffer = NULL;
+    }
+
+    return ret;
+}
+
+/* The same for the implicit layout, making up the times as it goes. */
+static int _cdb_implicit_read_records(cdb_t *cdb, cdb_request_t *request, uint64_t *num_recs,
+    cdb_record_t **buffer, uint64_t capacity) {
+
+    cdb_header_t *header = cdb->header;
+    double values[CDB_COLUMN_CHUNK];
+    uint64_t first = 0;
+    uint64_t last  = 0;
+    bool owned = *buffer == NULL;
+    int ret = CDB_SUCCESS;
+
+    *num_recs = 0;
+
+    if (!_cdb_slots_for_times(header, request->start, request->end, &first, &last)) {
+        return _cdb_read_buffer(cdb, buffer, capacity, 0, num_recs);
+    }
+
+    /* The last count slots - gaps among them aren't made up for */
+    if (request->count < 0 && request->start == 0 && (uint64_t)-request->count <= last) {
+        first = last + 1 + request->count;
+    }
+
+    if (!request->skip_checksums &&
+        (ret = _cdb_checksum_verify(cdb, _cdb_slot_physical(header, first), last - first + 1)) != CDB_SUCCESS) {
+        return ret;
+    }
+
+    if ((ret = _cdb_read_buffer(cdb, buffer, capacity, last - first + 1, num_recs)) != CDB_SUCCESS) {
+        return ret;
+    }
+
+    while (first <= last) {
+        uint64_t chunk = last - first + 1 > CDB_COLUMN_CHUNK ? CDB_COLUMN_CHUNK : last - first + 1;
+        uint64_t i = 0;
+
+        if ((ret = _cdb_slot_pread(cdb, first, chunk, values)) != CDB_SUCCESS) {
+
+            if (owned) {
+                free(*buffer);
+                *buffer = NULL;
+            }
+
+            return ret;
+        }
+
+        for (i = 0; i < chunk; i++) {
+
+            if (_cdb_is_gap(values[i])) {
+                continue;
+            }
+
+            (*buffer)[*num_recs].time  = header->base_time + (cdb_time_t)((first + i) * header->step);
+            (*buffer)[*num_recs].value = values[i];
+            *num_recs += 1;
+        }
+
+        first += chunk;
+    }
+
+    return CDB_SUCCESS;
+}
+
+/* Called with the handle lock held for reading. Returns CDB_EBUSY if a writer
+ * changed the file after the header was read at sequence. If *records is set
+ * the records are read into it, with room for capacity, and cooked, averaged
+ * and sliced in place. */
+static int _cdb_read_records_locked(cdb_t *cdb, cdb_request_t *request, uint16_t sequence,
+    uint64_t *num_recs, cdb_record_t **records, uint64_t capacity) {
+
+    cdb_record_t *buffer = *records;
+    bool owned = buffer == NULL;
+    int ret = CDB_SUCCESS;
+
+    if (request->start != 0 && request->end != 0 && request->end < request->start) {
+        return CDB_ETMRANGE;
+    }
+
+    if (cdb->header == NULL || cdb->synced == false) {
+        return CDB_ESANITY;
+    }
+
+    /* bail out if there are no records */
+    if (cdb->header->num_records <= 0) {
+        return CDB_ENORECS;
+    }
+
+    /*
+      get the number of requested records:
+
+      -ve indicates n records from the beginning
+      +ve indicates n records off of the end.
+      0 or undef means the whole thing.
+
+      switch the meaning of -ve/+ve to be more array like
+    */
+    if (request->count != 0) {
+        request->count = -request->count;
+    }
+
+#ifdef DEBUG
+    printf("read_records start: [%ld]\n", request->start);
+    printf("read_records end: [%ld]\n", request->end);
+    printf("read_records num_requested: [%"PRIu64"]\n", request->count);
+#endif
+
+    if (cdb->header->layout == CDB_LAYOUT_COMPRESSED) {
+        ret = _cdb_compressed_read_records(cdb, request, num_recs, &buffer, capacity);
+    } else if (cdb->header->layout == CDB_LAYOUT_IMPLICIT) {
+        ret = _cdb_implicit_read_records(cdb, request, num_recs, &buffer, capacity);
+    } else {
+        ret = _cdb_read_raw_records(cdb, request, num_recs, &buffer, capacity);
+    }
+
+    /* A checksum that doesn't match may only be a writer in another process
+     * caught half way */
+    if (ret == CDB_ECHECKSUM && _cdb_seq_read_retry(cdb, sequence)) {
+        return CDB_EBUSY;
+    }
+
+    if (ret != CDB_SUCCESS) {
+        return ret;
+    }
+
+    /* Someone wrote to the file while we were reading it - the records may be
+     * from either side of the write, so have the caller try again. */
+    if (_cdb_seq_read_retry(cdb, sequence)) {
+
+        if (owned) {
+            free(buffer);
+        }
+
+        return CDB_EBUSY;
+    }
+
+    /* Deal with cooking the output */
+    if (request->cooked) {
+
+        cdb_cook_t cook = cdb_new_cook();
+
+        CDB_STAT_START(cooking);
+
+        if (_compute_scale_factor_and_num_records(cdb, &request->count, &cook.factor)) {
+
+            if (owned) {
+                free(buffer);
+            }
+
+            return cdb_error();
+        }
+
+        *num_recs = _cdb_cook(cdb->header, &cook, buffer, *num_recs);
+
+        CDB_STAT_SINCE(cdb, cook_ns, cooking);
+    }
+
+    /* If we've been requested to average the records & timestamps */
+    if (request->step > 1) {
+
+        uint32_t step      = request->step;
+        uint64_t step_recs = 0;
+        uint64_t leftover  = (*num_recs % step);
+        uint64_t walkend   = (*num_recs - leftover);
+        uint64_t i = 0;
+
+        CDB_STAT_START(stepping);
+
+        /* Walk our list of cooked records, jumping ahead by the given step.
+           For each set of records within that step, we want to get the average
+           for those records and write it back at the front of the buffer,
+           behind the ones still to be read.
+         */
+        for (i = 0; i < walkend; i += step) {
+
+            uint64_t j = 0;
+            double xi[step];
+            double yi[step];
+
+            for (j = 0; j < step; j++) {
+
+                /* No NaNs on average - they cause bogus graphs. Is there a
+                 * better value than 0 to use here? */
+                if (isnan(buffer[i+j].value)) {
+                    buffer[i+j].value = 0;
+                }
+
+                xi[j] = (double)buffer[i+j].time;
+                yi[j] = buffer[i+j].value;
+            }
+
+            buffer[step_recs].time  = (cdb_time_t)gsl_stats_mean(xi, 1, step);
+            buffer[step_recs].value = gsl_stats_mean(yi, 1, step);
+            step_recs += 1;
+        }
+
+        /* Now collect from the last step point to the end & average. */
+        if (leftover > 0) {
+            uint64_t leftover_start = *num_recs - leftover;
+
+            uint64_t j = 0;
+            double xi[leftover];
+            double yi[leftover];
+
+            for (i = leftover_start; i < *num_recs; i++) {
+
+                /* No NaNs on average - they cause bogus graphs. Is there a
+                 * better value than 0 to use here? */
+                if (isnan(buffer[i].value)) {
+                    buffer[i].value = 0;
+                }
+
+                xi[j] = (double)buffer[i].time;
+                yi[j] = buffer[i].value;
+                j++;
+            }
+
+            buffer[step_recs].time  = (cdb_time_t)gsl_stats_mean(xi, 1, j);
+            buffer[step_recs].value = gsl_stats_mean(yi, 1, j);
+            step_recs += 1;
+        }
+
+        *num_recs = step_recs;
+
+        CDB_STAT_SINCE(cdb, step_ns, stepping);
+    }
+
+    /* now pull out the number of requested records if asked */
+    if (request->count != 0 && *num_recs >= abs(request->count)) {
+
+        uint64_t start_index = 0;
+
+        if (request->count <= 0) {
+            start_index = *num_recs - abs(request->count);
+        }
+
+        *num_recs = abs(request->count);
+
+        if (start_index > 0) {
+            memmove(buffer, &buffer[start_index], RECORD_SIZE * *num_recs);
+        }
+    }
+
+    *records = buffer;
+
+    return CDB_SUCCESS;
+}
+
+/* _cdb_read_records() into records if it is set, which has room for capacity.
+ * request is only mangled by a read that succeeds. */
+static int _cdb_read_records_into(cdb_t *cdb, cdb_request_t *request, uint64_t *num_recs,
+    cdb_record_t **records, uint64_t capacity) {
+
+    int ret = CDB_SUCCESS;
+    int retries = 0;
+
+    CDB_STAT_START(started);
+
+    do {
+        /* The read may mangle the request, so each attempt gets a fresh copy */
+        cdb_request_t attempt = *request;
+        uint16_t sequence = 0;
+
+        if ((ret = _cdb_rdlock(cdb, &sequence)) != CDB_SUCCESS) {
+            return ret;
+        }
+
+        ret = _cdb_read_records_locked(cdb, &attempt, sequence, num_recs, records, capacity);
+
+        pthread_rwlock_unlock(&cdb->lock);
+
+        if (ret == CDB_SUCCESS) {
+            *request = attempt;
+        }
+
+        if (ret != CDB_EBUSY) {
+            break;
+        }
+
+    } while (retries++ < CDB_SEQLOCK_RETRIES);
+
+    CDB_HISTOGRAM_SINCE(CDB_OP_READ, started);
+
+    return ret;
+}
+
+int _cdb_read_records(cdb_t *cdb, cdb_request_t *request, uint64_t *num_recs, cdb_record_t **records) {
+
+    *records = NULL;
+
+    return _cdb_read_records_into(cdb, request, num_recs, records, 0);
+}
+
+/* The next records of a compressed layout scan: what is left of one block. */
+static int _cdb_scan_compressed(cdb_t *cdb, cdb_scan_t *scan, cdb_record_t *records, uint64_t len, uint64_t *num_recs) {
+
+    cdb_block_header_t *block;
+    cdb_record_t *decoded = records;
+    unsigned char *raw;
+    uint64_t take = 0;
+    int ret = CDB_SUCCESS;
+
+    CDB_STAT_ADD(cdb, allocations, 1);
+
+    if ((raw = malloc(cdb->header->block_size)) == NULL) {
+        return CDB_ENOMEM;
+    }
+
+    ret   = _cdb_block_read(cdb, scan->position, raw, !scan->skip_checksums);
+    block = (cdb_block_header_t*)raw;
+
+    if (ret == CDB_SUCCESS && (block->count > CDB_BLOCK_MAX_RECORDS(cdb->header->block_size) || scan->offset > block->count)) {
+        ret = CDB_ESANITY;
+    }
+
+    /* Decode straight into records when the whole block fits */
+    if (ret == CDB_SUCCESS && (scan->offset > 0 || block->count > len) &&
+        (decoded = malloc(block->count * RECORD_SIZE)) == NULL) {
+        ret = CDB_ENOMEM;
+    }
+
+    if (decoded != records) {
+        CDB_STAT_ADD(cdb, allocations, 1);
+    }
+
+    if (ret == CDB_SUCCESS) {
+        _cdb_block_decode(block, raw + CDB_BLOCK_HEADER_SIZE, decoded);
 
-        if (!isnan(records[i].value)) {
+        CDB_STAT_ADD(cdb, records_decoded, block->count);
 
-            sum += values[valid] = records[i].value;
-            valid++;
+        take = block->count - scan->offset < len ? block->count - scan->offset : len;
+
+        if (decoded != records) {
+            memcpy(records, &decoded[scan->offset], take * RECORD_SIZE);
+            free(decoded);
+        }
+
+        *num_recs     = take;
+        scan->offset += take;
+
+        if (scan->offset == block->count) {
+            scan->position += 1;
+            scan->offset    = 0;
         }
     }
 
-    range->num_recs = valid;
-    range->mean     = gsl_stats_mean(values, 1, valid);
-    range->max      = gsl_stats_max(values, 1, valid);
-    range->min      = gsl_stats_min(values, 1, valid);
-    range->sum      = sum;
-    range->stddev   = gsl_stats_sd(values, 1, valid);
-    range->absdev   = gsl_stats_absdev(values, 1, valid);
+    free(raw);
 
-    /* The rest need sorted data */
-    gsl_sort(values, 1, valid);
+    return ret;
+}
 
-    range->median   = gsl_stats_median_from_sorted_data(values, 1, valid);
-    range->pct95th  = gsl_stats_quantile_from_sorted_data(values, 1, valid, 0.95);
-    range->pct75th  = gsl_stats_quantile_from_sorted_data(values, 1, valid, 0.75);
-    range->pct50th  = gsl_stats_quantile_from_sorted_data(values, 1, valid, 0.50);
-    range->pct25th  = gsl_stats_quantile_from_sorted_data(values, 1, valid, 0.25);
+/* The next records of an implicit layout scan, skipping over gaps. */
+static int _cdb_scan_implicit(cdb_t *cdb, cdb_scan_t *scan, cdb_record_t *records, uint64_t len, uint64_t *num_recs) {
 
-    /* MAD must come last because it alters the values array
-     * http://en.wikipedia.org/wiki/Median_absolute_deviation */
-    for (i = 0; i < valid; i++) {
-        values[i] = fabs(values[i] - range->median);
+    cdb_header_t *header = cdb->header;
+    double values[CDB_COLUMN_CHUNK];
+    int ret = CDB_SUCCESS;
 
-        if (values[i] < 0.0) {
-            values[i] *= -1.0;
+    while (*num_recs < len && scan->position < header->num_records) {
+        uint64_t chunk = header->num_records - scan->position;
+        uint64_t i = 0;
+
+        if (chunk > len - *num_recs) {
+            chunk = len - *num_recs;
         }
-    }
 
-    /* Final sort is required MAD */
-    gsl_sort(values, 1, valid);
-    range->mad = gsl_stats_median_from_sorted_data(values, 1, valid);
+        if (chunk > CDB_COLUMN_CHUNK) {
+            chunk = CDB_COLUMN_CHUNK;
+        }
 
-    free(values);
-}
+        if (!scan->skip_checksums &&
+            (ret = _cdb_checksum_verify(cdb, _cdb_slot_physical(header, scan->position), chunk)) != CDB_SUCCESS) {
+            return ret;
+        }
 
-double cdb_get_statistic(cdb_range_t *range, cdb_statistics_enum_t type) {
+        if ((ret = _cdb_slot_pread(cdb, scan->position, chunk, values)) != CDB_SUCCESS) {
+            return ret;
+        }
 
-    switch (type) {
-        case CDB_MEDIAN:
-            return range->median;
-        case CDB_MAD:
-            return range->mad;
-        case CDB_95TH:
-            return range->pct95th;
-        case CDB_75TH:
-            return range->pct75th;
-        case CDB_50TH:
-            return range->pct50th;
-        case CDB_25TH:
-            return range->pct25th;
-        case CDB_MEAN:
-            return range->mean;
-        case CDB_SUM:
-            return range->sum;
-        case CDB_MAX:
-            return range->max;
-        case CDB_MIN:
-            return range->min;
-        case CDB_STDDEV:
-            return range->stddev;
-        case CDB_ABSDEV:
-            return range->absdev;
-        default:
-            fprintf(stderr, "aggregate_using_function_for_records() function: [%d] not supported\n", type);
-            return CDB_FAILURE;
+        for (i = 0; i < chunk; i++) {
+
+            if (_cdb_is_gap(values[i])) {
+                continue;
+            }
+
+            records[*num_recs].time  = header->base_time + (cdb_time_t)((scan->position + i) * header->step);
+            records[*num_recs].value = values[i];
+            *num_recs += 1;
+        }
+
+        scan->position += chunk;
     }
+
+    return CDB_SUCCESS;
 }
 
-static int _cdb_read_records(cdb_t *cdb, cdb_request_t *request, uint64_t *num_recs, cdb_record_t **records) {
+/* The next records of a rows or columns layout scan. */
+static int _cdb_scan_raw(cdb_t *cdb, cdb_scan_t *scan, cdb_record_t *records, uint64_t len, uint64_t *num_recs) {
 
-    int64_t first_requested_logical_record;
-    int64_t last_requested_logical_record;
-    uint64_t last_requested_physical_record;
-    int64_t seek_physical_record;
+    cdb_header_t *header = cdb->header;
+    uint64_t physical = _physical_record_for_logical_record(header, scan->position);
+    uint64_t first    = 0;
+    int ret = CDB_SUCCESS;
+
+    if (len > header->num_records - scan->position) {
+        len = header->num_records - scan->position;
+    }
+
+    first = header->num_records - physical < len ? header->num_records - physical : len;
 
-    cdb_record_t *buffer = NULL;
+    if (!scan->skip_checksums &&
+        ((ret = _cdb_checksum_verify(cdb, physical, first)) != CDB_SUCCESS ||
+         (len > first && (ret = _cdb_checksum_verify(cdb, 0, len - first)) != CDB_SUCCESS))) {
+        return ret;
+    }
 
-    if (cdb_read_header(cdb) != CDB_SUCCESS) {
+    if (_cdb_pread_records(cdb, physical, first, records) != CDB_SUCCESS) {
         return cdb_error();
     }
 
-    if (request->start != 0 && request->end != 0 && request->end < request->start) {
-        return CDB_ETMRANGE;
+    /* The rest wrapped around to the start of the ring */
+    if (len > first && _cdb_pread_records(cdb, 0, len - first, &records[first]) != CDB_SUCCESS) {
+        return cdb_error();
+    }
+
+    *num_recs       = len;
+    scan->position += len;
+
+    return CDB_SUCCESS;
+}
+
+int cdb_scan_records(cdb_t *cdb, cdb_scan_t *scan, cdb_record_t *records, uint64_t len, uint64_t *num_recs) {
+
+    uint16_t sequence = 0;
+    uint64_t total = 0;
+    int ret = CDB_SUCCESS;
+
+    *num_recs = 0;
+
+    if (len == 0) {
+        return CDB_EINVAL;
+    }
+
+    if ((ret = _cdb_rdlock(cdb, &sequence)) != CDB_SUCCESS) {
+        return ret;
     }
 
     if (cdb->header == NULL || cdb->synced == false) {
+        pthread_rwlock_unlock(&cdb->lock);
         return CDB_ESANITY;
     }
 
-    /* bail out if there are no records */
-    if (cdb->header->num_records <= 0) {
-        return CDB_ENORECS;
+    /* Positions only mean anything in the file as it was at the start */
+    if (!scan->started) {
+        scan->started  = true;
+        scan->sequence = sequence;
+
+    } else if (sequence != scan->sequence) {
+        pthread_rwlock_unlock(&cdb->lock);
+        return CDB_EBUSY;
     }
 
-    /*
-      get the number of requested records:
+    total = cdb->header->layout == CDB_LAYOUT_COMPRESSED ? cdb->header->used_blocks : cdb->header->num_records;
 
-      -ve indicates n records from the beginning
-      +ve indicates n records off of the end.
-      0 or undef means the whole thing.
+    if (scan->position < total) {
 
-      switch the meaning of -ve/+ve to be more array like
-    */
-    if (request->count != 0) {
-        request->count = -request->count;
+        if (cdb->header->layout == CDB_LAYOUT_COMPRESSED) {
+            ret = _cdb_scan_compressed(cdb, scan, records, len, num_recs);
+        } else if (cdb->header->layout == CDB_LAYOUT_IMPLICIT) {
+            ret = _cdb_scan_implicit(cdb, scan, records, len, num_recs);
+        } else {
+            ret = _cdb_scan_raw(cdb, scan, records, len, num_recs);
+        }
     }
 
-#ifdef DEBUG
-    printf("read_records start: [%ld]\n", request->start);
-    printf("read_records end: [%ld]\n", request->end);
-    printf("read_records num_requested: [%"PRIu64"]\n", request->count);
-#endif
+    /* As for reads, a bad checksum may only be a writer caught half way */
+    if ((ret == CDB_SUCCESS || ret == CDB_ECHECKSUM) && _cdb_seq_read_retry(cdb, sequence)) {
+        ret = CDB_EBUSY;
+    }
 
-    if (request->count != 0 && request->count < 0 && request->start == 0) {
-        /* if reading only few records from the end, just set -ve offset to seek to */
-        first_requested_logical_record = request->count;
+    pthread_rwlock_unlock(&cdb->lock);
 
-    } else {
-        /* compute which record to start reading from the beginning, based on start time specified. */
-        first_requested_logical_record = _logical_record_for_time(cdb, request->start, 0, 0);
+    if (ret != CDB_SUCCESS) {
+        *num_recs = 0;
     }
 
-    /* if end is not defined, read all the records or only read uptill the specified record. */
-    if (request->end == 0) {
+    return ret;
+}
 
-        last_requested_logical_record = cdb->header->num_records - 1;
+int cdb_cook_records(cdb_t *cdb, cdb_cook_t *cook, cdb_record_t *records, uint64_t len, uint64_t *num_recs) {
 
-    } else {
+    uint16_t sequence = 0;
+    int64_t count = 0;
+    int ret = CDB_SUCCESS;
 
-        last_requested_logical_record = _logical_record_for_time(cdb, request->end, 0, 0);
+    *num_recs = 0;
 
-        /* this can return something > end, check for that */
-        if (_time_for_logical_record(cdb, last_requested_logical_record) > request->end) {
-            last_requested_logical_record -= 1;
+    if ((ret = _cdb_rdlock(cdb, &sequence)) != CDB_SUCCESS) {
+        return ret;
+    }
+
+    if (cdb->header == NULL || cdb->synced == false) {
+        pthread_rwlock_unlock(&cdb->lock);
+        return CDB_ESANITY;
+    }
+
+    if (!cook->started) {
+        cook->started = true;
+
+        if (_compute_scale_factor_and_num_records(cdb, &count, &cook->factor)) {
+            pthread_rwlock_unlock(&cdb->lock);
+            return cdb_error();
         }
     }
 
-    last_requested_physical_record = (last_requested_logical_record + cdb->header->start_record) % cdb->header->num_records;
+    *num_recs = _cdb_cook(cdb->header, cook, records, len);
 
-    /* After _seek_to_logical_record(), we're at the offset to read from. */
-    seek_physical_record = _seek_to_logical_record(cdb, first_requested_logical_record);
+    pthread_rwlock_unlock(&cdb->lock);
 
-    if (last_requested_physical_record >= seek_physical_record) {
+    return CDB_SUCCESS;
+}
 
-        uint64_t nrec = (last_requested_physical_record - seek_physical_record + 1);
-        uint64_t rlen = RECORD_SIZE * nrec;
+/* Records repaired at a time, both in and out */
+#define CDB_REPAIR_CHUNK 4096
+
+/* Where cdb_repair_records() is up to with its output. Only the record
+ * waiting to go out and the time of the last one that went are kept, so the
+ * repair needs no more memory for a bigger file. */
+typedef struct {
+    cdb_t *dst;
+    cdb_repair_t *report;
+    cdb_record_t *batch;
+    uint64_t batch_max;
+    uint64_t len;
+    cdb_record_t pending;
+    cdb_time_t last_time;
+    bool have_pending;
+    bool have_last;
+} cdb_repair_state_t;
+
+static int _cdb_repair_commit(cdb_repair_state_t *state, cdb_record_t *record) {
+
+    uint64_t written = 0;
+    int ret = CDB_SUCCESS;
 
-        if ((buffer = calloc(1, rlen)) == NULL) {
-            free(buffer);
-            return CDB_ENOMEM;
-        }
+    state->last_time = record->time;
+    state->have_last = true;
+    state->report->num_written += 1;
 
-        if (read(cdb->fd, buffer, rlen) != rlen) {
-            free(buffer);
-            return cdb_error();
-        }
+    if (state->dst == NULL) {
+        return CDB_SUCCESS;
+    }
 
-        *num_recs = nrec;
+    state->batch[state->len++] = *record;
+
+    if (state->len == state->batch_max) {
+        ret = cdb_write_records(state->dst, state->batch, state->len, &written);
+        state->len = 0;
+    }
+
+    return ret;
+}
+
+/* Keep the records in order. A record with the time of the one before it
+ * replaces it. One from before it is dropped - unless it is after the one
+ * before that, when it is the record before it that is out of place. */
+static int _cdb_repair_add(cdb_repair_state_t *state, cdb_record_t *record) {
+
+    int ret = CDB_SUCCESS;
+
+    state->report->num_read += 1;
+
+    if (!state->have_pending) {
+        state->pending = *record;
+        state->have_pending = true;
+
+    } else if (record->time > state->pending.time) {
+        ret = _cdb_repair_commit(state, &state->pending);
+        state->pending = *record;
+
+    } else if (record->time == state->pending.time) {
+        state->pending = *record;
+        state->report->num_merged += 1;
+
+    } else if (state->have_last && record->time > state->last_time) {
+        state->pending = *record;
+        state->report->num_dropped += 1;
 
     } else {
+        state->report->num_dropped += 1;
+    }
 
-        /* We've wrapped around the end of the file */
-        uint64_t nrec1 = (cdb->header->num_records - seek_physical_record);
-        uint64_t nrec2 = (last_requested_physical_record + 1);
+    return ret;
+}
 
-        uint64_t rlen1 = RECORD_SIZE * nrec1;
-        uint64_t rlen2 = RECORD_SIZE * nrec2;
+/* Where the oldest record of a rows or columns ring really is: the slot the
+ * times jump back at, taken round the ring. A jump back that only comes of a
+ * single record being out of place - after one that is too new, or at one
+ * that is too old - is only used when there is no other. The biggest jump
+ * wins. One sequential read of the slots, and three more. */
+static int _cdb_repair_find_start(cdb_t *cdb, cdb_record_t *records, uint64_t *start) {
+
+    uint64_t slots = cdb->header->num_records;
+    uint64_t best_drop = 0;
+    uint64_t any_drop  = 0;
+    uint64_t any_start = 0;
+    cdb_time_t window[4] = { 0, 0, 0, 0 };
+    uint64_t k = 0;
+    bool found = false;
+
+    *start = 0;
+
+    while (k < slots + 3) {
+        uint64_t physical = k % slots;
+        uint64_t len = slots - physical < CDB_REPAIR_CHUNK ? slots - physical : CDB_REPAIR_CHUNK;
+        uint64_t i = 0;
 
-        if ((buffer = calloc(1, rlen1 + rlen2)) == NULL) {
-            free(buffer);
-            return CDB_ENOMEM;
+        if (len > slots + 3 - k) {
+            len = slots + 3 - k;
         }
 
-        /* Read at the offset set by _seek_to_logical_record() */
-        if (read(cdb->fd, buffer, rlen1) != rlen1) {
-            free(buffer);
+        if (_cdb_pread_records(cdb, physical, len, records) != CDB_SUCCESS) {
             return cdb_error();
         }
 
-        /* And then the wrap around portion past the header. */
-        if (pread(cdb->fd, &buffer[nrec1], rlen2, HEADER_SIZE) != rlen2) {
-            free(buffer);
-            return cdb_error();
+        for (i = 0; i < len; i++, k++) {
+
+            window[0] = window[1];
+            window[1] = window[2];
+            window[2] = window[3];
+            window[3] = records[i].time;
+
+            /* Slot k - 1 against the two before it and the one after */
+            if (k >= 3 && window[2] < window[1]) {
+                uint64_t drop = (uint64_t)(window[1] - window[2]);
+                uint64_t slot = (k - 1) % slots;
+                bool spike = window[0] <= window[2];
+                bool dip   = window[3] >= window[1];
+
+                if (!spike && !dip && drop > best_drop) {
+                    best_drop = drop;
+                    *start    = slot;
+                    found     = true;
+                }
+
+                if (drop > any_drop) {
+                    any_drop  = drop;
+                    any_start = slot;
+                }
+            }
         }
+    }
 
-        *num_recs = nrec1 + nrec2;
+    if (!found) {
+        *start = any_start;
     }
 
-    /* Deal with cooking the output */
-    if (request->cooked) {
+    return CDB_SUCCESS;
+}
 
-        bool check_min_max = true;
-        int32_t factor = 0;
-        uint64_t i = 0;
-        uint64_t cooked_recs = 0;
-        double prev_value = 0.0;
-        cdb_time_t prev_date = 0;
-        cdb_record_t *crecords;
+int cdb_repair_records(cdb_t *src, cdb_t *dst, cdb_repair_t *report) {
 
-        if ((crecords = calloc(*num_recs, RECORD_SIZE)) == NULL) {
-            free(crecords);
-            free(buffer);
-            return CDB_ENOMEM;
-        }
+    cdb_repair_state_t state;
+    cdb_header_t *header = NULL;
+    cdb_record_t *records = NULL;
+    uint16_t sequence = 0;
+    uint64_t written = 0;
+    int ret = CDB_SUCCESS;
 
-        if (_compute_scale_factor_and_num_records(cdb, &request->count, &factor)) {
-            free(crecords);
-            free(buffer);
-            return cdb_error();
-        }
+    memset(report, 0, sizeof(cdb_repair_t));
+    memset(&state, 0, sizeof(state));
+
+    if ((ret = _cdb_rdlock(src, &sequence)) != CDB_SUCCESS) {
+        return ret;
+    }
+
+    header = src->header;
+
+    if (header == NULL || src->synced == false) {
+        pthread_rwlock_unlock(&src->lock);
+        return CDB_ESANITY;
+    }
 
-        if (cdb->header->min_value == 0 && cdb->header->max_value == 0) {
-            check_min_max = false;
+    state.dst       = dst;
+    state.report    = report;
+    state.batch_max = CDB_REPAIR_CHUNK;
+
+    /* A single write bigger than the new ring would wrap it */
+    if (dst != NULL && state.batch_max > dst->header->max_records) {
+        state.batch_max = dst->header->max_records;
+    }
+
+    records     = malloc(CDB_REPAIR_CHUNK * RECORD_SIZE);
+    state.batch = malloc(CDB_REPAIR_CHUNK * RECORD_SIZE);
+
+    if (records == NULL || state.batch == NULL) {
+        ret = CDB_ENOMEM;
+
+    } else if (header->layout == CDB_LAYOUT_ROWS || header->layout == CDB_LAYOUT_COLUMNS) {
+        uint64_t slots = header->num_records;
+        uint64_t done  = 0;
+
+        report->old_start = header->start_record;
+
+        if (slots > header->max_records) {
+            ret = CDB_ESANITY;
+
+        } else if (slots > 0) {
+            ret = _cdb_repair_find_start(src, records, &report->new_start);
         }
 
-        for (i = 0; i < *num_recs; i++) {
+        /* Round the ring from there, in as few reads as the wrap allows */
+        while (ret == CDB_SUCCESS && done < slots) {
+            uint64_t physical = (report->new_start + done) % slots;
+            uint64_t len = slots - physical < CDB_REPAIR_CHUNK ? slots - physical : CDB_REPAIR_CHUNK;
+            uint64_t i = 0;
 
-            cdb_time_t date = buffer[i].time;
-            double value    = buffer[i].value;
+            if (len > slots - done) {
+                len = slots - done;
+            }
 
-            if (cdb->header->type == CDB_TYPE_COUNTER) {
-                double new_value = value;
-                value = CDB_NAN;
+            if (_cdb_pread_records(src, physical, len, records) != CDB_SUCCESS) {
+                ret = cdb_error();
+                break;
+            }
 
-                if (!isnan(prev_value) && !isnan(new_value)) {
+            for (i = 0; i < len && ret == CDB_SUCCESS; i++) {
+                ret = _cdb_repair_add(&state, &records[i]);
+            }
 
-                    double val_delta = new_value - prev_value;
+            done += len;
+        }
 
-                    if (val_delta >= 0) {
-                        value = val_delta;
-                    }
-                }
+    } else {
+        /* Blocks and slots are in order already - only their records can be out */
+        cdb_scan_t scan = cdb_new_scan();
+        uint64_t len = 0;
+
+        scan.skip_checksums = true;
+
+        pthread_rwlock_unlock(&src->lock);
+
+        while ((ret = cdb_scan_records(src, &scan, records, CDB_REPAIR_CHUNK, &len)) == CDB_SUCCESS && len > 0) {
+            uint64_t i = 0;
 
-                prev_value = new_value;
+            for (i = 0; i < len && ret == CDB_SUCCESS; i++) {
+                ret = _cdb_repair_add(&state, &records[i]);
             }
 
-            if (factor != 0 && cdb->header->type == CDB_TYPE_COUNTER) {
+            if (ret != CDB_SUCCESS) {
+                break;
+            }
+        }
+
+        pthread_rwlock_rdlock(&src->lock);
+    }
+
+    if (ret == CDB_SUCCESS && state.have_pending) {
+        ret = _cdb_repair_commit(&state, &state.pending);
+    }
+
+    if (ret == CDB_SUCCESS && state.len > 0) {
+        ret = cdb_write_records(dst, state.batch, state.len, &written);
+    }
+
+    if (ret == CDB_SUCCESS && _cdb_seq_read_retry(src, sequence)) {
+        ret = CDB_EBUSY;
+    }
+
+    pthread_rwlock_unlock(&src->lock);
 
-                /* Skip the first entry, since it's absolute and is needed
-                 * to calculate the second */
-                if (prev_date == 0) {
-                    prev_date = date;
-                    continue;
-                }
+    free(records);
+    free(state.batch);
 
-                cdb_time_t time_delta = date - prev_date;
+    return ret;
+}
 
-                if (time_delta > 0 && !isnan(value)) {
-                    value = factor * (value / time_delta);
-                }
+/* Add a damaged run to the list, joining it to the last one if they touch. */
+static int _cdb_damage_add(cdb_damage_t **damage, uint64_t *num_damaged, uint64_t *capacity,
+    uint64_t first, uint64_t count) {
 
-                prev_date = date;
-            }
+    if (*num_damaged > 0 && (*damage)[*num_damaged - 1].first + (*damage)[*num_damaged - 1].count == first) {
+        (*damage)[*num_damaged - 1].count += count;
+        return CDB_SUCCESS;
+    }
 
-            /* Check for min/max boundaries */
-            /* Should this be done on write instead of read? */
-            if (check_min_max && !isnan(value)) {
-                if (value > cdb->header->max_value || value < cdb->header->min_value) {
-                    value = CDB_NAN;
-                }
-            }
+    if (*num_damaged == *capacity) {
+        uint64_t grown = *capacity ? *capacity * 2 : 16;
+        cdb_damage_t *resized = realloc(*damage, grown * sizeof(cdb_damage_t));
 
-            /* Copy the munged data to our new array, since we might skip
-             * elements. Also keep in mind mmap for the future */
-            crecords[cooked_recs].time  = date;
-            crecords[cooked_recs].value = value;
-            cooked_recs += 1;
+        if (resized == NULL) {
+            return CDB_ENOMEM;
         }
 
-        /* Now swap our cooked records for the buffer, so we can slice it as needed. */
-        free(buffer);
-        buffer = crecords;
-        *num_recs = cooked_recs;
+        *damage   = resized;
+        *capacity = grown;
     }
 
-    /* If we've been requested to average the records & timestamps */
-    if (request->step > 1) {
-
-        cdb_record_t *arecords;
-        uint32_t step      = request->step;
-        uint64_t step_recs = 0;
-        uint64_t leftover  = (*num_recs % step);
-        uint64_t walkend   = (*num_recs - leftover);
-        uint64_t i = 0;
+    (*damage)[*num_damaged].first = first;
+    (*damage)[*num_damaged].count = count;
+    *num_damaged += 1;
 
-        if ((arecords = calloc(((*num_recs / step) + leftover), RECORD_SIZE)) == NULL) {
-            free(arecords);
-            free(buffer);
-            return CDB_ENOMEM;
-        }
+    return CDB_SUCCESS;
+}
 
-        /* Walk our list of cooked records, jumping ahead by the given step.
-           For each set of records within that step, we want to get the average
-           for those records and place them into a new array.
-         */
-        for (i = 0; i < walkend; i += step) {
+static int _cdb_verify_checksums_locked(cdb_t *cdb, uint16_t sequence, cdb_damage_t **damage, uint64_t *num_damaged) {
 
-            uint64_t j = 0;
-            double xi[step];
-            double yi[step];
+    cdb_header_t *header = cdb->header;
+    unsigned char *raw = NULL;
+    uint64_t capacity = 0;
+    uint64_t total = 0;
+    uint64_t i = 0;
+    int ret = CDB_SUCCESS;
 
-            for (j = 0; j < step; j++) {
+    if (header == NULL || cdb->synced == false) {
+        return CDB_ESANITY;
+    }
 
-                /* No NaNs on average - they cause bogus graphs. Is there a
-                 * better value than 0 to use here? */
-                if (isnan(buffer[i+j].value)) {
-                    buffer[i+j].value = 0;
-                }
+    if (!(header->flags & CDB_FLAG_CHECKSUMS) || header->layout == CDB_LAYOUT_ROWS) {
+        return CDB_EINVAL;
+    }
 
-                xi[j] = (double)buffer[i+j].time;
-                yi[j] = buffer[i+j].value;
-            }
+    if (header->layout == CDB_LAYOUT_COMPRESSED) {
 
-            arecords[step_recs].time  = (cdb_time_t)gsl_stats_mean(xi, 1, step);
-            arecords[step_recs].value = gsl_stats_mean(yi, 1, step);
-            step_recs += 1;
+        if ((raw = malloc(header->block_size)) == NULL) {
+            return CDB_ENOMEM;
         }
 
-        /* Now collect from the last step point to the end & average. */
-        if (leftover > 0) {
-            uint64_t leftover_start = *num_recs - leftover;
+        total = header->used_blocks;
 
-            uint64_t j = 0;
-            double xi[leftover];
-            double yi[leftover];
+    } else {
+        total = _cdb_checksum_chunks(header);
+    }
 
-            for (i = leftover_start; i < *num_recs; i++) {
+    for (i = 0; i < total && ret == CDB_SUCCESS; i++) {
+        uint64_t first = i;
+        uint64_t count = 1;
 
-                /* No NaNs on average - they cause bogus graphs. Is there a
-                 * better value than 0 to use here? */
-                if (isnan(buffer[i].value)) {
-                    buffer[i].value = 0;
-                }
+        if (header->layout == CDB_LAYOUT_COMPRESSED) {
+            ret = _cdb_block_read(cdb, i, raw, true);
 
-                xi[j] = (double)buffer[i].time;
-                yi[j] = buffer[i].value;
-                j++;
+        } else {
+            uint32_t crc = 0;
+            uint32_t stored = 0;
+
+            first = i * CDB_CHECKSUM_RECORDS;
+            count = _cdb_checksum_slots(header, i);
+
+            if ((ret = _cdb_checksum_chunk(cdb, i, &crc, &stored)) == CDB_SUCCESS && crc != stored) {
+                ret = CDB_ECHECKSUM;
             }
+        }
 
-            arecords[step_recs].time  = (cdb_time_t)gsl_stats_mean(xi, 1, j);
-            arecords[step_recs].value = gsl_stats_mean(yi, 1, j);
-            step_recs += 1;
+        if (ret == CDB_ECHECKSUM) {
+            ret = _cdb_damage_add(damage, num_damaged, &capacity, first, count);
         }
+    }
 
-        free(buffer);
-        buffer = arecords;
-        *num_recs = step_recs;
+    free(raw);
+
+    if (ret == CDB_SUCCESS && _cdb_seq_read_retry(cdb, sequence)) {
+        ret = CDB_EBUSY;
     }
 
-    /* now pull out the number of requested records if asked */
-    if (request->count != 0 && *num_recs >= abs(request->count)) {
+    return ret;
+}
 
-        uint64_t start_index = 0;
+int cdb_verify_checksums(cdb_t *cdb, cdb_damage_t **damage, uint64_t *num_damaged) {
 
-        if (request->count <= 0) {
-            start_index = *num_recs - abs(request->count);
-        }
+    int ret = CDB_SUCCESS;
+    int retries = 0;
 
-        *num_recs = abs(request->count);
+    do {
+        uint16_t sequence = 0;
 
-        if ((*records  = calloc(*num_recs, RECORD_SIZE)) == NULL) {
-            free(buffer);
-            return CDB_ENOMEM;
+        *damage      = NULL;
+        *num_damaged = 0;
+
+        if ((ret = _cdb_rdlock(cdb, &sequence)) != CDB_SUCCESS) {
+            return ret;
         }
 
-        memcpy(*records, &buffer[start_index], RECORD_SIZE * *num_recs);
+        ret = _cdb_verify_checksums_locked(cdb, sequence, damage, num_damaged);
 
-        free(buffer);
+        pthread_rwlock_unlock(&cdb->lock);
 
-    } else {
+        if (ret != CDB_SUCCESS) {
+            free(*damage);
+            *damage      = NULL;
+            *num_damaged = 0;
+        }
 
-        *records = buffer;
-    }
+    } while (ret == CDB_EBUSY && retries++ < CDB_SEQLOCK_RETRIES);
 
-    return CDB_SUCCESS;
+    return ret;
 }
 
 int cdb_read_records(cdb_t *cdb, cdb_request_t *request,
@@ -1037,34 +4247,75 @@ int cdb_read_records(cdb_t *cdb, cdb_request_t *request,
 
     int ret   = CDB_SUCCESS;
 
+    CDB_PROBE4(read_records_entry, cdb->filename, request->start, request->end, request->count);
+
     ret = _cdb_read_records(cdb, request, num_recs, records);
 
     if (ret == CDB_SUCCESS) {
 
         if (*num_recs > 0) {
+            CDB_STAT_START(started);
+
             range->start_time = request->start;
             range->end_time   = request->end;
 
             _compute_statistics(range, num_recs, *records);
+
+            CDB_STAT_ADD(cdb, allocations, 1);
+            CDB_STAT_SINCE(cdb, stats_ns, started);
         }
     }
 
+    CDB_PROBE3(read_records_return, cdb->filename, ret, ret == CDB_SUCCESS ? *num_recs : 0);
+
+    return ret;
+}
+
+int cdb_read_records_into(cdb_t *cdb, const cdb_request_t *request, cdb_record_t *records, uint64_t capacity,
+    uint64_t *num_recs, cdb_range_t *range, double *scratch, uint64_t scratch_capacity) {
+
+    cdb_request_t attempt = *request;
+    int ret = CDB_SUCCESS;
+
+    if (records == NULL) {
+        return CDB_EINVAL;
+    }
+
+    /* No more can be returned than the buffer has room for */
+    if (range != NULL && (scratch == NULL || scratch_capacity < capacity)) {
+        *num_recs = capacity;
+        return CDB_ETOOSMALL;
+    }
+
+    CDB_PROBE4(read_records_entry, cdb->filename, request->start, request->end, request->count);
+
+    ret = _cdb_read_records_into(cdb, &attempt, num_recs, &records, capacity);
+
+    if (ret == CDB_SUCCESS && range != NULL && *num_recs > 0) {
+
+        CDB_STAT_START(started);
+
+        range->start_time = attempt.start;
+        range->end_time   = attempt.end;
+
+        _compute_statistics_into(range, num_recs, records, scratch);
+
+        CDB_STAT_SINCE(cdb, stats_ns, started);
+    }
+
+    CDB_PROBE3(read_records_return, cdb->filename, ret, ret == CDB_SUCCESS ? *num_recs : 0);
+
     return ret;
 }
 
 void cdb_print_records(cdb_t *cdb, cdb_request_t *request, FILE *fh, const char *date_format) {
 
-    uint64_t i = 0;
     uint64_t num_recs = 0;
 
     cdb_record_t *records = NULL;
 
     if (_cdb_read_records(cdb, request, &num_recs, &records) == CDB_SUCCESS) {
-
-        for (i = 0; i < num_recs; i++) {
-
-            _print_record(fh, records[i].time, records[i].value, date_format);
-        }
+        _print_records(fh, records, num_recs, date_format);
     }
 
     free(records);
@@ -1080,6 +4331,7 @@ void cdb_print(cdb_t *cdb) {
     request.count  = 0;
     request.step   = 0;
     request.cooked = false;
+    request.skip_checksums = false;
 
     printf("============== Header ================\n");
 
@@ -1105,83 +4357,143 @@ void cdb_print(cdb_t *cdb) {
     printf("============== End ================\n");
 }
 
-/* Take in an array of cdbs */
-int cdb_read_aggregate_records(cdb_t **cdbs, int num_cdbs, cdb_request_t *request,
-    uint64_t *driver_num_recs, cdb_record_t **records, cdb_range_t *range) {
+/* _cdb_read_records() into arena: into the free end of its region if that
+ * holds the records as read, and then into exactly as much as they need.
+ * The records are kept in the arena, and request is mangled as
+ * _cdb_read_records() would once one of the attempts succeeds. */
+static int _cdb_read_records_arena(cdb_t *cdb, cdb_request_t *request, cdb_arena_t *arena,
+    uint64_t *num_recs, cdb_record_t **records) {
 
-    uint64_t i = 0;
-    int ret    = CDB_SUCCESS;
-    cdb_record_t *driver_records = NULL;
-    *driver_num_recs = 0;
+    size_t rest = 0;
+    int retries = 0;
+    int ret = CDB_ETOOSMALL;
 
-    if (cdbs[0] == NULL) {
-        return CDB_ESANITY;
+    *num_recs = 0;
+
+    if ((*records = _cdb_arena_rest(arena, &rest)) != NULL && rest >= RECORD_SIZE) {
+        ret = _cdb_read_records_into(cdb, request, num_recs, records, rest / RECORD_SIZE);
     }
 
-    /* The first cdb is the driver */
-    ret = _cdb_read_records(cdbs[0], request, driver_num_recs, &driver_records);
+    /* The file may grow between attempts */
+    while (ret == CDB_ETOOSMALL && retries++ < CDB_SEQLOCK_RETRIES) {
+        uint64_t capacity = *num_recs > 0 ? *num_recs : 1;
+
+        if ((*records = cdb_arena_alloc(arena, capacity * RECORD_SIZE)) == NULL) {
+            return CDB_ENOMEM;
+        }
+
+        ret = _cdb_read_records_into(cdb, request, num_recs, records, capacity);
+    }
 
     if (ret != CDB_SUCCESS) {
-        fprintf(stderr, "Bailed on: %s\n", cdbs[0]->filename);
-        free(driver_records);
         return ret;
     }
 
-    if ((*records = calloc(*driver_num_recs, RECORD_SIZE)) == NULL) {
-        free(driver_records);
-        return CDB_ENOMEM;
+    /* Keep what was read into the free end. Anything else is already kept,
+     * and what it has spare is lost until the reset. */
+    if (rest > 0 && (unsigned char*)*records == _cdb_arena_rest(arena, &rest)) {
+        cdb_arena_alloc(arena, *num_recs * RECORD_SIZE);
     }
 
-    if (*driver_num_recs <= 1) {
-        free(driver_records);
-        return CDB_EINTERPD;
+    return CDB_SUCCESS;
+}
+
+/* Linear interpolation of the value at time between the records either side
+ * of it, like gsl_interp_linear - NaN before the first or after the last.
+ * The driver's times are in order too, so *at follows them along the
+ * records rather than searching for each. */
+static double _cdb_interpolate(cdb_record_t *records, uint64_t len, cdb_time_t time, uint64_t *at) {
+
+    uint64_t k = *at;
+    cdb_time_t dx;
+
+    if (len < 2 || time < records[0].time || time > records[len - 1].time) {
+        return CDB_NAN;
     }
 
-    double *driver_x_values   = calloc(*driver_num_recs, sizeof(double));
-    double *driver_y_values   = calloc(*driver_num_recs, sizeof(double));
-    double *follower_x_values = calloc(*driver_num_recs, sizeof(double));
-    double *follower_y_values = calloc(*driver_num_recs, sizeof(double));
+    /* The driver went back in time */
+    if (k >= len - 1 || time < records[k].time) {
+        k = 0;
+    }
 
-    for (i = 0; i < *driver_num_recs; i++) {
-        (*records)[i].time  = driver_x_values[i] = driver_records[i].time;
-        (*records)[i].value = driver_y_values[i] = driver_records[i].value;
+    while (k < len - 2 && records[k + 1].time <= time) {
+        k++;
     }
 
-    /* initialize and allocate the gsl objects  */
-    gsl_interp_accel *accel = gsl_interp_accel_alloc();
-    gsl_interp *interp = gsl_interp_alloc(gsl_interp_linear, *driver_num_recs);
+    *at = k;
 
-    /* Allows 0.0 to be returned as a valid yi */
-    gsl_set_error_handler_off();
+    /* A record at the time is taken as is, even next to a NaN */
+    if (records[k + 1].time == time) {
+        return records[k + 1].value;
+    }
 
-    gsl_interp_init(interp, driver_x_values, driver_y_values, *driver_num_recs);
+    if (records[k].time == time) {
+        return records[k].value;
+    }
 
-    for (i = 1; i < num_cdbs; i++) {
+    dx = records[k + 1].time - records[k].time;
 
-        uint64_t j = 0;
-        uint64_t follower_num_recs = 0;
+    if (dx <= 0) {
+        return CDB_NAN;
+    }
 
-        cdb_record_t *follower_records = NULL;
+    return records[k].value + ((double)(time - records[k].time) / dx) * (records[k + 1].value - records[k].value);
+}
 
-        ret = _cdb_read_records(cdbs[i], request, &follower_num_recs, &follower_records);
+/* Take in an array of cdbs. The driver's records are read into the arena,
+ * or allocated if malloced is set, and become the output. Each follower's
+ * are read into the arena, interpolated at the driver's times and given
+ * back. */
+static int _cdb_read_aggregate_records(cdb_t **cdbs, int num_cdbs, cdb_request_t *request, cdb_arena_t *arena,
+    bool malloced, uint64_t *driver_num_recs, cdb_record_t **records, cdb_range_t *range) {
 
-        /* Just bail, free all allocations below and let the error bubble up */
-        if (ret == CDB_SUCCESS && follower_num_recs != 0) {
+    cdb_request_t driver_request = *request;
+    int ret = CDB_SUCCESS;
+    int i = 0;
 
-            for (j = 0; j < *driver_num_recs; j++) {
+#ifdef CDB_STATS
+    uint64_t allocations = arena->allocations;
+#endif
 
-                /* Check for out of bounds */
-                if (j >= follower_num_recs) {
-                    break;
-                }
+    *driver_num_recs = 0;
 
-                follower_x_values[j] = follower_records[j].time;
-                follower_y_values[j] = follower_records[j].value;
-            }
+    if (cdbs[0] == NULL) {
+        return CDB_ESANITY;
+    }
+
+    /* The first cdb is the driver */
+    if (malloced) {
+        ret = _cdb_read_records(cdbs[0], &driver_request, driver_num_recs, records);
+    } else {
+        ret = _cdb_read_records_arena(cdbs[0], &driver_request, arena, driver_num_recs, records);
+    }
+
+    if (ret != CDB_SUCCESS) {
+        fprintf(stderr, "Bailed on: %s\n", cdbs[0]->filename);
+        return ret;
+    }
+
+    if (*driver_num_recs <= 1) {
+        return CDB_EINTERPD;
+    }
+
+    for (i = 1; i < num_cdbs && ret == CDB_SUCCESS; i++) {
+
+        /* Every follower is read for the request as it was given */
+        cdb_request_t follower_request = *request;
+        cdb_record_t *follower_records = NULL;
+        uint64_t follower_num_recs = 0;
+        uint64_t at = 0;
+        uint64_t j  = 0;
+        size_t mark = arena->used;
+
+        ret = _cdb_read_records_arena(cdbs[i], &follower_request, arena, &follower_num_recs, &follower_records);
+
+        if (ret == CDB_SUCCESS) {
 
             for (j = 0; j < *driver_num_recs; j++) {
 
-                double yi = gsl_interp_eval(interp, follower_x_values, follower_y_values, driver_x_values[j], accel);
+                double yi = _cdb_interpolate(follower_records, follower_num_recs, (*records)[j].time, &at);
 
                 if (isnormal(yi)) {
                     (*records)[j].value += yi;
@@ -1189,36 +4501,80 @@ int cdb_read_aggregate_records(cdb_t **cdbs, int num_cdbs, cdb_request_t *reques
             }
         }
 
-        free(follower_records);
+        _cdb_arena_rewind(arena, mark);
+    }
+
+    if (ret == CDB_SUCCESS) {
+        double *values;
 
-        if (ret != CDB_SUCCESS) {
-            break;
+        CDB_STAT_START(started);
+
+        if ((values = cdb_arena_alloc(arena, *driver_num_recs * sizeof(double))) == NULL) {
+            ret = CDB_ENOMEM;
+
+        } else {
+            /* Compute all the statistics for this range */
+            range->start_time = driver_request.start;
+            range->end_time   = driver_request.end;
+
+            _compute_statistics_into(range, driver_num_recs, *records, values);
         }
+
+        CDB_STAT_SINCE(cdbs[0], stats_ns, started);
     }
 
-    if (ret == CDB_SUCCESS && *driver_num_recs > 0) {
-        /* Compute all the statistics for this range */
-        range->start_time = request->start;
-        range->end_time   = request->end;
+    /* The arena's are counted against the driver */
+    CDB_STAT_ADD(cdbs[0], allocations, arena->allocations - allocations);
 
-        _compute_statistics(range, driver_num_recs, *records);
-    }
+    *request = driver_request;
+
+    return ret;
+}
 
-    free(driver_x_values);
-    free(driver_y_values);
-    free(follower_x_values);
-    free(follower_y_values);
+int cdb_read_aggregate_records_arena(cdb_t **cdbs, int num_cdbs, cdb_request_t *request, cdb_arena_t *arena,
+    uint64_t *driver_num_recs, cdb_record_t **records, cdb_range_t *range) {
+
+    int ret;
+
+    CDB_STAT_START(started);
+    CDB_PROBE4(aggregate_entry, cdbs[0] != NULL ? cdbs[0]->filename : NULL, num_cdbs, request->start, request->end);
+
+    ret = _cdb_read_aggregate_records(cdbs, num_cdbs, request, arena, false, driver_num_recs, records, range);
+
+    CDB_PROBE3(aggregate_return, cdbs[0] != NULL ? cdbs[0]->filename : NULL, ret, *driver_num_recs);
+    CDB_HISTOGRAM_SINCE(CDB_OP_AGGREGATE, started);
+
+    return ret;
+}
+
+int cdb_read_aggregate_records(cdb_t **cdbs, int num_cdbs, cdb_request_t *request,
+    uint64_t *driver_num_recs, cdb_record_t **records, cdb_range_t *range) {
+
+    cdb_arena_t *arena;
+    int ret;
+
+    CDB_STAT_START(started);
+    CDB_PROBE4(aggregate_entry, cdbs[0] != NULL ? cdbs[0]->filename : NULL, num_cdbs, request->start, request->end);
+
+    /* Only the scratch memory comes from the arena - the caller frees the
+     * records */
+    if ((arena = cdb_arena_new(NULL, 0)) == NULL) {
+        *driver_num_recs = 0;
+        ret = CDB_ENOMEM;
+
+    } else {
+        ret = _cdb_read_aggregate_records(cdbs, num_cdbs, request, arena, true, driver_num_recs, records, range);
+        cdb_arena_free(arena);
+    }
 
-    gsl_interp_free(interp);
-    gsl_interp_accel_free(accel);
-    free(driver_records);
+    CDB_PROBE3(aggregate_return, cdbs[0] != NULL ? cdbs[0]->filename : NULL, ret, *driver_num_recs);
+    CDB_HISTOGRAM_SINCE(CDB_OP_AGGREGATE, started);
 
     return ret;
 }
 
 void cdb_print_aggregate_records(cdb_t **cdbs, int32_t num_cdbs, cdb_request_t *request, FILE *fh, const char *date_format) {
 
-    uint64_t i = 0;
     uint64_t num_recs = 0;
 
     cdb_record_t *records = NULL;
@@ -1226,17 +4582,14 @@ void cdb_print_aggregate_records(cdb_t **cdbs, int32_t num_cdbs, cdb_request_t *
 
     cdb_read_aggregate_records(cdbs, num_cdbs, request, &num_recs, &records, range);
 
-    for (i = 0; i < num_recs; i++) {
-
-        _print_record(fh, records[i].time, records[i].value, date_format);
-    }
+    _print_records(fh, records, num_recs, date_format);
 
     free(range);
     free(records);
 }
 
 void cdb_generate_header(cdb_t *cdb, char* name, char* desc, uint64_t max_records, int32_t type,
-    char* units, uint64_t min_value, uint64_t max_value) {
+    char* units, uint64_t min_value, uint64_t max_value, uint32_t encoding) {
 
     if (max_records == 0) {
         max_records = CDB_DEFAULT_RECORDS;
@@ -1272,6 +4625,82 @@ void cdb_generate_header(cdb_t *cdb, char* name, char* desc, uint64_t max_record
     cdb->header->max_value    = max_value;
     cdb->header->num_records  = 0;
     cdb->header->start_record = 0;
+
+    /* Rows, unless the caller asks for something else before writing */
+    cdb->header->layout       = CDB_LAYOUT_ROWS;
+    cdb->header->flags        = 0;
+    cdb->header->data_offset  = 0;
+    cdb->header->base_time    = 0;
+    cdb->header->step         = 0;
+    cdb->header->encoding     = encoding;
+    cdb->header->value_offset = 0;
+    cdb->header->value_scale  = 1;
+
+    memset(cdb->header->reserved, 0, sizeof(cdb->header->reserved));
+}
+
+void cdb_copy_header(cdb_t *cdb, cdb_t *source) {
+
+    memcpy(cdb->header, source->header, HEADER_SIZE);
+
+    cdb->header->num_records  = 0;
+    cdb->header->start_record = 0;
+    cdb->header->data_offset  = 0;
+    cdb->header->block_size   = 0;
+    cdb->header->num_blocks   = 0;
+    cdb->header->start_block  = 0;
+    cdb->header->used_blocks  = 0;
+    cdb->header->base_time    = 0;
+}
+
+const char* cdb_strerror(int ret) {
+
+    switch (ret) {
+        case CDB_SUCCESS:
+            return "Success";
+        case CDB_FAILURE:
+            return "Failed";
+        case CDB_ETMRANGE:
+            return "Invalid time range";
+        case CDB_EFAULT:
+            return "Invalid pointer";
+        case CDB_EINVAL:
+            return "Invalid argument";
+        case CDB_EFAILED:
+            return "Failed";
+        case CDB_ESANITY:
+            return "Header failed its sanity check";
+        case CDB_ENOMEM:
+            return "Out of memory";
+        case CDB_EINVMAX:
+            return "Invalid max_records";
+        case CDB_ERDONLY:
+            return "Opened read only";
+        case CDB_ENORECS:
+            return "No records";
+        case CDB_EINTERPD:
+            return "Aggregate driver failed";
+        case CDB_EINTERPF:
+            return "Aggregate follower failed";
+        case CDB_EBADTOK:
+            return "Bad/bogus token";
+        case CDB_EBADVER:
+            return "Incompatible version";
+        case CDB_EBUSY:
+            return "Writers kept changing the file";
+        case CDB_EFULL:
+            return "Ingest queue full";
+        case CDB_ENOSPACE:
+            return "No room left";
+        case CDB_ENOSERIES:
+            return "No such series";
+        case CDB_ECHECKSUM:
+            return "Records failed their checksum";
+        case CDB_ETOOSMALL:
+            return "Buffer too small";
+        default:
+            return strerror(ret);
+    }
 }
 
 cdb_t* cdb_new(void) {
@@ -1284,6 +4713,8 @@ cdb_t* cdb_new(void) {
     cdb->flags = -1;
     cdb->mode = -1;
 
+    pthread_rwlock_init(&cdb->lock, NULL);
+
     return cdb;
 }
 
@@ -1298,6 +4729,59 @@ cdb_request_t cdb_new_request(void) {
     return request;
 }
 
+cdb_scan_t cdb_new_scan(void) {
+    cdb_scan_t scan;
+    memset(&scan, 0, sizeof(scan));
+    return scan;
+}
+
+cdb_cook_t cdb_new_cook(void) {
+    cdb_cook_t cook;
+    memset(&cook, 0, sizeof(cook));
+    return cook;
+}
+
+int cdb_get_stats(cdb_t *cdb, cdb_stats_t *stats) {
+
+    memset(stats, 0, sizeof(cdb_stats_t));
+
+#ifdef CDB_STATS
+    stats->syscalls        = __sync_fetch_and_add(&cdb->stats.syscalls, 0);
+    stats->bytes_read      = __sync_fetch_and_add(&cdb->stats.bytes_read, 0);
+    stats->bytes_written   = __sync_fetch_and_add(&cdb->stats.bytes_written, 0);
+    stats->lookups         = __sync_fetch_and_add(&cdb->stats.lookups, 0);
+    stats->probes          = __sync_fetch_and_add(&cdb->stats.probes, 0);
+    stats->records_decoded = __sync_fetch_and_add(&cdb->stats.records_decoded, 0);
+    stats->allocations     = __sync_fetch_and_add(&cdb->stats.allocations, 0);
+    stats->cook_ns         = __sync_fetch_and_add(&cdb->stats.cook_ns, 0);
+    stats->step_ns         = __sync_fetch_and_add(&cdb->stats.step_ns, 0);
+    stats->stats_ns        = __sync_fetch_and_add(&cdb->stats.stats_ns, 0);
+
+    return CDB_SUCCESS;
+#else
+    (void)cdb;
+    return CDB_EINVAL;
+#endif
+}
+
+void cdb_reset_stats(cdb_t *cdb) {
+
+#ifdef CDB_STATS
+    __sync_lock_test_and_set(&cdb->stats.syscalls, 0);
+    __sync_lock_test_and_set(&cdb->stats.bytes_read, 0);
+    __sync_lock_test_and_set(&cdb->stats.bytes_written, 0);
+    __sync_lock_test_and_set(&cdb->stats.lookups, 0);
+    __sync_lock_test_and_set(&cdb->stats.probes, 0);
+    __sync_lock_test_and_set(&cdb->stats.records_decoded, 0);
+    __sync_lock_test_and_set(&cdb->stats.allocations, 0);
+    __sync_lock_test_and_set(&cdb->stats.cook_ns, 0);
+    __sync_lock_test_and_set(&cdb->stats.step_ns, 0);
+    __sync_lock_test_and_set(&cdb->stats.stats_ns, 0);
+#else
+    memset(&cdb->stats, 0, sizeof(cdb_stats_t));
+#endif
+}
+
 int cdb_open(cdb_t *cdb) {
 
     if (cdb->fd >= 0) {
@@ -1318,8 +4802,12 @@ int cdb_open(cdb_t *cdb) {
         cdb->mode = S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH;
     }
 
+    CDB_STAT_START(started);
+
     cdb->fd = open(cdb->filename, cdb->flags, cdb->mode);
 
+    CDB_HISTOGRAM_SINCE(CDB_OP_OPEN, started);
+
     if (cdb->fd < 0) {
         return cdb_error();
     }
@@ -1329,17 +4817,40 @@ int cdb_open(cdb_t *cdb) {
 
 int cdb_close(cdb_t *cdb) {
 
+    int ret = CDB_SUCCESS;
+
     if (cdb != NULL) {
 
-        if (cdb->fd > 0) {
+        pthread_rwlock_wrlock(&cdb->lock);
+
+        if (cdb->mapped_header != NULL) {
+            munmap(cdb->mapped_header, CDB_HEADER_V1_SIZE);
+            cdb->mapped_header   = NULL;
+            cdb->mapped_sequence = NULL;
+        }
+
+        /* The container's file stays open, and so would our lock on it */
+        if (cdb->container != NULL) {
+
+            if (cdb->lock_depth > 0) {
+                _cdb_file_lock(cdb, F_UNLCK);
+            }
+
+        } else if (cdb->fd > 0) {
             if (close(cdb->fd) != 0) {
-                return cdb_error();
+                ret = cdb_error();
+            } else {
+                cdb->fd = -1;
             }
-            cdb->fd = -1;
         }
+
+        /* Closing the file released any lock we held on it */
+        cdb->lock_depth = 0;
+
+        pthread_rwlock_unlock(&cdb->lock);
     }
 
-    return CDB_SUCCESS;
+    return ret;
 }
 
 int cdb_free(cdb_t *cdb) {
@@ -1353,6 +4864,7 @@ int cdb_free(cdb_t *cdb) {
             cdb->header = NULL;
         }
 
+        pthread_rwlock_destroy(&cdb->lock);
         free(cdb);
         cdb = NULL;
     }
@@ -0,0 +1,181 @@
+/*
+ * CircularDB implementation for time series data.
+ *
+ * Copyright (c) 2007-2009 Powerset, Inc
+ * Copyright (c) Dan Grillo, Manish Dubey, Dan Sully
+ *
+ * All rights reserved.
+ */
+
+/* Query arenas.
+ *
+ * Allocation bumps an offset into one region, and a reset puts it back to
+ * the start, so all the scratch memory of a query goes back at once without
+ * a free() of its own. What doesn't fit in the region comes from chunks
+ * chained on to the arena and freed on reset. An arena that owns its region
+ * then grows it to what the last query used, so after the first few queries
+ * of a kind nothing is allocated at all. A caller's region is never grown.
+ *
+ * An arena isn't locked - a thread each. */
+
+#include "config.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <circulardb_interface.h>
+
+#include "circulardb_private.h"
+
+/* Enough for any type */
+#define CDB_ARENA_ALIGN      16
+
+/* Smallest chunk taken for an overflow */
+#define CDB_ARENA_MIN_CHUNK  (64 * 1024)
+
+#define _cdb_arena_round(size) (((size) + CDB_ARENA_ALIGN - 1) & ~(size_t)(CDB_ARENA_ALIGN - 1))
+
+typedef struct _cdb_arena_chunk_s {
+    struct _cdb_arena_chunk_s *next;
+    size_t size;
+    size_t used;
+} _cdb_arena_chunk_t;
+
+#define CDB_ARENA_CHUNK_HEADER _cdb_arena_round(sizeof(_cdb_arena_chunk_t))
+
+cdb_arena_t* cdb_arena_new(void *region, size_t size) {
+
+    cdb_arena_t *arena;
+
+    if ((arena = calloc(1, sizeof(cdb_arena_t))) == NULL) {
+        return NULL;
+    }
+
+    arena->owned = region == NULL;
+
+    if (region == NULL && size > 0) {
+        size = _cdb_arena_round(size);
+
+        if ((region = malloc(size)) == NULL) {
+            free(arena);
+            return NULL;
+        }
+
+        arena->allocations += 1;
+    }
+
+    /* Line the caller's region up, losing a few bytes if it needs it */
+    if (region != NULL) {
+        size_t skip = (CDB_ARENA_ALIGN - ((uintptr_t)region % CDB_ARENA_ALIGN)) % CDB_ARENA_ALIGN;
+
+        arena->base   = region;
+        arena->region = (unsigned char*)region + (skip < size ? skip : size);
+        arena->size   = skip < size ? size - skip : 0;
+    }
+
+    return arena;
+}
+
+void* cdb_arena_alloc(cdb_arena_t *arena, size_t size) {
+
+    _cdb_arena_chunk_t *chunk = arena->chunks;
+    size_t want = _cdb_arena_round(size ? size : 1);
+    void *ptr;
+
+    if (arena->size - arena->used >= want) {
+        ptr = arena->region + arena->used;
+        arena->used += want;
+        return ptr;
+    }
+
+    if (chunk == NULL || chunk->size - chunk->used < want) {
+        size_t chunk_size = want > CDB_ARENA_MIN_CHUNK ? want : CDB_ARENA_MIN_CHUNK;
+
+        if (chunk_size < arena->size) {
+            chunk_size = arena->size;
+        }
+
+        if ((chunk = malloc(CDB_ARENA_CHUNK_HEADER + chunk_size)) == NULL) {
+            return NULL;
+        }
+
+        chunk->next   = arena->chunks;
+        chunk->size   = chunk_size;
+        chunk->used   = 0;
+        arena->chunks = chunk;
+        arena->allocations += 1;
+    }
+
+    ptr = (unsigned char*)chunk + CDB_ARENA_CHUNK_HEADER + chunk->used;
+    chunk->used += want;
+    arena->overflow += want;
+
+    return ptr;
+}
+
+void* _cdb_arena_rest(cdb_arena_t *arena, size_t *size) {
+
+    *size = arena->size - arena->used;
+
+    return *size > 0 ? arena->region + arena->used : NULL;
+}
+
+void _cdb_arena_rewind(cdb_arena_t *arena, size_t mark) {
+
+    if (mark < arena->used) {
+        arena->used = mark;
+    }
+}
+
+void cdb_arena_reset(cdb_arena_t *arena) {
+
+    while (arena->chunks != NULL) {
+        _cdb_arena_chunk_t *next = arena->chunks->next;
+
+        free(arena->chunks);
+        arena->chunks = next;
+    }
+
+    /* Room for everything next time. Nothing in it is kept, so there is no
+     * need to realloc(). */
+    if (arena->owned && arena->overflow > 0) {
+        size_t size = arena->size + arena->overflow;
+        unsigned char *region;
+
+        if ((region = malloc(size)) != NULL) {
+            free(arena->base);
+            arena->base   = region;
+            arena->region = region;
+            arena->size   = size;
+            arena->allocations += 1;
+        }
+    }
+
+    arena->used     = 0;
+    arena->overflow = 0;
+}
+
+void cdb_arena_free(cdb_arena_t *arena) {
+
+    bool owned;
+
+    if (arena == NULL) {
+        return;
+    }
+
+    /* Don't grow what is about to go */
+    owned = arena->owned;
+    arena->owned = false;
+
+    cdb_arena_reset(arena);
+
+    if (owned) {
+        free(arena->base);
+    }
+
+    free(arena);
+}
+
+/* -*- Mode: C; tab-width: 4 -*- */
+/* vim: set tabstop=4 expandtab shiftwidth=4: */
@@ -0,0 +1,260 @@
+/*
+ * CircularDB implementation for time series data.
+ *
+ * Copyright (c) 2007-2009 Powerset, Inc
+ * Copyright (c) Dan Grillo, Manish Dubey, Dan Sully
+ *
+ * All rights reserved.
+ */
+
+/* Gorilla block codec for the compressed layout.
+ *
+ * Times: the first is stored whole, after that only the change in delta:
+ *
+ *   0                      same delta as before
+ *   10   + 7 bits          -63 .. 64
+ *   110  + 9 bits          -255 .. 256
+ *   1110 + 12 bits         -2047 .. 2048
+ *   1111 + 64 bits         anything else
+ *
+ * Values: the first is stored whole, after that XORed with the previous one:
+ *
+ *   0                      same value
+ *   10 + meaningful bits   fits in the previous leading/trailing zero window
+ *   11 + 6 bits leading zeros + 6 bits length - 1 + meaningful bits
+ *
+ * Regular timestamps cost a bit each and slowly changing values a handful. */
+
+#include "config.h"
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "circulardb_private.h"
+
+/* No XOR window yet */
+#define CDB_NO_WINDOW 0xff
+
+/* Write the low n bits of value, most significant first. Bits are set and
+ * cleared explicitly, so a partly written record that is given up on leaves
+ * nothing behind that matters. */
+static bool _cdb_bits_put(unsigned char *stream, uint64_t capacity, uint64_t *pos, uint64_t value, int n) {
+
+    if (*pos + n > capacity) {
+        return false;
+    }
+
+    while (n > 0) {
+        uint64_t byte = *pos >> 3;
+        int room = 8 - (int)(*pos & 7);
+        int take = n < room ? n : room;
+        unsigned int bits = (unsigned int)(value >> (n - take)) & ((1u << take) - 1);
+        unsigned int mask = ((1u << take) - 1) << (room - take);
+
+        stream[byte] = (unsigned char)((stream[byte] & ~mask) | (bits << (room - take)));
+
+        *pos += take;
+        n    -= take;
+    }
+
+    return true;
+}
+
+static uint64_t _cdb_bits_get(const unsigned char *stream, uint64_t *pos, int n) {
+
+    uint64_t value = 0;
+
+    while (n > 0) {
+        uint64_t byte = *pos >> 3;
+        int room = 8 - (int)(*pos & 7);
+        int take = n < room ? n : room;
+
+        value = (value << take) | ((stream[byte] >> (room - take)) & ((1u << take) - 1));
+
+        *pos += take;
+        n    -= take;
+    }
+
+    return value;
+}
+
+static bool _cdb_put_dod(unsigned char *stream, uint64_t capacity, uint64_t *pos, int64_t dod) {
+
+    if (dod == 0) {
+        return _cdb_bits_put(stream, capacity, pos, 0, 1);
+    }
+
+    if (dod >= -63 && dod <= 64) {
+        return _cdb_bits_put(stream, capacity, pos, 0x2, 2) &&
+            _cdb_bits_put(stream, capacity, pos, (uint64_t)(dod + 63), 7);
+    }
+
+    if (dod >= -255 && dod <= 256) {
+        return _cdb_bits_put(stream, capacity, pos, 0x6, 3) &&
+            _cdb_bits_put(stream, capacity, pos, (uint64_t)(dod + 255), 9);
+    }
+
+    if (dod >= -2047 && dod <= 2048) {
+        return _cdb_bits_put(stream, capacity, pos, 0xe, 4) &&
+            _cdb_bits_put(stream, capacity, pos, (uint64_t)(dod + 2047), 12);
+    }
+
+    return _cdb_bits_put(stream, capacity, pos, 0xf, 4) &&
+        _cdb_bits_put(stream, capacity, pos, (uint64_t)dod, 64);
+}
+
+static int64_t _cdb_get_dod(const unsigned char *stream, uint64_t *pos) {
+
+    if (_cdb_bits_get(stream, pos, 1) == 0) {
+        return 0;
+    }
+
+    if (_cdb_bits_get(stream, pos, 1) == 0) {
+        return (int64_t)_cdb_bits_get(stream, pos, 7) - 63;
+    }
+
+    if (_cdb_bits_get(stream, pos, 1) == 0) {
+        return (int64_t)_cdb_bits_get(stream, pos, 9) - 255;
+    }
+
+    if (_cdb_bits_get(stream, pos, 1) == 0) {
+        return (int64_t)_cdb_bits_get(stream, pos, 12) - 2047;
+    }
+
+    return (int64_t)_cdb_bits_get(stream, pos, 64);
+}
+
+void _cdb_block_init(cdb_block_header_t *block) {
+
+    memset(block, 0, CDB_BLOCK_HEADER_SIZE);
+
+    block->lead = CDB_NO_WINDOW;
+}
+
+bool _cdb_block_append(cdb_block_header_t *block, unsigned char *stream, uint64_t capacity,
+    cdb_time_t time, double value) {
+
+    uint64_t pos   = block->bits;
+    uint64_t bits  = 0;
+    uint64_t prev  = 0;
+    int64_t delta  = 0;
+    uint8_t lead   = block->lead;
+    uint8_t trail  = block->trail;
+
+    capacity *= 8;
+
+    memcpy(&bits, &value, sizeof(bits));
+
+    if (block->count == 0) {
+
+        if (!_cdb_bits_put(stream, capacity, &pos, (uint64_t)time, 64) ||
+            !_cdb_bits_put(stream, capacity, &pos, bits, 64)) {
+            return false;
+        }
+
+        block->first_time = time;
+
+    } else {
+        uint64_t xor;
+
+        delta = time - block->last_time;
+
+        if (!_cdb_put_dod(stream, capacity, &pos, delta - block->last_delta)) {
+            return false;
+        }
+
+        memcpy(&prev, &block->last_value, sizeof(prev));
+
+        xor = bits ^ prev;
+
+        if (xor == 0) {
+
+            if (!_cdb_bits_put(stream, capacity, &pos, 0, 1)) {
+                return false;
+            }
+
+        } else {
+            int new_lead  = __builtin_clzll(xor);
+            int new_trail = __builtin_ctzll(xor);
+
+            if (lead != CDB_NO_WINDOW && new_lead >= lead && new_trail >= trail) {
+
+                if (!_cdb_bits_put(stream, capacity, &pos, 0x2, 2) ||
+                    !_cdb_bits_put(stream, capacity, &pos, xor >> trail, 64 - lead - trail)) {
+                    return false;
+                }
+
+            } else {
+                int len = 64 - new_lead - new_trail;
+
+                if (!_cdb_bits_put(stream, capacity, &pos, 0x3, 2) ||
+                    !_cdb_bits_put(stream, capacity, &pos, new_lead, 6) ||
+                    !_cdb_bits_put(stream, capacity, &pos, len - 1, 6) ||
+                    !_cdb_bits_put(stream, capacity, &pos, xor >> new_trail, len)) {
+                    return false;
+                }
+
+                lead  = (uint8_t)new_lead;
+                trail = (uint8_t)new_trail;
+            }
+        }
+    }
+
+    block->bits       = (uint32_t)pos;
+    block->count     += 1;
+    block->last_time  = time;
+    block->last_delta = delta;
+    block->last_value = value;
+    block->lead       = lead;
+    block->trail      = trail;
+
+    return true;
+}
+
+void _cdb_block_decode(const cdb_block_header_t *block, const unsigned char *stream, cdb_record_t *records) {
+
+    uint64_t pos   = 0;
+    uint64_t bits  = 0;
+    int64_t delta  = 0;
+    int lead       = CDB_NO_WINDOW;
+    int trail      = 0;
+    cdb_time_t time;
+    uint32_t i     = 0;
+
+    if (block->count == 0) {
+        return;
+    }
+
+    time = (cdb_time_t)_cdb_bits_get(stream, &pos, 64);
+    bits = _cdb_bits_get(stream, &pos, 64);
+
+    records[0].time = time;
+    memcpy(&records[0].value, &bits, sizeof(bits));
+
+    for (i = 1; i < block->count; i++) {
+
+        delta += _cdb_get_dod(stream, &pos);
+        time  += delta;
+
+        if (_cdb_bits_get(stream, &pos, 1) == 1) {
+
+            if (_cdb_bits_get(stream, &pos, 1) == 1) {
+                int len;
+
+                lead  = (int)_cdb_bits_get(stream, &pos, 6);
+                len   = (int)_cdb_bits_get(stream, &pos, 6) + 1;
+                trail = 64 - lead - len;
+            }
+
+            bits ^= _cdb_bits_get(stream, &pos, 64 - lead - trail) << trail;
+        }
+
+        records[i].time = time;
+        memcpy(&records[i].value, &bits, sizeof(bits));
+    }
+}
+
+/* -*- Mode: C; tab-width: 4 -*- */
+/* vim: set tabstop=4 expandtab shiftwidth=4: */
@@ -0,0 +1,746 @@
+/*
+ * CircularDB implementation for time series data.
+ *
+ * Copyright (c) 2007-2009 Powerset, Inc
+ * Copyright (c) Dan Grillo, Manish Dubey, Dan Sully
+ *
+ * All rights reserved.
+ */
+
+/* Containers.
+ *
+ * The file starts with a container header and a directory of max_series
+ * entries, each a series name with where its space starts and how big it is.
+ * Series follow, page aligned so their headers can be mapped, in the order
+ * they were added. Each is laid out as a file of its own would be, except
+ * that header->data_offset counts from the start of the container.
+ *
+ * The container header and the directory entries are little endian, laid
+ * out by hand like the 2.0.0 series header:
+ *
+ *   header                          entry
+ *    0  token[4]     "CDBC"          0  name[128]
+ *    4  version[6]   "1.0.0"       128  offset     u64
+ *   10  pad[2]                     136  size       u64
+ *   12  max_series   u32
+ *   16  num_series   u32
+ *   20  pad          u32
+ *   24  end          u64
+ *   32  reserved[32]
+ *
+ * Adding a series writes its header and directory entry before bumping
+ * num_series, under an fcntl() lock on the container header, so readers in
+ * other processes never see an entry that isn't there yet. A name that isn't
+ * in our copy of the directory makes us look for entries added since. */
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <circulardb_interface.h>
+
+#include "circulardb_private.h"
+
+#define CDB_CONTAINER_TOKEN   "CDBC"
+#define CDB_CONTAINER_VERSION "1.0.0"
+
+/* Series start on a page boundary */
+#define CDB_CONTAINER_ALIGN   4096
+
+/* On disk sizes of the header and of a directory entry */
+#define CDB_CONTAINER_HEADER_SIZE 64
+#define CDB_CONTAINER_ENTRY_SIZE  144
+
+/* Most series a directory can hold */
+#define CDB_CONTAINER_MAX_SERIES  (1 << 24)
+
+/* Series up to this size are read ahead whole, along with their neighbours */
+#define CDB_CONTAINER_READAHEAD (1024 * 1024)
+
+#ifdef F_OFD_SETLKW
+#define CDB_SETLKW F_OFD_SETLKW
+#else
+#define CDB_SETLKW F_SETLKW
+#endif
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+typedef struct _cdb_container_header_s {
+    char        token[4];           // CDBC
+    char        version[6];
+    uint32_t    max_series;         // Entries in the directory
+    uint32_t    num_series;         // Entries in use
+    uint64_t    end;                // Where the next series goes
+} _cdb_container_header_t;
+
+typedef struct _cdb_container_entry_s {
+    char        name[128];
+    uint64_t    offset;             // Where the series' header is
+    uint64_t    size;               // Bytes, rounded up to CDB_CONTAINER_ALIGN
+} _cdb_container_entry_t;
+
+struct cdb_container_s {
+    int fd;
+    int flags;
+    char *filename;
+    pthread_mutex_t lock;
+    _cdb_container_header_t header;
+    _cdb_container_entry_t *entries;
+    cdb_t **series;                 /* Handles, opened as they are asked for */
+    uint32_t *index;                /* Open addressed: entry + 1, 0 if free */
+    uint32_t index_size;            /* A power of two */
+};
+
+typedef struct _cdb_container_read_s {
+    uint64_t offset;
+    uint64_t size;
+    uint64_t nth;                   /* Which of the names */
+} _cdb_container_read_t;
+
+/* FNV-1a */
+static uint64_t _cdb_container_hash(const char *name) {
+
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    size_t i = 0;
+
+    for (i = 0; i < sizeof(((_cdb_container_entry_t*)0)->name) && name[i] != '\0'; i++) {
+        hash ^= (unsigned char)name[i];
+        hash *= 0x100000001b3ULL;
+    }
+
+    return hash;
+}
+
+static off_t _cdb_container_entry_offset(uint32_t nth) {
+
+    return CDB_CONTAINER_HEADER_SIZE + ((off_t)nth * CDB_CONTAINER_ENTRY_SIZE);
+}
+
+static void _cdb_container_header_encode(const _cdb_container_header_t *header, unsigned char *buffer) {
+
+    memset(buffer, 0, CDB_CONTAINER_HEADER_SIZE);
+
+    memcpy(buffer, header->token, sizeof(header->token));
+    memcpy(buffer + 4, header->version, sizeof(header->version));
+
+    _cdb_le32_put(buffer + 12, header->max_series);
+    _cdb_le32_put(buffer + 16, header->num_series);
+    _cdb_le64_put(buffer + 24, header->end);
+}
+
+static void _cdb_container_header_decode(_cdb_container_header_t *header, const unsigned char *buffer) {
+
+    memcpy(header->token, buffer, sizeof(header->token));
+    memcpy(header->version, buffer + 4, sizeof(header->version));
+
+    header->max_series = _cdb_le32_get(buffer + 12);
+    header->num_series = _cdb_le32_get(buffer + 16);
+    header->end        = _cdb_le64_get(buffer + 24);
+}
+
+static void _cdb_container_entry_encode(const _cdb_container_entry_t *entry, unsigned char *buffer) {
+
+    memcpy(buffer, entry->name, sizeof(entry->name));
+
+    _cdb_le64_put(buffer + 128, entry->offset);
+    _cdb_le64_put(buffer + 136, entry->size);
+}
+
+static void _cdb_container_entry_decode(_cdb_container_entry_t *entry, const unsigned char *buffer) {
+
+    memcpy(entry->name, buffer, sizeof(entry->name));
+
+    entry->offset = _cdb_le64_get(buffer + 128);
+    entry->size   = _cdb_le64_get(buffer + 136);
+}
+
+static int _cdb_container_write_header(cdb_container_t *container) {
+
+    unsigned char buffer[CDB_CONTAINER_HEADER_SIZE];
+
+    _cdb_container_header_encode(&container->header, buffer);
+
+    if (pwrite(container->fd, buffer, sizeof(buffer), 0) != sizeof(buffer)) {
+        return cdb_error();
+    }
+
+    return CDB_SUCCESS;
+}
+
+static int64_t _cdb_container_lookup(cdb_container_t *container, const char *name) {
+
+    uint32_t mask = container->index_size - 1;
+    uint32_t slot = (uint32_t)_cdb_container_hash(name) & mask;
+
+    while (container->index[slot] != 0) {
+        uint32_t nth = container->index[slot] - 1;
+
+        if (strncmp(container->entries[nth].name, name, sizeof(container->entries[nth].name)) == 0) {
+            return nth;
+        }
+
+        slot = (slot + 1) & mask;
+    }
+
+    return -1;
+}
+
+static void _cdb_container_index(cdb_container_t *container, uint32_t nth) {
+
+    uint32_t mask = container->index_size - 1;
+    uint32_t slot = (uint32_t)_cdb_container_hash(container->entries[nth].name) & mask;
+
+    while (container->index[slot] != 0) {
+        slot = (slot + 1) & mask;
+    }
+
+    container->index[slot] = nth + 1;
+}
+
+static int _cdb_container_file_lock(cdb_container_t *container, short type) {
+
+    struct flock fl;
+
+    memset(&fl, 0, sizeof(fl));
+
+    fl.l_type   = type;
+    fl.l_whence = SEEK_SET;
+    fl.l_start  = 0;
+    fl.l_len    = CDB_CONTAINER_HEADER_SIZE;
+
+    while (fcntl(container->fd, CDB_SETLKW, &fl) != 0) {
+
+        if (errno != EINTR) {
+            return cdb_error();
+        }
+    }
+
+    return CDB_SUCCESS;
+}
+
+/* Pick up the entries other processes have added since we last looked. */
+static int _cdb_container_refresh(cdb_container_t *container) {
+
+    _cdb_container_header_t header;
+    unsigned char buffer[CDB_CONTAINER_HEADER_SIZE];
+    uint32_t have = container->header.num_series;
+    uint32_t nth  = 0;
+
+    if (pread(container->fd, buffer, sizeof(buffer), 0) != sizeof(buffer)) {
+        return cdb_error();
+    }
+
+    _cdb_container_header_decode(&header, buffer);
+
+    if (header.num_series > container->header.max_series || header.num_series < have) {
+        return CDB_ESANITY;
+    }
+
+    if (header.num_series > have) {
+        size_t size = (size_t)(header.num_series - have) * CDB_CONTAINER_ENTRY_SIZE;
+        unsigned char *entries = malloc(size);
+
+        if (entries == NULL) {
+            return CDB_ENOMEM;
+        }
+
+        if (pread(container->fd, entries, size, _cdb_container_entry_offset(have)) != size) {
+            int ret = cdb_error();
+            free(entries);
+            return ret;
+        }
+
+        for (nth = have; nth < header.num_series; nth++) {
+            _cdb_container_entry_decode(&container->entries[nth], entries + ((size_t)(nth - have) * CDB_CONTAINER_ENTRY_SIZE));
+            _cdb_container_index(container, nth);
+        }
+
+        free(entries);
+    }
+
+    container->header.num_series = header.num_series;
+    container->header.end        = header.end;
+
+    return CDB_SUCCESS;
+}
+
+/* Write a new container's header and empty directory. */
+static int _cdb_container_create(cdb_container_t *container, uint32_t max_series) {
+
+    _cdb_container_header_t *header = &container->header;
+    off_t directory_end = _cdb_container_entry_offset(max_series);
+
+    memset(header, 0, sizeof(*header));
+
+    memcpy(header->token, CDB_CONTAINER_TOKEN, sizeof(header->token));
+    strncpy(header->version, CDB_CONTAINER_VERSION, sizeof(header->version));
+
+    header->max_series = max_series;
+    header->num_series = 0;
+    header->end = ((directory_end + CDB_CONTAINER_ALIGN - 1) / CDB_CONTAINER_ALIGN) * CDB_CONTAINER_ALIGN;
+
+    if (ftruncate(container->fd, header->end) != 0) {
+        return cdb_error();
+    }
+
+    return _cdb_container_write_header(container);
+}
+
+int cdb_container_open(const char *filename, int flags, uint32_t max_series, cdb_container_t **container) {
+
+    cdb_container_t *c;
+    unsigned char buffer[CDB_CONTAINER_HEADER_SIZE];
+    struct stat st;
+    int ret = CDB_SUCCESS;
+
+    *container = NULL;
+
+    if (max_series == 0) {
+        max_series = CDB_CONTAINER_DEFAULT_SERIES;
+    }
+
+    if (max_series > CDB_CONTAINER_MAX_SERIES) {
+        return CDB_EINVAL;
+    }
+
+    if ((c = calloc(1, sizeof(cdb_container_t))) == NULL || (c->filename = strdup(filename)) == NULL) {
+        free(c);
+        return CDB_ENOMEM;
+    }
+
+    /* Series need to read their headers */
+    if (flags & O_WRONLY) {
+        flags = (flags & ~O_WRONLY) | O_RDWR;
+    }
+
+    c->flags = flags;
+
+    pthread_mutex_init(&c->lock, NULL);
+
+    if ((c->fd = open(filename, flags|O_BINARY, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)) < 0) {
+        ret = cdb_error();
+        cdb_container_close(c);
+        return ret;
+    }
+
+    if ((flags & O_ACCMODE) != O_RDONLY && (ret = _cdb_container_file_lock(c, F_WRLCK)) != CDB_SUCCESS) {
+        cdb_container_close(c);
+        return ret;
+    }
+
+    if (fstat(c->fd, &st) != 0) {
+        ret = cdb_error();
+
+    } else if (st.st_size == 0 && (flags & O_ACCMODE) != O_RDONLY) {
+        ret = _cdb_container_create(c, max_series);
+
+    } else if (pread(c->fd, buffer, sizeof(buffer), 0) != sizeof(buffer)) {
+        ret = st.st_size < sizeof(buffer) ? CDB_EBADTOK : cdb_error();
+
+    } else {
+        _cdb_container_header_decode(&c->header, buffer);
+
+        if (strncmp(c->header.token, CDB_CONTAINER_TOKEN, sizeof(c->header.token)) != 0) {
+            ret = CDB_EBADTOK;
+
+        } else if (strncmp(c->header.version, CDB_CONTAINER_VERSION, sizeof(c->header.version)) != 0) {
+            ret = CDB_EBADVER;
+
+        /* The directory is sized from max_series, so it has to be one we
+         * could have written, and lie within the file before any series */
+        } else if (c->header.max_series == 0 || c->header.max_series > CDB_CONTAINER_MAX_SERIES ||
+            _cdb_container_entry_offset(c->header.max_series) > c->header.end ||
+            c->header.end > (uint64_t)st.st_size) {
+            ret = CDB_ESANITY;
+        }
+    }
+
+    if ((flags & O_ACCMODE) != O_RDONLY) {
+        _cdb_container_file_lock(c, F_UNLCK);
+    }
+
+    if (ret != CDB_SUCCESS) {
+        cdb_container_close(c);
+        return ret;
+    }
+
+    /* Load the whole directory */
+    for (c->index_size = 1; c->index_size < c->header.max_series * 2; c->index_size <<= 1);
+
+    c->entries = calloc(c->header.max_series, sizeof(_cdb_container_entry_t));
+    c->series  = calloc(c->header.max_series, sizeof(cdb_t*));
+    c->index   = calloc(c->index_size, sizeof(uint32_t));
+
+    if (c->entries == NULL || c->series == NULL || c->index == NULL) {
+        cdb_container_close(c);
+        return CDB_ENOMEM;
+    }
+
+    c->header.num_series = 0;
+
+    if ((ret = _cdb_container_refresh(c)) != CDB_SUCCESS) {
+        cdb_container_close(c);
+        return ret;
+    }
+
+    *container = c;
+
+    return CDB_SUCCESS;
+}
+
+/* A handle for the nth series, sharing the container's file. */
+static cdb_t* _cdb_container_handle(cdb_container_t *container, uint32_t nth) {
+
+    cdb_t *cdb = cdb_new();
+
+    cdb->fd        = container->fd;
+    cdb->flags     = container->flags;
+    cdb->filename  = container->filename;
+    cdb->base      = container->entries[nth].offset;
+    cdb->container = container;
+
+    return cdb;
+}
+
+/* Called with the container lock held. */
+static int _cdb_container_open_series(cdb_container_t *container, const char *name, int64_t *nth) {
+
+    cdb_t *cdb;
+    int ret = CDB_SUCCESS;
+
+    if ((*nth = _cdb_container_lookup(container, name)) < 0) {
+
+        if ((ret = _cdb_container_refresh(container)) != CDB_SUCCESS) {
+            return ret;
+        }
+
+        if ((*nth = _cdb_container_lookup(container, name)) < 0) {
+            return CDB_ENOSERIES;
+        }
+    }
+
+    if (container->series[*nth] != NULL) {
+        return CDB_SUCCESS;
+    }
+
+    cdb = _cdb_container_handle(container, *nth);
+
+    if ((ret = cdb_read_header(cdb)) != CDB_SUCCESS) {
+        cdb_free(cdb);
+        return ret;
+    }
+
+    /* Its records have to stay inside its own space */
+    if (cdb->header->layout == CDB_LAYOUT_ROWS ||
+        cdb->header->data_offset < cdb->base + HEADER_SIZE ||
+        cdb->base + _cdb_series_size(cdb->header) > container->entries[*nth].offset + container->entries[*nth].size) {
+        cdb_free(cdb);
+        return CDB_ESANITY;
+    }
+
+    container->series[*nth] = cdb;
+
+    return CDB_SUCCESS;
+}
+
+int cdb_container_open_series(cdb_container_t *container, const char *name, cdb_t **cdb) {
+
+    int64_t nth = 0;
+    int ret = CDB_SUCCESS;
+
+    pthread_mutex_lock(&container->lock);
+
+    if ((ret = _cdb_container_open_series(container, name, &nth)) == CDB_SUCCESS) {
+        *cdb = container->series[nth];
+    }
+
+    pthread_mutex_unlock(&container->lock);
+
+    return ret;
+}
+
+static int _cdb_container_add_series(cdb_container_t *container, cdb_t *proto, cdb_t **cdb) {
+
+    _cdb_container_entry_t *entry;
+    unsigned char buffer[CDB_CONTAINER_ENTRY_SIZE];
+    cdb_t *series;
+    uint32_t nth;
+    uint64_t size;
+    int ret = CDB_SUCCESS;
+
+    if ((ret = _cdb_container_refresh(container)) != CDB_SUCCESS) {
+        return ret;
+    }
+
+    nth = container->header.num_series;
+
+    if (_cdb_container_lookup(container, proto->header->name) >= 0) {
+        return CDB_EINVAL;
+    }
+
+    if (nth == container->header.max_series) {
+        return CDB_ENOSPACE;
+    }
+
+    entry = &container->entries[nth];
+
+    memset(entry, 0, sizeof(*entry));
+    strncpy(entry->name, proto->header->name, sizeof(entry->name));
+
+    entry->offset = container->header.end;
+
+    series = _cdb_container_handle(container, nth);
+
+    memcpy(series->header, proto->header, HEADER_SIZE);
+
+    /* A new series gets the current header, whatever proto was read from */
+    memset(series->header->version, 0, sizeof(series->header->version));
+    strncpy(series->header->version, CDB_VERSION, sizeof(series->header->version));
+
+    /* Rows count their records from the size of the file */
+    if (series->header->layout == CDB_LAYOUT_ROWS) {
+        series->header->layout = CDB_LAYOUT_COLUMNS;
+    }
+
+    series->header->num_records  = 0;
+    series->header->start_record = 0;
+    series->header->data_offset  = 0;
+    series->header->start_block  = 0;
+    series->header->used_blocks  = 0;
+    series->header->base_time    = 0;
+
+    if ((size = _cdb_series_size(series->header)) == 0) {
+        cdb_free(series);
+        return CDB_EINVAL;
+    }
+
+    entry->size = ((size + CDB_CONTAINER_ALIGN - 1) / CDB_CONTAINER_ALIGN) * CDB_CONTAINER_ALIGN;
+
+    if (ftruncate(container->fd, entry->offset + entry->size) != 0) {
+        ret = cdb_error();
+        cdb_free(series);
+        return ret;
+    }
+
+    if ((ret = cdb_write_header(series)) != CDB_SUCCESS) {
+        cdb_free(series);
+        return ret;
+    }
+
+    /* The entry, then the count that makes it visible */
+    container->header.num_series += 1;
+    container->header.end        += entry->size;
+
+    _cdb_container_entry_encode(entry, buffer);
+
+    if (pwrite(container->fd, buffer, sizeof(buffer), _cdb_container_entry_offset(nth)) != sizeof(buffer)) {
+        ret = cdb_error();
+    } else {
+        ret = _cdb_container_write_header(container);
+    }
+
+    if (ret != CDB_SUCCESS) {
+        container->header.num_series -= 1;
+        container->header.end        -= entry->size;
+        cdb_free(series);
+        return ret;
+    }
+
+    _cdb_container_index(container, nth);
+
+    container->series[nth] = series;
+    *cdb = series;
+
+    return CDB_SUCCESS;
+}
+
+int cdb_container_add_series(cdb_container_t *container, cdb_t *proto, cdb_t **cdb) {
+
+    int ret = CDB_SUCCESS;
+
+    if ((container->flags & O_ACCMODE) == O_RDONLY) {
+        return CDB_ERDONLY;
+    }
+
+    if (proto->header->name[0] == '\0') {
+        return CDB_EINVAL;
+    }
+
+    pthread_mutex_lock(&container->lock);
+
+    if ((ret = _cdb_container_file_lock(container, F_WRLCK)) == CDB_SUCCESS) {
+
+        ret = _cdb_container_add_series(container, proto, cdb);
+
+        _cdb_container_file_lock(container, F_UNLCK);
+    }
+
+    pthread_mutex_unlock(&container->lock);
+
+    return ret;
+}
+
+static int _cdb_container_compare_reads(const void *a, const void *b) {
+
+    const _cdb_container_read_t *ra = (const _cdb_container_read_t*)a;
+    const _cdb_container_read_t *rb = (const _cdb_container_read_t*)b;
+
+    return ra->offset < rb->offset ? -1 : ra->offset > rb->offset;
+}
+
+/* Ask for runs of small neighbouring series to be read in one go. */
+static void _cdb_container_readahead(cdb_container_t *container, _cdb_container_read_t *reads, uint64_t num) {
+
+#ifdef POSIX_FADV_WILLNEED
+    uint64_t i = 0;
+
+    while (i < num) {
+        uint64_t start = reads[i].offset;
+        uint64_t end   = reads[i].offset + reads[i].size;
+
+        if (reads[i].size > CDB_CONTAINER_READAHEAD) {
+            i++;
+            continue;
+        }
+
+        for (i++; i < num && reads[i].offset <= end && reads[i].size <= CDB_CONTAINER_READAHEAD; i++) {
+
+            if (reads[i].offset + reads[i].size > end) {
+                end = reads[i].offset + reads[i].size;
+            }
+        }
+
+        posix_fadvise(container->fd, start, end - start, POSIX_FADV_WILLNEED);
+    }
+#endif
+}
+
+int cdb_container_read_records(cdb_container_t *container, const char **names, uint64_t num,
+    cdb_request_t *request, cdb_record_t **records, uint64_t *num_recs) {
+
+    _cdb_container_read_t *reads;
+    cdb_t **cdbs;
+    uint64_t i = 0;
+    int ret = CDB_SUCCESS;
+
+    for (i = 0; i < num; i++) {
+        records[i]  = NULL;
+        num_recs[i] = 0;
+    }
+
+    reads = calloc(num ? num : 1, sizeof(_cdb_container_read_t));
+    cdbs  = calloc(num ? num : 1, sizeof(cdb_t*));
+
+    if (reads == NULL || cdbs == NULL) {
+        free(reads);
+        free(cdbs);
+        return CDB_ENOMEM;
+    }
+
+    pthread_mutex_lock(&container->lock);
+
+    for (i = 0; i < num && ret == CDB_SUCCESS; i++) {
+        int64_t nth = 0;
+
+        if ((ret = _cdb_container_open_series(container, names[i], &nth)) == CDB_SUCCESS) {
+            cdbs[i]         = container->series[nth];
+            reads[i].offset = container->entries[nth].offset;
+            reads[i].size   = container->entries[nth].size;
+            reads[i].nth    = i;
+        }
+    }
+
+    pthread_mutex_unlock(&container->lock);
+
+    if (ret == CDB_SUCCESS) {
+
+        qsort(reads, num, sizeof(_cdb_container_read_t), _cdb_container_compare_reads);
+
+        _cdb_container_readahead(container, reads, num);
+
+        for (i = 0; i < num; i++) {
+            uint64_t nth = reads[i].nth;
+            cdb_request_t attempt = *request;
+            int read_ret = _cdb_read_records(cdbs[nth], &attempt, &num_recs[nth], &records[nth]);
+
+            if (read_ret == CDB_ENORECS) {
+                continue;
+            }
+
+            if (read_ret != CDB_SUCCESS && ret == CDB_SUCCESS) {
+                ret = read_ret;
+            }
+
+            if (read_ret == CDB_SUCCESS && num_recs[nth] == 0) {
+                free(records[nth]);
+                records[nth] = NULL;
+            }
+        }
+    }
+
+    free(reads);
+    free(cdbs);
+
+    return ret;
+}
+
+uint32_t cdb_container_num_series(cdb_container_t *container) {
+
+    uint32_t num_series = 0;
+
+    pthread_mutex_lock(&container->lock);
+
+    if (_cdb_container_refresh(container) == CDB_SUCCESS) {
+        num_series = container->header.num_series;
+    }
+
+    pthread_mutex_unlock(&container->lock);
+
+    return num_series;
+}
+
+int cdb_container_close(cdb_container_t *container) {
+
+    int ret = CDB_SUCCESS;
+    uint32_t nth = 0;
+
+    if (container == NULL) {
+        return CDB_SUCCESS;
+    }
+
+    if (container->series != NULL) {
+
+        for (nth = 0; nth < container->header.max_series; nth++) {
+            cdb_free(container->series[nth]);
+        }
+    }
+
+    if (container->fd >= 0 && close(container->fd) != 0) {
+        ret = cdb_error();
+    }
+
+    pthread_mutex_destroy(&container->lock);
+
+    free(container->entries);
+    free(container->series);
+    free(container->index);
+    free(container->filename);
+    free(container);
+
+    return ret;
+}
+
+/* -*- Mode: C; tab-width: 4 -*- */
+/* vim: set tabstop=4 expandtab shiftwidth=4: */
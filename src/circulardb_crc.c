@@ -0,0 +1,143 @@
+/*
+ * CircularDB implementation for time series data.
+ *
+ * Copyright (c) 2007-2009 Powerset, Inc
+ * Copyright (c) Dan Grillo, Manish Dubey, Dan Sully
+ *
+ * All rights reserved.
+ */
+
+/* CRC32C (Castagnoli), using the SSE4.2 crc32 instruction when the CPU has
+ * it and a table otherwise. There is no pre or post inversion: the caller
+ * passes 0 to start, and runs of zeros leave a zero CRC alone. */
+
+#include "config.h"
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "circulardb_private.h"
+
+/* Reflected polynomial */
+#define CDB_CRC32C_POLY 0x82f63b78U
+
+static pthread_once_t _cdb_crc_once = PTHREAD_ONCE_INIT;
+
+static uint32_t _cdb_crc_table[256];
+
+/* x^(8 * 2^n) modulo the polynomial */
+static uint32_t _cdb_crc_x2n[64];
+
+static uint32_t (*_cdb_crc_update)(uint32_t crc, const unsigned char *buffer, size_t len);
+
+static uint32_t _cdb_crc32c_table(uint32_t crc, const unsigned char *buffer, size_t len) {
+
+    while (len-- > 0) {
+        crc = _cdb_crc_table[(crc ^ *buffer++) & 0xff] ^ (crc >> 8);
+    }
+
+    return crc;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+__attribute__((target("sse4.2")))
+static uint32_t _cdb_crc32c_sse42(uint32_t crc, const unsigned char *buffer, size_t len) {
+
+    uint64_t crc64 = crc;
+
+    while (len >= sizeof(uint64_t)) {
+        uint64_t word;
+
+        memcpy(&word, buffer, sizeof(word));
+
+        crc64   = __builtin_ia32_crc32di(crc64, word);
+        buffer += sizeof(uint64_t);
+        len    -= sizeof(uint64_t);
+    }
+
+    crc = (uint32_t)crc64;
+
+    while (len-- > 0) {
+        crc = __builtin_ia32_crc32qi(crc, *buffer++);
+    }
+
+    return crc;
+}
+#endif
+
+/* a * b modulo the polynomial, bit reflected */
+static uint32_t _cdb_crc_multiply(uint32_t a, uint32_t b) {
+
+    uint32_t m = 1U << 31;
+    uint32_t p = 0;
+
+    while (m != 0) {
+
+        if (a & m) {
+            p ^= b;
+        }
+
+        m >>= 1;
+        b = (b & 1) ? (b >> 1) ^ CDB_CRC32C_POLY : b >> 1;
+    }
+
+    return p;
+}
+
+static void _cdb_crc_init(void) {
+
+    uint32_t p = 1U << 23;      /* x^8 */
+    int i = 0;
+    int k = 0;
+
+    for (i = 0; i < 256; i++) {
+        uint32_t crc = i;
+
+        for (k = 0; k < 8; k++) {
+            crc = (crc & 1) ? (crc >> 1) ^ CDB_CRC32C_POLY : crc >> 1;
+        }
+
+        _cdb_crc_table[i] = crc;
+    }
+
+    for (i = 0; i < 64; i++) {
+        _cdb_crc_x2n[i] = p;
+        p = _cdb_crc_multiply(p, p);
+    }
+
+    _cdb_crc_update = _cdb_crc32c_table;
+
+#if defined(__x86_64__) && defined(__GNUC__)
+    if (__builtin_cpu_supports("sse4.2")) {
+        _cdb_crc_update = _cdb_crc32c_sse42;
+    }
+#endif
+}
+
+uint32_t _cdb_crc32c(uint32_t crc, const void *buffer, size_t len) {
+
+    pthread_once(&_cdb_crc_once, _cdb_crc_init);
+
+    return _cdb_crc_update(crc, (const unsigned char*)buffer, len);
+}
+
+uint32_t _cdb_crc32c_zeros(uint32_t crc, uint64_t len) {
+
+    int n = 0;
+
+    pthread_once(&_cdb_crc_once, _cdb_crc_init);
+
+    for (n = 0; len != 0 && n < 64; n++, len >>= 1) {
+
+        if (len & 1) {
+            crc = _cdb_crc_multiply(_cdb_crc_x2n[n], crc);
+        }
+    }
+
+    return crc;
+}
+
+/* -*- Mode: C; tab-width: 4 -*- */
+/* vim: set tabstop=4 expandtab shiftwidth=4: */
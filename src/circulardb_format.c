@@ -0,0 +1,387 @@
+/*
+ * CircularDB implementation for time series data.
+ *
+ * Copyright (c) 2007-2009 Powerset, Inc
+ * Copyright (c) Dan Grillo, Manish Dubey, Dan Sully
+ *
+ * All rights reserved.
+ */
+
+/* Number and date formatting, and number parsing, for moving records in and
+ * out as text without going through printf()/strtod() for every one.
+ *
+ * Doubles are written so they read back as the same double: integers and
+ * values with up to CDB_FORMAT_DECIMALS decimals that are exactly the double
+ * nearest to that decimal are done by hand, anything else goes to "%.17g".
+ * Parsing takes the same shortcut the other way: up to 19 digits and a power
+ * of ten of at most 22 convert exactly, the rest goes to strtod().
+ *
+ * The print functions keep their "%.8g" output, done by hand for everything
+ * but exponents and values too close to half way to round safely. */
+
+#include "config.h"
+
+#include <float.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "circulardb_private.h"
+
+/* Most decimals the hand formatter tries before giving up */
+#define CDB_FORMAT_DECIMALS 6
+
+/* Integers up to this convert to double exactly */
+#define CDB_EXACT_INTEGER 9007199254740992.0
+
+static const double _cdb_powers_of_ten[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+static const double _cdb_negative_powers_of_ten[] = {
+    1e0, 1e-1, 1e-2, 1e-3, 1e-4
+};
+
+/* Digits of value, backwards from end. Returns where they start. */
+static char* _cdb_format_digits(char *end, uint64_t value) {
+
+    do {
+        *--end = (char)('0' + (value % 10));
+        value /= 10;
+    } while (value != 0);
+
+    return end;
+}
+
+size_t _cdb_format_int(char *buffer, int64_t value) {
+
+    char digits[24];
+    char *start;
+    size_t len = 0;
+    uint64_t magnitude = value < 0 ? (uint64_t)0 - (uint64_t)value : (uint64_t)value;
+
+    start = _cdb_format_digits(digits + sizeof(digits), magnitude);
+
+    if (value < 0) {
+        buffer[len++] = '-';
+    }
+
+    memcpy(buffer + len, start, (digits + sizeof(digits)) - start);
+    len += (digits + sizeof(digits)) - start;
+    buffer[len] = '\0';
+
+    return len;
+}
+
+size_t _cdb_format_double(char *buffer, double value) {
+
+    double magnitude = fabs(value);
+    int decimals = 0;
+
+    if (isnan(value)) {
+        memcpy(buffer, "nan", 4);
+        return 3;
+    }
+
+    if (isinf(value)) {
+        memcpy(buffer, value < 0 ? "-inf" : "inf", value < 0 ? 5 : 4);
+        return value < 0 ? 4 : 3;
+    }
+
+    for (decimals = 0; decimals <= CDB_FORMAT_DECIMALS; decimals++) {
+        double scaled = magnitude * _cdb_powers_of_ten[decimals];
+        double mantissa;
+
+        if (scaled >= CDB_EXACT_INTEGER) {
+            break;
+        }
+
+        mantissa = floor(scaled + 0.5);
+
+        /* Division of two exact doubles rounds correctly, just like the
+         * parse of the decimal would */
+        if (mantissa / _cdb_powers_of_ten[decimals] == magnitude) {
+            char digits[24];
+            char *end   = digits + sizeof(digits);
+            char *start = _cdb_format_digits(end, (uint64_t)mantissa);
+            size_t len  = 0;
+            size_t count = end - start;
+
+            if (value < 0 || (value == 0 && signbit(value))) {
+                buffer[len++] = '-';
+            }
+
+            if (decimals == 0) {
+                memcpy(buffer + len, start, count);
+                len += count;
+
+            } else {
+
+                /* Pad to at least one digit before the point */
+                while (count <= (size_t)decimals) {
+                    *--start = '0';
+                    count++;
+                }
+
+                memcpy(buffer + len, start, count - decimals);
+                len += count - decimals;
+                buffer[len++] = '.';
+                memcpy(buffer + len, start + count - decimals, decimals);
+                len += decimals;
+            }
+
+            buffer[len] = '\0';
+
+            return len;
+        }
+    }
+
+    return (size_t)snprintf(buffer, CDB_FORMAT_DOUBLE_MAX, "%.17g", value);
+}
+
+size_t _cdb_format_double_g(char *buffer, double value, int precision) {
+
+    double magnitude = fabs(value);
+    double scaled;
+    double mantissa;
+    char digits[24];
+    char *end = digits + sizeof(digits);
+    char *start;
+    size_t len = 0;
+    int exponent = -4;
+    int point;
+
+    if (value == 0 && !signbit(value)) {
+        memcpy(buffer, "0", 2);
+        return 1;
+    }
+
+    /* "%g" switches to an exponent below 1e-4 and from 10^precision up.
+     * Each of the doubles 1e-4 to 1e-1 is just above the power of ten, so
+     * comparing against them finds the exponent exactly. */
+    if (!isfinite(value) || magnitude < _cdb_negative_powers_of_ten[4] ||
+        magnitude >= _cdb_powers_of_ten[precision]) {
+
+        return (size_t)snprintf(buffer, CDB_FORMAT_DOUBLE_MAX, "%.*g", precision, value);
+    }
+
+    while (exponent < precision - 1 && magnitude >= (exponent + 1 < 0 ?
+        _cdb_negative_powers_of_ten[-(exponent + 1)] : _cdb_powers_of_ten[exponent + 1])) {
+        exponent++;
+    }
+
+    /* The multiply by an exact power of ten rounds once, so only a value
+     * within an ulp or two of half way can round the wrong way */
+    scaled   = magnitude * _cdb_powers_of_ten[precision - 1 - exponent];
+    mantissa = floor(scaled + 0.5);
+
+    if (fabs(fabs(scaled - floor(scaled)) - 0.5) <= scaled * 4 * DBL_EPSILON ||
+        mantissa >= _cdb_powers_of_ten[precision]) {
+
+        return (size_t)snprintf(buffer, CDB_FORMAT_DOUBLE_MAX, "%.*g", precision, value);
+    }
+
+    start = _cdb_format_digits(end, (uint64_t)mantissa);
+
+    /* Trailing zeros of the fraction go, as they do for "%g" */
+    point = exponent + 1;
+
+    while (end - start > point && end - start > 1 && end[-1] == '0') {
+        end--;
+    }
+
+    if (value < 0) {
+        buffer[len++] = '-';
+    }
+
+    if (point <= 0) {
+        buffer[len++] = '0';
+        buffer[len++] = '.';
+        memset(buffer + len, '0', -point);
+        len += -point;
+        memcpy(buffer + len, start, end - start);
+        len += end - start;
+
+    } else {
+        memcpy(buffer + len, start, point);
+        len += point;
+
+        if (end - start > point) {
+            buffer[len++] = '.';
+            memcpy(buffer + len, start + point, (end - start) - point);
+            len += (end - start) - point;
+        }
+    }
+
+    buffer[len] = '\0';
+
+    return len;
+}
+
+size_t _cdb_format_date(cdb_date_cache_t *cache, cdb_time_t time, const char *format, const char **formatted) {
+
+    if (cache->valid == false || cache->time != time) {
+        struct tm tm;
+        time_t stime = (time_t)time;
+
+        if (cache->day_end > 0 && time >= cache->day_start && time < cache->day_end) {
+            int64_t seconds = time - cache->day_start;
+
+            tm = cache->day;
+            tm.tm_hour = (int)(seconds / 3600);
+            tm.tm_min  = (int)((seconds / 60) % 60);
+            tm.tm_sec  = (int)(seconds % 60);
+
+        } else {
+            struct tm first;
+            struct tm last;
+            time_t first_second;
+            time_t last_second;
+
+            localtime_r(&stime, &tm);
+
+            cache->day       = tm;
+            cache->day_start = time - ((tm.tm_hour * 3600) + (tm.tm_min * 60) + tm.tm_sec);
+            cache->day_end   = cache->day_start + 86400;
+
+            /* A day with a daylight saving change isn't 86400 seconds of
+             * the same offset - leave those to localtime_r() */
+            first_second = (time_t)cache->day_start;
+            last_second  = (time_t)(cache->day_end - 1);
+
+            localtime_r(&first_second, &first);
+            localtime_r(&last_second, &last);
+
+            if (first.tm_yday != tm.tm_yday || first.tm_hour != 0 || first.tm_min != 0 || first.tm_sec != 0 ||
+                last.tm_yday != tm.tm_yday || last.tm_hour != 23 || last.tm_min != 59 || last.tm_sec != 59) {
+                cache->day_end = 0;
+            }
+        }
+
+        cache->len   = strftime(cache->formatted, sizeof(cache->formatted), format, &tm);
+        cache->time  = time;
+        cache->valid = true;
+    }
+
+    *formatted = cache->formatted;
+
+    return cache->len;
+}
+
+bool _cdb_parse_int(const char **p, const char *end, int64_t *value) {
+
+    const char *s = *p;
+    uint64_t magnitude = 0;
+    bool negative = false;
+
+    if (s < end && (*s == '-' || *s == '+')) {
+        negative = *s++ == '-';
+    }
+
+    if (s == end || *s < '0' || *s > '9') {
+        return false;
+    }
+
+    while (s < end && *s >= '0' && *s <= '9') {
+        magnitude = (magnitude * 10) + (uint64_t)(*s++ - '0');
+    }
+
+    *value = negative ? (int64_t)((uint64_t)0 - magnitude) : (int64_t)magnitude;
+    *p = s;
+
+    return true;
+}
+
+bool _cdb_parse_double(const char **p, const char *end, double *value) {
+
+    const char *s = *p;
+    uint64_t mantissa = 0;
+    int digits = 0;
+    int exponent = 0;
+    bool negative = false;
+    bool any = false;
+
+    if (s < end && (*s == '-' || *s == '+')) {
+        negative = *s++ == '-';
+    }
+
+    while (s < end && *s >= '0' && *s <= '9') {
+
+        if (digits < 19) {
+            mantissa = (mantissa * 10) + (uint64_t)(*s - '0');
+            digits  += mantissa > 0;
+        } else {
+            exponent += 1;
+        }
+
+        s++;
+        any = true;
+    }
+
+    if (s < end && *s == '.') {
+        s++;
+
+        while (s < end && *s >= '0' && *s <= '9') {
+
+            if (digits < 19) {
+                mantissa  = (mantissa * 10) + (uint64_t)(*s - '0');
+                digits   += mantissa > 0;
+                exponent -= 1;
+            }
+
+            s++;
+            any = true;
+        }
+    }
+
+    if (any && s < end && (*s == 'e' || *s == 'E')) {
+        const char *e = s + 1;
+        int64_t power = 0;
+
+        if (_cdb_parse_int(&e, end, &power) && power > -400 && power < 400) {
+            exponent += (int)power;
+            s = e;
+        } else {
+            any = false;
+        }
+    }
+
+    if (any && mantissa <= (uint64_t)CDB_EXACT_INTEGER && exponent >= -22 && exponent <= 22) {
+        double result = (double)mantissa;
+
+        result = exponent < 0 ? result / _cdb_powers_of_ten[-exponent] : result * _cdb_powers_of_ten[exponent];
+
+        *value = negative ? -result : result;
+        *p = s;
+
+        return true;
+    }
+
+    /* Everything else, nan and inf included */
+    {
+        char copy[64];
+        char *stop = NULL;
+        size_t len = end - *p < (long)sizeof(copy) - 1 ? (size_t)(end - *p) : sizeof(copy) - 1;
+
+        memcpy(copy, *p, len);
+        copy[len] = '\0';
+
+        *value = strtod(copy, &stop);
+
+        if (stop == copy) {
+            return false;
+        }
+
+        *p += stop - copy;
+    }
+
+    return true;
+}
+
+/* -*- Mode: C; tab-width: 4 -*- */
+/* vim: set tabstop=4 expandtab shiftwidth=4: */
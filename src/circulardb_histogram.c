@@ -0,0 +1,322 @@
+/*
+ * CircularDB implementation for time series data.
+ *
+ * Copyright (c) 2007-2009 Powerset, Inc
+ * Copyright (c) Dan Grillo, Manish Dubey, Dan Sully
+ *
+ * All rights reserved.
+ */
+
+/* Latency histograms.
+ *
+ * Every thread that times an operation gets a set of histograms of its own,
+ * found through a thread local pointer, and is the only one to write it - a
+ * relaxed load and store per counter, no locked instructions. The sets are on
+ * a list so snapshots can add them up. When a thread exits its counts are
+ * folded into the retired set and its own is freed.
+ *
+ * A reset bumps the epoch rather than zeroing sets other threads are writing
+ * to: a thread that finds its set from an older epoch zeroes it before it
+ * records again, and snapshots skip such sets until it does. */
+
+#include "config.h"
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <circulardb_interface.h>
+
+#include "circulardb_private.h"
+
+#define CDB_HISTOGRAM_SUB_BUCKETS (1 << CDB_HISTOGRAM_SUB_BITS)
+
+static const char *_cdb_op_names[CDB_OP_MAX] = {
+    "open", "read", "search", "write", "stats", "aggregate",
+};
+
+const char* cdb_op_name(cdb_op_t op) {
+
+    if ((int)op < 0 || op >= CDB_OP_MAX) {
+        return "unknown";
+    }
+
+    return _cdb_op_names[op];
+}
+
+uint64_t cdb_histogram_bucket_low(int bucket) {
+
+    int shift;
+
+    if (bucket < CDB_HISTOGRAM_SUB_BUCKETS) {
+        return bucket < 0 ? 0 : (uint64_t)bucket;
+    }
+
+    if (bucket >= CDB_HISTOGRAM_BUCKETS) {
+        bucket = CDB_HISTOGRAM_BUCKETS - 1;
+    }
+
+    shift = (bucket >> CDB_HISTOGRAM_SUB_BITS) - 1;
+
+    return (uint64_t)(CDB_HISTOGRAM_SUB_BUCKETS + (bucket & (CDB_HISTOGRAM_SUB_BUCKETS - 1))) << shift;
+}
+
+uint64_t cdb_histogram_bucket_high(int bucket) {
+
+    if (bucket < CDB_HISTOGRAM_SUB_BUCKETS) {
+        return cdb_histogram_bucket_low(bucket);
+    }
+
+    if (bucket >= CDB_HISTOGRAM_BUCKETS) {
+        bucket = CDB_HISTOGRAM_BUCKETS - 1;
+    }
+
+    return cdb_histogram_bucket_low(bucket) + ((uint64_t)1 << ((bucket >> CDB_HISTOGRAM_SUB_BITS) - 1)) - 1;
+}
+
+uint64_t cdb_histogram_percentile(const cdb_histogram_t *histogram, double p) {
+
+    uint64_t rank;
+    uint64_t seen = 0;
+    int i;
+
+    if (histogram->count == 0) {
+        return 0;
+    }
+
+    p    = p < 0 ? 0 : p > 1 ? 1 : p;
+    rank = (uint64_t)(p * (histogram->count - 1)) + 1;
+
+    for (i = 0; i < CDB_HISTOGRAM_BUCKETS; i++) {
+
+        if ((seen += histogram->buckets[i]) >= rank) {
+            uint64_t high = cdb_histogram_bucket_high(i);
+            return high < histogram->max_ns ? high : histogram->max_ns;
+        }
+    }
+
+    return histogram->max_ns;
+}
+
+void cdb_merge_histogram(cdb_histogram_t *into, const cdb_histogram_t *from) {
+
+    int i;
+
+    into->count  += from->count;
+    into->sum_ns += from->sum_ns;
+
+    if (from->max_ns > into->max_ns) {
+        into->max_ns = from->max_ns;
+    }
+
+    for (i = 0; i < CDB_HISTOGRAM_BUCKETS; i++) {
+        into->buckets[i] += from->buckets[i];
+    }
+}
+
+#ifdef CDB_STATS
+
+/* Linear below CDB_HISTOGRAM_SUB_BUCKETS, then CDB_HISTOGRAM_SUB_BUCKETS
+ * buckets for each power of two. */
+static int _cdb_histogram_bucket(uint64_t ns) {
+
+    int shift;
+
+    if (ns < CDB_HISTOGRAM_SUB_BUCKETS) {
+        return (int)ns;
+    }
+
+    shift = 63 - __builtin_clzll(ns) - CDB_HISTOGRAM_SUB_BITS;
+
+    return ((shift + 1) << CDB_HISTOGRAM_SUB_BITS) + (int)((ns >> shift) & (CDB_HISTOGRAM_SUB_BUCKETS - 1));
+}
+
+typedef struct _cdb_histograms_s {
+    struct _cdb_histograms_s *next;
+    struct _cdb_histograms_s *prev;
+    uint64_t epoch;
+    cdb_histogram_t ops[CDB_OP_MAX];
+} _cdb_histograms_t;
+
+static pthread_mutex_t _cdb_histograms_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t _cdb_histograms_once  = PTHREAD_ONCE_INIT;
+static pthread_key_t _cdb_histograms_key;
+
+static _cdb_histograms_t *_cdb_histograms_list = NULL;
+static _cdb_histograms_t _cdb_histograms_retired;
+static uint64_t _cdb_histograms_epoch = 0;
+
+static __thread _cdb_histograms_t *_cdb_thread_histograms = NULL;
+
+/* Copy a set that may be written to while we read it */
+static void _cdb_histograms_add(cdb_histogram_t *into, _cdb_histograms_t *set) {
+
+    int op, i;
+
+    for (op = 0; op < CDB_OP_MAX; op++) {
+        cdb_histogram_t *from = &set->ops[op];
+        uint64_t max = __atomic_load_n(&from->max_ns, __ATOMIC_RELAXED);
+
+        into[op].count  += __atomic_load_n(&from->count, __ATOMIC_RELAXED);
+        into[op].sum_ns += __atomic_load_n(&from->sum_ns, __ATOMIC_RELAXED);
+
+        if (max > into[op].max_ns) {
+            into[op].max_ns = max;
+        }
+
+        for (i = 0; i < CDB_HISTOGRAM_BUCKETS; i++) {
+            into[op].buckets[i] += __atomic_load_n(&from->buckets[i], __ATOMIC_RELAXED);
+        }
+    }
+}
+
+static void _cdb_histograms_exit(void *arg) {
+
+    _cdb_histograms_t *set = (_cdb_histograms_t*)arg;
+
+    pthread_mutex_lock(&_cdb_histograms_lock);
+
+    if (set->epoch == _cdb_histograms_epoch) {
+        _cdb_histograms_add(_cdb_histograms_retired.ops, set);
+    }
+
+    if (set->prev != NULL) {
+        set->prev->next = set->next;
+    } else {
+        _cdb_histograms_list = set->next;
+    }
+
+    if (set->next != NULL) {
+        set->next->prev = set->prev;
+    }
+
+    pthread_mutex_unlock(&_cdb_histograms_lock);
+
+    free(set);
+}
+
+static void _cdb_histograms_init(void) {
+    pthread_key_create(&_cdb_histograms_key, _cdb_histograms_exit);
+}
+
+static _cdb_histograms_t* _cdb_histograms_for_thread(void) {
+
+    _cdb_histograms_t *set = _cdb_thread_histograms;
+
+    if (set != NULL) {
+        return set;
+    }
+
+    pthread_once(&_cdb_histograms_once, _cdb_histograms_init);
+
+    if ((set = calloc(1, sizeof(_cdb_histograms_t))) == NULL) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&_cdb_histograms_lock);
+
+    set->epoch = _cdb_histograms_epoch;
+    set->next  = _cdb_histograms_list;
+
+    if (_cdb_histograms_list != NULL) {
+        _cdb_histograms_list->prev = set;
+    }
+
+    _cdb_histograms_list = set;
+
+    pthread_mutex_unlock(&_cdb_histograms_lock);
+
+    pthread_setspecific(_cdb_histograms_key, set);
+    _cdb_thread_histograms = set;
+
+    return set;
+}
+
+/* Only this thread writes to its set, so the counters need no locked
+ * instructions - just whole loads and stores for the snapshots. */
+static void _cdb_histogram_bump(uint64_t *counter, uint64_t n) {
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+void _cdb_histogram_record(cdb_op_t op, uint64_t ns) {
+
+    _cdb_histograms_t *set = _cdb_histograms_for_thread();
+    cdb_histogram_t *histogram;
+    uint64_t epoch;
+
+    if (set == NULL) {
+        return;
+    }
+
+    /* Reset since we last recorded - start again. Snapshots ignore the set
+     * until its epoch is current. */
+    if ((epoch = __atomic_load_n(&_cdb_histograms_epoch, __ATOMIC_ACQUIRE)) != set->epoch) {
+        memset(set->ops, 0, sizeof(set->ops));
+        __atomic_store_n(&set->epoch, epoch, __ATOMIC_RELEASE);
+    }
+
+    histogram = &set->ops[op];
+
+    _cdb_histogram_bump(&histogram->count, 1);
+    _cdb_histogram_bump(&histogram->sum_ns, ns);
+    _cdb_histogram_bump(&histogram->buckets[_cdb_histogram_bucket(ns)], 1);
+
+    if (ns > histogram->max_ns) {
+        __atomic_store_n(&histogram->max_ns, ns, __ATOMIC_RELAXED);
+    }
+}
+
+int cdb_get_histograms(cdb_histogram_t histograms[CDB_OP_MAX]) {
+
+    _cdb_histograms_t *set;
+    uint64_t epoch;
+
+    memset(histograms, 0, CDB_OP_MAX * sizeof(cdb_histogram_t));
+
+    pthread_mutex_lock(&_cdb_histograms_lock);
+
+    epoch = _cdb_histograms_epoch;
+
+    _cdb_histograms_add(histograms, &_cdb_histograms_retired);
+
+    for (set = _cdb_histograms_list; set != NULL; set = set->next) {
+
+        if (__atomic_load_n(&set->epoch, __ATOMIC_ACQUIRE) == epoch) {
+            _cdb_histograms_add(histograms, set);
+        }
+    }
+
+    pthread_mutex_unlock(&_cdb_histograms_lock);
+
+    return CDB_SUCCESS;
+}
+
+void cdb_reset_histograms(void) {
+
+    pthread_mutex_lock(&_cdb_histograms_lock);
+
+    memset(&_cdb_histograms_retired, 0, sizeof(_cdb_histograms_retired));
+    __atomic_store_n(&_cdb_histograms_epoch, _cdb_histograms_epoch + 1, __ATOMIC_RELEASE);
+
+    pthread_mutex_unlock(&_cdb_histograms_lock);
+}
+
+#else
+
+int cdb_get_histograms(cdb_histogram_t histograms[CDB_OP_MAX]) {
+
+    memset(histograms, 0, CDB_OP_MAX * sizeof(cdb_histogram_t));
+
+    return CDB_EINVAL;
+}
+
+void cdb_reset_histograms(void) {
+}
+
+#endif
+
+/* -*- Mode: C; tab-width: 4 -*- */
+/* vim: set tabstop=4 expandtab shiftwidth=4: */
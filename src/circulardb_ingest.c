@@ -0,0 +1,565 @@
+/*
+ * CircularDB implementation for time series data.
+ *
+ * Copyright (c) 2007-2009 Powerset, Inc
+ * Copyright (c) Dan Grillo, Manish Dubey, Dan Sully
+ *
+ * All rights reserved.
+ */
+
+/* Ingest queue.
+ *
+ * Producers push single records for any cdb_t into a bounded multi producer,
+ * single consumer ring (Dmitry Vyukov's design - every slot carries its own
+ * sequence number, so a push is one compare and swap on the tail and no
+ * locks). Each ring is drained by its own flusher thread, which sorts what it
+ * took off the ring by series and hands every series' run to a single
+ * cdb_write_records() call.
+ *
+ * A series always hashes to the same ring, so records for one cdb_t are
+ * written in the order they were pushed (per producer), and only ever by one
+ * flusher.
+ *
+ * Producers count themselves in and out of cdb_ingest_push(). Shutting down
+ * turns new pushes away, waits for the ones already inside to finish, and
+ * only then lets the flushers drain their rings and exit - so nothing is
+ * pushed onto a ring that has been freed, or that no flusher will empty. */
+
+#include "config.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
+
+#include <circulardb_interface.h>
+
+/* Most records a flusher takes off its ring in one go */
+#define CDB_INGEST_BATCH 4096
+
+/* How long a sleeping flusher or a blocked producer waits before looking
+ * again on its own, in case it missed a wakeup */
+#define CDB_INGEST_WAIT_MSEC 10
+
+#define CDB_CACHE_LINE 64
+
+typedef struct _cdb_ingest_slot_s {
+    volatile uint64_t sequence;
+    cdb_t *cdb;
+    cdb_record_t record;
+} _cdb_ingest_slot_t;
+
+/* A record taken off the ring, remembering its place so sorting by series
+ * keeps each series in push order. */
+typedef struct _cdb_ingest_entry_s {
+    cdb_t *cdb;
+    uint64_t order;
+    cdb_record_t record;
+} _cdb_ingest_entry_t;
+
+typedef struct _cdb_ingest_queue_s {
+    /* Producers only touch the tail, the flusher only the head */
+    volatile uint64_t tail;
+    char pad1[CDB_CACHE_LINE - sizeof(uint64_t)];
+    volatile uint64_t head;
+    char pad2[CDB_CACHE_LINE - sizeof(uint64_t)];
+
+    /* Records whose write has completed (or failed) */
+    volatile uint64_t done;
+    volatile uint64_t written;
+    volatile uint64_t failed;
+    volatile uint64_t rejected;
+    volatile uint64_t high_water;
+    volatile int error;
+
+    volatile bool idle;
+    volatile int waiters;
+
+    uint64_t mask;
+    _cdb_ingest_slot_t *slots;
+
+    _cdb_ingest_entry_t *entries;
+    cdb_record_t *records;
+
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t work;    /* signalled when records are pushed or on shutdown */
+    pthread_cond_t room;    /* signalled when a batch has been taken off the ring */
+    pthread_cond_t drained; /* signalled when a batch has been written */
+
+    struct cdb_ingest_s *ingest;
+} _cdb_ingest_queue_t;
+
+struct cdb_ingest_s {
+    int num_queues;
+    bool block;
+    volatile bool stopping;     /* no new pushes */
+    volatile bool draining;     /* no pushes left - flushers exit once empty */
+    volatile int pushing;       /* producers inside cdb_ingest_push() */
+    _cdb_ingest_queue_t *queues;
+};
+
+static void _cdb_ingest_timedwait(pthread_cond_t *cond, pthread_mutex_t *mutex, int msec) {
+
+    struct timeval now;
+    struct timespec until;
+
+    gettimeofday(&now, NULL);
+
+    until.tv_sec  = now.tv_sec + (msec / 1000);
+    until.tv_nsec = (now.tv_usec * 1000) + ((msec % 1000) * 1000000);
+
+    if (until.tv_nsec >= 1000000000) {
+        until.tv_sec  += 1;
+        until.tv_nsec -= 1000000000;
+    }
+
+    pthread_cond_timedwait(cond, mutex, &until);
+}
+
+/* Series are spread over the rings by their handle, not their name - two
+ * handles on one file are two series as far as the ingest queue goes. */
+static _cdb_ingest_queue_t* _cdb_ingest_queue_for(cdb_ingest_t *ingest, cdb_t *cdb) {
+
+    uint64_t hash = (uint64_t)(uintptr_t)cdb;
+
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+
+    return &ingest->queues[hash % ingest->num_queues];
+}
+
+static bool _cdb_ingest_enqueue(_cdb_ingest_queue_t *queue, cdb_t *cdb, cdb_time_t time, double value) {
+
+    _cdb_ingest_slot_t *slot;
+    uint64_t pos = queue->tail;
+
+    for (;;) {
+        int64_t diff;
+
+        slot = &queue->slots[pos & queue->mask];
+
+        __sync_synchronize();
+
+        diff = (int64_t)slot->sequence - (int64_t)pos;
+
+        if (diff == 0) {
+            uint64_t seen = __sync_val_compare_and_swap(&queue->tail, pos, pos + 1);
+
+            if (seen == pos) {
+                break;
+            }
+
+            pos = seen;
+
+        } else if (diff < 0) {
+
+            /* The flusher hasn't freed this slot from the previous lap */
+            return false;
+
+        } else {
+            pos = queue->tail;
+        }
+    }
+
+    slot->cdb          = cdb;
+    slot->record.time  = time;
+    slot->record.value = value;
+
+    /* Publish the slot to the flusher */
+    __sync_synchronize();
+    slot->sequence = pos + 1;
+
+    return true;
+}
+
+/* Take up to CDB_INGEST_BATCH published records off the ring. */
+static uint64_t _cdb_ingest_dequeue(_cdb_ingest_queue_t *queue) {
+
+    uint64_t len = 0;
+
+    while (len < CDB_INGEST_BATCH) {
+        uint64_t pos = queue->head;
+        _cdb_ingest_slot_t *slot = &queue->slots[pos & queue->mask];
+
+        __sync_synchronize();
+
+        if (slot->sequence != pos + 1) {
+            break;
+        }
+
+        queue->entries[len].cdb    = slot->cdb;
+        queue->entries[len].order  = pos;
+        queue->entries[len].record = slot->record;
+        len++;
+
+        /* Hand the slot back to producers for the next lap */
+        __sync_synchronize();
+        slot->sequence = pos + queue->mask + 1;
+        queue->head = pos + 1;
+    }
+
+    return len;
+}
+
+static int _cdb_ingest_compare(const void *a, const void *b) {
+
+    const _cdb_ingest_entry_t *x = (const _cdb_ingest_entry_t*)a;
+    const _cdb_ingest_entry_t *y = (const _cdb_ingest_entry_t*)b;
+
+    if (x->cdb != y->cdb) {
+        return (uintptr_t)x->cdb < (uintptr_t)y->cdb ? -1 : 1;
+    }
+
+    if (x->order != y->order) {
+        return x->order < y->order ? -1 : 1;
+    }
+
+    return 0;
+}
+
+/* Write a batch out with one cdb_write_records() call per series. */
+static void _cdb_ingest_write(_cdb_ingest_queue_t *queue, uint64_t len) {
+
+    uint64_t i = 0;
+
+    qsort(queue->entries, len, sizeof(_cdb_ingest_entry_t), _cdb_ingest_compare);
+
+    while (i < len) {
+        cdb_t *cdb = queue->entries[i].cdb;
+        uint64_t num_recs = 0;
+        uint64_t run = 0;
+        int ret;
+
+        while (i + run < len && queue->entries[i + run].cdb == cdb) {
+            queue->records[run] = queue->entries[i + run].record;
+            run++;
+        }
+
+        ret = cdb_write_records(cdb, queue->records, run, &num_recs);
+
+        if (ret == CDB_SUCCESS) {
+            __sync_fetch_and_add(&queue->written, run);
+        } else {
+            __sync_fetch_and_add(&queue->failed, run);
+            queue->error = ret;
+        }
+
+        i += run;
+    }
+}
+
+static void* _cdb_ingest_flusher(void *arg) {
+
+    _cdb_ingest_queue_t *queue = (_cdb_ingest_queue_t*)arg;
+    cdb_ingest_t *ingest = queue->ingest;
+
+    for (;;) {
+        uint64_t depth = queue->tail - queue->done;
+        uint64_t len;
+
+        if (depth > queue->high_water) {
+            queue->high_water = depth;
+        }
+
+        len = _cdb_ingest_dequeue(queue);
+
+        if (len > 0) {
+
+            /* Blocked producers can go again as soon as the slots are free */
+            if (queue->waiters > 0) {
+                pthread_mutex_lock(&queue->mutex);
+                pthread_cond_broadcast(&queue->room);
+                pthread_mutex_unlock(&queue->mutex);
+            }
+
+            _cdb_ingest_write(queue, len);
+
+            pthread_mutex_lock(&queue->mutex);
+            queue->done += len;
+            pthread_cond_broadcast(&queue->drained);
+            pthread_mutex_unlock(&queue->mutex);
+
+            continue;
+        }
+
+        /* Every push has finished, so everything claimed is published */
+        if (ingest->draining && queue->done == queue->tail) {
+            break;
+        }
+
+        pthread_mutex_lock(&queue->mutex);
+
+        queue->idle = true;
+        __sync_synchronize();
+
+        /* Check again now that producers will see us as idle */
+        if (queue->slots[queue->head & queue->mask].sequence != queue->head + 1 && !ingest->draining) {
+            _cdb_ingest_timedwait(&queue->work, &queue->mutex, CDB_INGEST_WAIT_MSEC);
+        }
+
+        queue->idle = false;
+
+        pthread_mutex_unlock(&queue->mutex);
+    }
+
+    return NULL;
+}
+
+static void _cdb_ingest_wake(_cdb_ingest_queue_t *queue) {
+
+    __sync_synchronize();
+
+    if (queue->idle) {
+        pthread_mutex_lock(&queue->mutex);
+        pthread_cond_signal(&queue->work);
+        pthread_mutex_unlock(&queue->mutex);
+    }
+}
+
+static void _cdb_ingest_free_queues(cdb_ingest_t *ingest, int num_queues) {
+
+    int i = 0;
+
+    for (i = 0; i < num_queues; i++) {
+        _cdb_ingest_queue_t *queue = &ingest->queues[i];
+
+        pthread_mutex_destroy(&queue->mutex);
+        pthread_cond_destroy(&queue->work);
+        pthread_cond_destroy(&queue->room);
+        pthread_cond_destroy(&queue->drained);
+
+        free(queue->slots);
+        free(queue->entries);
+        free(queue->records);
+    }
+
+    free(ingest->queues);
+    free(ingest);
+}
+
+cdb_ingest_t* cdb_ingest_new(uint64_t capacity, int num_flushers, bool block) {
+
+    cdb_ingest_t *ingest = NULL;
+    uint64_t size = 2;
+    int i = 0;
+
+    if (num_flushers <= 0) {
+        num_flushers = 1;
+    }
+
+    while (size < capacity) {
+        size <<= 1;
+    }
+
+    if ((ingest = calloc(1, sizeof(cdb_ingest_t))) == NULL) {
+        return NULL;
+    }
+
+    if ((ingest->queues = calloc(num_flushers, sizeof(_cdb_ingest_queue_t))) == NULL) {
+        free(ingest);
+        return NULL;
+    }
+
+    ingest->num_queues = num_flushers;
+    ingest->block      = block;
+    ingest->stopping   = false;
+    ingest->draining   = false;
+    ingest->pushing    = 0;
+
+    for (i = 0; i < num_flushers; i++) {
+        _cdb_ingest_queue_t *queue = &ingest->queues[i];
+        uint64_t j = 0;
+
+        queue->ingest  = ingest;
+        queue->mask    = size - 1;
+        queue->slots   = calloc(size, sizeof(_cdb_ingest_slot_t));
+        queue->entries = calloc(CDB_INGEST_BATCH, sizeof(_cdb_ingest_entry_t));
+        queue->records = calloc(CDB_INGEST_BATCH, RECORD_SIZE);
+
+        pthread_mutex_init(&queue->mutex, NULL);
+        pthread_cond_init(&queue->work, NULL);
+        pthread_cond_init(&queue->room, NULL);
+        pthread_cond_init(&queue->drained, NULL);
+
+        if (queue->slots == NULL || queue->entries == NULL || queue->records == NULL) {
+            _cdb_ingest_free_queues(ingest, i + 1);
+            return NULL;
+        }
+
+        for (j = 0; j < size; j++) {
+            queue->slots[j].sequence = j;
+        }
+    }
+
+    for (i = 0; i < num_flushers; i++) {
+
+        if (pthread_create(&ingest->queues[i].thread, NULL, _cdb_ingest_flusher, &ingest->queues[i]) != 0) {
+
+            /* Let the flushers that did start exit */
+            ingest->stopping = true;
+            ingest->draining = true;
+
+            while (--i >= 0) {
+                _cdb_ingest_wake(&ingest->queues[i]);
+                pthread_join(ingest->queues[i].thread, NULL);
+            }
+
+            _cdb_ingest_free_queues(ingest, num_flushers);
+            return NULL;
+        }
+    }
+
+    return ingest;
+}
+
+int cdb_ingest_push(cdb_ingest_t *ingest, cdb_t *cdb, cdb_time_t time, double value) {
+
+    _cdb_ingest_queue_t *queue;
+
+    if (ingest == NULL || cdb == NULL) {
+        return CDB_EFAULT;
+    }
+
+    /* Counted in before looking at stopping, which cdb_ingest_free() sets
+     * before looking at the count - one of us sees the other */
+    __sync_fetch_and_add(&ingest->pushing, 1);
+
+    if (ingest->stopping) {
+        __sync_fetch_and_sub(&ingest->pushing, 1);
+        return CDB_EINVAL;
+    }
+
+    queue = _cdb_ingest_queue_for(ingest, cdb);
+
+    while (_cdb_ingest_enqueue(queue, cdb, time, value) == false) {
+
+        if (ingest->block == false) {
+            __sync_fetch_and_add(&queue->rejected, 1);
+            __sync_fetch_and_sub(&ingest->pushing, 1);
+            return CDB_EFULL;
+        }
+
+        /* Backpressure: wait for the flusher to free some slots */
+        pthread_mutex_lock(&queue->mutex);
+        queue->waiters++;
+        pthread_cond_signal(&queue->work);
+        _cdb_ingest_timedwait(&queue->room, &queue->mutex, CDB_INGEST_WAIT_MSEC);
+        queue->waiters--;
+        pthread_mutex_unlock(&queue->mutex);
+    }
+
+    _cdb_ingest_wake(queue);
+
+    __sync_fetch_and_sub(&ingest->pushing, 1);
+
+    return CDB_SUCCESS;
+}
+
+int cdb_ingest_flush(cdb_ingest_t *ingest) {
+
+    int ret = CDB_SUCCESS;
+    int i = 0;
+
+    if (ingest == NULL) {
+        return CDB_EFAULT;
+    }
+
+    for (i = 0; i < ingest->num_queues; i++) {
+        _cdb_ingest_queue_t *queue = &ingest->queues[i];
+        uint64_t target = queue->tail;
+
+        pthread_mutex_lock(&queue->mutex);
+
+        while (queue->done < target) {
+            pthread_cond_signal(&queue->work);
+            _cdb_ingest_timedwait(&queue->drained, &queue->mutex, CDB_INGEST_WAIT_MSEC);
+        }
+
+        pthread_mutex_unlock(&queue->mutex);
+
+        if (queue->error != CDB_SUCCESS) {
+            ret = __sync_lock_test_and_set(&queue->error, CDB_SUCCESS);
+        }
+    }
+
+    return ret;
+}
+
+int cdb_ingest_free(cdb_ingest_t *ingest) {
+
+    int ret = CDB_SUCCESS;
+    int i = 0;
+
+    if (ingest == NULL) {
+        return CDB_SUCCESS;
+    }
+
+    ingest->stopping = true;
+    __sync_synchronize();
+
+    /* Producers already past the stopping check may still be claiming
+     * slots, or waiting for room - the flushers keep going for them */
+    while (ingest->pushing > 0) {
+        sched_yield();
+    }
+
+    ingest->draining = true;
+    __sync_synchronize();
+
+    for (i = 0; i < ingest->num_queues; i++) {
+        _cdb_ingest_queue_t *queue = &ingest->queues[i];
+
+        pthread_mutex_lock(&queue->mutex);
+        pthread_cond_signal(&queue->work);
+        pthread_mutex_unlock(&queue->mutex);
+
+        pthread_join(queue->thread, NULL);
+
+        if (queue->error != CDB_SUCCESS) {
+            ret = queue->error;
+        }
+    }
+
+    _cdb_ingest_free_queues(ingest, ingest->num_queues);
+
+    return ret;
+}
+
+void cdb_ingest_get_stats(cdb_ingest_t *ingest, cdb_ingest_stats_t *stats) {
+
+    int i = 0;
+
+    memset(stats, 0, sizeof(cdb_ingest_stats_t));
+
+    if (ingest == NULL) {
+        return;
+    }
+
+    for (i = 0; i < ingest->num_queues; i++) {
+        _cdb_ingest_queue_t *queue = &ingest->queues[i];
+        uint64_t done  = queue->done;
+        uint64_t tail  = queue->tail;
+
+        stats->capacity   += queue->mask + 1;
+        stats->depth      += tail > done ? tail - done : 0;
+        stats->pushed     += tail;
+        stats->written    += queue->written;
+        stats->failed     += queue->failed;
+        stats->rejected   += queue->rejected;
+
+        if (queue->high_water > stats->high_water) {
+            stats->high_water = queue->high_water;
+        }
+    }
+}
+
+/* -*- Mode: C; tab-width: 4 -*- */
+/* vim: set tabstop=4 expandtab shiftwidth=4: */
@@ -0,0 +1,753 @@
+/*
+ * CircularDB implementation for time series data.
+ *
+ * Copyright (c) 2007-2009 Powerset, Inc
+ * Copyright (c) Dan Grillo, Manish Dubey, Dan Sully
+ *
+ * All rights reserved.
+ */
+
+/* Writer pool.
+ *
+ * Series are named by path and hashed to one of num_shards shards. Every
+ * shard runs a thread that alone opens, buffers and writes the series that
+ * hash to it, so nothing on the write path is shared with another shard.
+ *
+ * Producers hand batches to a shard through a lock free inbox (a stack the
+ * shard takes over whole). The shard appends each batch to its series'
+ * buffer and then writes all the series it has records for as one round.
+ * The round is a list of series that anybody may claim one at a time - a
+ * shard with nothing of its own to do claims series from busy shards, so a
+ * burst on a few shards is written by all of them. A series is in a round at
+ * most once, and its owner doesn't touch it until the round is over, so a
+ * claimed series is still written by exactly one thread, in order.
+ *
+ * A series' file stays open between rounds, up to max_open files a shard.
+ * Past that the shard closes the ones it has written least recently before
+ * the next round, and they are opened again on their next write. */
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
+
+#include <circulardb_interface.h>
+
+#define CDB_POOL_WAIT_MSEC 10
+#define CDB_POOL_BUCKETS   1024
+
+/* Files a shard keeps open when cdb_pool_new() isn't told */
+#define CDB_POOL_MAX_OPEN  256
+
+typedef struct _cdb_pool_msg_s {
+    struct _cdb_pool_msg_s *next;
+    uint64_t hash;
+    uint64_t len;
+    cdb_record_t *records;
+    char *path;
+} _cdb_pool_msg_t;
+
+typedef struct _cdb_pool_series_s {
+    struct _cdb_pool_series_s *next;    /* hash chain */
+    struct _cdb_pool_series_s *newer;   /* written list */
+    struct _cdb_pool_series_s *older;
+    uint64_t hash;
+    cdb_t *cdb;
+    bool pending;                       /* already in the next round */
+    bool listed;                        /* on the written list */
+    cdb_record_t *records;
+    uint64_t len;
+    uint64_t size;
+} _cdb_pool_series_t;
+
+typedef struct _cdb_pool_shard_s {
+    _cdb_pool_msg_t * volatile inbox;
+
+    /* Series table, only ever touched by the owning thread */
+    _cdb_pool_series_t **buckets;
+    uint64_t num_buckets;
+    uint64_t num_series;
+
+    /* Series that may have their file open, most recently written first */
+    _cdb_pool_series_t *newest;
+    _cdb_pool_series_t *oldest;
+    uint64_t num_open;
+
+    /* The current round. claim and round carry the round number in their top
+     * 32 bits, so a claim can never land in a round it didn't look at. */
+    _cdb_pool_series_t **units;
+    uint64_t units_size;
+    volatile uint64_t round;    /* number << 32 | series in the round */
+    volatile uint64_t claim;    /* number << 32 | next series to hand out */
+    volatile uint64_t outstanding;
+
+    volatile uint64_t submitted;
+    volatile uint64_t done;
+    volatile uint64_t written;
+    volatile uint64_t failed;
+    volatile uint64_t rejected;
+    volatile uint64_t stolen;
+    volatile uint64_t high_water;
+    volatile int error;
+
+    volatile bool idle;
+    volatile int waiters;
+
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t work;
+    pthread_cond_t room;
+    pthread_cond_t drained;
+
+    struct cdb_pool_s *pool;
+} _cdb_pool_shard_t;
+
+struct cdb_pool_s {
+    int num_shards;
+    uint64_t max_pending;
+    uint64_t max_open;
+    bool block;
+    volatile bool stopping;
+    _cdb_pool_shard_t *shards;
+};
+
+static void _cdb_pool_timedwait(pthread_cond_t *cond, pthread_mutex_t *mutex, int msec) {
+
+    struct timeval now;
+    struct timespec until;
+
+    gettimeofday(&now, NULL);
+
+    until.tv_sec  = now.tv_sec + (msec / 1000);
+    until.tv_nsec = (now.tv_usec * 1000) + ((msec % 1000) * 1000000);
+
+    if (until.tv_nsec >= 1000000000) {
+        until.tv_sec  += 1;
+        until.tv_nsec -= 1000000000;
+    }
+
+    pthread_cond_timedwait(cond, mutex, &until);
+}
+
+/* FNV-1a */
+static uint64_t _cdb_pool_hash(const char *path) {
+
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    while (*path) {
+        hash ^= (unsigned char)*path++;
+        hash *= 0x100000001b3ULL;
+    }
+
+    return hash;
+}
+
+static void _cdb_pool_wake(_cdb_pool_shard_t *shard) {
+
+    __sync_synchronize();
+
+    if (shard->idle) {
+        pthread_mutex_lock(&shard->mutex);
+        pthread_cond_signal(&shard->work);
+        pthread_mutex_unlock(&shard->mutex);
+    }
+}
+
+static _cdb_pool_series_t* _cdb_pool_lookup(_cdb_pool_shard_t *shard, _cdb_pool_msg_t *msg) {
+
+    _cdb_pool_series_t *series;
+    uint64_t i = 0;
+
+    for (series = shard->buckets[msg->hash & (shard->num_buckets - 1)]; series != NULL; series = series->next) {
+
+        if (series->hash == msg->hash && strcmp(series->cdb->filename, msg->path) == 0) {
+            return series;
+        }
+    }
+
+    /* Keep chains short as the shard picks up series */
+    if (shard->num_series >= shard->num_buckets) {
+        uint64_t num_buckets = shard->num_buckets * 2;
+        _cdb_pool_series_t **buckets = calloc(num_buckets, sizeof(_cdb_pool_series_t*));
+
+        if (buckets != NULL) {
+
+            for (i = 0; i < shard->num_buckets; i++) {
+
+                while ((series = shard->buckets[i]) != NULL) {
+                    shard->buckets[i] = series->next;
+                    series->next = buckets[series->hash & (num_buckets - 1)];
+                    buckets[series->hash & (num_buckets - 1)] = series;
+                }
+            }
+
+            free(shard->buckets);
+            shard->buckets     = buckets;
+            shard->num_buckets = num_buckets;
+        }
+    }
+
+    /* A series is in a round at most once, so a round never outgrows this */
+    if (shard->num_series >= shard->units_size) {
+        uint64_t size = shard->units_size ? shard->units_size * 2 : 64;
+        _cdb_pool_series_t **units = realloc(shard->units, size * sizeof(_cdb_pool_series_t*));
+
+        if (units == NULL) {
+            return NULL;
+        }
+
+        shard->units      = units;
+        shard->units_size = size;
+    }
+
+    if ((series = calloc(1, sizeof(_cdb_pool_series_t))) == NULL) {
+        return NULL;
+    }
+
+    if ((series->cdb = cdb_new()) == NULL || (series->cdb->filename = strdup(msg->path)) == NULL) {
+        cdb_free(series->cdb);
+        free(series);
+        return NULL;
+    }
+
+    /* The file is opened on the first write */
+    series->cdb->flags = O_RDWR;
+    series->hash       = msg->hash;
+    series->next       = shard->buckets[msg->hash & (shard->num_buckets - 1)];
+
+    shard->buckets[msg->hash & (shard->num_buckets - 1)] = series;
+    shard->num_series++;
+
+    return series;
+}
+
+static void _cdb_pool_unlist(_cdb_pool_shard_t *shard, _cdb_pool_series_t *series) {
+
+    if (series->newer != NULL) {
+        series->newer->older = series->older;
+    } else {
+        shard->newest = series->older;
+    }
+
+    if (series->older != NULL) {
+        series->older->newer = series->newer;
+    } else {
+        shard->oldest = series->newer;
+    }
+
+    series->newer  = NULL;
+    series->older  = NULL;
+    series->listed = false;
+    shard->num_open--;
+}
+
+/* Put a series about to be written at the front of the written list */
+static void _cdb_pool_touch(_cdb_pool_shard_t *shard, _cdb_pool_series_t *series) {
+
+    if (series->listed) {
+        _cdb_pool_unlist(shard, series);
+    }
+
+    series->older  = shard->newest;
+    series->listed = true;
+
+    if (shard->newest != NULL) {
+        shard->newest->newer = series;
+    } else {
+        shard->oldest = series;
+    }
+
+    shard->newest = series;
+    shard->num_open++;
+}
+
+/* Close the files of the least recently written series until the shard is
+ * back under max_open. Series in the coming round are at the front and are
+ * left alone, so a round bigger than max_open still gets all its files. */
+static void _cdb_pool_evict(_cdb_pool_shard_t *shard) {
+
+    _cdb_pool_series_t *series;
+
+    while (shard->num_open > shard->pool->max_open && (series = shard->oldest) != NULL && series->pending == false) {
+        _cdb_pool_unlist(shard, series);
+        cdb_close(series->cdb);
+    }
+}
+
+/* Move everything in the inbox into series buffers, oldest batch first.
+ * Returns the number of records taken from the inbox, including any that
+ * couldn't be buffered. */
+static uint64_t _cdb_pool_collect(_cdb_pool_shard_t *shard, uint64_t *num_units) {
+
+    _cdb_pool_msg_t *msg  = __sync_lock_test_and_set(&shard->inbox, NULL);
+    _cdb_pool_msg_t *fifo = NULL;
+    uint64_t num_recs = 0;
+
+    *num_units = 0;
+
+    /* The inbox is a stack */
+    while (msg != NULL) {
+        _cdb_pool_msg_t *next = msg->next;
+        msg->next = fifo;
+        fifo = msg;
+        msg  = next;
+    }
+
+    while ((msg = fifo) != NULL) {
+        _cdb_pool_series_t *series = _cdb_pool_lookup(shard, msg);
+
+        fifo = msg->next;
+
+        num_recs += msg->len;
+
+        if (series == NULL) {
+            __sync_fetch_and_add(&shard->failed, msg->len);
+            shard->error = CDB_ENOMEM;
+            free(msg);
+            continue;
+        }
+
+        if (series->len + msg->len > series->size) {
+            uint64_t size = series->size ? series->size : 64;
+            cdb_record_t *records;
+
+            while (size < series->len + msg->len) {
+                size *= 2;
+            }
+
+            if ((records = realloc(series->records, size * RECORD_SIZE)) == NULL) {
+                __sync_fetch_and_add(&shard->failed, msg->len);
+                shard->error = CDB_ENOMEM;
+                free(msg);
+                continue;
+            }
+
+            series->records = records;
+            series->size    = size;
+        }
+
+        memcpy(&series->records[series->len], msg->records, msg->len * RECORD_SIZE);
+        series->len += msg->len;
+
+        if (series->pending == false) {
+            series->pending = true;
+            shard->units[(*num_units)++] = series;
+            _cdb_pool_touch(shard, series);
+        }
+
+        free(msg);
+    }
+
+    _cdb_pool_evict(shard);
+
+    return num_recs;
+}
+
+/* Hand out the next series of shard's round, or NULL once they are all out. */
+static _cdb_pool_series_t* _cdb_pool_claim(_cdb_pool_shard_t *shard) {
+
+    for (;;) {
+        uint64_t claim = shard->claim;
+        uint64_t round;
+
+        __sync_synchronize();
+        round = shard->round;
+
+        if ((claim >> 32) != (round >> 32)) {
+            continue;
+        }
+
+        if ((claim & 0xffffffff) >= (round & 0xffffffff)) {
+            return NULL;
+        }
+
+        if (__sync_bool_compare_and_swap(&shard->claim, claim, claim + 1)) {
+            return shard->units[claim & 0xffffffff];
+        }
+    }
+}
+
+static void _cdb_pool_write(_cdb_pool_shard_t *shard, _cdb_pool_series_t *series) {
+
+    uint64_t num_recs = 0;
+    int ret = cdb_write_records(series->cdb, series->records, series->len, &num_recs);
+
+    if (ret == CDB_SUCCESS) {
+        __sync_fetch_and_add(&shard->written, series->len);
+    } else {
+        __sync_fetch_and_add(&shard->failed, series->len);
+        shard->error = ret;
+    }
+
+    series->len     = 0;
+    series->pending = false;
+
+    __sync_synchronize();
+    __sync_fetch_and_sub(&shard->outstanding, 1);
+}
+
+/* Help whichever other shard still has unclaimed series. */
+static bool _cdb_pool_steal(_cdb_pool_shard_t *shard) {
+
+    cdb_pool_t *pool = shard->pool;
+    int self = shard - pool->shards;
+    int i = 0;
+
+    for (i = 1; i < pool->num_shards; i++) {
+        _cdb_pool_shard_t *victim = &pool->shards[(self + i) % pool->num_shards];
+        _cdb_pool_series_t *series = _cdb_pool_claim(victim);
+
+        if (series != NULL) {
+            _cdb_pool_write(victim, series);
+            __sync_fetch_and_add(&victim->stolen, 1);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static void* _cdb_pool_shard(void *arg) {
+
+    _cdb_pool_shard_t *shard = (_cdb_pool_shard_t*)arg;
+    cdb_pool_t *pool = shard->pool;
+
+    for (;;) {
+        _cdb_pool_series_t *series;
+        uint64_t num_units = 0;
+        uint64_t num_recs  = 0;
+        uint64_t depth     = shard->submitted - shard->done;
+
+        if (depth > shard->high_water) {
+            shard->high_water = depth;
+        }
+
+        if (shard->inbox != NULL) {
+
+            num_recs = _cdb_pool_collect(shard, &num_units);
+
+            /* Open the round up to thieves */
+            shard->outstanding = num_units;
+            shard->round = ((shard->round >> 32) + 1) << 32 | num_units;
+            __sync_synchronize();
+            shard->claim = shard->round & ~0xffffffffULL;
+
+            while ((series = _cdb_pool_claim(shard)) != NULL) {
+                _cdb_pool_write(shard, series);
+            }
+
+            /* Everything is claimed, wait for the thieves to finish theirs */
+            while (shard->outstanding > 0) {
+                sched_yield();
+            }
+
+            pthread_mutex_lock(&shard->mutex);
+            shard->done += num_recs;
+            pthread_cond_broadcast(&shard->drained);
+
+            if (shard->waiters > 0) {
+                pthread_cond_broadcast(&shard->room);
+            }
+
+            pthread_mutex_unlock(&shard->mutex);
+
+            continue;
+        }
+
+        if (_cdb_pool_steal(shard)) {
+            continue;
+        }
+
+        if (pool->stopping && shard->done == shard->submitted) {
+            break;
+        }
+
+        pthread_mutex_lock(&shard->mutex);
+
+        shard->idle = true;
+        __sync_synchronize();
+
+        if (shard->inbox == NULL && !pool->stopping) {
+            _cdb_pool_timedwait(&shard->work, &shard->mutex, CDB_POOL_WAIT_MSEC);
+        }
+
+        shard->idle = false;
+
+        pthread_mutex_unlock(&shard->mutex);
+    }
+
+    return NULL;
+}
+
+static void _cdb_pool_free_shards(cdb_pool_t *pool, int num_shards) {
+
+    int i = 0;
+
+    for (i = 0; i < num_shards; i++) {
+        _cdb_pool_shard_t *shard = &pool->shards[i];
+        uint64_t j = 0;
+
+        for (j = 0; shard->buckets != NULL && j < shard->num_buckets; j++) {
+            _cdb_pool_series_t *series;
+
+            while ((series = shard->buckets[j]) != NULL) {
+                shard->buckets[j] = series->next;
+
+                free(series->cdb->filename);
+                cdb_free(series->cdb);
+                free(series->records);
+                free(series);
+            }
+        }
+
+        pthread_mutex_destroy(&shard->mutex);
+        pthread_cond_destroy(&shard->work);
+        pthread_cond_destroy(&shard->room);
+        pthread_cond_destroy(&shard->drained);
+
+        free(shard->buckets);
+        free(shard->units);
+    }
+
+    free(pool->shards);
+    free(pool);
+}
+
+cdb_pool_t* cdb_pool_new(int num_shards, uint64_t max_pending, uint64_t max_open, bool block) {
+
+    cdb_pool_t *pool = NULL;
+    int i = 0;
+
+    if (num_shards <= 0) {
+        num_shards = 1;
+    }
+
+    if ((pool = calloc(1, sizeof(cdb_pool_t))) == NULL) {
+        return NULL;
+    }
+
+    if ((pool->shards = calloc(num_shards, sizeof(_cdb_pool_shard_t))) == NULL) {
+        free(pool);
+        return NULL;
+    }
+
+    pool->num_shards  = num_shards;
+    pool->max_pending = max_pending;
+    pool->max_open    = max_open > 0 ? max_open : CDB_POOL_MAX_OPEN;
+    pool->block       = block;
+    pool->stopping    = false;
+
+    for (i = 0; i < num_shards; i++) {
+        _cdb_pool_shard_t *shard = &pool->shards[i];
+
+        shard->pool        = pool;
+        shard->num_buckets = CDB_POOL_BUCKETS;
+        shard->buckets     = calloc(CDB_POOL_BUCKETS, sizeof(_cdb_pool_series_t*));
+
+        pthread_mutex_init(&shard->mutex, NULL);
+        pthread_cond_init(&shard->work, NULL);
+        pthread_cond_init(&shard->room, NULL);
+        pthread_cond_init(&shard->drained, NULL);
+
+        if (shard->buckets == NULL) {
+            _cdb_pool_free_shards(pool, i + 1);
+            return NULL;
+        }
+    }
+
+    for (i = 0; i < num_shards; i++) {
+
+        if (pthread_create(&pool->shards[i].thread, NULL, _cdb_pool_shard, &pool->shards[i]) != 0) {
+
+            pool->stopping = true;
+
+            while (--i >= 0) {
+                _cdb_pool_wake(&pool->shards[i]);
+                pthread_join(pool->shards[i].thread, NULL);
+            }
+
+            _cdb_pool_free_shards(pool, num_shards);
+            return NULL;
+        }
+    }
+
+    return pool;
+}
+
+int cdb_pool_write_records(cdb_pool_t *pool, const char *path, cdb_record_t *records, uint64_t len) {
+
+    _cdb_pool_shard_t *shard;
+    _cdb_pool_msg_t *msg;
+    uint64_t hash;
+    size_t path_len;
+
+    if (pool == NULL || path == NULL || records == NULL) {
+        return CDB_EFAULT;
+    }
+
+    if (pool->stopping) {
+        return CDB_EINVAL;
+    }
+
+    if (len == 0) {
+        return CDB_SUCCESS;
+    }
+
+    hash  = _cdb_pool_hash(path);
+    shard = &pool->shards[hash % pool->num_shards];
+
+    while (pool->max_pending > 0 && shard->submitted - shard->done >= pool->max_pending) {
+
+        if (pool->block == false) {
+            __sync_fetch_and_add(&shard->rejected, len);
+            return CDB_EFULL;
+        }
+
+        pthread_mutex_lock(&shard->mutex);
+        shard->waiters++;
+        pthread_cond_signal(&shard->work);
+        _cdb_pool_timedwait(&shard->room, &shard->mutex, CDB_POOL_WAIT_MSEC);
+        shard->waiters--;
+        pthread_mutex_unlock(&shard->mutex);
+    }
+
+    /* One allocation for the batch, its records and its path */
+    path_len = strlen(path) + 1;
+
+    if ((msg = malloc(sizeof(_cdb_pool_msg_t) + (len * RECORD_SIZE) + path_len)) == NULL) {
+        return CDB_ENOMEM;
+    }
+
+    msg->hash    = hash;
+    msg->len     = len;
+    msg->records = (cdb_record_t*)(msg + 1);
+    msg->path    = (char*)(msg->records + len);
+
+    memcpy(msg->records, records, len * RECORD_SIZE);
+    memcpy(msg->path, path, path_len);
+
+    __sync_fetch_and_add(&shard->submitted, len);
+
+    do {
+        msg->next = shard->inbox;
+    } while (__sync_bool_compare_and_swap(&shard->inbox, msg->next, msg) == false);
+
+    _cdb_pool_wake(shard);
+
+    return CDB_SUCCESS;
+}
+
+int cdb_pool_write_record(cdb_pool_t *pool, const char *path, cdb_time_t time, double value) {
+
+    cdb_record_t record;
+
+    record.time  = time;
+    record.value = value;
+
+    return cdb_pool_write_records(pool, path, &record, 1);
+}
+
+int cdb_pool_flush(cdb_pool_t *pool) {
+
+    int ret = CDB_SUCCESS;
+    int i = 0;
+
+    if (pool == NULL) {
+        return CDB_EFAULT;
+    }
+
+    for (i = 0; i < pool->num_shards; i++) {
+        _cdb_pool_shard_t *shard = &pool->shards[i];
+        uint64_t target = shard->submitted;
+
+        pthread_mutex_lock(&shard->mutex);
+
+        while (shard->done < target) {
+            pthread_cond_signal(&shard->work);
+            _cdb_pool_timedwait(&shard->drained, &shard->mutex, CDB_POOL_WAIT_MSEC);
+        }
+
+        pthread_mutex_unlock(&shard->mutex);
+
+        if (shard->error != CDB_SUCCESS) {
+            ret = __sync_lock_test_and_set(&shard->error, CDB_SUCCESS);
+        }
+    }
+
+    return ret;
+}
+
+int cdb_pool_free(cdb_pool_t *pool) {
+
+    int ret = CDB_SUCCESS;
+    int i = 0;
+
+    if (pool == NULL) {
+        return CDB_SUCCESS;
+    }
+
+    pool->stopping = true;
+    __sync_synchronize();
+
+    for (i = 0; i < pool->num_shards; i++) {
+        _cdb_pool_shard_t *shard = &pool->shards[i];
+
+        pthread_mutex_lock(&shard->mutex);
+        pthread_cond_signal(&shard->work);
+        pthread_mutex_unlock(&shard->mutex);
+    }
+
+    /* Shards keep helping each other until the last one has drained */
+    for (i = 0; i < pool->num_shards; i++) {
+        pthread_join(pool->shards[i].thread, NULL);
+
+        if (pool->shards[i].error != CDB_SUCCESS) {
+            ret = pool->shards[i].error;
+        }
+    }
+
+    _cdb_pool_free_shards(pool, pool->num_shards);
+
+    return ret;
+}
+
+void cdb_pool_get_stats(cdb_pool_t *pool, cdb_ingest_stats_t *stats) {
+
+    int i = 0;
+
+    memset(stats, 0, sizeof(cdb_ingest_stats_t));
+
+    if (pool == NULL) {
+        return;
+    }
+
+    for (i = 0; i < pool->num_shards; i++) {
+        _cdb_pool_shard_t *shard = &pool->shards[i];
+        uint64_t done      = shard->done;
+        uint64_t submitted = shard->submitted;
+
+        stats->capacity += pool->max_pending;
+        stats->depth    += submitted > done ? submitted - done : 0;
+        stats->pushed   += submitted;
+        stats->written  += shard->written;
+        stats->failed   += shard->failed;
+        stats->rejected += shard->rejected;
+        stats->stolen   += shard->stolen;
+
+        if (shard->high_water > stats->high_water) {
+            stats->high_water = shard->high_water;
+        }
+    }
+}
+
+/* -*- Mode: C; tab-width: 4 -*- */
+/* vim: set tabstop=4 expandtab shiftwidth=4: */
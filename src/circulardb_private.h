@@ -0,0 +1,176 @@
+/*
+ * CircularDB implementation for time series data.
+ *
+ * Copyright (c) 2007-2009 Powerset, Inc
+ * Copyright (c) Dan Grillo, Manish Dubey, Dan Sully
+ *
+ * All rights reserved.
+ */
+
+/* Shared between the library's source files, not installed. */
+
+#ifndef __CIRCULARDB_PRIVATE_H__
+#define __CIRCULARDB_PRIVATE_H__
+
+#include <time.h>
+
+#include <circulardb_interface.h>
+
+/* Compressed layout blocks.
+ *
+ * Every block starts with this header, followed by a bit stream of Gorilla
+ * encoded records: the first time and value as is, then each time as the
+ * change in its distance from the previous one (delta of delta) and each
+ * value XORed with the previous one. The header also carries what the
+ * encoder needs to append to the block later. */
+typedef struct cdb_block_header_s {
+    uint32_t    count;              // Records in the block
+    uint32_t    bits;               // Bits of the stream in use
+    cdb_time_t  first_time;
+    cdb_time_t  last_time;
+    int64_t     last_delta;
+    double      last_value;
+    uint8_t     lead;               // Leading zeros of the last XOR window
+    uint8_t     trail;              // Trailing zeros of the last XOR window
+    uint8_t     pad[2];
+    uint32_t    crc;                // CRC32C of the block with this zeroed
+} cdb_block_header_t;
+
+#define CDB_BLOCK_HEADER_SIZE sizeof(cdb_block_header_t)
+
+/* Most records a block of block_size bytes can hold - two bits each */
+#define CDB_BLOCK_MAX_RECORDS(block_size) ((((block_size) - CDB_BLOCK_HEADER_SIZE) * 8) / 2)
+
+void _cdb_block_init(cdb_block_header_t *block);
+
+/* Append a record to the block's stream of capacity bytes. Returns false,
+ * leaving the block as it was, if the record doesn't fit. */
+bool _cdb_block_append(cdb_block_header_t *block, unsigned char *stream, uint64_t capacity,
+    cdb_time_t time, double value);
+
+/* Decode all block->count records into records. */
+void _cdb_block_decode(const cdb_block_header_t *block, const unsigned char *stream, cdb_record_t *records);
+
+/* Little endian integers in and out of on-disk layouts. */
+void _cdb_le32_put(unsigned char *p, uint32_t v);
+void _cdb_le64_put(unsigned char *p, uint64_t v);
+uint32_t _cdb_le32_get(const unsigned char *p);
+uint64_t _cdb_le64_get(const unsigned char *p);
+
+/* CRC32C of len bytes, carrying on from crc (0 to start). */
+uint32_t _cdb_crc32c(uint32_t crc, const void *buffer, size_t len);
+
+/* crc carried on over len zero bytes, without reading them. */
+uint32_t _cdb_crc32c_zeros(uint32_t crc, uint64_t len);
+
+/* Text formatting and parsing - see circulardb_format.c.
+ *
+ * The formatters NUL terminate and return the length without it. buffer
+ * needs CDB_FORMAT_DOUBLE_MAX bytes for any of them. The parsers move *p
+ * past what they used, and return false if nothing there was a number. */
+#define CDB_FORMAT_DOUBLE_MAX 32
+
+typedef struct cdb_date_cache_s {
+    bool        valid;
+    cdb_time_t  time;               // What formatted holds
+    size_t      len;
+    char        formatted[256];
+    cdb_time_t  day_start;          // Local midnight of day, when day_end > 0
+    cdb_time_t  day_end;
+    struct tm   day;
+} cdb_date_cache_t;
+
+size_t _cdb_format_int(char *buffer, int64_t value);
+size_t _cdb_format_double(char *buffer, double value);
+
+/* Same as printf()'s "%.<precision>g", for precision 1 to 15. */
+size_t _cdb_format_double_g(char *buffer, double value, int precision);
+
+/* strftime() of time, only done again when the second changes. The broken
+ * down time is only worked out again when the day changes. */
+size_t _cdb_format_date(cdb_date_cache_t *cache, cdb_time_t time, const char *format, const char **formatted);
+
+bool _cdb_parse_int(const char **p, const char *end, int64_t *value);
+bool _cdb_parse_double(const char **p, const char *end, double *value);
+
+/* Counting into cdb->stats, and timing operations into the latency
+ * histograms - see circulardb_histogram.c. Without CDB_STATS
+ * (--enable-stats) these are nothing at all, and CDB_STAT_START() declares
+ * nothing. */
+#ifdef CDB_STATS
+uint64_t _cdb_stat_clock(void);
+void _cdb_histogram_record(cdb_op_t op, uint64_t ns);
+
+#define CDB_STAT_ADD(cdb, field, n) __sync_fetch_and_add(&(cdb)->stats.field, (uint64_t)(n))
+#define CDB_STAT_START(started) uint64_t started = _cdb_stat_clock()
+#define CDB_STAT_SINCE(cdb, field, started) CDB_STAT_ADD(cdb, field, _cdb_stat_clock() - (started))
+#define CDB_HISTOGRAM_SINCE(op, started) _cdb_histogram_record(op, _cdb_stat_clock() - (started))
+#else
+#define CDB_STAT_ADD(cdb, field, n) do { } while (0)
+#define CDB_STAT_START(started) do { } while (0)
+#define CDB_STAT_SINCE(cdb, field, started) do { } while (0)
+#define CDB_HISTOGRAM_SINCE(op, started) do { } while (0)
+#endif
+
+/* USDT probes, for bpftrace or SystemTap, with --enable-dtrace (CDB_DTRACE).
+ * Compiled out otherwise. All under the circulardb provider:
+ *
+ *   read_records_entry    filename, start, end, count
+ *   read_records_return   filename, ret, num_recs
+ *   write_records_entry   filename, len, first time, last time
+ *   write_records_return  filename, ret, num_recs
+ *   search_entry          filename, time, num_records
+ *   search_return         filename, time, logical record
+ *   statistics_entry      num_recs, start, end
+ *   statistics_return     records used, start, end
+ *   aggregate_entry       driver filename, num_cdbs, start, end
+ *   aggregate_return      driver filename, ret, num_recs */
+#ifdef CDB_DTRACE
+#include <sys/sdt.h>
+
+#define CDB_PROBE3(name, a, b, c)    DTRACE_PROBE3(circulardb, name, a, b, c)
+#define CDB_PROBE4(name, a, b, c, d) DTRACE_PROBE4(circulardb, name, a, b, c, d)
+#else
+#define CDB_PROBE3(name, a, b, c)    do { } while (0)
+#define CDB_PROBE4(name, a, b, c, d) do { } while (0)
+#endif
+
+/* Query arenas - see circulardb_arena.c. */
+struct cdb_arena_s {
+    void            *base;          // What was handed in or allocated
+    unsigned char   *region;        // base lined up
+    size_t          size;
+    size_t          used;
+    bool            owned;          // region is ours, and grows
+    struct _cdb_arena_chunk_s *chunks;
+    size_t          overflow;       // Bytes from chunks since the last reset
+    uint64_t        allocations;    // malloc() calls, ever
+};
+
+/* The free end of the region, and its size - 0 and NULL if there is none.
+ * Something read into it is kept by a cdb_arena_alloc() of what was used,
+ * with nothing else allocated in between. */
+void* _cdb_arena_rest(cdb_arena_t *arena, size_t *size);
+
+/* Give back what was allocated from the region since arena->used was mark.
+ * Chunks are kept until the reset. */
+void _cdb_arena_rewind(cdb_arena_t *arena, size_t mark);
+
+/* errno, saved away before it can be overwritten */
+int cdb_error(void);
+
+/* Bytes a series with this header takes in a container, header included.
+ * Fills in the compressed layout's block defaults. */
+uint64_t _cdb_series_size(cdb_header_t *header);
+
+/* The search cdb_read_records() starts with: the first logical record at or
+ * after time, in the rows and columns layouts. -1 for any other, or none. */
+int64_t _cdb_logical_record_for_time(cdb_t *cdb, cdb_time_t time);
+
+/* cdb_read_records() without the statistics. */
+int _cdb_read_records(cdb_t *cdb, cdb_request_t *request, uint64_t *num_recs, cdb_record_t **records);
+
+#endif
+
+/* -*- Mode: C; tab-width: 4 -*- */
+/* vim: set tabstop=4 expandtab shiftwidth=4: */
@@ -0,0 +1,151 @@
+/*
+ * bench_pool
+ *
+ * Writer pool throughput in records/sec for 1, 2, 4 ... threads.
+ *
+ * Usage: bench_pool [max threads] [series] [records per run]
+ */
+
+#ifndef LINT
+static const char svnid[] __attribute__ ((unused)) = "$Id$";
+#endif
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <circulardb.h>
+
+#define BATCH 100
+
+static char dir[] = "/tmp/cdb_bench_pool.XXXXXX";
+static char **paths = NULL;
+static int num_series = 1000;
+static uint64_t num_records = 2000000;
+
+typedef struct {
+    cdb_pool_t *pool;
+    int producer;
+    int num_producers;
+} producer_args_t;
+
+static double now(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + (tv.tv_usec / 1e6);
+}
+
+static void* producer(void *arg) {
+    producer_args_t *args = (producer_args_t*)arg;
+    cdb_record_t records[BATCH];
+    uint64_t batches = num_records / BATCH / args->num_producers;
+    uint64_t i = 0;
+    int k = 0;
+
+    for (i = 0; i < batches; i++) {
+        int series = (int)((i * args->num_producers + args->producer) % num_series);
+
+        for (k = 0; k < BATCH; k++) {
+            records[k].time  = 1190860358 + (i * BATCH) + k;
+            records[k].value = k;
+        }
+
+        if (cdb_pool_write_records(args->pool, paths[series], records, BATCH) != CDB_SUCCESS) {
+            fprintf(stderr, "write to %s failed\n", paths[series]);
+            exit(1);
+        }
+    }
+
+    return NULL;
+}
+
+int main(int argc, char **argv) {
+    int max_threads = argc > 1 ? atoi(argv[1]) : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    int threads = 1;
+    int i = 0;
+
+    if (argc > 2) num_series  = atoi(argv[2]);
+    if (argc > 3) num_records = strtoull(argv[3], NULL, 10);
+
+    if (max_threads < 1 || num_series < 1 || num_records < BATCH) {
+        fprintf(stderr, "Usage: %s [max threads] [series] [records per run]\n", argv[0]);
+        return 1;
+    }
+
+    if (mkdtemp(dir) == NULL) {
+        perror("mkdtemp");
+        return 1;
+    }
+
+    paths = calloc(num_series, sizeof(char*));
+
+    for (i = 0; i < num_series; i++) {
+        cdb_t *cdb = cdb_new();
+
+        paths[i] = malloc(strlen(dir) + 32);
+        sprintf(paths[i], "%s/%d.cdb", dir, i);
+
+        cdb->filename = paths[i];
+        cdb->flags    = O_CREAT|O_RDWR;
+
+        cdb_generate_header(cdb, (char*)"bench", (char*)"", 10000, CDB_TYPE_GAUGE, (char*)"absolute", 0, 0, CDB_ENCODING_FLOAT64);
+
+        if (cdb_write_header(cdb) != CDB_SUCCESS) {
+            fprintf(stderr, "couldn't create %s\n", paths[i]);
+            return 1;
+        }
+
+        cdb_free(cdb);
+    }
+
+    printf("%8s %14s %10s\n", "threads", "records/sec", "stolen");
+
+    for (threads = 1; threads <= max_threads; threads *= 2) {
+        cdb_pool_t *pool = cdb_pool_new(threads, 100000, 0, true);
+        pthread_t *tids = calloc(threads, sizeof(pthread_t));
+        producer_args_t *args = calloc(threads, sizeof(producer_args_t));
+        cdb_ingest_stats_t stats;
+        double start = now();
+        double elapsed;
+
+        for (i = 0; i < threads; i++) {
+            args[i].pool          = pool;
+            args[i].producer      = i;
+            args[i].num_producers = threads;
+            pthread_create(&tids[i], NULL, producer, &args[i]);
+        }
+
+        for (i = 0; i < threads; i++) {
+            pthread_join(tids[i], NULL);
+        }
+
+        if (cdb_pool_flush(pool) != CDB_SUCCESS) {
+            fprintf(stderr, "flush failed\n");
+            return 1;
+        }
+
+        elapsed = now() - start;
+
+        cdb_pool_get_stats(pool, &stats);
+        cdb_pool_free(pool);
+
+        printf("%8d %14.0f %10"PRIu64"\n", threads, stats.written / elapsed, stats.stolen);
+
+        free(tids);
+        free(args);
+    }
+
+    for (i = 0; i < num_series; i++) {
+        unlink(paths[i]);
+        free(paths[i]);
+    }
+
+    free(paths);
+    rmdir(dir);
+
+    return 0;
+}
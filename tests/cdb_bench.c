@@ -0,0 +1,411 @@
+/*
+ * cdb_bench
+ *
+ * Throughput and latency of the write, search, read, cook and aggregate
+ * paths, as JSON, so runs on different commits can be compared.
+ *
+ * Usage: cdb_bench [-m max_records] [-f fill] [-t step] [-l layout] [-b batch]
+ *                  [-n files] [-k lookups] [-r repeats] [-o output]
+ *
+ * Synthetic gauge and counter files of max_records get max_records * fill
+ * records, one every step seconds - a fill over 1 wraps the ring.
+ */
+
+#ifndef LINT
+static const char svnid[] __attribute__ ((unused)) = "$Id$";
+#endif
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <circulardb.h>
+
+#include "circulardb_private.h"
+
+#define START_TIME 1190860358
+
+static char dir[] = "/tmp/cdb_bench.XXXXXX";
+
+static uint64_t max_records = 100000;
+static double fill          = 1.0;
+static uint64_t step        = 60;
+static int layout           = CDB_LAYOUT_ROWS;
+static uint64_t batch       = 1000;
+static int num_files        = 8;
+static uint64_t num_lookups = 10000;
+static int repeats          = 10;
+
+static FILE *out = NULL;
+static int num_results = 0;
+
+/* Latencies of each op of a run, in microseconds */
+typedef struct {
+    double *samples;
+    uint64_t len;
+    uint64_t records;
+    double elapsed;
+} run_t;
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+
+static void run_init(run_t *run, uint64_t ops) {
+    run->samples = calloc(ops ? ops : 1, sizeof(double));
+    run->len     = 0;
+    run->records = 0;
+    run->elapsed = 0;
+}
+
+static void run_add(run_t *run, double started, uint64_t records) {
+    double took = now() - started;
+
+    run->samples[run->len++] = took * 1e6;
+    run->records += records;
+    run->elapsed += took;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile(run_t *run, double p) {
+    return run->samples[(uint64_t)(p * (run->len - 1))];
+}
+
+static void run_report(run_t *run, const char *name) {
+
+    if (run->len == 0) {
+        free(run->samples);
+        return;
+    }
+
+    qsort(run->samples, run->len, sizeof(double), compare_doubles);
+
+    fprintf(out, "%s    {\"name\": \"%s\", \"ops\": %"PRIu64", \"records\": %"PRIu64", \"seconds\": %.6f,\n",
+        num_results++ ? ",\n" : "", name, run->len, run->records, run->elapsed);
+    fprintf(out, "     \"ops_per_sec\": %.1f, \"records_per_sec\": %.1f,\n",
+        run->len / run->elapsed, run->records / run->elapsed);
+    fprintf(out, "     \"latency_us\": {\"p50\": %.3f, \"p90\": %.3f, \"p99\": %.3f, \"p999\": %.3f, \"max\": %.3f}}",
+        percentile(run, 0.5), percentile(run, 0.9), percentile(run, 0.99), percentile(run, 0.999), run->samples[run->len - 1]);
+
+    free(run->samples);
+}
+
+static cdb_t* create(const char *name, int type) {
+    cdb_t *cdb = cdb_new();
+
+    cdb->filename = malloc(strlen(dir) + strlen(name) + 8);
+    sprintf(cdb->filename, "%s/%s.cdb", dir, name);
+    cdb->flags = O_CREAT|O_RDWR;
+
+    cdb_generate_header(cdb, (char*)name, (char*)"", max_records, type, (char*)"absolute", 0, 0, CDB_ENCODING_FLOAT64);
+    cdb->header->layout = layout;
+    cdb->header->step   = step;
+
+    if (cdb_write_header(cdb) != CDB_SUCCESS) {
+        fprintf(stderr, "couldn't create %s\n", cdb->filename);
+        exit(1);
+    }
+
+    return cdb;
+}
+
+static void destroy(cdb_t *cdb) {
+    unlink(cdb->filename);
+    free(cdb->filename);
+    cdb_free(cdb);
+}
+
+/* A gauge wanders about, a counter only goes up */
+static void generate(cdb_record_t *records, uint64_t len, int type, unsigned int *seed) {
+    double counter = 0;
+    uint64_t i = 0;
+
+    for (i = 0; i < len; i++) {
+        records[i].time = START_TIME + (cdb_time_t)(i * step);
+
+        if (type == CDB_TYPE_COUNTER) {
+            counter += rand_r(seed) % 1000;
+            records[i].value = counter;
+        } else {
+            records[i].value = 50 + (40 * sin(i / 100.0)) + (rand_r(seed) % 100) / 10.0;
+        }
+    }
+}
+
+static void write_all(cdb_t *cdb, cdb_record_t *records, uint64_t len, run_t *run) {
+    uint64_t done = 0;
+
+    while (done < len) {
+        uint64_t n = len - done < batch ? len - done : batch;
+        uint64_t written = 0;
+        double started = now();
+
+        if (cdb_write_records(cdb, &records[done], n, &written) != CDB_SUCCESS) {
+            fprintf(stderr, "write to %s failed\n", cdb->filename);
+            exit(1);
+        }
+
+        if (run != NULL) {
+            run_add(run, started, n);
+        }
+
+        done += n;
+    }
+}
+
+static void bench_reads(cdb_t *cdb, const char *name, cdb_request_t *base, bool stats) {
+    run_t run;
+    int i = 0;
+
+    run_init(&run, repeats);
+
+    for (i = 0; i < repeats; i++) {
+        cdb_request_t request = *base;
+        cdb_record_t *records = NULL;
+        cdb_range_t range;
+        uint64_t num_recs = 0;
+        double started = now();
+        int ret;
+
+        if (stats) {
+            ret = cdb_read_records(cdb, &request, &num_recs, &records, &range);
+        } else {
+            ret = _cdb_read_records(cdb, &request, &num_recs, &records);
+        }
+
+        if (ret != CDB_SUCCESS) {
+            fprintf(stderr, "%s failed: %d\n", name, ret);
+            exit(1);
+        }
+
+        run_add(&run, started, num_recs);
+        free(records);
+    }
+
+    run_report(&run, name);
+}
+
+static void usage(const char *name) {
+    fprintf(stderr,
+        "Usage: %s [-m max_records] [-f fill] [-t step] [-l layout] [-b batch]\n"
+        "          [-n files] [-k lookups] [-r repeats] [-o output]\n", name);
+}
+
+int main(int argc, char **argv) {
+    cdb_record_t *records;
+    cdb_request_t request;
+    cdb_t *gauge;
+    cdb_t *counter;
+    cdb_t **cdbs;
+    cdb_arena_t *arena;
+    uint64_t len;
+    unsigned int seed = 42;
+    run_t run;
+    int opt;
+    int i = 0;
+
+    out = stdout;
+
+    while ((opt = getopt(argc, argv, "m:f:t:l:b:n:k:r:o:h")) != -1) {
+        switch (opt) {
+            case 'm': max_records = strtoull(optarg, NULL, 10); break;
+            case 'f': fill        = strtod(optarg, NULL); break;
+            case 't': step        = strtoull(optarg, NULL, 10); break;
+            case 'b': batch       = strtoull(optarg, NULL, 10); break;
+            case 'n': num_files   = atoi(optarg); break;
+            case 'k': num_lookups = strtoull(optarg, NULL, 10); break;
+            case 'r': repeats     = atoi(optarg); break;
+            case 'l':
+                if (strcmp(optarg, "rows") == 0) layout = CDB_LAYOUT_ROWS;
+                else if (strcmp(optarg, "columns") == 0) layout = CDB_LAYOUT_COLUMNS;
+                else if (strcmp(optarg, "compressed") == 0) layout = CDB_LAYOUT_COMPRESSED;
+                else if (strcmp(optarg, "implicit") == 0) layout = CDB_LAYOUT_IMPLICIT;
+                else { usage(argv[0]); return 1; }
+                break;
+            case 'o':
+                if ((out = fopen(optarg, "w")) == NULL) {
+                    perror(optarg);
+                    return 1;
+                }
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+
+    len = (uint64_t)(max_records * fill);
+
+    if (max_records < 2 || len < 2 || step < 1 || batch < 1 || num_files < 1 || repeats < 1) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    /* A single write bigger than the ring would wrap it */
+    if (batch > max_records) {
+        batch = max_records;
+    }
+
+    if (mkdtemp(dir) == NULL) {
+        perror("mkdtemp");
+        return 1;
+    }
+
+    records = malloc(len * RECORD_SIZE);
+
+    fprintf(out, "{\n  \"config\": {\"max_records\": %"PRIu64", \"records\": %"PRIu64", \"step\": %"PRIu64
+        ", \"layout\": %d, \"batch\": %"PRIu64", \"files\": %d, \"lookups\": %"PRIu64", \"repeats\": %d},\n",
+        max_records, len, step, layout, batch, num_files, num_lookups, repeats);
+    fprintf(out, "  \"results\": [\n");
+
+    /* Writes */
+    gauge = create("gauge", CDB_TYPE_GAUGE);
+    generate(records, len, CDB_TYPE_GAUGE, &seed);
+
+    run_init(&run, len);
+
+    for (i = 0; (uint64_t)i < len; i++) {
+        double started = now();
+
+        if (!cdb_write_record(gauge, records[i].time, records[i].value)) {
+            fprintf(stderr, "write to %s failed\n", gauge->filename);
+            return 1;
+        }
+
+        run_add(&run, started, 1);
+    }
+
+    run_report(&run, "write_record");
+
+    counter = create("counter", CDB_TYPE_COUNTER);
+    generate(records, len, CDB_TYPE_COUNTER, &seed);
+
+    run_init(&run, (len / batch) + 1);
+    write_all(counter, records, len, &run);
+    run_report(&run, "write_records");
+
+    /* Searches - only the rows and columns layouts search for times */
+    if (layout == CDB_LAYOUT_ROWS || layout == CDB_LAYOUT_COLUMNS) {
+        uint64_t kept   = len < max_records ? len : max_records;
+        uint64_t oldest = len - kept;
+
+        run_init(&run, num_lookups);
+
+        for (i = 0; (uint64_t)i < num_lookups; i++) {
+            cdb_time_t time = START_TIME + (cdb_time_t)((oldest + (rand_r(&seed) % kept)) * step);
+            double started = now();
+
+            if (_cdb_logical_record_for_time(gauge, time) < 0) {
+                fprintf(stderr, "lookup failed\n");
+                return 1;
+            }
+
+            run_add(&run, started, 1);
+        }
+
+        run_report(&run, "logical_record_for_time");
+    }
+
+    /* Reads */
+    request = cdb_new_request();
+    request.cooked = false;
+    bench_reads(gauge, "read_records", &request, false);
+    bench_reads(gauge, "read_records_stats", &request, true);
+
+    request.cooked = true;
+    bench_reads(counter, "read_records_cooked", &request, false);
+
+    request.cooked = false;
+    request.step   = 10;
+    bench_reads(gauge, "read_records_step", &request, false);
+
+    /* Aggregates of num_files gauges */
+    cdbs = calloc(num_files, sizeof(cdb_t*));
+
+    for (i = 0; i < num_files; i++) {
+        char name[32];
+
+        snprintf(name, sizeof(name), "aggregate%d", i);
+
+        cdbs[i] = create(name, CDB_TYPE_GAUGE);
+        generate(records, len, CDB_TYPE_GAUGE, &seed);
+        write_all(cdbs[i], records, len, NULL);
+    }
+
+    run_init(&run, repeats);
+
+    for (i = 0; i < repeats; i++) {
+        cdb_record_t *aggregate = NULL;
+        cdb_range_t range;
+        uint64_t num_recs = 0;
+        double started;
+
+        request = cdb_new_request();
+        started = now();
+
+        if (cdb_read_aggregate_records(cdbs, num_files, &request, &num_recs, &aggregate, &range) != CDB_SUCCESS) {
+            fprintf(stderr, "aggregate read failed\n");
+            return 1;
+        }
+
+        run_add(&run, started, num_recs * num_files);
+        free(aggregate);
+    }
+
+    run_report(&run, "read_aggregate_records");
+
+    /* The same from one arena, reset after each */
+    arena = cdb_arena_new(NULL, 0);
+
+    run_init(&run, repeats);
+
+    for (i = 0; i < repeats; i++) {
+        cdb_record_t *aggregate = NULL;
+        cdb_range_t range;
+        uint64_t num_recs = 0;
+        double started;
+
+        request = cdb_new_request();
+        started = now();
+
+        if (cdb_read_aggregate_records_arena(cdbs, num_files, &request, arena, &num_recs, &aggregate, &range) != CDB_SUCCESS) {
+            fprintf(stderr, "aggregate read failed\n");
+            return 1;
+        }
+
+        run_add(&run, started, num_recs * num_files);
+        cdb_arena_reset(arena);
+    }
+
+    run_report(&run, "read_aggregate_records_arena");
+    cdb_arena_free(arena);
+
+    fprintf(out, "\n  ]\n}\n");
+
+    for (i = 0; i < num_files; i++) {
+        destroy(cdbs[i]);
+    }
+
+    destroy(gauge);
+    destroy(counter);
+    free(cdbs);
+    free(records);
+    rmdir(dir);
+
+    if (out != stdout) {
+        fclose(out);
+    }
+
+    return 0;
+}
@@ -8,14 +8,22 @@ static const char svnid[] __attribute__ ((unused)) = "$Id$";
 #endif
 
 #include <check.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <float.h>
 #include <inttypes.h>
 #include <math.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 #include <unistd.h>
 #include <circulardb.h>
 
+#include "circulardb_private.h"
+
 #define TEST_FILENAME "/tmp/cdb_test.cdb"
 
 void setup(void) {
@@ -371,40 +379,82 @@ START_TEST (test_cdb_wrap)
 }
 END_TEST
 
-START_TEST (test_cdb_average)
+START_TEST (test_cdb_columns)
 {
+    cdb_record_t w_records[700];
     cdb_record_t *r_records = NULL;
     cdb_request_t request   = cdb_new_request();
     cdb_range_t *range      = calloc(1, sizeof(cdb_range_t));
     uint64_t num_recs = 0;
+    struct stat st;
     int i = 0;
 
-    request.step = 5;
+    cdb_t *cdb = cdb_new();
+    cdb->filename = (char*)TEST_FILENAME;
+    cdb->flags    = O_CREAT|O_RDWR;
 
-    cdb_t *cdb = create_cdb(CDB_TYPE_GAUGE, "percent", 20);
+    cdb_generate_header(cdb, (char*)"test", (char*)"", 500, CDB_TYPE_GAUGE, (char*)"absolute", 0, 0, 0);
+    cdb->header->layout = CDB_LAYOUT_COLUMNS;
 
-    if (!cdb) fail("cdb is null");
+    fail_unless(cdb_write_header(cdb) == CDB_SUCCESS, NULL);
 
-    for (i = 0; i < 20; i++) {
-        cdb_write_record(cdb, 1190860358+i, i);
+    for (i = 0; i < 700; i++) {
+        w_records[i].time  = 1190860358 + i;
+        w_records[i].value = i;
     }
 
-    cdb_read_records(cdb, &request, &num_recs, &r_records, range);
+    /* Fill most of it, then write across the wrap */
+    fail_unless(cdb_write_records(cdb, w_records, 400, &num_recs) == CDB_SUCCESS, NULL);
+    fail_unless(cdb_write_records(cdb, &w_records[400], 300, &num_recs) == CDB_SUCCESS, NULL);
 
-    // for first 5, should have time of 1190860360 and value of 2
-    // for next  5, should have time of 1190860365 and value of 7
-    fail_unless(num_recs == 4, "Couldn't read 4 records");
-    fail_unless(r_records[0].time  == 1190860360);
-    fail_unless(r_records[0].value == 2);
+    fail_unless(cdb_update_record(cdb, 1190860358 + 600, 42), NULL);
 
-    fail_unless(r_records[1].time  == 1190860365);
-    fail_unless(r_records[1].value == 7);
+    request.start = 1190860358 + 650;
+    request.end   = 1190860358 + 659;
+    fail_unless(cdb_discard_records_in_time_range(cdb, &request, &num_recs) == CDB_SUCCESS, NULL);
+    fail_unless(num_recs == 10, NULL);
 
-    fail_unless(r_records[2].time  == 1190860370);
-    fail_unless(r_records[2].value == 12);
+    cdb_close(cdb);
+    cdb_free(cdb);
 
-    fail_unless(r_records[3].time  == 1190860375);
-    fail_unless(r_records[3].value == 17);
+    /* Times then values, after a full size header */
+    fail_unless(stat(TEST_FILENAME, &st) == 0, NULL);
+    fail_unless(st.st_size == HEADER_SIZE + (500 * RECORD_SIZE), NULL);
+
+    /* The count comes from the header, not the file size */
+    cdb = cdb_new();
+    cdb->filename = (char*)TEST_FILENAME;
+
+    request = cdb_new_request();
+    request.cooked = false;
+
+    fail_unless(cdb_read_records(cdb, &request, &num_recs, &r_records, range) == CDB_SUCCESS, NULL);
+    fail_unless(cdb->header->layout == CDB_LAYOUT_COLUMNS, NULL);
+    fail_unless(strcmp(cdb->header->version, CDB_VERSION) == 0, NULL);
+    fail_unless(num_recs == 500, NULL);
+
+    for (i = 0; i < 500; i++) {
+        fail_unless(r_records[i].time == 1190860358 + 200 + i, NULL);
+
+        if (i + 200 == 600) {
+            fail_unless(r_records[i].value == 42, NULL);
+        } else if (i + 200 >= 650 && i + 200 <= 659) {
+            fail_unless(isnan(r_records[i].value), NULL);
+        } else {
+            fail_unless(r_records[i].value == 200 + i, NULL);
+        }
+    }
+
+    free(r_records);
+
+    /* Searching the time column */
+    request.start = 1190860358 + 300;
+    request.end   = 1190860358 + 309;
+
+    fail_unless(cdb_read_records(cdb, &request, &num_recs, &r_records, range) == CDB_SUCCESS, NULL);
+    fail_unless(num_recs == 10, NULL);
+    fail_unless(r_records[0].time == 1190860358 + 300, NULL);
+    fail_unless(r_records[9].value == 309, NULL);
 
     free(range);
     free(r_records);
@@ -413,18 +463,2529 @@ START_TEST (test_cdb_average)
 }
 END_TEST
 
-Suite* cdb_suite (void) {
-    Suite *s = suite_create("CircularDB");
+START_TEST (test_cdb_columns_wrap)
+{
+    cdb_record_t w_records[64];
+    cdb_record_t *r_records = NULL;
+    cdb_request_t request   = cdb_new_request();
+    cdb_range_t *range      = calloc(1, sizeof(cdb_range_t));
+    uint64_t num_recs = 0;
+    uint64_t damaged  = 0;
+    cdb_damage_t *damage = NULL;
+    int lens[] = { 4, 5, 5, 5, 5, 25 };
+    int written = 0;
+    int i = 0;
+    int j = 0;
 
-    TCase *tc_core1 = tcase_create("Basic");
-    tcase_add_checked_fixture(tc_core1, setup, teardown);
-    tcase_add_test(tc_core1, test_cdb_basic_create);
-    tcase_add_test(tc_core1, test_cdb_basic_rw);
-    tcase_add_test(tc_core1, test_cdb_overflow);
-    tcase_add_test(tc_core1, test_cdb_timefind);
-    tcase_add_test(tc_core1, test_cdb_wrap);
-    tcase_add_test(tc_core1, test_cdb_average);
-    suite_add_tcase(s, tc_core1);
+    cdb_t *cdb = cdb_new();
+    cdb->filename = (char*)TEST_FILENAME;
+    cdb->flags    = O_CREAT|O_RDWR;
+
+    cdb_generate_header(cdb, (char*)"test", (char*)"", 10, CDB_TYPE_GAUGE, (char*)"absolute", 0, 0, 0);
+    cdb->header->layout = CDB_LAYOUT_COLUMNS;
+    cdb->header->flags  = CDB_FLAG_CHECKSUMS;
+
+    fail_unless(cdb_write_header(cdb) == CDB_SUCCESS, NULL);
+
+    for (i = 0; i < 64; i++) {
+        w_records[i].time  = 1190860358 + i;
+        w_records[i].value = i;
+    }
+
+    /* Each write runs past the end of the ring at a different place, and
+       the last is longer than the whole ring */
+    for (i = 0; i < 6; i++) {
+        fail_unless(cdb_write_records(cdb, &w_records[written], lens[i], &num_recs) == CDB_SUCCESS, NULL);
+        written += lens[i];
+
+        request = cdb_new_request();
+        request.cooked = false;
+
+        fail_unless(cdb_read_records(cdb, &request, &num_recs, &r_records, range) == CDB_SUCCESS, NULL);
+        fail_unless(num_recs == (written < 10 ? written : 10), NULL);
+
+        for (j = 0; j < num_recs; j++) {
+            fail_unless(r_records[j].time == w_records[written - num_recs + j].time, NULL);
+            fail_unless(r_records[j].value == w_records[written - num_recs + j].value, NULL);
+        }
+
+        free(r_records);
+        r_records = NULL;
+    }
+
+    fail_unless(cdb_verify_checksums(cdb, &damage, &damaged) == CDB_SUCCESS, NULL);
+    fail_unless(damaged == 0, NULL);
+
+    free(damage);
+    free(range);
+    cdb_close(cdb);
+    cdb_free(cdb);
+}
+END_TEST
+
+START_TEST (test_cdb_header_versions)
+{
+    cdb_header_t old;
+    cdb_record_t records[2];
+    cdb_record_t *r_records = NULL;
+    cdb_request_t request   = cdb_new_request();
+    cdb_range_t *range      = calloc(1, sizeof(cdb_range_t));
+    unsigned char fixed[64];
+    unsigned char tag[6] = { 0x00, 0x01, 0x02, 0x00, 'x', 'x' };
+    uint64_t num_recs = 0;
+    uint32_t ext_size = 0;
+    struct stat st;
+    int fd;
+
+    cdb_t *cdb = create_cdb(CDB_TYPE_COUNTER, "absolute", 0);
+
+    cdb_write_record(cdb, 1190860358, 10);
+    cdb_write_record(cdb, 1190860359, 11);
+
+    cdb_close(cdb);
+    cdb_free(cdb);
+
+    /* Packed, little endian, whatever the host */
+    fail_unless(stat(TEST_FILENAME, &st) == 0, NULL);
+    fail_unless(st.st_size == HEADER_SIZE + (2 * RECORD_SIZE), NULL);
+
+    fd = open(TEST_FILENAME, O_RDWR);
+    fail_unless(pread(fd, fixed, sizeof(fixed), 0) == sizeof(fixed), NULL);
+    fail_unless(strcmp((char*)fixed + 4, CDB_VERSION) == 0, NULL);
+    fail_unless(fixed[12] == CDB_TYPE_COUNTER && fixed[13] == 0, NULL);
+    fail_unless(fixed[16] == (500 & 0xff) && fixed[17] == (500 >> 8), NULL);
+
+    /* Extensions a reader doesn't know are skipped, unless they say not to */
+    ext_size = fixed[56] | (fixed[57] << 8);
+    fail_unless(pwrite(fd, tag, sizeof(tag), 64 + ext_size) == sizeof(tag), NULL);
+    ext_size += sizeof(tag);
+    fixed[56] = ext_size & 0xff;
+    fixed[57] = ext_size >> 8;
+    fail_unless(pwrite(fd, fixed, sizeof(fixed), 0) == sizeof(fixed), NULL);
+
+    cdb = cdb_new();
+    cdb->filename = (char*)TEST_FILENAME;
+    fail_unless(cdb_read_header(cdb) == CDB_SUCCESS, NULL);
+    fail_unless(strcmp(cdb->header->name, "test") == 0, NULL);
+    fail_unless(cdb->header->type == CDB_TYPE_COUNTER, NULL);
+    fail_unless(cdb->header->num_records == 2, NULL);
+    cdb_close(cdb);
+    cdb_free(cdb);
+
+    tag[1] = 0x81;
+    fail_unless(pwrite(fd, tag, sizeof(tag), 64 + ext_size - sizeof(tag)) == sizeof(tag), NULL);
+    close(fd);
+
+    cdb = cdb_new();
+    cdb->filename = (char*)TEST_FILENAME;
+    fail_unless(cdb_read_header(cdb) == CDB_EBADVER, NULL);
+    cdb_close(cdb);
+    cdb_free(cdb);
+    unlink(TEST_FILENAME);
+
+    /* 1.1.1 files are still read, and stay 1.1.1 */
+    memset(&old, 0, sizeof(old));
+    strncpy(old.token, CDB_TOKEN, sizeof(old.token));
+    strncpy(old.version, CDB_VERSION_1_1, sizeof(old.version));
+    strncpy(old.name, "old", sizeof(old.name));
+    old.type        = CDB_TYPE_GAUGE;
+    old.max_records = 100;
+
+    records[0].time  = 1190860358;
+    records[0].value = 1;
+    records[1].time  = 1190860359;
+    records[1].value = 2;
+
+    fd = open(TEST_FILENAME, O_CREAT|O_RDWR, 0644);
+    fail_unless(pwrite(fd, &old, 760, 0) == 760, NULL);
+    fail_unless(pwrite(fd, records, sizeof(records), 760) == sizeof(records), NULL);
+    close(fd);
+
+    cdb = cdb_new();
+    cdb->filename = (char*)TEST_FILENAME;
+    cdb->flags    = O_RDWR;
+
+    fail_unless(cdb_write_record(cdb, 1190860360, 3), NULL);
+
+    request.cooked = false;
+    fail_unless(cdb_read_records(cdb, &request, &num_recs, &r_records, range) == CDB_SUCCESS, NULL);
+    fail_unless(num_recs == 3 && r_records[2].value == 3, NULL);
+    fail_unless(strcmp(cdb->header->version, CDB_VERSION_1_1) == 0, NULL);
+
+    fail_unless(stat(TEST_FILENAME, &st) == 0, NULL);
+    fail_unless(st.st_size == 760 + (3 * RECORD_SIZE), NULL);
+
+    free(r_records);
+    free(range);
+    cdb_close(cdb);
+    cdb_free(cdb);
+}
+END_TEST
+
+cdb_t* create_compressed_cdb(uint64_t max) {
+    cdb_t *cdb = cdb_new();
+
+    cdb->filename = (char*)TEST_FILENAME;
+    cdb->flags    = O_CREAT|O_RDWR;
+
+    cdb_generate_header(cdb, (char*)"test", (char*)"", max, CDB_TYPE_GAUGE, (char*)"absolute", 0, 0, 0);
+    cdb->header->layout = CDB_LAYOUT_COMPRESSED;
+    cdb_write_header(cdb);
+
+    return cdb;
+}
+
+START_TEST (test_cdb_compressed)
+{
+    cdb_record_t w_records[1000];
+    cdb_record_t *r_records = NULL;
+    cdb_request_t request   = cdb_new_request();
+    cdb_range_t *range      = calloc(1, sizeof(cdb_range_t));
+    uint64_t num_recs = 0;
+    uint64_t j = 0;
+    struct stat st;
+    int i = 0;
+    int k = 0;
+
+    cdb_t *cdb = create_compressed_cdb(20000);
+
+    /* Regular samples of a slowly changing gauge */
+    for (i = 0; i < 100; i++) {
+
+        for (k = 0; k < 1000; k++) {
+            int n = (i * 1000) + k;
+
+            w_records[k].time  = 1190860358 + (n * 60);
+            w_records[k].value = 50 + (n % 300) / 10;
+        }
+
+        fail_unless(cdb_write_records(cdb, w_records, 1000, &num_recs) == CDB_SUCCESS, NULL);
+        fail_unless(num_recs == 1000, NULL);
+    }
+
+    cdb_close(cdb);
+    cdb_free(cdb);
+
+    /* Far smaller than the 320k the last 20000 records take uncompressed */
+    fail_unless(stat(TEST_FILENAME, &st) == 0, NULL);
+    fail_unless(st.st_size < 64 * 1024, NULL);
+
+    cdb = cdb_new();
+    cdb->filename = (char*)TEST_FILENAME;
+    cdb->flags    = O_RDWR;
+
+    request.cooked = false;
+
+    fail_unless(cdb_read_records(cdb, &request, &num_recs, &r_records, range) == CDB_SUCCESS, NULL);
+    fail_unless(cdb->header->layout == CDB_LAYOUT_COMPRESSED, NULL);
+
+    /* At least max_records, and no more than one block's worth over */
+    fail_unless(num_recs >= 20000 && num_recs == cdb->header->num_records, NULL);
+    fail_unless(num_recs < 20000 + (cdb->header->block_size * 8 / 2), NULL);
+
+    for (j = 0; j < num_recs; j++) {
+        int n = 100000 - num_recs + j;
+
+        fail_unless(r_records[j].time == 1190860358 + (n * 60), NULL);
+        fail_unless(r_records[j].value == 50 + (n % 300) / 10, NULL);
+    }
+
+    free(r_records);
+
+    /* A range in the middle */
+    request.start = 1190860358 + (90000 * 60);
+    request.end   = 1190860358 + (90099 * 60);
+
+    fail_unless(cdb_read_records(cdb, &request, &num_recs, &r_records, range) == CDB_SUCCESS, NULL);
+    fail_unless(num_recs == 100, NULL);
+    fail_unless(r_records[0].time == request.start, NULL);
+    fail_unless(r_records[99].time == request.end, NULL);
+    free(r_records);
+
+    /* The last few */
+    request = cdb_new_request();
+    request.cooked = false;
+    request.count  = 5;
+
+    fail_unless(cdb_read_records(cdb, &request, &num_recs, &r_records, range) == CDB_SUCCESS, NULL);
+    fail_unless(num_recs == 5, NULL);
+    fail_unless(r_records[4].time == 1190860358 + (99999 * 60), NULL);
+    free(r_records);
+
+    /* Updates and discards rewrite the block */
+    fail_unless(cdb_update_record(cdb, 1190860358 + (95000 * 60), 1234.5), NULL);
+
+    request = cdb_new_request();
+    request.start = 1190860358 + (96000 * 60);
+    request.end   = 1190860358 + (96009 * 60);
+
+    fail_unless(cdb_discard_records_in_time_range(cdb, &request, &num_recs) == CDB_SUCCESS, NULL);
+    fail_unless(num_recs == 10, NULL);
+
+    request = cdb_new_request();
+    request.cooked = false;
+    request.start  = 1190860358 + (95000 * 60);
+    request.end    = 1190860358 + (96009 * 60);
+
+    fail_unless(cdb_read_records(cdb, &request, &num_recs, &r_records, range) == CDB_SUCCESS, NULL);
+    fail_unless(num_recs == 1010, NULL);
+    fail_unless(r_records[0].value == 1234.5, NULL);
+    fail_unless(r_records[1].value == 50 + (95001 % 300) / 10, NULL);
+
+    for (j = 1000; j < 1010; j++) {
+        fail_unless(isnan(r_records[j].value), NULL);
+    }
+
+    free(r_records);
+    free(range);
+    cdb_close(cdb);
+    cdb_free(cdb);
+}
+END_TEST
+
+START_TEST (test_cdb_compressed_values)
+{
+    cdb_record_t w_records[5000];
+    cdb_record_t *r_records = NULL;
+    cdb_request_t request   = cdb_new_request();
+    cdb_range_t *range      = calloc(1, sizeof(cdb_range_t));
+    uint64_t num_recs = 0;
+    int i = 0;
+
+    cdb_t *cdb = create_compressed_cdb(5000);
+
+    /* Nothing compresses well: irregular times, and values all over */
+    srandom(42);
+
+    for (i = 0; i < 5000; i++) {
+        w_records[i].time  = (i == 0 ? 1190860358 : w_records[i - 1].time) + 1 + (random() % 100000);
+        w_records[i].value = (random() - (RAND_MAX / 2)) / (double)(random() + 1);
+    }
+
+    w_records[10].value = CDB_NAN;
+    w_records[11].value = -0.0;
+    w_records[12].value = DBL_MAX;
+    w_records[13].value = DBL_MIN;
+    w_records[14].time += 1LL << 40;
+
+    for (i = 15; i < 5000; i++) {
+        w_records[i].time += 1LL << 40;
+    }
+
+    fail_unless(cdb_write_records(cdb, w_records, 5000, &num_recs) == CDB_SUCCESS, NULL);
+
+    request.cooked = false;
+
+    fail_unless(cdb_read_records(cdb, &request, &num_recs, &r_records, range) == CDB_SUCCESS, NULL);
+    fail_unless(num_recs == cdb->header->num_records, NULL);
+    fail_unless(num_recs > 0, NULL);
+
+    /* Older blocks may have been dropped, the rest must be exact */
+    for (i = 0; i < num_recs; i++) {
+        cdb_record_t *w = &w_records[5000 - num_recs + i];
+
+        fail_unless(r_records[i].time == w->time, NULL);
+        fail_unless(memcmp(&r_records[i].value, &w->value, sizeof(double)) == 0, NULL);
+    }
+
+    free(r_records);
+    free(range);
+    cdb_close(cdb);
+    cdb_free(cdb);
+}
+END_TEST
+
+START_TEST (test_cdb_implicit)
+{
+    cdb_record_t w_records[705];
+    cdb_record_t *r_records = NULL;
+    cdb_request_t request   = cdb_new_request();
+    cdb_range_t *range      = calloc(1, sizeof(cdb_range_t));
+    cdb_time_t t0     = 1190860358;
+    uint64_t num_recs = 0;
+    struct stat st;
+    int i = 0;
+    int n = 0;
+
+    cdb_t *cdb = cdb_new();
+    cdb->filename = (char*)TEST_FILENAME;
+    cdb->flags    = O_CREAT|O_RDWR;
+
+    cdb_generate_header(cdb, (char*)"test", (char*)"", 500, CDB_TYPE_GAUGE, (char*)"absolute", 0, 0, 0);
+    cdb->header->layout = CDB_LAYOUT_IMPLICIT;
+
+    /* A step is required */
+    fail_unless(cdb_write_header(cdb) == CDB_EINVAL, NULL);
+
+    cdb->header->step = 60;
+    fail_unless(cdb_write_header(cdb) == CDB_SUCCESS, NULL);
+
+    /* Every minute, missing five, and across the wrap */
+    for (i = 0, n = 0; n < 705; n++) {
+
+        if (n >= 400 && n < 405) {
+            continue;
+        }
+
+        w_records[i].time  = t0 + (n * 60);
+        w_records[i].value = n;
+        i++;
+    }
+
+    fail_unless(cdb_write_records(cdb, w_records, 400, &num_recs) == CDB_SUCCESS, NULL);
+    fail_unless(cdb_write_records(cdb, &w_records[400], 300, &num_recs) == CDB_SUCCESS, NULL);
+    fail_unless(num_recs == 300, NULL);
+
+    /* Rounded down to the step */
+    fail_unless(cdb_write_record(cdb, t0 + (705 * 60) + 30, 9999), NULL);
+
+    /* Too old to keep */
+    w_records[0].time = t0 + (10 * 60);
+    fail_unless(cdb_write_records(cdb, w_records, 1, &num_recs) == CDB_SUCCESS, NULL);
+    fail_unless(num_recs == 0, NULL);
+
+    /* Late, but still held */
+    fail_unless(cdb_write_record(cdb, t0 + (600 * 60), 42), NULL);
+
+    fail_unless(cdb_update_record(cdb, t0 + (650 * 60), 43), NULL);
+
+    /* Gaps aren't records to update */
+    w_records[0].time = t0 + (402 * 60);
+    fail_unless(cdb_update_records(cdb, w_records, 1, &num_recs) == CDB_SUCCESS, NULL);
+    fail_unless(num_recs == 0, NULL);
+
+    request.start = t0 + (660 * 60);
+    request.end   = t0 + (669 * 60);
+    fail_unless(cdb_discard_records_in_time_range(cdb, &request, &num_recs) == CDB_SUCCESS, NULL);
+    fail_unless(num_recs == 10, NULL);
+
+    cdb_close(cdb);
+    cdb_free(cdb);
+
+    /* Just the values after a full size header */
+    fail_unless(stat(TEST_FILENAME, &st) == 0, NULL);
+    fail_unless(st.st_size == HEADER_SIZE + (500 * sizeof(double)), NULL);
+
+    cdb = cdb_new();
+    cdb->filename = (char*)TEST_FILENAME;
+
+    request = cdb_new_request();
+    request.cooked = false;
+
+    fail_unless(cdb_read_records(cdb, &request, &num_recs, &r_records, range) == CDB_SUCCESS, NULL);
+    fail_unless(cdb->header->layout == CDB_LAYOUT_IMPLICIT, NULL);
+    fail_unless(cdb->header->base_time == t0 + (206 * 60), NULL);
+    fail_unless(num_recs == 495, NULL);
+
+    for (i = 0, n = 206; n <= 705; n++) {
+
+        if (n >= 400 && n < 405) {
+            continue;
+        }
+
+        fail_unless(r_records[i].time == t0 + (n * 60), NULL);
+
+        if (n == 600) {
+            fail_unless(r_records[i].value == 42, NULL);
+        } else if (n == 650) {
+            fail_unless(r_records[i].value == 43, NULL);
+        } else if (n >= 660 && n <= 669) {
+            fail_unless(isnan(r_records[i].value), NULL);
+        } else if (n == 705) {
+            fail_unless(r_records[i].value == 9999, NULL);
+        } else {
+            fail_unless(r_records[i].value == n, NULL);
+        }
+
+        i++;
+    }
+
+    free(r_records);
+
+    /* Around the gap, with times that aren't on the step */
+    request.start = t0 + (398 * 60) - 59;
+    request.end   = t0 + (406 * 60) + 59;
+
+    fail_unless(cdb_read_records(cdb, &request, &num_recs, &r_records, range) == CDB_SUCCESS, NULL);
+    fail_unless(num_recs == 4, NULL);
+    fail_unless(r_records[0].time == t0 + (398 * 60), NULL);
+    fail_unless(r_records[1].time == t0 + (399 * 60), NULL);
+    fail_unless(r_records[2].time == t0 + (405 * 60), NULL);
+    fail_unless(r_records[3].time == t0 + (406 * 60), NULL);
+    free(r_records);
+
+    /* The last few */
+    request = cdb_new_request();
+    request.cooked = false;
+    request.count  = 5;
+
+    fail_unless(cdb_read_records(cdb, &request, &num_recs, &r_records, range) == CDB_SUCCESS, NULL);
+    fail_unless(num_recs == 5, NULL);
+    fail_unless(r_records[0].time == t0 + (701 * 60), NULL);
+    fail_unless(r_records[4].value == 9999, NULL);
+
+    free(r_records);
+    free(range);
+    cdb_close(cdb);
+    cdb_free(cdb);
+}
+END_TEST
+
+START_TEST (test_cdb_encodings)
+{
+    cdb_record_t w_records[600];
+    cdb_record_t *r_records = NULL;
+    cdb_request_t request   = cdb_new_request();
+    cdb_range_t *range      = calloc(1, sizeof(cdb_range_t));
+    uint64_t num_recs = 0;
+    struct stat st;
+    int i = 0;
+
+    cdb_t *cdb = cdb_new();
+    cdb->filename = (char*)TEST_FILENAME;
+    cdb->flags    = O_CREAT|O_RDWR;
+
+    /* Rows have nowhere to put narrower values */
+    cdb_generate_header(cdb, (char*)"test", (char*)"", 500, CDB_TYPE_GAUGE, (char*)"absolute", 0, 0, CDB_ENCODING_FLOAT32);
+    fail_unless(cdb_write_header(cdb) == CDB_EINVAL, NULL);
+
+    /* Percentages to a tenth, in the implicit layout */
+    cdb_generate_header(cdb, (char*)"test", (char*)"", 500, CDB_TYPE_GAUGE, (char*)"percent", 0, 0, CDB_ENCODING_INT16);
+    cdb->header->layout      = CDB_LAYOUT_IMPLICIT;
+    cdb->header->step        = 60;
+    cdb->header->value_scale = 0.1;
+
+    fail_unless(cdb_write_header(cdb) == CDB_SUCCESS, NULL);
+
+    for (i = 0; i < 600; i++) {
+        w_records[i].time  = 1190860358 + (i * 60);
+        w_records[i].value = (i % 1001) / 10.0;
+    }
+
+    w_records[590].value = CDB_NAN;
+    w_records[591].value = 1e9;
+    w_records[592].value = -1e9;
+    w_records[599].time += 120;
+
+    fail_unless(cdb_write_records(cdb, w_records, 600, &num_recs) == CDB_SUCCESS, NULL);
+
+    cdb_close(cdb);
+    cdb_free(cdb);
+
+    /* Two bytes a value */
+    fail_unless(stat(TEST_FILENAME, &st) == 0, NULL);
+    fail_unless(st.st_size == HEADER_SIZE + (500 * sizeof(int16_t)), NULL);
+
+    cdb = cdb_new();
+    cdb->filename = (char*)TEST_FILENAME;
+
+    request.cooked = false;
+
+    fail_unless(cdb_read_records(cdb, &request, &num_recs, &r_records, range) == CDB_SUCCESS, NULL);
+    fail_unless(cdb->header->encoding == CDB_ENCODING_INT16, NULL);
+
+    /* The two slots skipped before the last record are still gaps */
+    fail_unless(num_recs == 498, NULL);
+
+    for (i = 0; i < 497; i++) {
+        int n = 102 + i;
+
+        fail_unless(r_records[i].time == w_records[n].time, NULL);
+
+        if (n == 590) {
+            fail_unless(isnan(r_records[i].value), NULL);
+        } else if (n == 591) {
+            fail_unless(r_records[i].value > 3276 && r_records[i].value < 3277, NULL);
+        } else if (n == 592) {
+            fail_unless(r_records[i].value < -3276 && r_records[i].value > -3277, NULL);
+        } else {
+            fail_unless(fabs(r_records[i].value - w_records[n].value) < 0.05, NULL);
+        }
+    }
+
+    fail_unless(r_records[497].time == w_records[599].time, NULL);
+
+    free(r_records);
+    cdb_close(cdb);
+    cdb_free(cdb);
+    unlink(TEST_FILENAME);
+
+    /* float32 columns */
+    cdb = cdb_new();
+    cdb->filename = (char*)TEST_FILENAME;
+    cdb->flags    = O_CREAT|O_RDWR;
+
+    cdb_generate_header(cdb, (char*)"test", (char*)"", 500, CDB_TYPE_GAUGE, (char*)"absolute", 0, 0, CDB_ENCODING_FLOAT32);
+    cdb->header->layout = CDB_LAYOUT_COLUMNS;
+
+    fail_unless(cdb_write_header(cdb) == CDB_SUCCESS, NULL);
+    fail_unless(cdb_write_records(cdb, w_records, 400, &num_recs) == CDB_SUCCESS, NULL);
+    fail_unless(cdb_write_records(cdb, &w_records[400], 200, &num_recs) == CDB_SUCCESS, NULL);
+
+    cdb_close(cdb);
+    cdb_free(cdb);
+
+    fail_unless(stat(TEST_FILENAME, &st) == 0, NULL);
+    fail_unless(st.st_size == HEADER_SIZE + (500 * (sizeof(cdb_time_t) + sizeof(float))), NULL);
+
+    cdb = cdb_new();
+    cdb->filename = (char*)TEST_FILENAME;
+
+    fail_unless(cdb_read_records(cdb, &request, &num_recs, &r_records, range) == CDB_SUCCESS, NULL);
+    fail_unless(num_recs == 500, NULL);
+
+    for (i = 0; i < 500; i++) {
+        cdb_record_t *w = &w_records[100 + i];
+
+        fail_unless(r_records[i].time == w->time, NULL);
+        fail_unless((isnan(w->value) && isnan(r_records[i].value)) || r_records[i].value == (float)w->value, NULL);
+    }
+
+    free(r_records);
+    free(range);
+    cdb_close(cdb);
+    cdb_free(cdb);
+}
+END_TEST
+
+START_TEST (test_cdb_checksums)
+{
+    cdb_record_t w_records[1200];
+    cdb_record_t *r_records = NULL;
+    cdb_request_t request   = cdb_new_request();
+    cdb_range_t *range      = calloc(1, sizeof(cdb_range_t));
+    cdb_damage_t *damage    = NULL;
+    uint64_t num_damaged = 0;
+    uint64_t num_recs = 0;
+    double bad = 12345.0;
+    int fd = -1;
+    int i = 0;
+
+    cdb_t *cdb = cdb_new();
+    cdb->filename = (char*)TEST_FILENAME;
+    cdb->flags    = O_CREAT|O_RDWR;
+
+    /* Rows have nowhere to keep the flag */
+    cdb_generate_header(cdb, (char*)"test", (char*)"", 1000, CDB_TYPE_GAUGE, (char*)"absolute", 0, 0, CDB_ENCODING_FLOAT64);
+    cdb->header->flags = CDB_FLAG_CHECKSUMS;
+    fail_unless(cdb_write_header(cdb) == CDB_EINVAL, NULL);
+
+    cdb->header->layout = CDB_LAYOUT_COLUMNS;
+    fail_unless(cdb_write_header(cdb) == CDB_SUCCESS, NULL);
+
+    for (i = 0; i < 1200; i++) {
+        w_records[i].time  = 1190860358 + (i * 60);
+        w_records[i].value = i;
+    }
+
+    /* Around the ring and then some */
+    for (i = 0; i < 1200; i += 400) {
+        fail_unless(cdb_write_records(cdb, &w_records[i], 400, &num_recs) == CDB_SUCCESS, NULL);
+    }
+
+    fail_unless(cdb_update_record(cdb, w_records[1100].time, -1), NULL);
+
+    fail_unless(cdb_verify_checksums(cdb, &damage, &num_damaged) == CDB_SUCCESS, NULL);
+    fail_unless(num_damaged == 0 && damage == NULL, NULL);
+
+    /* Damage the value in physical slot 700 */
+    fd = open(TEST_FILENAME, O_RDWR);
+    fail_unless(pwrite(fd, &bad, sizeof(bad), HEADER_SIZE + (1000 * sizeof(cdb_time_t)) + (700 * sizeof(double))) == sizeof(bad), NULL);
+    close(fd);
+
+    request.cooked = false;
+
+    fail_unless(cdb_read_records(cdb, &request, &num_recs, &r_records, range) == CDB_ECHECKSUM, NULL);
+
+    /* The last 100 records are in the first chunk */
+    request.count = 100;
+    fail_unless(cdb_read_records(cdb, &request, &num_recs, &r_records, range) == CDB_SUCCESS, NULL);
+    fail_unless(num_recs == 100 && r_records[99].value == 1199, NULL);
+    free(r_records);
+
+    request.count = 0;
+    request.skip_checksums = true;
+    fail_unless(cdb_read_records(cdb, &request, &num_recs, &r_records, range) == CDB_SUCCESS, NULL);
+    fail_unless(num_recs == 1000 && r_records[500].value == bad, NULL);
+    fail_unless(r_records[900].value == -1, NULL);
+    free(r_records);
+
+    /* Writing elsewhere in the chunk doesn't checksum the damage over */
+    fail_unless(cdb_update_record(cdb, w_records[701].time, -2), NULL);
+
+    fail_unless(cdb_verify_checksums(cdb, &damage, &num_damaged) == CDB_SUCCESS, NULL);
+    fail_unless(num_damaged == 1, NULL);
+    fail_unless(damage[0].first == 512 && damage[0].count == 488, NULL);
+    free(damage);
+
+    cdb_close(cdb);
+    cdb_free(cdb);
+    unlink(TEST_FILENAME);
+
+    /* Compressed blocks */
+    cdb = cdb_new();
+    cdb->filename = (char*)TEST_FILENAME;
+    cdb->flags    = O_CREAT|O_RDWR;
+
+    cdb_generate_header(cdb, (char*)"test", (char*)"", 1000, CDB_TYPE_GAUGE, (char*)"absolute", 0, 0, CDB_ENCODING_FLOAT64);
+    cdb->header->layout = CDB_LAYOUT_COMPRESSED;
+    cdb->header->flags  = CDB_FLAG_CHECKSUMS;
+
+    fail_unless(cdb_write_header(cdb) == CDB_SUCCESS, NULL);
+    fail_unless(cdb_write_records(cdb, w_records, 100, &num_recs) == CDB_SUCCESS, NULL);
+
+    /* Flip a bit in the stream of the only block */
+    fd = open(TEST_FILENAME, O_RDWR);
+    fail_unless(pread(fd, &bad, 1, cdb->header->data_offset + 100) == 1, NULL);
+    ((unsigned char*)&bad)[0] ^= 0x10;
+    fail_unless(pwrite(fd, &bad, 1, cdb->header->data_offset + 100) == 1, NULL);
+    close(fd);
+
+    request.skip_checksums = false;
+    fail_unless(cdb_read_records(cdb, &request, &num_recs, &r_records, range) == CDB_ECHECKSUM, NULL);
+
+    /* Writes carry on in a new block */
+    fail_unless(cdb_write_records(cdb, &w_records[100], 100, &num_recs) == CDB_SUCCESS, NULL);
+
+    fail_unless(cdb_verify_checksums(cdb, &damage, &num_damaged) == CDB_SUCCESS, NULL);
+    fail_unless(num_damaged == 1 && damage[0].first == 0 && damage[0].count == 1, NULL);
+    free(damage);
+
+    request.start = w_records[100].time;
+    fail_unless(cdb_read_records(cdb, &request, &num_recs, &r_records, range) == CDB_SUCCESS, NULL);
+    fail_unless(num_recs == 100 && r_records[0].value == 100, NULL);
+    free(r_records);
+
+    free(range);
+    cdb_close(cdb);
+    cdb_free(cdb);
+}
+END_TEST
+
+START_TEST (test_cdb_container)
+{
+    const char *names[] = { "net", "cpu", "mem" };
+    cdb_record_t w_records[1000];
+    cdb_record_t *records[3];
+    uint64_t num_recs[3];
+    cdb_container_t *container = NULL;
+    cdb_container_t *other     = NULL;
+    cdb_request_t request      = cdb_new_request();
+    cdb_t *proto = cdb_new();
+    cdb_t *cdb   = NULL;
+    uint64_t n   = 0;
+    int i = 0;
+
+    fail_unless(cdb_container_open(TEST_FILENAME, O_CREAT|O_RDWR, 3, &container) == CDB_SUCCESS, NULL);
+    fail_unless(cdb_container_open(TEST_FILENAME, O_RDONLY, 0, &other) == CDB_SUCCESS, NULL);
+
+    /* Rows become columns */
+    cdb_generate_header(proto, (char*)"cpu", (char*)"", 500, CDB_TYPE_GAUGE, (char*)"percent", 0, 0, 0);
+    fail_unless(cdb_container_add_series(container, proto, &cdb) == CDB_SUCCESS, NULL);
+    fail_unless(cdb->header->layout == CDB_LAYOUT_COLUMNS, NULL);
+    fail_unless(cdb_container_add_series(container, proto, &cdb) == CDB_EINVAL, NULL);
+
+    cdb_generate_header(proto, (char*)"mem", (char*)"", 500, CDB_TYPE_GAUGE, (char*)"bytes", 0, 0, CDB_ENCODING_INT32);
+    proto->header->layout = CDB_LAYOUT_IMPLICIT;
+    proto->header->step   = 60;
+    fail_unless(cdb_container_add_series(container, proto, &cdb) == CDB_SUCCESS, NULL);
+
+    cdb_generate_header(proto, (char*)"net", (char*)"", 500, CDB_TYPE_GAUGE, (char*)"bytes", 0, 0, 0);
+    proto->header->layout = CDB_LAYOUT_COMPRESSED;
+    fail_unless(cdb_container_add_series(container, proto, &cdb) == CDB_SUCCESS, NULL);
+
+    cdb_generate_header(proto, (char*)"disk", (char*)"", 500, CDB_TYPE_GAUGE, (char*)"bytes", 0, 0, 0);
+    fail_unless(cdb_container_add_series(container, proto, &cdb) == CDB_ENOSPACE, NULL);
+
+    for (i = 0; i < 1000; i++) {
+        w_records[i].time  = 1190860358 + (i * 60);
+        w_records[i].value = i;
+    }
+
+    /* Every series keeps to its own space */
+    for (i = 2; i >= 0; i--) {
+        fail_unless(cdb_container_open_series(container, names[i], &cdb) == CDB_SUCCESS, NULL);
+
+        cdb->locking = true;
+
+        fail_unless(cdb_write_records(cdb, w_records, 400, &n) == CDB_SUCCESS, NULL);
+        fail_unless(cdb_write_records(cdb, &w_records[400], 200 + (i * 100), &n) == CDB_SUCCESS, NULL);
+    }
+
+    fail_unless(cdb_container_num_series(container) == 3, NULL);
+    fail_unless(cdb_container_close(container) == CDB_SUCCESS, NULL);
+
+    /* Found by name after the directory was read */
+    fail_unless(cdb_container_open_series(other, "disk", &cdb) == CDB_ENOSERIES, NULL);
+    fail_unless(cdb_container_open_series(other, "net", &cdb) == CDB_SUCCESS, NULL);
+    fail_unless(cdb->header->layout == CDB_LAYOUT_COMPRESSED, NULL);
+
+    request.cooked = false;
+    request.start  = 1190860358 + (450 * 60);
+    request.end    = 1190860358 + (549 * 60);
+
+    fail_unless(cdb_container_read_records(other, names, 3, &request, records, num_recs) == CDB_SUCCESS, NULL);
+
+    for (i = 0; i < 3; i++) {
+        fail_unless(num_recs[i] == 100, NULL);
+        fail_unless(records[i][0].time == request.start, NULL);
+        fail_unless(records[i][0].value == 450, NULL);
+        fail_unless(records[i][99].value == 549, NULL);
+        free(records[i]);
+    }
+
+    /* The last of each */
+    request = cdb_new_request();
+    request.cooked = false;
+    request.count  = 1;
+
+    fail_unless(cdb_container_read_records(other, names, 3, &request, records, num_recs) == CDB_SUCCESS, NULL);
+
+    for (i = 0; i < 3; i++) {
+        fail_unless(num_recs[i] == 1, NULL);
+        fail_unless(records[i][0].value == 599 + (i * 100), NULL);
+        free(records[i]);
+    }
+
+    names[1] = "disk";
+    fail_unless(cdb_container_read_records(other, names, 3, &request, records, num_recs) == CDB_ENOSERIES, NULL);
+
+    fail_unless(cdb_container_close(other) == CDB_SUCCESS, NULL);
+    cdb_free(proto);
+
+    /* The header and directory are little endian whatever the host */
+    {
+        unsigned char header[64];
+        unsigned char entry[144];
+        int fd = open(TEST_FILENAME, O_RDWR);
+
+        fail_unless(fd >= 0, NULL);
+        fail_unless(pread(fd, header, sizeof(header), 0) == sizeof(header), NULL);
+        fail_unless(pread(fd, entry, sizeof(entry), sizeof(header)) == sizeof(entry), NULL);
+
+        fail_unless(memcmp(header, "CDBC", 4) == 0, NULL);
+        fail_unless(header[12] == 3 && header[13] == 0 && header[14] == 0 && header[15] == 0, NULL);
+        fail_unless(header[16] == 3 && header[17] == 0 && header[18] == 0 && header[19] == 0, NULL);
+        fail_unless(strcmp((char*)entry, "cpu") == 0, NULL);
+        fail_unless(entry[128] == 0 && entry[129] == 0x10 && entry[130] == 0, "First series at 4096");
+
+        /* A directory bigger than the file is refused before it's allocated */
+        header[15] = 0x7f;
+        fail_unless(pwrite(fd, header, sizeof(header), 0) == sizeof(header), NULL);
+        fail_unless(cdb_container_open(TEST_FILENAME, O_RDONLY, 0, &other) == CDB_ESANITY, NULL);
+        fail_unless(other == NULL, NULL);
+
+        close(fd);
+    }
+}
+END_TEST
+
+START_TEST (test_cdb_average)
+{
+    cdb_record_t *r_records = NULL;
+    cdb_request_t request   = cdb_new_request();
+    cdb_range_t *range      = calloc(1, sizeof(cdb_range_t));
+    uint64_t num_recs = 0;
+    int i = 0;
+
+    request.step = 5;
+
+    cdb_t *cdb = create_cdb(CDB_TYPE_GAUGE, "percent", 20);
+
+    if (!cdb) fail("cdb is null");
+
+    for (i = 0; i < 20; i++) {
+        cdb_write_record(cdb, 1190860358+i, i);
+    }
+
+    cdb_read_records(cdb, &request, &num_recs, &r_records, range);
+
+    // for first 5, should have time of 1190860360 and value of 2
+    // for next  5, should have time of 1190860365 and value of 7
+    fail_unless(num_recs == 4, "Couldn't read 4 records");
+    fail_unless(r_records[0].time  == 1190860360);
+    fail_unless(r_records[0].value == 2);
+
+    fail_unless(r_records[1].time  == 1190860365);
+    fail_unless(r_records[1].value == 7);
+
+    fail_unless(r_records[2].time  == 1190860370);
+    fail_unless(r_records[2].value == 12);
+
+    fail_unless(r_records[3].time  == 1190860375);
+    fail_unless(r_records[3].value == 17);
+
+    free(range);
+    free(r_records);
+    cdb_close(cdb);
+    cdb_free(cdb);
+}
+END_TEST
+
+START_TEST (test_cdb_print)
+{
+    cdb_request_t request = cdb_new_request();
+    const char *date_format = "%Y-%m-%d %H:%M:%S";
+    double values[] = { 0, -0.5, 1.0 / 3, 12345678.9, 99999999.5, 1e-5, 0.0001, 42, -1e300, NAN };
+    char expected[256];
+    char line[256];
+    int i = 0;
+    FILE *fh = tmpfile();
+
+    cdb_t *cdb = create_cdb(CDB_TYPE_GAUGE, "absolute", 500);
+
+    if (!cdb) fail("cdb is null");
+    if (!fh) fail("tmpfile failed");
+
+    /* A record a little under every 7 hours, across a few days */
+    for (i = 0; i < 100; i++) {
+        cdb_write_record(cdb, 1190860358 + (i * 25000), values[i % 10]);
+    }
+
+    request.cooked = false;
+    cdb_print_records(cdb, &request, fh, date_format);
+    rewind(fh);
+
+    /* Same as printf() of "%d [%s] %.8g" for each record */
+    for (i = 0; i < 100; i++) {
+        char formatted[64];
+        time_t stime = 1190860358 + (i * 25000);
+
+        strftime(formatted, sizeof(formatted), date_format, localtime(&stime));
+        snprintf(expected, sizeof(expected), "%d [%s] %.8g\n", (int)stime, formatted, values[i % 10]);
+
+        fail_unless(fgets(line, sizeof(line), fh) != NULL, "Missing record %d", i);
+        fail_unless(strcmp(line, expected) == 0, "Got %s, not %s", line, expected);
+    }
+
+    fail_unless(fgets(line, sizeof(line), fh) == NULL, "Extra records printed");
+
+    fclose(fh);
+    cdb_close(cdb);
+    cdb_free(cdb);
+}
+END_TEST
+
+START_TEST (test_cdb_scan)
+{
+    int layouts[] = { CDB_LAYOUT_ROWS, CDB_LAYOUT_COLUMNS, CDB_LAYOUT_COMPRESSED, CDB_LAYOUT_IMPLICIT };
+    cdb_record_t w_records[700];
+    cdb_record_t s_records[37];
+    int l = 0;
+    int i = 0;
+
+    for (i = 0; i < 700; i++) {
+        w_records[i].time  = 1190860358 + (i * 60) + (i > 300 ? 120 : 0);
+        w_records[i].value = i * 1.5;
+    }
+
+    for (l = 0; l < 4; l++) {
+        cdb_record_t *r_records = NULL;
+        cdb_request_t request   = cdb_new_request();
+        cdb_scan_t scan         = cdb_new_scan();
+        cdb_range_t range;
+        uint64_t num_recs = 0;
+        uint64_t scanned  = 0;
+        uint64_t j = 0;
+
+        cdb_t *cdb = cdb_new();
+        cdb->filename = (char*)TEST_FILENAME;
+        cdb->flags    = O_CREAT|O_RDWR;
+
+        unlink(TEST_FILENAME);
+
+        cdb_generate_header(cdb, (char*)"test", (char*)"", 500, CDB_TYPE_GAUGE, (char*)"absolute", 0, 0, 0);
+        cdb->header->layout = layouts[l];
+        cdb->header->step   = 60;
+
+        fail_unless(cdb_write_header(cdb) == CDB_SUCCESS, NULL);
+
+        /* Across the wrap */
+        fail_unless(cdb_write_records(cdb, w_records, 400, &num_recs) == CDB_SUCCESS, NULL);
+        fail_unless(cdb_write_records(cdb, &w_records[400], 300, &num_recs) == CDB_SUCCESS, NULL);
+
+        request.cooked = false;
+        fail_unless(cdb_read_records(cdb, &request, &num_recs, &r_records, &range) == CDB_SUCCESS, NULL);
+
+        /* A buffer at a time gives the same records as reading them all */
+        do {
+            fail_unless(cdb_scan_records(cdb, &scan, s_records, 37, &j) == CDB_SUCCESS, "Layout %d", layouts[l]);
+
+            for (i = 0; (uint64_t)i < j; i++) {
+                fail_unless(scanned + i < num_recs, "Layout %d scanned too many", layouts[l]);
+                fail_unless(s_records[i].time == r_records[scanned + i].time, "Layout %d", layouts[l]);
+                fail_unless(s_records[i].value == r_records[scanned + i].value, "Layout %d", layouts[l]);
+            }
+
+            scanned += j;
+
+        } while (j > 0);
+
+        fail_unless(scanned == num_recs, "Layout %d scanned %"PRIu64" of %"PRIu64, layouts[l], scanned, num_recs);
+
+        /* A write part way through is noticed */
+        scan = cdb_new_scan();
+
+        fail_unless(cdb_scan_records(cdb, &scan, s_records, 37, &j) == CDB_SUCCESS, NULL);
+        fail_unless(cdb_write_record(cdb, 1190860358 + (800 * 60), 1), NULL);
+        fail_unless(cdb_scan_records(cdb, &scan, s_records, 37, &j) == CDB_EBUSY, "Layout %d", layouts[l]);
+
+        free(r_records);
+        cdb_close(cdb);
+        cdb_free(cdb);
+    }
+}
+END_TEST
+
+START_TEST (test_cdb_cook)
+{
+    const char *units[] = { "", "per min" };
+    cdb_record_t w_records[400];
+    cdb_record_t s_records[37];
+    double counter = 0;
+    int u = 0;
+    int i = 0;
+
+    /* A counter that resets now and then, with a gap or two */
+    for (i = 0; i < 400; i++) {
+        counter += (i % 50 == 49) ? -counter : (i % 7);
+
+        w_records[i].time  = 1190860358 + (i * 60) + (i > 200 ? 30 : 0);
+        w_records[i].value = (i % 31 == 5) ? CDB_NAN : counter;
+    }
+
+    for (u = 0; u < 2; u++) {
+        cdb_record_t *r_records = NULL;
+        cdb_request_t request   = cdb_new_request();
+        cdb_scan_t scan         = cdb_new_scan();
+        cdb_cook_t cook         = cdb_new_cook();
+        cdb_range_t range;
+        uint64_t num_recs = 0;
+        uint64_t cooked   = 0;
+        uint64_t j = 0;
+
+        cdb_t *cdb = cdb_new();
+        cdb->filename = (char*)TEST_FILENAME;
+        cdb->flags    = O_CREAT|O_RDWR;
+
+        unlink(TEST_FILENAME);
+
+        cdb_generate_header(cdb, (char*)"test", (char*)"", 300, CDB_TYPE_COUNTER, (char*)units[u], 0, 5, 0);
+
+        fail_unless(cdb_write_header(cdb) == CDB_SUCCESS, NULL);
+        fail_unless(cdb_write_records(cdb, w_records, 400, &num_recs) == CDB_SUCCESS, NULL);
+
+        fail_unless(cdb_read_records(cdb, &request, &num_recs, &r_records, &range) == CDB_SUCCESS, NULL);
+
+        /* Cooking a buffer at a time gives what a cooked read does */
+        do {
+            uint64_t k = 0;
+
+            fail_unless(cdb_scan_records(cdb, &scan, s_records, 37, &j) == CDB_SUCCESS, NULL);
+            fail_unless(cdb_cook_records(cdb, &cook, s_records, j, &k) == CDB_SUCCESS, NULL);
+
+            for (i = 0; (uint64_t)i < k; i++) {
+                fail_unless(cooked + i < num_recs, "Units '%s' cooked too many", units[u]);
+                fail_unless(s_records[i].time == r_records[cooked + i].time, "Units '%s'", units[u]);
+                fail_unless(s_records[i].value == r_records[cooked + i].value ||
+                    (isnan(s_records[i].value) && isnan(r_records[cooked + i].value)), "Units '%s'", units[u]);
+            }
+
+            cooked += k;
+
+        } while (j > 0);
+
+        fail_unless(cooked == num_recs, "Units '%s' cooked %"PRIu64" of %"PRIu64, units[u], cooked, num_recs);
+
+        free(r_records);
+        cdb_close(cdb);
+        cdb_free(cdb);
+    }
+}
+END_TEST
+
+START_TEST (test_cdb_repair)
+{
+    int layouts[] = { CDB_LAYOUT_ROWS, CDB_LAYOUT_COLUMNS, CDB_LAYOUT_COMPRESSED };
+    cdb_record_t w_records[700];
+    int l = 0;
+    int i = 0;
+
+    for (i = 0; i < 700; i++) {
+        w_records[i].time  = 1190860358 + (i * 60);
+        w_records[i].value = i;
+    }
+
+    /* A duplicate, one far in the future and one from the past */
+    w_records[450].time = w_records[449].time;
+    w_records[500].time = 2000000000;
+    w_records[600].time = 1190860358;
+
+    for (l = 0; l < 3; l++) {
+        cdb_record_t *r_records = NULL;
+        cdb_request_t request   = cdb_new_request();
+        cdb_repair_t report;
+        cdb_range_t range;
+        uint64_t num_recs = 0;
+        uint64_t j = 0;
+        const char *fixed = "/tmp/cdb_test_repaired.cdb";
+
+        cdb_t *cdb = cdb_new();
+        cdb_t *dst = cdb_new();
+
+        unlink(TEST_FILENAME);
+        unlink(fixed);
+
+        cdb->filename = (char*)TEST_FILENAME;
+        cdb->flags    = O_CREAT|O_RDWR;
+
+        cdb_generate_header(cdb, (char*)"test", (char*)"", 500, CDB_TYPE_GAUGE, (char*)"absolute", 0, 0, 0);
+        cdb->header->layout = layouts[l];
+
+        fail_unless(cdb_write_header(cdb) == CDB_SUCCESS, NULL);
+        fail_unless(cdb_write_records(cdb, w_records, 400, &num_recs) == CDB_SUCCESS, NULL);
+        fail_unless(cdb_write_records(cdb, &w_records[400], 300, &num_recs) == CDB_SUCCESS, NULL);
+
+        /* A header that lost track of where the ring starts */
+        if (layouts[l] != CDB_LAYOUT_COMPRESSED) {
+            fail_unless(cdb->header->start_record == 200, NULL);
+
+            cdb->header->start_record = 77;
+            cdb->synced = false;
+            fail_unless(cdb_write_header(cdb) == CDB_SUCCESS, NULL);
+        }
+
+        dst->filename = (char*)fixed;
+        dst->flags    = O_CREAT|O_RDWR;
+
+        cdb_generate_header(dst, (char*)"test", (char*)"", 500, CDB_TYPE_GAUGE, (char*)"absolute", 0, 0, 0);
+        dst->header->layout = layouts[l];
+
+        fail_unless(cdb_write_header(dst) == CDB_SUCCESS, NULL);
+        fail_unless(cdb_repair_records(cdb, dst, &report) == CDB_SUCCESS, NULL);
+
+        if (layouts[l] != CDB_LAYOUT_COMPRESSED) {
+            fail_unless(report.old_start == 77, NULL);
+            fail_unless(report.new_start == 200, "Layout %d start %"PRIu64, layouts[l], report.new_start);
+            fail_unless(report.num_read == 500, NULL);
+        }
+
+        fail_unless(report.num_merged == 1, "Layout %d merged %"PRIu64, layouts[l], report.num_merged);
+        fail_unless(report.num_dropped == 2, "Layout %d dropped %"PRIu64, layouts[l], report.num_dropped);
+        fail_unless(report.num_written == report.num_read - 3, NULL);
+
+        request.cooked = false;
+        fail_unless(cdb_read_records(dst, &request, &num_recs, &r_records, &range) == CDB_SUCCESS, NULL);
+        fail_unless(num_recs == report.num_written, NULL);
+
+        /* In order, the later of the duplicates kept */
+        for (j = 1; j < num_recs; j++) {
+            fail_unless(r_records[j].time > r_records[j-1].time, "Layout %d out of order at %"PRIu64, layouts[l], j);
+
+            if (r_records[j].time == w_records[450].time) {
+                fail_unless(r_records[j].value == 450, NULL);
+            }
+        }
+
+        free(r_records);
+        cdb_free(dst);
+        cdb_close(cdb);
+        cdb_free(cdb);
+        unlink(fixed);
+    }
+}
+END_TEST
+
+START_TEST (test_cdb_stats)
+{
+    cdb_record_t w_records[400];
+    cdb_record_t *r_records = NULL;
+    cdb_request_t request = cdb_new_request();
+    cdb_stats_t stats;
+    cdb_range_t range;
+    uint64_t num_recs = 0;
+    int i = 0;
+
+    cdb_t *cdb = create_cdb(CDB_TYPE_COUNTER, "absolute", 0);
+
+    for (i = 0; i < 400; i++) {
+        w_records[i].time  = 1190860358 + (i * 60);
+        w_records[i].value = i * 10;
+    }
+
+    fail_unless(cdb_write_records(cdb, w_records, 400, &num_recs) == CDB_SUCCESS, NULL);
+
+    cdb_reset_stats(cdb);
+
+    request.start = w_records[100].time;
+    request.step  = 4;
+    fail_unless(cdb_read_records(cdb, &request, &num_recs, &r_records, &range) == CDB_SUCCESS, NULL);
+    free(r_records);
+
+    /* Without --enable-stats nothing is counted */
+    if (cdb_get_stats(cdb, &stats) == CDB_EINVAL) {
+        fail_unless(stats.syscalls == 0 && stats.bytes_read == 0 && stats.allocations == 0, NULL);
+
+    } else {
+        fail_unless(stats.syscalls > 0, NULL);
+        fail_unless(stats.bytes_read >= 300 * RECORD_SIZE, NULL);
+        fail_unless(stats.bytes_written == 0, NULL);
+        fail_unless(stats.lookups == 1, "%"PRIu64" lookups", stats.lookups);
+        fail_unless(stats.probes > 0 && stats.probes < 100, "%"PRIu64" probes", stats.probes);
+        fail_unless(stats.records_decoded == 300, "%"PRIu64" decoded", stats.records_decoded);
+        /* The records and the statistics' scratch - cooking, averaging and
+         * slicing happen in place */
+        fail_unless(stats.allocations == 2, "%"PRIu64" allocations", stats.allocations);
+
+        fail_unless(cdb_write_record(cdb, 1190860358 + (400 * 60), 4000), NULL);
+        fail_unless(cdb_get_stats(cdb, &stats) == CDB_SUCCESS, NULL);
+        fail_unless(stats.bytes_written >= RECORD_SIZE, NULL);
+
+        cdb_reset_stats(cdb);
+        fail_unless(cdb_get_stats(cdb, &stats) == CDB_SUCCESS, NULL);
+        fail_unless(stats.syscalls == 0 && stats.bytes_written == 0 && stats.probes == 0, NULL);
+    }
+
+    cdb_close(cdb);
+    cdb_free(cdb);
+}
+END_TEST
+
+START_TEST (test_cdb_read_records_into)
+{
+    cdb_record_t w_records[400];
+    cdb_record_t i_records[400];
+    cdb_record_t *r_records = NULL;
+    cdb_request_t request = cdb_new_request();
+    cdb_request_t attempt;
+    cdb_range_t range;
+    cdb_range_t i_range;
+    double scratch[400];
+    uint64_t num_recs = 0;
+    uint64_t i_num_recs = 0;
+    int i = 0;
+
+    cdb_t *cdb = create_cdb(CDB_TYPE_COUNTER, "requests per min", 0);
+
+    for (i = 0; i < 400; i++) {
+        w_records[i].time  = 1190860358 + (i * 60);
+        w_records[i].value = i * 10;
+    }
+
+    fail_unless(cdb_write_records(cdb, w_records, 400, &num_recs) == CDB_SUCCESS, NULL);
+
+    /* Cooked, averaged and sliced in place, the same as cdb_read_records() */
+    request.start  = w_records[100].time;
+    request.count  = 20;
+    request.step   = 3;
+    request.cooked = true;
+
+    /* cdb_read_records() mangles the request, cdb_read_records_into() doesn't */
+    attempt = request;
+    fail_unless(cdb_read_records(cdb, &attempt, &num_recs, &r_records, &range) == CDB_SUCCESS, NULL);
+
+    fail_unless(cdb_read_records_into(cdb, &request, i_records, 400, &i_num_recs, &i_range, scratch, 400) == CDB_SUCCESS, NULL);
+    fail_unless(memcmp(&attempt, &request, sizeof(request)) != 0, NULL);
+
+    fail_unless(num_recs > 0 && i_num_recs == num_recs, NULL);
+    fail_unless(memcmp(r_records, i_records, RECORD_SIZE * num_recs) == 0, NULL);
+    fail_unless(i_range.mean == range.mean && i_range.median == range.median && i_range.mad == range.mad, NULL);
+
+    free(r_records);
+
+    /* Too small for the records as read, or scratch too small for as many
+     * records as the buffer holds, which is found without reading */
+    fail_unless(cdb_read_records_into(cdb, &request, i_records, 100, &i_num_recs, NULL, NULL, 0) == CDB_ETOOSMALL, NULL);
+    fail_unless(i_num_recs == 300, "%"PRIu64" needed", i_num_recs);
+
+    fail_unless(cdb_read_records_into(cdb, &request, i_records, 400, &i_num_recs, &i_range, scratch, 10) == CDB_ETOOSMALL, NULL);
+    fail_unless(i_num_recs == 400, NULL);
+
+    fail_unless(cdb_read_records_into(cdb, &request, i_records, 400, &i_num_recs, &i_range, NULL, 400) == CDB_ETOOSMALL, NULL);
+
+    fail_unless(cdb_read_records_into(cdb, &request, i_records, 400, &i_num_recs, NULL, NULL, 0) == CDB_SUCCESS, NULL);
+    fail_unless(i_num_recs == num_recs, NULL);
+    fail_unless(cdb_read_records_into(cdb, &request, NULL, 400, &i_num_recs, NULL, NULL, 0) == CDB_EINVAL, NULL);
+
+    cdb_close(cdb);
+    cdb_free(cdb);
+}
+END_TEST
+
+START_TEST (test_cdb_arena)
+{
+    cdb_record_t w_records[100];
+    cdb_record_t *r_records = NULL;
+    cdb_record_t *a_records = NULL;
+    cdb_request_t request = cdb_new_request();
+    cdb_range_t range;
+    cdb_range_t a_range;
+    cdb_stats_t stats;
+    cdb_arena_t *arena;
+    cdb_t *cdbs[3];
+    double region[64];
+    uint64_t num_recs = 0;
+    uint64_t a_num_recs = 0;
+    int i = 0;
+
+    /* Carved from the caller's region, and past it until the reset */
+    fail_unless((arena = cdb_arena_new(region, sizeof(region))) != NULL, NULL);
+    fail_unless(cdb_arena_alloc(arena, 100) == (void*)region, NULL);
+    fail_unless(((uintptr_t)cdb_arena_alloc(arena, 3) % 16) == 0, NULL);
+    fail_unless(cdb_arena_alloc(arena, 1000) != NULL, NULL);
+
+    cdb_arena_reset(arena);
+    fail_unless(cdb_arena_alloc(arena, 100) == (void*)region, NULL);
+    cdb_arena_free(arena);
+
+    /* Its own region grows to what the query before needed */
+    fail_unless((arena = cdb_arena_new(NULL, 0)) != NULL, NULL);
+
+    /* The same series three times over */
+    cdbs[0] = create_cdb(CDB_TYPE_GAUGE, "absolute", 0);
+
+    for (i = 0; i < 100; i++) {
+        w_records[i].time  = 1190860358 + (i * 60);
+        w_records[i].value = i + 1;
+    }
+
+    fail_unless(cdb_write_records(cdbs[0], w_records, 100, &num_recs) == CDB_SUCCESS, NULL);
+
+    for (i = 1; i < 3; i++) {
+        cdbs[i] = cdb_new();
+        cdbs[i]->filename = (char*)TEST_FILENAME;
+        cdbs[i]->flags    = O_RDONLY;
+    }
+
+    fail_unless(cdb_read_aggregate_records(cdbs, 3, &request, &num_recs, &r_records, &range) == CDB_SUCCESS, NULL);
+
+    for (i = 0; i < 3; i++) {
+        cdb_reset_stats(cdbs[0]);
+
+        request = cdb_new_request();
+        fail_unless(cdb_read_aggregate_records_arena(cdbs, 3, &request, arena, &a_num_recs, &a_records, &a_range) == CDB_SUCCESS, NULL);
+
+        fail_unless(a_num_recs == 100 && num_recs == 100, NULL);
+        fail_unless(memcmp(a_records, r_records, 100 * RECORD_SIZE) == 0, NULL);
+        fail_unless(a_range.sum == range.sum && a_range.median == range.median, NULL);
+
+        /* Nothing is allocated once the arena has grown */
+        if (i > 0 && cdb_get_stats(cdbs[0], &stats) == CDB_SUCCESS) {
+            fail_unless(stats.allocations == 0, "%"PRIu64" allocations", stats.allocations);
+        }
+
+        cdb_arena_reset(arena);
+    }
+
+    for (i = 0; i < 100; i++) {
+        fail_unless(r_records[i].value == (i + 1) * 3, NULL);
+    }
+
+    fail_unless(range.sum == 15150 && range.min == 3 && range.max == 300, NULL);
+
+    free(r_records);
+    cdb_arena_free(arena);
+
+    for (i = 0; i < 3; i++) {
+        cdb_close(cdbs[i]);
+        cdb_free(cdbs[i]);
+    }
+}
+END_TEST
+
+START_TEST (test_cdb_histograms)
+{
+    cdb_histogram_t histograms[CDB_OP_MAX];
+    cdb_histogram_t merged;
+    cdb_record_t *r_records = NULL;
+    cdb_request_t request = cdb_new_request();
+    cdb_range_t range;
+    uint64_t num_recs = 0;
+    uint64_t ns = 0;
+    int i = 0;
+
+    cdb_t *cdb = create_cdb(CDB_TYPE_GAUGE, "absolute", 0);
+
+    /* Buckets cover every latency, in order, within an eighth */
+    for (i = 1; i < CDB_HISTOGRAM_BUCKETS; i++) {
+        fail_unless(cdb_histogram_bucket_low(i) == cdb_histogram_bucket_high(i - 1) + 1, "bucket %d", i);
+        fail_unless(cdb_histogram_bucket_high(i) - cdb_histogram_bucket_low(i) <= cdb_histogram_bucket_low(i) / 8, NULL);
+    }
+
+    fail_unless(cdb_histogram_bucket_high(CDB_HISTOGRAM_BUCKETS - 1) == UINT64_MAX, NULL);
+
+    /* 1 to 1000 us, merged in from two halves */
+    memset(&merged, 0, sizeof(merged));
+    memset(histograms, 0, sizeof(histograms));
+
+    for (ns = 1000; ns <= 1000000; ns += 1000) {
+        cdb_histogram_t *half = &histograms[ns % 2000 == 0 ? 0 : 1];
+
+        for (i = 0; cdb_histogram_bucket_high(i) < ns; i++);
+
+        half->buckets[i] += 1;
+        half->count  += 1;
+        half->sum_ns += ns;
+        half->max_ns  = ns;
+    }
+
+    cdb_merge_histogram(&merged, &histograms[0]);
+    cdb_merge_histogram(&merged, &histograms[1]);
+
+    fail_unless(merged.count == 1000 && merged.max_ns == 1000000, NULL);
+    fail_unless(cdb_histogram_percentile(&merged, 0.5) >= 500000 && cdb_histogram_percentile(&merged, 0.5) <= 500000 * 9 / 8, NULL);
+    fail_unless(cdb_histogram_percentile(&merged, 0.99) >= 990000, NULL);
+    fail_unless(cdb_histogram_percentile(&merged, 1) == 1000000, NULL);
+
+    for (i = 0; i < 100; i++) {
+        fail_unless(cdb_write_record(cdb, 1190860358 + (i * 60), i), NULL);
+    }
+
+    cdb_reset_histograms();
+
+    request.start = 1190860358 + (50 * 60);
+    fail_unless(cdb_read_records(cdb, &request, &num_recs, &r_records, &range) == CDB_SUCCESS, NULL);
+    free(r_records);
+
+    /* Without --enable-stats nothing is kept */
+    if (cdb_get_histograms(histograms) == CDB_SUCCESS) {
+        fail_unless(histograms[CDB_OP_READ].count == 1, NULL);
+        fail_unless(histograms[CDB_OP_SEARCH].count >= 1, NULL);
+        fail_unless(histograms[CDB_OP_STATS].count == 1, NULL);
+        fail_unless(histograms[CDB_OP_WRITE].count == 0, NULL);
+        fail_unless(cdb_histogram_percentile(&histograms[CDB_OP_READ], 0.99) > 0, NULL);
+
+        cdb_reset_histograms();
+        fail_unless(cdb_get_histograms(histograms) == CDB_SUCCESS, NULL);
+        fail_unless(histograms[CDB_OP_READ].count == 0, NULL);
+
+    } else {
+        fail_unless(histograms[CDB_OP_READ].count == 0, NULL);
+    }
+
+    fail_unless(strcmp(cdb_op_name(CDB_OP_AGGREGATE), "aggregate") == 0, NULL);
+
+    cdb_close(cdb);
+    cdb_free(cdb);
+}
+END_TEST
+
+#define NUM_READER_THREADS 8
+
+static void* _concurrent_reader(void *arg) {
+    cdb_t *cdb = (cdb_t*)arg;
+    int i = 0;
+    int64_t failures = 0;
+
+    for (i = 0; i < 2000; i++) {
+        cdb_record_t *r_records = NULL;
+        cdb_request_t request   = cdb_new_request();
+        cdb_range_t range;
+        uint64_t num_recs = 0;
+        uint64_t j = 0;
+
+        /* Walk the start time around the wrapped ring */
+        request.start = 1190860358 + 300 + (i % 100);
+
+        if (cdb_read_records(cdb, &request, &num_recs, &r_records, &range) != CDB_SUCCESS) {
+            failures++;
+            continue;
+        }
+
+        if (num_recs != 400 - (i % 100) || r_records[0].time != request.start) {
+            failures++;
+        }
+
+        for (j = 1; j < num_recs; j++) {
+            if (r_records[j].time != r_records[j-1].time + 1) {
+                failures++;
+            }
+        }
+
+        free(r_records);
+    }
+
+    return (void*)(intptr_t)failures;
+}
+
+START_TEST (test_cdb_concurrent_readers)
+{
+    int i = 0;
+    pthread_t threads[NUM_READER_THREADS];
+
+    cdb_t *cdb = create_cdb(CDB_TYPE_GAUGE, "absolute", 500);
+
+    if (!cdb) fail("cdb is null");
+
+    /* 700 records into a 500 record ring, so reads have to handle the wrap. */
+    for (i = 0; i < 700; i++) {
+        cdb_write_record(cdb, 1190860358+i, i);
+    }
+
+    for (i = 0; i < NUM_READER_THREADS; i++) {
+        fail_unless(pthread_create(&threads[i], NULL, _concurrent_reader, cdb) == 0, "Couldn't start reader");
+    }
+
+    for (i = 0; i < NUM_READER_THREADS; i++) {
+        void *failures = NULL;
+
+        pthread_join(threads[i], &failures);
+
+        fail_unless((intptr_t)failures == 0, "Concurrent reader saw bad records");
+    }
+
+    cdb_close(cdb);
+    cdb_free(cdb);
+}
+END_TEST
+
+START_TEST (test_cdb_seqlock_reader)
+{
+    int i = 0;
+    int status = 0;
+    pid_t writer;
+    cdb_t *reader;
+
+    cdb_t *cdb = create_cdb(CDB_TYPE_GAUGE, "absolute", 100);
+
+    if (!cdb) fail("cdb is null");
+
+    for (i = 0; i < 100; i++) {
+        cdb_write_record(cdb, 1190860358+i, i);
+    }
+
+    /* Keep wrapping the ring from another process while we read it. */
+    if ((writer = fork()) == 0) {
+
+        for (i = 100; i < 50000; i++) {
+            cdb_write_record(cdb, 1190860358+i, i);
+        }
+
+        _exit(0);
+    }
+
+    reader = cdb_new();
+    reader->filename = (char*)TEST_FILENAME;
+    reader->flags = O_RDONLY;
+
+    fail_unless(cdb_read_header(reader) == CDB_SUCCESS, "Couldn't open reader");
+
+    while (waitpid(writer, &status, WNOHANG) == 0) {
+
+        cdb_record_t *r_records = NULL;
+        cdb_request_t request   = cdb_new_request();
+        cdb_range_t range;
+        uint64_t num_recs = 0;
+        uint64_t j = 0;
+
+        fail_unless(cdb_read_records(reader, &request, &num_recs, &r_records, &range) == CDB_SUCCESS, NULL);
+        fail_unless(num_recs == 100, "Torn read: wrong number of records");
+
+        for (j = 1; j < num_recs; j++) {
+            fail_unless(r_records[j].time == r_records[j-1].time + 1, "Torn read: records out of order");
+        }
+
+        free(r_records);
+    }
+
+    fail_unless(WIFEXITED(status) && WEXITSTATUS(status) == 0, "Writer failed");
+
+    cdb_close(reader);
+    cdb_free(reader);
+    cdb_close(cdb);
+    cdb_free(cdb);
+}
+END_TEST
+
+#define NUM_WRITER_PROCS 4
+#define RECS_PER_WRITER  1000
+
+/* Writers in separate processes, each with its own handle, interleaving
+ * batches into a ring that wraps. With locking, some of them go in groups. */
+static void _test_writers(bool locking)
+{
+    int i = 0;
+    int w = 0;
+    uint64_t j = 0;
+    uint64_t num_recs = 0;
+    pid_t writers[NUM_WRITER_PROCS];
+
+    cdb_record_t *r_records = NULL;
+    cdb_request_t request   = cdb_new_request();
+    cdb_range_t range;
+
+    int64_t last_seen[NUM_WRITER_PROCS];
+    int64_t num_seen[NUM_WRITER_PROCS];
+    int gate[2];
+
+    /* Smaller than everything written, so the writers have to wrap */
+    cdb_t *cdb = create_cdb(CDB_TYPE_GAUGE, "absolute", 3000);
+
+    if (!cdb) fail("cdb is null");
+
+    fail_unless(pipe(gate) == 0, NULL);
+
+    for (w = 0; w < NUM_WRITER_PROCS; w++) {
+
+        if ((writers[w] = fork()) == 0) {
+
+            char go;
+
+            /* Each writer needs its own open file for the lock to mean anything */
+            cdb_t *writer = cdb_new();
+            writer->filename = (char*)TEST_FILENAME;
+            writer->flags    = O_RDWR;
+            writer->locking  = locking;
+
+            /* Start everyone at once */
+            close(gate[1]);
+            if (read(gate[0], &go, 1) != 0) {
+                _exit(1);
+            }
+
+            for (i = 0; i < RECS_PER_WRITER; i += 2) {
+                cdb_record_t w_records[2];
+                int k = 0;
+
+                for (k = 0; k < 2; k++) {
+                    w_records[k].time  = 1190860358 + i + k;
+                    w_records[k].value = (w * RECS_PER_WRITER) + i + k;
+                }
+
+                /* Alternate between a group commit of five batches and
+                 * locking each batch on its own */
+                if (locking && (i / 2) % 10 == 0 && cdb_lock(writer) != CDB_SUCCESS) {
+                    _exit(1);
+                }
+
+                if (cdb_write_records(writer, w_records, 2, &num_recs) != CDB_SUCCESS) {
+                    _exit(1);
+                }
+
+                if (locking && (i / 2) % 10 == 4 && cdb_unlock(writer) != CDB_SUCCESS) {
+                    _exit(1);
+                }
+            }
+
+            cdb_close(writer);
+            cdb_free(writer);
+            _exit(0);
+        }
+    }
+
+    close(gate[0]);
+    close(gate[1]);
+
+    for (w = 0; w < NUM_WRITER_PROCS; w++) {
+        int status = 0;
+
+        waitpid(writers[w], &status, 0);
+
+        fail_unless(WIFEXITED(status) && WEXITSTATUS(status) == 0, "Writer failed");
+
+        last_seen[w] = -1;
+        num_seen[w]  = 0;
+    }
+
+    request.cooked = false;
+
+    fail_unless(cdb_read_records(cdb, &request, &num_recs, &r_records, &range) == CDB_SUCCESS, NULL);
+    fail_unless(num_recs == 3000, "Lost records");
+
+    /* Every writer wrote its values in order and the ring drops the oldest
+     * first, so each writer must have left an in order run of its most
+     * recent values, and nothing else. */
+    for (j = 0; j < num_recs; j++) {
+        int64_t value = (int64_t)r_records[j].value;
+
+        w = value / RECS_PER_WRITER;
+
+        fail_unless(w >= 0 && w < NUM_WRITER_PROCS, "Bogus value");
+        fail_unless(value > last_seen[w], "Writer's records out of order");
+
+        last_seen[w] = value;
+        num_seen[w] += 1;
+    }
+
+    for (w = 0; w < NUM_WRITER_PROCS; w++) {
+        if (num_seen[w] > 0) {
+            fail_unless(last_seen[w] == (w + 1) * RECS_PER_WRITER - 1, "Writer's last record missing");
+        }
+    }
+
+    free(r_records);
+    cdb_close(cdb);
+    cdb_free(cdb);
+}
+
+START_TEST (test_cdb_locked_writers)
+{
+    _test_writers(true);
+}
+END_TEST
+
+/* Without locking, writers still take turns at the sequence count */
+START_TEST (test_cdb_unlocked_writers)
+{
+    _test_writers(false);
+}
+END_TEST
+
+START_TEST (test_cdb_seqlock_stale)
+{
+    cdb_record_t *r_records = NULL;
+    cdb_request_t request   = cdb_new_request();
+    cdb_range_t range;
+    uint64_t num_recs = 0;
+    int status = 0;
+    int ready[2];
+    char go;
+    pid_t writer;
+    int i = 0;
+
+    cdb_t *cdb = create_cdb(CDB_TYPE_GAUGE, "absolute", 100);
+    cdb_t *reader = NULL;
+
+    for (i = 0; i < 10; i++) {
+        fail_unless(cdb_write_record(cdb, 1190860358 + i, i), NULL);
+    }
+
+    fail_unless(pipe(ready) == 0, NULL);
+
+    /* A writer that stops half way through an update, still holding the
+     * lock, until it is killed */
+    if ((writer = fork()) == 0) {
+
+        cdb_t *w = cdb_new();
+        w->filename = (char*)TEST_FILENAME;
+        w->flags    = O_RDWR;
+        w->locking  = true;
+
+        close(ready[0]);
+
+        if (cdb_lock(w) != CDB_SUCCESS || cdb_read_header(w) != CDB_SUCCESS || w->mapped_sequence == NULL) {
+            _exit(1);
+        }
+
+        __sync_add_and_fetch(w->mapped_sequence, 1);
+
+        if (write(ready[1], "x", 1) != 1) {
+            _exit(1);
+        }
+
+        pause();
+        _exit(0);
+    }
+
+    close(ready[1]);
+    fail_unless(read(ready[0], &go, 1) == 1, NULL);
+    close(ready[0]);
+
+    request.cooked = false;
+
+    /* While it is alive, readers wait on it and give up */
+    reader = cdb_new();
+    reader->filename = (char*)TEST_FILENAME;
+    reader->flags    = O_RDONLY;
+
+    fail_unless(cdb_read_header(reader) == CDB_EBUSY, NULL);
+
+    kill(writer, SIGKILL);
+    waitpid(writer, &status, 0);
+
+    /* Once it is dead, the odd count it left doesn't hold anyone up */
+    fail_unless(cdb_read_header(reader) == CDB_SUCCESS, NULL);
+    fail_unless((*reader->mapped_sequence & 1) == 1, NULL);
+
+    fail_unless(cdb_read_records(reader, &request, &num_recs, &r_records, &range) == CDB_SUCCESS, NULL);
+    fail_unless(num_recs == 10, NULL);
+    free(r_records);
+
+    /* The next write moves it on, and readers see that */
+    fail_unless(cdb_write_record(cdb, 1190860358 + 10, 10), NULL);
+    fail_unless((*reader->mapped_sequence & 1) == 0, NULL);
+
+    fail_unless(cdb_read_records(reader, &request, &num_recs, &r_records, &range) == CDB_SUCCESS, NULL);
+    fail_unless(num_recs == 11 && r_records[10].value == 10, NULL);
+    free(r_records);
+
+    cdb_close(reader);
+    cdb_free(reader);
+    cdb_close(cdb);
+    cdb_free(cdb);
+}
+END_TEST
+
+START_TEST (test_cdb_locked_replaced)
+{
+    uint64_t num_recs = 0;
+    cdb_record_t *r_records = NULL;
+    cdb_request_t request   = cdb_new_request();
+    cdb_range_t range;
+    pid_t writer_pid;
+    int status = 0;
+    int gate[2];
+    char ready;
+
+    cdb_t *cdb = create_cdb(CDB_TYPE_GAUGE, "absolute", 100);
+    cdb_t *replacement;
+
+    if (!cdb) fail("cdb is null");
+
+    fail_unless(cdb_write_record(cdb, 1190860358, 1), NULL);
+
+    cdb->locking = true;
+    fail_unless(cdb_lock(cdb) == CDB_SUCCESS, NULL);
+
+    fail_unless(pipe(gate) == 0, NULL);
+
+    if ((writer_pid = fork()) == 0) {
+
+        cdb_t *writer = cdb_new();
+        writer->filename = (char*)TEST_FILENAME;
+        writer->flags    = O_RDWR;
+        writer->locking  = true;
+
+        /* The lock is on the open file, which our copy of the descriptor
+         * would keep held if the parent went away */
+        close(cdb->fd);
+
+        /* The old file is open before it is replaced */
+        if (cdb_read_header(writer) != CDB_SUCCESS || write(gate[1], "x", 1) != 1) {
+            _exit(1);
+        }
+
+        /* Waits for the lock, which it gets on the old, unlinked file */
+        _exit(cdb_write_record(writer, 1190860360, 3) ? 0 : 1);
+    }
+
+    fail_unless(read(gate[0], &ready, 1) == 1, NULL);
+    usleep(100000);
+
+    /* Swap a new file in under the lock, as cdb_convert does */
+    replacement = cdb_new();
+    replacement->filename = (char*)TEST_FILENAME ".new";
+    replacement->flags    = O_CREAT|O_RDWR;
+
+    cdb_generate_header(replacement, (char*)"test", (char*)"", 100, CDB_TYPE_GAUGE, (char*)"absolute", 0, 0, 0);
+    fail_unless(cdb_write_header(replacement) == CDB_SUCCESS, NULL);
+    fail_unless(cdb_write_record(replacement, 1190860359, 2), NULL);
+
+    cdb_close(replacement);
+    cdb_free(replacement);
+
+    fail_unless(rename(TEST_FILENAME ".new", TEST_FILENAME) == 0, NULL);
+    fail_unless(cdb_unlock(cdb) == CDB_SUCCESS, NULL);
+
+    waitpid(writer_pid, &status, 0);
+    fail_unless(WIFEXITED(status) && WEXITSTATUS(status) == 0, "Writer failed");
+
+    close(gate[0]);
+    close(gate[1]);
+    cdb_close(cdb);
+    cdb_free(cdb);
+
+    /* The writer followed the file to its new inode */
+    cdb = cdb_new();
+    cdb->filename = (char*)TEST_FILENAME;
+
+    request.cooked = false;
+
+    fail_unless(cdb_read_records(cdb, &request, &num_recs, &r_records, &range) == CDB_SUCCESS, NULL);
+    fail_unless(num_recs == 2, "Write went to the replaced file");
+    fail_unless(r_records[0].value == 2 && r_records[1].value == 3, NULL);
+
+    free(r_records);
+    cdb_close(cdb);
+    cdb_free(cdb);
+}
+END_TEST
+
+#define INGEST_FILENAME   "/tmp/cdb_test_ingest.cdb"
+#define NUM_PRODUCERS     4
+#define RECS_PER_PRODUCER 5000
+
+typedef struct {
+    cdb_ingest_t *ingest;
+    cdb_t *cdbs[2];
+    int producer;
+} ingest_args_t;
+
+static void* _ingest_producer(void *arg) {
+    ingest_args_t *args = (ingest_args_t*)arg;
+    int i = 0;
+
+    for (i = 0; i < RECS_PER_PRODUCER; i++) {
+        /* Every producer feeds both series */
+        double value = (args->producer * RECS_PER_PRODUCER) + i;
+
+        if (cdb_ingest_push(args->ingest, args->cdbs[i % 2], 1190860358 + i, value) != CDB_SUCCESS) {
+            return (void*)1;
+        }
+    }
+
+    return NULL;
+}
+
+START_TEST (test_cdb_ingest)
+{
+    int i = 0;
+    int p = 0;
+    uint64_t j = 0;
+    uint64_t num_recs = 0;
+    pthread_t threads[NUM_PRODUCERS];
+    ingest_args_t args[NUM_PRODUCERS];
+    cdb_ingest_stats_t stats;
+
+    cdb_request_t request = cdb_new_request();
+    cdb_range_t *range      = calloc(1, sizeof(cdb_range_t));
+    cdb_record_t *r_records = NULL;
+
+    cdb_t *cdbs[2];
+
+    /* Far smaller than what gets pushed, so producers have to wait */
+    cdb_ingest_t *ingest = cdb_ingest_new(64, 2, true);
+
+    fail_unless(ingest != NULL, NULL);
+
+    unlink(INGEST_FILENAME);
+
+    cdbs[0] = create_cdb(CDB_TYPE_GAUGE, "absolute", 20000);
+    cdbs[1] = cdb_new();
+    cdbs[1]->filename = (char*)INGEST_FILENAME;
+    cdbs[1]->flags    = O_CREAT|O_RDWR;
+    cdb_generate_header(cdbs[1], (char*)"ingest", (char*)"", 20000, CDB_TYPE_GAUGE, (char*)"absolute", 0, 0, 0);
+    fail_unless(cdb_write_header(cdbs[1]) == CDB_SUCCESS, NULL);
+
+    for (p = 0; p < NUM_PRODUCERS; p++) {
+        args[p].ingest  = ingest;
+        args[p].cdbs[0] = cdbs[0];
+        args[p].cdbs[1] = cdbs[1];
+        args[p].producer = p;
+
+        pthread_create(&threads[p], NULL, _ingest_producer, &args[p]);
+    }
+
+    for (p = 0; p < NUM_PRODUCERS; p++) {
+        void *ret = NULL;
+        pthread_join(threads[p], &ret);
+        fail_unless(ret == NULL, "Push failed");
+    }
+
+    fail_unless(cdb_ingest_flush(ingest) == CDB_SUCCESS, NULL);
+
+    cdb_ingest_get_stats(ingest, &stats);
+
+    fail_unless(stats.pushed == NUM_PRODUCERS * RECS_PER_PRODUCER, NULL);
+    fail_unless(stats.written == stats.pushed, NULL);
+    fail_unless(stats.depth == 0, NULL);
+    fail_unless(stats.failed == 0 && stats.rejected == 0, NULL);
+    fail_unless(stats.high_water <= 128, NULL);
+
+    fail_unless(cdb_ingest_free(ingest) == CDB_SUCCESS, NULL);
+
+    /* Each series has half of every producer's records, in push order */
+    for (i = 0; i < 2; i++) {
+        double last_seen[NUM_PRODUCERS];
+
+        for (p = 0; p < NUM_PRODUCERS; p++) {
+            last_seen[p] = -1;
+        }
+
+        request.cooked = false;
+
+        fail_unless(cdb_read_records(cdbs[i], &request, &num_recs, &r_records, range) == CDB_SUCCESS, NULL);
+        fail_unless(num_recs == NUM_PRODUCERS * RECS_PER_PRODUCER / 2, "Lost records");
+
+        for (j = 0; j < num_recs; j++) {
+            int64_t value = (int64_t)r_records[j].value;
+
+            p = value / RECS_PER_PRODUCER;
+
+            fail_unless(p >= 0 && p < NUM_PRODUCERS, "Bogus value");
+            fail_unless(value % 2 == i, "Record written to the wrong series");
+            fail_unless(value > last_seen[p], "Producer's records out of order");
+
+            last_seen[p] = value;
+        }
+
+        free(r_records);
+        r_records = NULL;
+
+        cdb_close(cdbs[i]);
+        cdb_free(cdbs[i]);
+    }
+
+    free(range);
+    unlink(INGEST_FILENAME);
+}
+END_TEST
+
+typedef struct {
+    cdb_pool_t *pool;
+    int producer;
+} pool_args_t;
+
+static void* _pool_producer(void *arg) {
+    pool_args_t *args = (pool_args_t*)arg;
+    const char *paths[2] = { TEST_FILENAME, INGEST_FILENAME };
+    int i = 0;
+    int k = 0;
+
+    for (i = 0; i < RECS_PER_PRODUCER; i += 10) {
+        cdb_record_t w_records[10];
+
+        for (k = 0; k < 10; k++) {
+            w_records[k].time  = 1190860358 + i + k;
+            w_records[k].value = (args->producer * RECS_PER_PRODUCER) + i + k;
+        }
+
+        /* Alternate batches between the two series */
+        if (cdb_pool_write_records(args->pool, paths[(i / 10) % 2], w_records, 10) != CDB_SUCCESS) {
+            return (void*)1;
+        }
+    }
+
+    return NULL;
+}
+
+START_TEST (test_cdb_pool)
+{
+    int i = 0;
+    int p = 0;
+    uint64_t j = 0;
+    uint64_t num_recs = 0;
+    pthread_t threads[NUM_PRODUCERS];
+    pool_args_t args[NUM_PRODUCERS];
+    cdb_ingest_stats_t stats;
+
+    cdb_request_t request = cdb_new_request();
+    cdb_range_t *range      = calloc(1, sizeof(cdb_range_t));
+    cdb_record_t *r_records = NULL;
+
+    cdb_t *cdbs[2];
+    cdb_pool_t *pool = cdb_pool_new(4, 100, 0, true);
+
+    fail_unless(pool != NULL, NULL);
+
+    unlink(INGEST_FILENAME);
+
+    cdbs[0] = create_cdb(CDB_TYPE_GAUGE, "absolute", 20000);
+    cdbs[1] = cdb_new();
+    cdbs[1]->filename = (char*)INGEST_FILENAME;
+    cdbs[1]->flags    = O_CREAT|O_RDWR;
+    cdb_generate_header(cdbs[1], (char*)"pool", (char*)"", 20000, CDB_TYPE_GAUGE, (char*)"absolute", 0, 0, 0);
+    fail_unless(cdb_write_header(cdbs[1]) == CDB_SUCCESS, NULL);
+
+    for (p = 0; p < NUM_PRODUCERS; p++) {
+        args[p].pool     = pool;
+        args[p].producer = p;
+
+        pthread_create(&threads[p], NULL, _pool_producer, &args[p]);
+    }
+
+    for (p = 0; p < NUM_PRODUCERS; p++) {
+        void *ret = NULL;
+        pthread_join(threads[p], &ret);
+        fail_unless(ret == NULL, "Write failed");
+    }
+
+    fail_unless(cdb_pool_flush(pool) == CDB_SUCCESS, NULL);
+
+    cdb_pool_get_stats(pool, &stats);
+
+    fail_unless(stats.pushed == NUM_PRODUCERS * RECS_PER_PRODUCER, NULL);
+    fail_unless(stats.written == stats.pushed, NULL);
+    fail_unless(stats.depth == 0, NULL);
+    fail_unless(stats.failed == 0 && stats.rejected == 0, NULL);
+
+    /* Series that don't exist fail on their own */
+    fail_unless(cdb_pool_write_record(pool, "/tmp/cdb_test_missing.cdb", 1190860358, 1) == CDB_SUCCESS, NULL);
+    fail_unless(cdb_pool_flush(pool) == ENOENT, NULL);
+
+    cdb_pool_get_stats(pool, &stats);
+    fail_unless(stats.failed == 1, NULL);
+
+    fail_unless(cdb_pool_free(pool) == CDB_SUCCESS, NULL);
+
+    for (i = 0; i < 2; i++) {
+        int64_t last_seen[NUM_PRODUCERS];
+
+        for (p = 0; p < NUM_PRODUCERS; p++) {
+            last_seen[p] = -1;
+        }
+
+        request.cooked = false;
+
+        fail_unless(cdb_read_records(cdbs[i], &request, &num_recs, &r_records, range) == CDB_SUCCESS, NULL);
+        fail_unless(num_recs == NUM_PRODUCERS * RECS_PER_PRODUCER / 2, "Lost records");
+
+        for (j = 0; j < num_recs; j++) {
+            int64_t value = (int64_t)r_records[j].value;
+
+            p = value / RECS_PER_PRODUCER;
+
+            fail_unless(p >= 0 && p < NUM_PRODUCERS, "Bogus value");
+            fail_unless(((value % RECS_PER_PRODUCER) / 10) % 2 == i, "Record written to the wrong series");
+            fail_unless(value > last_seen[p], "Producer's records out of order");
+
+            last_seen[p] = value;
+        }
+
+        free(r_records);
+        r_records = NULL;
+
+        cdb_close(cdbs[i]);
+        cdb_free(cdbs[i]);
+    }
+
+    free(range);
+    unlink(INGEST_FILENAME);
+}
+END_TEST
+
+#define NUM_POOL_SERIES 8
+#define POOL_MAX_OPEN   2
+
+static int count_open_fds(void) {
+    int count = 0;
+    int fd = 0;
+
+    for (fd = 0; fd < 1024; fd++) {
+        if (fcntl(fd, F_GETFD) != -1) {
+            count++;
+        }
+    }
+
+    return count;
+}
+
+/* A shard keeps no more than max_open files open between rounds, and the
+ * series whose files it closed are opened again on their next write. */
+START_TEST (test_cdb_pool_max_open)
+{
+    char paths[NUM_POOL_SERIES][64];
+    cdb_pool_t *pool;
+    int open_fds = count_open_fds();
+    int lap = 0;
+    int i = 0;
+
+    for (i = 0; i < NUM_POOL_SERIES; i++) {
+        cdb_t *cdb = cdb_new();
+
+        snprintf(paths[i], sizeof(paths[i]), "/tmp/cdb_test_pool_%d.cdb", i);
+        unlink(paths[i]);
+
+        cdb->filename = paths[i];
+        cdb->flags    = O_CREAT|O_RDWR;
+        cdb_generate_header(cdb, (char*)"pool", (char*)"", 100, CDB_TYPE_GAUGE, (char*)"absolute", 0, 0, 0);
+        fail_unless(cdb_write_header(cdb) == CDB_SUCCESS, NULL);
+
+        cdb_free(cdb);
+    }
+
+    pool = cdb_pool_new(1, 0, POOL_MAX_OPEN, true);
+    fail_unless(pool != NULL, NULL);
+
+    for (lap = 0; lap < 3; lap++) {
+
+        for (i = 0; i < NUM_POOL_SERIES; i++) {
+            fail_unless(cdb_pool_write_record(pool, paths[i], 1190860358 + lap, lap) == CDB_SUCCESS, NULL);
+            fail_unless(cdb_pool_flush(pool) == CDB_SUCCESS, NULL);
+            fail_unless(count_open_fds() - open_fds <= POOL_MAX_OPEN, "%d files open",
+                count_open_fds() - open_fds);
+        }
+    }
+
+    fail_unless(cdb_pool_free(pool) == CDB_SUCCESS, NULL);
+    fail_unless(count_open_fds() == open_fds, NULL);
+
+    for (i = 0; i < NUM_POOL_SERIES; i++) {
+        cdb_record_t *r_records = NULL;
+        cdb_request_t request   = cdb_new_request();
+        cdb_range_t range;
+        uint64_t num_recs = 0;
+
+        cdb_t *cdb = cdb_new();
+        cdb->filename = paths[i];
+        cdb->flags    = O_RDONLY;
+
+        request.cooked = false;
+        fail_unless(cdb_read_records(cdb, &request, &num_recs, &r_records, &range) == CDB_SUCCESS, NULL);
+        fail_unless(num_recs == 3, "%s has %"PRIu64" records", paths[i], num_recs);
+
+        for (lap = 0; lap < 3; lap++) {
+            fail_unless(r_records[lap].time == 1190860358 + lap && r_records[lap].value == lap, NULL);
+        }
+
+        free(r_records);
+        cdb_free(cdb);
+        unlink(paths[i]);
+    }
+}
+END_TEST
+
+/* Values the text formatting and parsing have to get right */
+static const double format_values[] = {
+    0.0, -0.0, 1.0, -1.0, 0.1, 0.5, 1.5, 2.675, 1e-4, 1e-5, 0.00001234, 123456.789012,
+    1e15, 1e16, 1e17, 1e21, 1e22, 1e23, 1e300, 1e-300, 4.9406564584124654e-324,
+    DBL_MAX, DBL_MIN, DBL_EPSILON, 9007199254740991.0, 9007199254740992.0, 9007199254740993.0,
+    -9007199254740992.0, 9007199254740994.5, 4503599627370495.5, 0.30000000000000004,
+    123.456, 99.99999999, 0.999999999999, 5e-5, 9.5e-5, 0.000099999, 1234567.0, 12345678.5,
+    99999999.5, 999999.95, 3.14159265358979
+};
+
+/* Random doubles, anything but NaN - some from bits, some decimal looking */
+static double format_random(uint64_t *seed) {
+    uint64_t bits = 0;
+    double value  = 0;
+
+    *seed = (*seed * 6364136223846793005ULL) + 1442695040888963407ULL;
+    bits  = *seed ^ (*seed >> 29);
+
+    if (bits & 1) {
+        memcpy(&value, &bits, sizeof(value));
+
+        if (isnan(value)) {
+            value = (double)(int64_t)bits;
+        }
+
+    } else {
+        value = (double)(int64_t)((bits >> 8) % 100000000) / pow(10, (double)((bits >> 48) % 12));
+
+        if (bits & 2) {
+            value = -value;
+        }
+    }
+
+    return value;
+}
+
+static bool format_same(double a, double b) {
+    return memcmp(&a, &b, sizeof(a)) == 0 || (isnan(a) && isnan(b));
+}
+
+START_TEST (test_cdb_format_double)
+{
+    char buffer[CDB_FORMAT_DOUBLE_MAX];
+    char expected[CDB_FORMAT_DOUBLE_MAX];
+    uint64_t seed = 42;
+    int i = 0;
+
+    for (i = 0; i < 200000; i++) {
+        size_t count = sizeof(format_values) / sizeof(format_values[0]);
+        double value = (size_t)i < count ? format_values[i] : format_random(&seed);
+        const char *p = buffer;
+        double parsed = 0;
+        size_t len = 0;
+
+        /* What is written reads back as the same double, both ways */
+        len = _cdb_format_double(buffer, value);
+
+        fail_unless(len == strlen(buffer), "%s", buffer);
+        fail_unless(format_same(strtod(buffer, NULL), value), "%.17g wrote %s", value, buffer);
+        fail_unless(_cdb_parse_double(&p, buffer + len, &parsed), "%s", buffer);
+        fail_unless(p == buffer + len && format_same(parsed, value), "%.17g parsed %s as %.17g", value, buffer, parsed);
+
+        /* And anything "%.17g" or "%.6e" writes parses as strtod() has it */
+        snprintf(expected, sizeof(expected), (i & 1) ? "%.17g" : "%.6e", value);
+
+        p = expected;
+        fail_unless(_cdb_parse_double(&p, expected + strlen(expected), &parsed), "%s", expected);
+        fail_unless(format_same(parsed, strtod(expected, NULL)), "%s parsed as %.17g", expected, parsed);
+    }
+
+    /* The non-finite values, and the ones that only strtod() can parse */
+    {
+        const char *texts[] = {
+            "nan", "-nan", "inf", "-inf", "Infinity", "1e400", "-1e400", "1e-400", "1e23", "1e-23",
+            "12345678901234567890", "1234567890.1234567890123", "0.000000000000000000000000001",
+            "9007199254740993", "-0", "-0.0", "+1.5", "1e5", "1E-5", "00012.5000", ".5", "5."
+        };
+
+        for (i = 0; i < (int)(sizeof(texts) / sizeof(texts[0])); i++) {
+            const char *end = texts[i] + strlen(texts[i]);
+            const char *p = texts[i];
+            double parsed = 0;
+
+            fail_unless(_cdb_parse_double(&p, end, &parsed), "%s", texts[i]);
+            fail_unless(p == end, "%s stopped early", texts[i]);
+            fail_unless(format_same(parsed, strtod(texts[i], NULL)), "%s parsed as %.17g", texts[i], parsed);
+        }
+
+        fail_unless(_cdb_format_double(buffer, CDB_NAN) == 3 && strcmp(buffer, "nan") == 0, NULL);
+        fail_unless(_cdb_format_double(buffer, -HUGE_VAL) == 4 && strcmp(buffer, "-inf") == 0, NULL);
+        fail_unless(_cdb_format_double(buffer, -0.0) == 2 && strcmp(buffer, "-0") == 0, NULL);
+    }
+
+    /* Not a number, and a number that stops where the text does */
+    {
+        const char *bad[] = { "", "-", "e5", "x1", "." };
+        const char *text = "1.25e3,7";
+        const char *p = NULL;
+        double parsed = 0;
+
+        for (i = 0; i < (int)(sizeof(bad) / sizeof(bad[0])); i++) {
+            p = bad[i];
+            fail_unless(!_cdb_parse_double(&p, bad[i] + strlen(bad[i]), &parsed), "'%s' parsed", bad[i]);
+            fail_unless(p == bad[i], NULL);
+        }
+
+        p = text;
+        fail_unless(_cdb_parse_double(&p, text + 6, &parsed) && parsed == 1250 && *p == ',', NULL);
+
+        p = text;
+        fail_unless(_cdb_parse_double(&p, text + 3, &parsed) && parsed == 1.2 && p == text + 3, NULL);
+    }
+}
+END_TEST
+
+START_TEST (test_cdb_format_double_g)
+{
+    char buffer[CDB_FORMAT_DOUBLE_MAX];
+    char expected[CDB_FORMAT_DOUBLE_MAX];
+    uint64_t seed = 7;
+    int precision = 0;
+    int i = 0;
+
+    for (i = 0; i < 50000; i++) {
+        size_t count = sizeof(format_values) / sizeof(format_values[0]);
+        double value = (size_t)i < count ? format_values[i] : format_random(&seed);
+
+        for (precision = 1; precision <= 15; precision++) {
+            size_t len = _cdb_format_double_g(buffer, value, precision);
+
+            snprintf(expected, sizeof(expected), "%.*g", precision, value);
+
+            fail_unless(strcmp(buffer, expected) == 0, "%%.%dg of %.17g: %s not %s", precision, value, buffer, expected);
+            fail_unless(len == strlen(expected), NULL);
+        }
+    }
+
+    fail_unless(_cdb_format_double_g(buffer, NAN, 8) == 3 && strcmp(buffer, "nan") == 0, NULL);
+    fail_unless(_cdb_format_double_g(buffer, HUGE_VAL, 8) == 3 && strcmp(buffer, "inf") == 0, NULL);
+}
+END_TEST
+
+START_TEST (test_cdb_format_int)
+{
+    const int64_t values[] = { 0, 1, -1, 9, 10, -10, 1190860358, INT32_MAX, INT32_MIN, INT64_MAX, INT64_MIN };
+    char buffer[CDB_FORMAT_DOUBLE_MAX];
+    char expected[CDB_FORMAT_DOUBLE_MAX];
+    uint64_t seed = 3;
+    int i = 0;
+
+    for (i = 0; i < 100000; i++) {
+        int64_t value = 0;
+        int64_t parsed = 0;
+        const char *p = buffer;
+        size_t len = 0;
+
+        if ((size_t)i < sizeof(values) / sizeof(values[0])) {
+            value = values[i];
+        } else {
+            seed  = (seed * 6364136223846793005ULL) + 1442695040888963407ULL;
+            value = (int64_t)(seed >> (seed % 64));
+        }
+
+        len = _cdb_format_int(buffer, value);
+        snprintf(expected, sizeof(expected), "%"PRId64, value);
+
+        fail_unless(strcmp(buffer, expected) == 0 && len == strlen(expected), "%s not %s", buffer, expected);
+        fail_unless(_cdb_parse_int(&p, buffer + len, &parsed) && parsed == value && p == buffer + len, "%s", buffer);
+    }
+}
+END_TEST
+
+/* Where cdb_export and cdb_import are - ../src when run by make check */
+static const char* format_tools(void) {
+    const char *tools = getenv("CDB_TOOLS");
+    return tools != NULL ? tools : "../src";
+}
+
+START_TEST (test_cdb_export_import)
+{
+    const char *formats[] = { "csv", "jsonl", "binary" };
+    const char *imported  = TEST_FILENAME ".imported";
+    const char *exported  = TEST_FILENAME ".exported";
+    size_t count = sizeof(format_values) / sizeof(format_values[0]);
+    cdb_record_t w_records[300];
+    uint64_t seed = 11;
+    uint64_t num_recs = 0;
+    int f = 0;
+    int i = 0;
+
+    cdb_t *cdb = cdb_new();
+    cdb->filename = (char*)TEST_FILENAME;
+    cdb->flags    = O_CREAT|O_RDWR;
+
+    for (i = 0; i < 300; i++) {
+        w_records[i].time  = 1190860358 + (i * 60);
+        w_records[i].value = (size_t)i < count ? format_values[i] : format_random(&seed);
+    }
+
+    w_records[count].value     = CDB_NAN;
+    w_records[count + 1].value = HUGE_VAL;
+    w_records[count + 2].value = -HUGE_VAL;
+
+    cdb_generate_header(cdb, (char*)"test", (char*)"", 300, CDB_TYPE_GAUGE, (char*)"", 0, 0, 0);
+
+    fail_unless(cdb_write_header(cdb) == CDB_SUCCESS, NULL);
+    fail_unless(cdb_write_records(cdb, w_records, 300, &num_recs) == CDB_SUCCESS, NULL);
+
+    cdb_close(cdb);
+    cdb_free(cdb);
+
+    for (f = 0; f < 3; f++) {
+        cdb_record_t *r_records = NULL;
+        cdb_request_t request   = cdb_new_request();
+        cdb_range_t range;
+        char command[1024];
+
+        unlink(imported);
+
+        snprintf(command, sizeof(command), "%s/cdb_export -f %s -o %s %s && %s/cdb_import -f %s -m 300 -i %s %s 2>/dev/null",
+            format_tools(), formats[f], exported, TEST_FILENAME, format_tools(), formats[f], exported, imported);
+
+        fail_unless(system(command) == 0, "%s", command);
+
+        cdb = cdb_new();
+        cdb->filename = (char*)imported;
+        cdb->flags    = O_RDONLY;
+
+        request.cooked = false;
+        fail_unless(cdb_read_records(cdb, &request, &num_recs, &r_records, &range) == CDB_SUCCESS, NULL);
+        fail_unless(num_recs == 300, "%s gave %"PRIu64" records", formats[f], num_recs);
+
+        for (i = 0; i < 300; i++) {
+            double expected = w_records[i].value;
+
+            /* JSON has no infinities, so they come back as NaN */
+            if (f == 1 && isinf(expected)) {
+                expected = CDB_NAN;
+            }
+
+            fail_unless(r_records[i].time == w_records[i].time, "%s record %d", formats[f], i);
+            fail_unless(format_same(r_records[i].value, expected), "%s record %d: %.17g not %.17g",
+                formats[f], i, r_records[i].value, expected);
+        }
+
+        free(r_records);
+        cdb_free(cdb);
+    }
+
+    /* Output that can't be written is an error, not a short export */
+    if (access("/dev/full", W_OK) == 0) {
+        char command[1024];
+
+        snprintf(command, sizeof(command), "%s/cdb_export -o /dev/full %s 2>/dev/null", format_tools(), TEST_FILENAME);
+        fail_unless(system(command) != 0, "%s", command);
+    }
+
+    unlink(imported);
+    unlink(exported);
+}
+END_TEST
+
+/* All of a line too long for cdb_import's buffer is skipped - its tail
+ * mustn't be taken for a record of its own. */
+START_TEST (test_cdb_import_long_line)
+{
+    const char *imported = TEST_FILENAME ".imported";
+    const char *input    = TEST_FILENAME ".csv";
+    cdb_record_t *r_records = NULL;
+    cdb_request_t request   = cdb_new_request();
+    cdb_range_t range;
+    uint64_t num_recs = 0;
+    char command[1024];
+    int i = 0;
+
+    FILE *fh = fopen(input, "w");
+    fail_unless(fh != NULL, NULL);
+
+    fprintf(fh, "time,value\n1190860358,1\n1190860400,");
+
+    for (i = 0; i < 3 * 1024 * 1024; i++) {
+        fputc(' ', fh);
+    }
+
+    fprintf(fh, "1190860418,5\n1190860478,2\n");
+    fail_unless(fclose(fh) == 0, NULL);
+
+    unlink(imported);
+
+    snprintf(command, sizeof(command), "%s/cdb_import -m 10 -i %s %s 2>/dev/null", format_tools(), input, imported);
+    fail_unless(system(command) == 0, "%s", command);
+
+    cdb_t *cdb = cdb_new();
+    cdb->filename = (char*)imported;
+    cdb->flags    = O_RDONLY;
+
+    request.cooked = false;
+    fail_unless(cdb_read_records(cdb, &request, &num_recs, &r_records, &range) == CDB_SUCCESS, NULL);
+    fail_unless(num_recs == 2, "got %"PRIu64" records", num_recs);
+    fail_unless(r_records[0].time == 1190860358 && r_records[0].value == 1, NULL);
+    fail_unless(r_records[1].time == 1190860478 && r_records[1].value == 2, NULL);
+
+    free(r_records);
+    cdb_free(cdb);
+
+    unlink(imported);
+    unlink(input);
+}
+END_TEST
+
+Suite* cdb_suite (void) {
+    Suite *s = suite_create("CircularDB");
+
+    TCase *tc_core1 = tcase_create("Basic");
+    tcase_add_checked_fixture(tc_core1, setup, teardown);
+    tcase_add_test(tc_core1, test_cdb_basic_create);
+    tcase_add_test(tc_core1, test_cdb_basic_rw);
+    tcase_add_test(tc_core1, test_cdb_overflow);
+    tcase_add_test(tc_core1, test_cdb_timefind);
+    tcase_add_test(tc_core1, test_cdb_wrap);
+    tcase_add_test(tc_core1, test_cdb_average);
+    tcase_add_test(tc_core1, test_cdb_print);
+    tcase_add_test(tc_core1, test_cdb_scan);
+    tcase_add_test(tc_core1, test_cdb_cook);
+    tcase_add_test(tc_core1, test_cdb_repair);
+    tcase_add_test(tc_core1, test_cdb_stats);
+    tcase_add_test(tc_core1, test_cdb_histograms);
+    tcase_add_test(tc_core1, test_cdb_read_records_into);
+    tcase_add_test(tc_core1, test_cdb_arena);
+    tcase_add_test(tc_core1, test_cdb_columns);
+    tcase_add_test(tc_core1, test_cdb_columns_wrap);
+    tcase_add_test(tc_core1, test_cdb_header_versions);
+    tcase_add_test(tc_core1, test_cdb_compressed);
+    tcase_add_test(tc_core1, test_cdb_compressed_values);
+    tcase_add_test(tc_core1, test_cdb_implicit);
+    tcase_add_test(tc_core1, test_cdb_encodings);
+    tcase_add_test(tc_core1, test_cdb_checksums);
+    tcase_add_test(tc_core1, test_cdb_container);
+    suite_add_tcase(s, tc_core1);
+
+    TCase *tc_core3 = tcase_create("Concurrency");
+    tcase_add_checked_fixture(tc_core3, setup, teardown);
+    tcase_add_test(tc_core3, test_cdb_concurrent_readers);
+    tcase_add_test(tc_core3, test_cdb_seqlock_reader);
+    tcase_add_test(tc_core3, test_cdb_locked_writers);
+    tcase_add_test(tc_core3, test_cdb_unlocked_writers);
+    tcase_add_test(tc_core3, test_cdb_seqlock_stale);
+    tcase_add_test(tc_core3, test_cdb_locked_replaced);
+    tcase_add_test(tc_core3, test_cdb_ingest);
+    tcase_add_test(tc_core3, test_cdb_pool);
+    tcase_add_test(tc_core3, test_cdb_pool_max_open);
+    suite_add_tcase(s, tc_core3);
+
+    TCase *tc_core4 = tcase_create("Format");
+    tcase_add_checked_fixture(tc_core4, setup, teardown);
+    tcase_add_test(tc_core4, test_cdb_format_double);
+    tcase_add_test(tc_core4, test_cdb_format_double_g);
+    tcase_add_test(tc_core4, test_cdb_format_int);
+    tcase_add_test(tc_core4, test_cdb_export_import);
+    tcase_add_test(tc_core4, test_cdb_import_long_line);
+    suite_add_tcase(s, tc_core4);
 
     TCase *tc_core2 = tcase_create("Aggregate");
     tcase_add_checked_fixture(tc_core2, setup, teardown);